@@ -322,6 +322,15 @@ static int skel_fallocate(vfs_handle_struct *handle, files_struct *fsp,
 	return -1;
 }
 
+static ssize_t skel_copy_chunk(vfs_handle_struct *handle,
+			       files_struct *src_fsp, SMB_OFF_T src_off,
+			       files_struct *dest_fsp, SMB_OFF_T dest_off,
+			       size_t num)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
 static bool skel_lock(vfs_handle_struct *handle, files_struct *fsp, int op, SMB_OFF_T offset, SMB_OFF_T count, int type)
 {
 	errno = ENOSYS;
@@ -829,6 +838,7 @@ struct vfs_fn_pointers skel_transparent_fns = {
 	.ntimes = skel_ntimes,
 	.ftruncate = skel_ftruncate,
 	.fallocate = skel_fallocate,
+	.copy_chunk = skel_copy_chunk,
 	.lock = skel_lock,
 	.kernel_flock = skel_kernel_flock,
 	.linux_setlease = skel_linux_setlease,
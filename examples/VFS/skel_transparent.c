@@ -306,6 +306,15 @@ static int skel_fallocate(vfs_handle_struct *handle, files_struct *fsp,
 	return SMB_VFS_NEXT_FALLOCATE(handle, fsp, mode, offset, len);
 }
 
+static ssize_t skel_copy_chunk(vfs_handle_struct *handle,
+			       files_struct *src_fsp, SMB_OFF_T src_off,
+			       files_struct *dest_fsp, SMB_OFF_T dest_off,
+			       size_t num)
+{
+	return SMB_VFS_NEXT_COPY_CHUNK(handle, src_fsp, src_off,
+				       dest_fsp, dest_off, num);
+}
+
 static bool skel_lock(vfs_handle_struct *handle, files_struct *fsp, int op, SMB_OFF_T offset, SMB_OFF_T count, int type)
 {
 	return SMB_VFS_NEXT_LOCK(handle, fsp, op, offset, count, type);
@@ -773,6 +782,7 @@ struct vfs_fn_pointers skel_transparent_fns = {
 	.ntimes = skel_ntimes,
 	.ftruncate = skel_ftruncate,
 	.fallocate = skel_fallocate,
+	.copy_chunk = skel_copy_chunk,
 	.lock = skel_lock,
 	.kernel_flock = skel_kernel_flock,
 	.linux_setlease = skel_linux_setlease,
@@ -39,7 +39,12 @@ static bool tdb_check_header(struct tdb_context *tdb, tdb_off_t *recovery)
 	if (hdr.version != TDB_VERSION)
 		goto corrupt;
 
-	if (hdr.rwlocks != 0 && hdr.rwlocks != TDB_HASH_RWLOCK_MAGIC)
+	if (hdr.rwlocks != 0 && hdr.rwlocks != TDB_HASH_RWLOCK_MAGIC &&
+	    hdr.rwlocks != TDB_FEATURE_FLAG_MAGIC)
+		goto corrupt;
+
+	if (hdr.rwlocks == TDB_FEATURE_FLAG_MAGIC &&
+	    hdr.mutex_size != tdb->header.mutex_size)
 		goto corrupt;
 
 	tdb_header_hash(tdb, &h1, &h2);
@@ -54,7 +59,7 @@ static bool tdb_check_header(struct tdb_context *tdb, tdb_off_t *recovery)
 		goto corrupt;
 
 	if (hdr.recovery_start != 0 &&
-	    hdr.recovery_start < TDB_DATA_START(tdb->header.hash_size))
+	    hdr.recovery_start < TDB_DATA_START(tdb))
 		goto corrupt;
 
 	*recovery = hdr.recovery_start;
@@ -74,7 +79,7 @@ static bool tdb_check_record(struct tdb_context *tdb,
 	tdb_off_t tailer;
 
 	/* Check rec->next: 0 or points to record offset, aligned. */
-	if (rec->next > 0 && rec->next < TDB_DATA_START(tdb->header.hash_size)){
+	if (rec->next > 0 && rec->next < TDB_DATA_START(tdb)){
 		TDB_LOG((tdb, TDB_DEBUG_ERROR,
 			 "Record offset %d too small next %d\n",
 			 off, rec->next));
@@ -307,6 +312,45 @@ static bool tdb_check_free_record(struct tdb_context *tdb,
 	return true;
 }
 
+/* Mark the heads of the split hash chains and the tables holding them. */
+static bool tdb_check_split_chains(struct tdb_context *tdb,
+				   unsigned char **hashes)
+{
+	uint32_t num_buckets, size, b;
+	unsigned int level;
+	tdb_off_t dir, off, top;
+
+	if (!tdb_hash_grows(tdb))
+		return true;
+
+	if (tdb_hash_buckets(tdb, &num_buckets) == -1)
+		return false;
+	if (num_buckets == tdb->header.hash_size)
+		return true;
+
+	/* The directory and the tables are referred to once each. */
+	if (tdb_ofs_read(tdb, TDB_HASH_DIR_OFS, &dir) == -1)
+		return false;
+	record_offset(hashes[0], dir);
+	for (level = 0, size = tdb->header.hash_size;
+	     size < num_buckets;
+	     level++, size *= 2) {
+		if (tdb_ofs_read(tdb, dir + sizeof(struct tdb_record)
+				 + level * sizeof(tdb_off_t), &off) == -1)
+			return false;
+		record_offset(hashes[0], off);
+	}
+
+	for (b = tdb->header.hash_size; b < num_buckets; b++) {
+		top = tdb_bucket_top(tdb, b);
+		if (top == 0 || tdb_ofs_read(tdb, top, &off) == -1)
+			return false;
+		if (off)
+			record_offset(hashes[BUCKET(b)+1], off);
+	}
+	return true;
+}
+
 /* Slow, but should be very rare. */
 size_t tdb_dead_space(struct tdb_context *tdb, tdb_off_t off)
 {
@@ -352,7 +396,7 @@ _PUBLIC_ int tdb_check(struct tdb_context *tdb,
 		goto unlock;
 
 	/* We should have the whole header, too. */
-	if (tdb->map_size < TDB_DATA_START(tdb->header.hash_size)) {
+	if (tdb->map_size < TDB_DATA_START(tdb)) {
 		tdb->ecode = TDB_ERR_CORRUPT;
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "File too short for hashes\n"));
 		goto unlock;
@@ -381,8 +425,19 @@ _PUBLIC_ int tdb_check(struct tdb_context *tdb,
 			record_offset(hashes[h], off);
 	}
 
+	/* The free lists of the larger size classes */
+	for (h = 1; h < tdb_free_lists(tdb); h++) {
+		if (tdb_ofs_read(tdb, TDB_FREELIST_TOP(h), &off) == -1)
+			goto free;
+		if (off)
+			record_offset(hashes[0], off);
+	}
+
+	if (!tdb_check_split_chains(tdb, hashes))
+		goto free;
+
 	/* For each record, read it in and check it's ok. */
-	for (off = TDB_DATA_START(tdb->header.hash_size);
+	for (off = TDB_DATA_START(tdb);
 	     off < tdb->map_size;
 	     off += sizeof(rec) + rec.rec_len) {
 		if (tdb->methods->tdb_read(tdb, off, &rec, sizeof(rec),
@@ -399,6 +454,11 @@ _PUBLIC_ int tdb_check(struct tdb_context *tdb,
 			if (!tdb_check_free_record(tdb, off, &rec, hashes))
 				goto free;
 			break;
+		case TDB_HASH_TABLE_MAGIC:
+			if (!tdb_check_record(tdb, off, &rec))
+				goto free;
+			record_offset(hashes[0], off);
+			break;
 		/* If we crash after ftruncate, we can get zeroes or fill. */
 		case TDB_RECOVERY_INVALID_MAGIC:
 		case 0x42424242:
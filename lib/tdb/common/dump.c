@@ -61,14 +61,15 @@ static tdb_off_t tdb_dump_record(struct tdb_context *tdb, int hash,
 static int tdb_dump_chain(struct tdb_context *tdb, int i)
 {
 	tdb_off_t rec_ptr, top;
+	int list = (i < 0) ? i : BUCKET(i);
 
-	top = TDB_HASH_TOP(i);
-
-	if (tdb_lock(tdb, i, F_WRLCK) != 0)
+	if (tdb_lock(tdb, list, F_WRLCK) != 0)
 		return -1;
 
-	if (tdb_ofs_read(tdb, top, &rec_ptr) == -1)
-		return tdb_unlock(tdb, i, F_WRLCK);
+	top = (i < 0) ? TDB_HASH_TOP(i) : tdb_bucket_top(tdb, i);
+
+	if (top == 0 || tdb_ofs_read(tdb, top, &rec_ptr) == -1)
+		return tdb_unlock(tdb, list, F_WRLCK);
 
 	if (rec_ptr)
 		printf("hash=%d\n", i);
@@ -77,13 +78,18 @@ static int tdb_dump_chain(struct tdb_context *tdb, int i)
 		rec_ptr = tdb_dump_record(tdb, i, rec_ptr);
 	}
 
-	return tdb_unlock(tdb, i, F_WRLCK);
+	return tdb_unlock(tdb, list, F_WRLCK);
 }
 
 _PUBLIC_ void tdb_dump_all(struct tdb_context *tdb)
 {
+	uint32_t num_buckets;
 	int i;
-	for (i=0;i<tdb->header.hash_size;i++) {
+
+	if (tdb_hash_buckets(tdb, &num_buckets) == -1) {
+		num_buckets = tdb->header.hash_size;
+	}
+	for (i=0;i<num_buckets;i++) {
 		tdb_dump_chain(tdb, i);
 	}
 	printf("freelist:\n");
@@ -96,42 +102,48 @@ _PUBLIC_ int tdb_printfreelist(struct tdb_context *tdb)
 	long total_free = 0;
 	tdb_off_t offset, rec_ptr;
 	struct tdb_record rec;
+	unsigned int list;
 
 	if ((ret = tdb_lock(tdb, -1, F_WRLCK)) != 0)
 		return ret;
 
-	offset = FREELIST_TOP;
-
-	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, offset, &rec_ptr) == -1) {
-		tdb_unlock(tdb, -1, F_WRLCK);
-		return 0;
-	}
+	for (list = 0; list < tdb_free_lists(tdb); list++) {
+		offset = TDB_FREELIST_TOP(list);
 
-	printf("freelist top=[0x%08x]\n", rec_ptr );
-	while (rec_ptr) {
-		if (tdb->methods->tdb_read(tdb, rec_ptr, (char *)&rec, 
-					   sizeof(rec), DOCONV()) == -1) {
+		/* read in the freelist top */
+		if (tdb_ofs_read(tdb, offset, &rec_ptr) == -1) {
 			tdb_unlock(tdb, -1, F_WRLCK);
-			return -1;
+			return 0;
 		}
 
-		if (rec.magic != TDB_FREE_MAGIC) {
-			printf("bad magic 0x%08x in free list\n", rec.magic);
-			tdb_unlock(tdb, -1, F_WRLCK);
-			return -1;
+		if (list == 0) {
+			printf("freelist top=[0x%08x]\n", rec_ptr );
+		} else {
+			printf("freelist %u top=[0x%08x]\n", list, rec_ptr);
+		}
+		while (rec_ptr) {
+			if (tdb->methods->tdb_read(tdb, rec_ptr, (char *)&rec, 
+						   sizeof(rec), DOCONV()) == -1) {
+				tdb_unlock(tdb, -1, F_WRLCK);
+				return -1;
+			}
+
+			if (rec.magic != TDB_FREE_MAGIC) {
+				printf("bad magic 0x%08x in free list\n", rec.magic);
+				tdb_unlock(tdb, -1, F_WRLCK);
+				return -1;
+			}
+
+			printf("entry offset=[0x%08x], rec.rec_len = [0x%08x (%d)] (end = 0x%08x)\n", 
+			       rec_ptr, rec.rec_len, rec.rec_len, rec_ptr + rec.rec_len);
+			total_free += rec.rec_len;
+
+			/* move to the next record */
+			rec_ptr = rec.next;
 		}
-
-		printf("entry offset=[0x%08x], rec.rec_len = [0x%08x (%d)] (end = 0x%08x)\n", 
-		       rec_ptr, rec.rec_len, rec.rec_len, rec_ptr + rec.rec_len);
-		total_free += rec.rec_len;
-
-		/* move to the next record */
-		rec_ptr = rec.next;
 	}
 	printf("total rec_len = [0x%08x (%d)]\n", (int)total_free, 
                (int)total_free);
 
 	return tdb_unlock(tdb, -1, F_WRLCK);
 }
-
@@ -33,6 +33,84 @@
 */
 #define USE_RIGHT_MERGES 0
 
+/*
+ * With TDB_SIZE_CLASSES the free records are spread over
+ * TDB_FREE_CLASSES lists by size: list 0 holds records below 64
+ * bytes, list c records of at least 32 << c bytes, and the last list
+ * everything from 4096 bytes on. The head of list 0 is the classic
+ * freelist head at FREELIST_TOP, the others are in the header. A free
+ * record carries its list number in full_hash.
+ *
+ * A record is never smaller than its list says: left merges only make
+ * it bigger, and when an allocation shrinks it below that it moves
+ * down. So every record of a larger list than the one we're looking
+ * for fits.
+ * Allocation does its best fit search on the list of the requested
+ * size only and takes the first record of the larger lists.
+ *
+ * The freelist lock (list -1) becomes a read lock, each list gets
+ * its own write lock below it (list -2 - c). Code that needs the whole
+ * free space to itself, like tdb_expand(), takes the freelist lock
+ * for writing as before. Locks of two lists are only held together
+ * to move a shrunk record to a smaller list, so they are taken from
+ * the larger list down. With mutexes the freelist lock is a plain
+ * mutex, so it stays the only lock.
+ */
+
+unsigned int tdb_free_lists(struct tdb_context *tdb)
+{
+	if (tdb->header.feature_flags & TDB_FEATURE_FLAG_SIZE_CLASSES) {
+		return TDB_FREE_CLASSES;
+	}
+	return 1;
+}
+
+/* The list for a free record of rec_len bytes */
+static unsigned int tdb_size_class(struct tdb_context *tdb, tdb_len_t len)
+{
+	unsigned int list = 0;
+
+	while ((list < tdb_free_lists(tdb) - 1) && (len >= (64U << list))) {
+		list++;
+	}
+	return list;
+}
+
+static bool tdb_free_list_locks(struct tdb_context *tdb)
+{
+	return (tdb_free_lists(tdb) > 1) && !tdb_have_mutexes(tdb);
+}
+
+/* Get at the free lists, as opposed to tdb_lock(tdb, -1, F_WRLCK) */
+static int tdb_lock_free(struct tdb_context *tdb)
+{
+	return tdb_lock(tdb, -1,
+			tdb_free_list_locks(tdb) ? F_RDLCK : F_WRLCK);
+}
+
+static int tdb_unlock_free(struct tdb_context *tdb)
+{
+	return tdb_unlock(tdb, -1,
+			  tdb_free_list_locks(tdb) ? F_RDLCK : F_WRLCK);
+}
+
+/* lock a single free list, needs tdb_lock_free() */
+static int tdb_lock_free_list(struct tdb_context *tdb, unsigned int list)
+{
+	if (!tdb_free_list_locks(tdb)) {
+		return 0;
+	}
+	return tdb_lock(tdb, -2 - (int)list, F_WRLCK);
+}
+
+static int tdb_unlock_free_list(struct tdb_context *tdb, unsigned int list)
+{
+	if (!tdb_free_list_locks(tdb)) {
+		return 0;
+	}
+	return tdb_unlock(tdb, -2 - (int)list, F_WRLCK);
+}
+
 /* read a freelist record and check for simple errors */
 int tdb_rec_free_read(struct tdb_context *tdb, tdb_off_t off, struct tdb_record *rec)
 {
@@ -97,12 +175,57 @@ static int update_tailer(struct tdb_context *tdb, tdb_off_t offset,
 			 &totalsize);
 }
 
+/*
+ * Merge the record at offset into the free record l at left, which is
+ * on the given list. Called with that list locked. With several lists
+ * l was read without the lock, so it is read again. Returns 1 if the
+ * record was merged, 0 if l has been taken or moved in the meantime.
+ */
+static int tdb_merge_left(struct tdb_context *tdb, tdb_off_t offset,
+			  struct tdb_record *rec, tdb_off_t left,
+			  struct tdb_record *l, unsigned int list)
+{
+	if (tdb_free_list_locks(tdb)) {
+		tdb_off_t leftsize;
+
+		if (tdb_ofs_read(tdb, offset - sizeof(tdb_off_t),
+				 &leftsize) == -1) {
+			return -1;
+		}
+		if ((leftsize != offset - left) ||
+		    (tdb->methods->tdb_read(tdb, left, l, sizeof(*l),
+					    DOCONV()) == -1)) {
+			return 0;
+		}
+		if ((l->magic != TDB_FREE_MAGIC) || (l->full_hash != list)) {
+			return 0;
+		}
+	}
+
+	/* we now merge the new record into the left record, rather than the other 
+	   way around. This makes the operation O(1) instead of O(n). This change
+	   prevents traverse from being O(n^2) after a lot of deletes */
+	l->rec_len += sizeof(*rec) + rec->rec_len;
+	if (tdb_rec_write(tdb, left, l) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_left failed at %u\n", left));
+		return -1;
+	}
+	if (update_tailer(tdb, left, l) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_tailer failed at %u\n", offset));
+		return -1;
+	}
+	return 1;
+}
+
 /* Add an element into the freelist. Merge adjacent records if
    necessary. */
 int tdb_free(struct tdb_context *tdb, tdb_off_t offset, struct tdb_record *rec)
 {
+	unsigned int list;
+	uint32_t hash;
+
 	/* Allocation and tailer lock */
-	if (tdb_lock(tdb, -1, F_WRLCK) != 0)
+	if (tdb_lock_free(tdb) != 0)
 		return -1;
 
 	/* set an initial tailer, so if we fail we don't leave a bogus record */
@@ -139,7 +262,7 @@ left:
 #endif
 
 	/* Look left */
-	if (offset - sizeof(tdb_off_t) > TDB_DATA_START(tdb->header.hash_size)) {
+	if (offset - sizeof(tdb_off_t) > TDB_DATA_START(tdb)) {
 		tdb_off_t left = offset - sizeof(tdb_off_t);
 		struct tdb_record l;
 		tdb_off_t leftsize;
@@ -158,7 +281,7 @@ left:
 		left = offset - leftsize;
 
 		if (leftsize > offset ||
-		    left < TDB_DATA_START(tdb->header.hash_size)) {
+		    left < TDB_DATA_START(tdb)) {
 			goto update;
 		}
 
@@ -170,41 +293,58 @@ left:
 
 		/* If it's free, expand to include it. */
 		if (l.magic == TDB_FREE_MAGIC) {
-			/* we now merge the new record into the left record, rather than the other 
-			   way around. This makes the operation O(1) instead of O(n). This change
-			   prevents traverse from being O(n^2) after a lot of deletes */
-			l.rec_len += sizeof(*rec) + rec->rec_len;
-			if (tdb_rec_write(tdb, left, &l) == -1) {
-				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_left failed at %u\n", left));
+			int ret;
+
+			list = (tdb_free_lists(tdb) > 1) ? l.full_hash : 0;
+			if (list >= tdb_free_lists(tdb)) {
+				goto update;
+			}
+			if (tdb_lock_free_list(tdb, list) == -1) {
 				goto fail;
 			}
-			if (update_tailer(tdb, left, &l) == -1) {
-				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_tailer failed at %u\n", offset));
+			ret = tdb_merge_left(tdb, offset, rec, left, &l, list);
+			tdb_unlock_free_list(tdb, list);
+			if (ret == -1) {
 				goto fail;
 			}
-			tdb_unlock(tdb, -1, F_WRLCK);
-			return 0;
+			if (ret == 1) {
+				tdb_unlock_free(tdb);
+				return 0;
+			}
 		}
 	}
 
 update:
 
 	/* Now, prepend to free list */
+	list = tdb_size_class(tdb, rec->rec_len);
 	rec->magic = TDB_FREE_MAGIC;
 
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &rec->next) == -1 ||
+	/* our callers still need the hash of the record */
+	hash = rec->full_hash;
+	rec->full_hash = list;
+
+	if (tdb_lock_free_list(tdb, list) == -1) {
+		rec->full_hash = hash;
+		goto fail;
+	}
+	if (tdb_ofs_read(tdb, TDB_FREELIST_TOP(list), &rec->next) == -1 ||
 	    tdb_rec_write(tdb, offset, rec) == -1 ||
-	    tdb_ofs_write(tdb, FREELIST_TOP, &offset) == -1) {
+	    tdb_ofs_write(tdb, TDB_FREELIST_TOP(list), &offset) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free record write failed at offset=%d\n", offset));
+		tdb_unlock_free_list(tdb, list);
+		rec->full_hash = hash;
 		goto fail;
 	}
+	tdb_unlock_free_list(tdb, list);
+	rec->full_hash = hash;
 
 	/* And we're done. */
-	tdb_unlock(tdb, -1, F_WRLCK);
+	tdb_unlock_free(tdb);
 	return 0;
 
  fail:
-	tdb_unlock(tdb, -1, F_WRLCK);
+	tdb_unlock_free(tdb);
 	return -1;
 }
 
@@ -220,9 +360,11 @@ update:
  */
 static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb, 
 				  tdb_len_t length, tdb_off_t rec_ptr,
-				  struct tdb_record *rec, tdb_off_t last_ptr)
+				  struct tdb_record *rec, tdb_off_t last_ptr,
+				  unsigned int list)
 {
 #define MIN_REC_SIZE (sizeof(struct tdb_record) + sizeof(tdb_off_t) + 8)
+	unsigned int new_list;
 
 	if (rec->rec_len < length + MIN_REC_SIZE) {
 		/* we have to grab the whole record */
@@ -242,7 +384,27 @@ static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb,
 
 	/* we're going to just shorten the existing record */
 	rec->rec_len -= (length + sizeof(*rec));
-	if (tdb_rec_write(tdb, rec_ptr, rec) == -1) {
+
+	new_list = tdb_size_class(tdb, rec->rec_len);
+	if (new_list < list) {
+		/* it's too small for its list now, move it down */
+		if (tdb_ofs_write(tdb, last_ptr, &rec->next) == -1) {
+			return 0;
+		}
+		if (tdb_lock_free_list(tdb, new_list) == -1) {
+			return 0;
+		}
+		rec->full_hash = new_list;
+		if (tdb_ofs_read(tdb, TDB_FREELIST_TOP(new_list),
+				 &rec->next) == -1 ||
+		    tdb_rec_write(tdb, rec_ptr, rec) == -1 ||
+		    tdb_ofs_write(tdb, TDB_FREELIST_TOP(new_list),
+				  &rec_ptr) == -1) {
+			tdb_unlock_free_list(tdb, new_list);
+			return 0;
+		}
+		tdb_unlock_free_list(tdb, new_list);
+	} else if (tdb_rec_write(tdb, rec_ptr, rec) == -1) {
 		return 0;
 	}
 	if (update_tailer(tdb, rec_ptr, rec) == -1) {
@@ -267,13 +429,16 @@ static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb,
 	return rec_ptr;
 }
 
-/* allocate some space from the free list. The offset returned points
-   to a unconnected tdb_record within the database with room for at
-   least length bytes of total data
+/*
+  allocate from one free list, called with the list locked. With
+  first_fit we take the first record that is big enough, which is
+  what we want on the lists of larger records.
 
-   0 is returned if the space could not be allocated
+  Returns -1 on error, otherwise *pnewrec_ptr is 0 if nothing fits
  */
-tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_record *rec)
+static int tdb_allocate_list(struct tdb_context *tdb, tdb_len_t length,
+			     unsigned int list, bool first_fit,
+			     struct tdb_record *rec, tdb_off_t *pnewrec_ptr)
 {
 	tdb_off_t rec_ptr, last_ptr, newrec_ptr;
 	struct {
@@ -282,22 +447,13 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_rec
 	} bestfit;
 	float multiplier = 1.0;
 
-	if (tdb_lock(tdb, -1, F_WRLCK) == -1)
-		return 0;
+	*pnewrec_ptr = 0;
 
-	/* over-allocate to reduce fragmentation */
-	length *= 1.25;
-
-	/* Extra bytes required for tailer */
-	length += sizeof(tdb_off_t);
-	length = TDB_ALIGN(length, TDB_ALIGNMENT);
-
- again:
-	last_ptr = FREELIST_TOP;
+	last_ptr = TDB_FREELIST_TOP(list);
 
 	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &rec_ptr) == -1)
-		goto fail;
+	if (tdb_ofs_read(tdb, last_ptr, &rec_ptr) == -1)
+		return -1;
 
 	bestfit.rec_ptr = 0;
 	bestfit.last_ptr = 0;
@@ -310,7 +466,7 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_rec
 	 */
 	while (rec_ptr) {
 		if (tdb_rec_free_read(tdb, rec_ptr, rec) == -1) {
-			goto fail;
+			return -1;
 		}
 
 		if (rec->rec_len >= length) {
@@ -320,6 +476,9 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_rec
 				bestfit.rec_ptr = rec_ptr;
 				bestfit.last_ptr = last_ptr;
 			}
+			if (first_fit) {
+				break;
+			}
 		}
 
 		/* move to the next record */
@@ -342,23 +501,74 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_rec
 		multiplier *= 1.05;
 	}
 
-	if (bestfit.rec_ptr != 0) {
-		if (tdb_rec_free_read(tdb, bestfit.rec_ptr, rec) == -1) {
+	if (bestfit.rec_ptr == 0) {
+		return 0;
+	}
+
+	if (tdb_rec_free_read(tdb, bestfit.rec_ptr, rec) == -1) {
+		return -1;
+	}
+
+	newrec_ptr = tdb_allocate_ofs(tdb, length, bestfit.rec_ptr,
+				      rec, bestfit.last_ptr, list);
+	if (newrec_ptr == 0) {
+		return -1;
+	}
+	*pnewrec_ptr = newrec_ptr;
+	return 0;
+}
+
+/* allocate some space from the free list. The offset returned points
+   to a unconnected tdb_record within the database with room for at
+   least length bytes of total data
+
+   0 is returned if the space could not be allocated
+ */
+tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_record *rec)
+{
+	tdb_off_t newrec_ptr = 0;
+	unsigned int list, first;
+	int ret;
+
+	/* over-allocate to reduce fragmentation */
+	length *= 1.25;
+
+	/* Extra bytes required for tailer */
+	length += sizeof(tdb_off_t);
+	length = TDB_ALIGN(length, TDB_ALIGNMENT);
+
+	first = tdb_size_class(tdb, length);
+
+ again:
+	if (tdb_lock_free(tdb) == -1)
+		return 0;
+
+	for (list = first; list < tdb_free_lists(tdb); list++) {
+		if (tdb_lock_free_list(tdb, list) == -1) {
 			goto fail;
 		}
+		ret = tdb_allocate_list(tdb, length, list, (list != first),
+					rec, &newrec_ptr);
+		tdb_unlock_free_list(tdb, list);
 
-		newrec_ptr = tdb_allocate_ofs(tdb, length, bestfit.rec_ptr, 
-					      rec, bestfit.last_ptr);
-		tdb_unlock(tdb, -1, F_WRLCK);
-		return newrec_ptr;
+		if (ret == -1) {
+			goto fail;
+		}
+		if (newrec_ptr != 0) {
+			tdb_unlock_free(tdb);
+			return newrec_ptr;
+		}
 	}
 
 	/* we didn't find enough space. See if we can expand the
-	   database and if we can then try again */
+	   database and if we can then try again. tdb_expand() needs
+	   the free lists to itself. */
+	tdb_unlock_free(tdb);
 	if (tdb_expand(tdb, length + sizeof(*rec)) == 0)
 		goto again;
+	return 0;
  fail:
-	tdb_unlock(tdb, -1, F_WRLCK);
+	tdb_unlock_free(tdb);
 	return 0;
 }
 
@@ -370,17 +580,22 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_rec
 _PUBLIC_ int tdb_freelist_size(struct tdb_context *tdb)
 {
 	tdb_off_t ptr;
+	unsigned int list;
 	int count=0;
+	/* keep the allocators of all lists away */
+	int ltype = (tdb_free_lists(tdb) > 1) ? F_WRLCK : F_RDLCK;
 
-	if (tdb_lock(tdb, -1, F_RDLCK) == -1) {
+	if (tdb_lock(tdb, -1, ltype) == -1) {
 		return -1;
 	}
 
-	ptr = FREELIST_TOP;
-	while (tdb_ofs_read(tdb, ptr, &ptr) == 0 && ptr != 0) {
-		count++;
+	for (list = 0; list < tdb_free_lists(tdb); list++) {
+		ptr = TDB_FREELIST_TOP(list);
+		while (tdb_ofs_read(tdb, ptr, &ptr) == 0 && ptr != 0) {
+			count++;
+		}
 	}
 
-	tdb_unlock(tdb, -1, F_RDLCK);
+	tdb_unlock(tdb, -1, ltype);
 	return count;
 }
@@ -36,6 +36,11 @@ static int fcntl_lock(struct tdb_context *tdb,
 		      int rw, off_t off, off_t len, bool waitflag)
 {
 	struct flock fl;
+	int ret;
+
+	if (tdb_mutex_lock(tdb, rw, off, len, waitflag, &ret)) {
+		return ret;
+	}
 
 	fl.l_type = rw;
 	fl.l_whence = SEEK_SET;
@@ -52,6 +57,7 @@ static int fcntl_lock(struct tdb_context *tdb,
 static int fcntl_unlock(struct tdb_context *tdb, int rw, off_t off, off_t len)
 {
 	struct flock fl;
+	int ret;
 #if 0 /* Check they matched up locks and unlocks correctly. */
 	char line[80];
 	FILE *locks;
@@ -110,6 +116,10 @@ static int fcntl_unlock(struct tdb_context *tdb, int rw, off_t off, off_t len)
 	fclose(locks);
 #endif
 
+	if (tdb_mutex_unlock(tdb, rw, off, len, &ret)) {
+		return ret;
+	}
+
 	fl.l_type = F_UNLCK;
 	fl.l_whence = SEEK_SET;
 	fl.l_start = off;
@@ -206,6 +216,7 @@ int tdb_brunlock(struct tdb_context *tdb,
 int tdb_allrecord_upgrade(struct tdb_context *tdb)
 {
 	int count = 1000;
+	tdb_off_t off = FREELIST_TOP;
 
 	if (tdb->allrecord_lock.count != 1) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR,
@@ -220,9 +231,18 @@ int tdb_allrecord_upgrade(struct tdb_context *tdb)
 		return -1;
 	}
 
+	if (tdb_have_mutexes(tdb)) {
+		/* The chains are upgraded in the mutexes, the records
+		 * below are still fcntl locked. */
+		if (tdb_mutex_allrecord_upgrade(tdb) == -1) {
+			return -1;
+		}
+		off = lock_offset(tdb->header.hash_size);
+	}
+
 	while (count--) {
 		struct timeval tv;
-		if (tdb_brlock(tdb, F_WRLCK, FREELIST_TOP, 0,
+		if (tdb_brlock(tdb, F_WRLCK, off, 0,
 			       TDB_LOCK_WAIT|TDB_LOCK_PROBE) == 0) {
 			tdb->allrecord_lock.ltype = F_WRLCK;
 			tdb->allrecord_lock.off = 0;
@@ -236,6 +256,9 @@ int tdb_allrecord_upgrade(struct tdb_context *tdb)
 		tv.tv_usec = 1;
 		select(0, NULL, NULL, NULL, &tv);
 	}
+	if (tdb_have_mutexes(tdb)) {
+		tdb_mutex_allrecord_downgrade(tdb);
+	}
 	TDB_LOG((tdb, TDB_DEBUG_TRACE,"tdb_allrecord_upgrade failed\n"));
 	return -1;
 }
@@ -301,26 +324,40 @@ int tdb_nest_lock(struct tdb_context *tdb, uint32_t offset, int ltype,
 	return 0;
 }
 
-static int tdb_lock_and_recover(struct tdb_context *tdb)
+int tdb_lock_and_recover(struct tdb_context *tdb)
 {
 	int ret;
 
 	/* We need to match locking order in transaction commit. */
-	if (tdb_brlock(tdb, F_WRLCK, FREELIST_TOP, 0, TDB_LOCK_WAIT)) {
+	if (tdb_have_mutexes(tdb) &&
+	    tdb_mutex_allrecord_lock(tdb, F_WRLCK, TDB_LOCK_WAIT)) {
 		return -1;
 	}
 
+	if (tdb_brlock(tdb, F_WRLCK, FREELIST_TOP, 0, TDB_LOCK_WAIT)) {
+		goto fail;
+	}
+
 	if (tdb_brlock(tdb, F_WRLCK, OPEN_LOCK, 1, TDB_LOCK_WAIT)) {
 		tdb_brunlock(tdb, F_WRLCK, FREELIST_TOP, 0);
-		return -1;
+		goto fail;
 	}
 
 	ret = tdb_transaction_recover(tdb);
 
 	tdb_brunlock(tdb, F_WRLCK, OPEN_LOCK, 1);
 	tdb_brunlock(tdb, F_WRLCK, FREELIST_TOP, 0);
+	if (tdb_have_mutexes(tdb)) {
+		tdb_mutex_allrecord_unlock(tdb);
+	}
 
 	return ret;
+
+fail:
+	if (tdb_have_mutexes(tdb)) {
+		tdb_mutex_allrecord_unlock(tdb);
+	}
+	return -1;
 }
 
 static bool have_data_locks(const struct tdb_context *tdb)
@@ -362,6 +399,18 @@ static int tdb_lock_list(struct tdb_context *tdb, int list, int ltype,
 			}
 			return tdb_lock_list(tdb, list, ltype, waitflag);
 		}
+
+		/* Our writes would not be covered by the batch's
+		 * recovery data, so finish the batch first. */
+		if (ret == 0 && check && ltype == F_WRLCK &&
+		    tdb_batch_pending(tdb)) {
+			tdb_nest_unlock(tdb, lock_offset(list), ltype, false);
+
+			if (tdb_transaction_close_batch(tdb) == -1) {
+				return -1;
+			}
+			return tdb_lock_list(tdb, list, ltype, waitflag);
+		}
 	}
 	return ret;
 }
@@ -547,6 +596,24 @@ static int tdb_chainlock_gradual(struct tdb_context *tdb,
 	return 0;
 }
 
+/* Does another process take part in an open commit batch? F_GETLK
+ * works on read-only file descriptors as well. */
+bool tdb_batch_open(struct tdb_context *tdb)
+{
+	struct flock fl;
+
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = BATCH_LOCK;
+	fl.l_len = 1;
+	fl.l_pid = 0;
+
+	if (fcntl(tdb->fd, F_GETLK, &fl) == -1) {
+		return false;
+	}
+	return fl.l_type != F_UNLCK;
+}
+
 /* lock/unlock entire database.  It can only be upgradable if you have some
  * other way of guaranteeing exclusivity (ie. transaction write lock).
  * We do the locking gradually to avoid being starved by smaller locks. */
@@ -566,17 +633,27 @@ int tdb_allrecord_lock(struct tdb_context *tdb, int ltype,
 	 *    chain locks.
 	 *
 	 * It is (1) which cause the starvation problem, so we're only
-	 * gradual for that. */
-	if (tdb_chainlock_gradual(tdb, ltype, flags, FREELIST_TOP,
-				  tdb->header.hash_size * 4) == -1) {
+	 * gradual for that. With mutexes, (1) is the allrecord mutex. */
+	if (tdb_have_mutexes(tdb)) {
+		if (tdb_mutex_allrecord_lock(tdb, ltype, flags) == -1) {
+			return -1;
+		}
+	} else if (tdb_chainlock_gradual(tdb, ltype, flags, FREELIST_TOP,
+					 tdb->header.hash_size * 4) == -1) {
 		return -1;
 	}
 
 	/* Grab individual record locks. */
 	if (tdb_brlock(tdb, ltype, lock_offset(tdb->header.hash_size), 0,
 		       flags) == -1) {
-		tdb_brunlock(tdb, ltype, FREELIST_TOP,
-			     tdb->header.hash_size * 4);
+		if (tdb_have_mutexes(tdb)) {
+			if (!(flags & TDB_LOCK_MARK_ONLY)) {
+				tdb_mutex_allrecord_unlock(tdb);
+			}
+		} else {
+			tdb_brunlock(tdb, ltype, FREELIST_TOP,
+				     tdb->header.hash_size * 4);
+		}
 		return -1;
 	}
 
@@ -601,6 +678,23 @@ int tdb_allrecord_lock(struct tdb_context *tdb, int ltype,
 		return tdb_allrecord_lock(tdb, ltype, flags, upgradable);
 	}
 
+	/* A transaction joins an open commit batch, other writers
+	 * finish it first. */
+	if (ltype == F_WRLCK && !upgradable && tdb_batch_pending(tdb)) {
+		bool mark = flags & TDB_LOCK_MARK_ONLY;
+		tdb_allrecord_unlock(tdb, ltype, mark);
+		if (mark) {
+			tdb->ecode = TDB_ERR_LOCK;
+			TDB_LOG((tdb, TDB_DEBUG_ERROR,
+				 "tdb_lockall_mark cannot finish commit batch\n"));
+			return -1;
+		}
+		if (tdb_transaction_close_batch(tdb) == -1) {
+			return -1;
+		}
+		return tdb_allrecord_lock(tdb, ltype, flags, upgradable);
+	}
+
 	return 0;
 }
 
@@ -632,6 +726,11 @@ int tdb_allrecord_unlock(struct tdb_context *tdb, int ltype, bool mark_lock)
 		return 0;
 	}
 
+	if (!mark_lock && tdb_have_mutexes(tdb) &&
+	    tdb_mutex_allrecord_unlock(tdb)) {
+		return -1;
+	}
+
 	if (!mark_lock && tdb_brunlock(tdb, ltype, FREELIST_TOP, 0)) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_unlockall failed (%s)\n", strerror(errno)));
 		return -1;
@@ -840,6 +939,9 @@ void tdb_release_transaction_locks(struct tdb_context *tdb)
 	unsigned int i, active = 0;
 
 	if (tdb->allrecord_lock.count != 0) {
+		if (tdb_have_mutexes(tdb)) {
+			tdb_mutex_allrecord_unlock(tdb);
+		}
 		tdb_brunlock(tdb, tdb->allrecord_lock.ltype, FREELIST_TOP, 0);
 		tdb->allrecord_lock.count = 0;
 	}
@@ -0,0 +1,572 @@
+ /*
+   Unix SMB/CIFS implementation.
+
+   trivial database library - robust mutexes for the chain locks
+
+     ** NOTE! The following LGPL license applies to the tdb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tdb_private.h"
+
+#ifdef USE_TDB_MUTEX_LOCKING
+
+#include <pthread.h>
+
+/*
+ * Every chain and freelist lock is an fcntl lock, a system call even
+ * when nobody else is interested in the chain. With TDB_MUTEX_LOCKING
+ * these locks are process shared robust mutexes stored in the file, so
+ * an uncontended lock stays in user space. If a holder dies, the next
+ * locker gets EOWNERDEAD and carries on, just like the kernel drops
+ * the fcntl locks of a dying process.
+ *
+ * The mutex area sits between the hash table and the first record,
+ * starting on a page boundary. It is mapped on its own: the kernel
+ * finds the robust mutexes a process holds by their address, so they
+ * must not move when the file is remapped after it grew.
+ *
+ * hashchains[0] is the freelist lock, hashchains[i+1] the lock of hash
+ * chain i. The record locks stay fcntl locks.
+ *
+ * The allrecord lock is allrecord_mutex together with the type of the
+ * allrecord lock in allrecord_lock. A chain locker that finds
+ * allrecord_lock set drops its chain mutex and waits for
+ * allrecord_mutex. The allrecord locker sets allrecord_lock and then
+ * locks and unlocks every chain mutex once, to wait for the chain
+ * lockers that got in before it. Like the fcntl based allrecord lock,
+ * it does not cover the freelist.
+ */
+
+struct tdb_mutexes {
+	pthread_mutex_t allrecord_mutex;
+	short int allrecord_lock; /* F_UNLCK, F_RDLCK or F_WRLCK */
+	pthread_mutex_t hashchains[1];
+};
+
+bool tdb_have_mutexes(struct tdb_context *tdb)
+{
+	return (tdb->mutexes != NULL);
+}
+
+bool tdb_mutex_supported(void)
+{
+	return true;
+}
+
+/* the page aligned region the mutexes occupy in the file */
+static void tdb_mutex_area(struct tdb_context *tdb, uint32_t hash_size,
+			   tdb_off_t *ofs, tdb_len_t *len)
+{
+	size_t size;
+
+	size = sizeof(struct tdb_mutexes) + hash_size * sizeof(pthread_mutex_t);
+
+	*ofs = TDB_ALIGN(TDB_HASH_END(hash_size), tdb->page_size);
+	*len = TDB_ALIGN(size, tdb->page_size);
+}
+
+/* the space between hash table and first record of a new database */
+tdb_len_t tdb_mutex_size(struct tdb_context *tdb, uint32_t hash_size)
+{
+	tdb_off_t ofs;
+	tdb_len_t len;
+
+	tdb_mutex_area(tdb, hash_size, &ofs, &len);
+	return (ofs - TDB_HASH_END(hash_size)) + len;
+}
+
+int tdb_mutex_mmap(struct tdb_context *tdb)
+{
+	struct stat st;
+	tdb_off_t ofs;
+	tdb_len_t len;
+	void *ptr;
+
+	if (tdb->mutexes != NULL) {
+		return 0;
+	}
+
+	tdb_mutex_area(tdb, tdb->header.hash_size, &ofs, &len);
+
+	/* This fails if the page size changed since the file was created */
+	if (ofs + len > TDB_DATA_START(tdb)) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_mutex_mmap: mutex area "
+			 "%u+%u does not fit below %u\n", ofs, len,
+			 (unsigned)TDB_DATA_START(tdb)));
+		tdb->ecode = TDB_ERR_CORRUPT;
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fstat(tdb->fd, &st) == -1) {
+		return -1;
+	}
+	if (st.st_size < (off_t)ofs + len) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_mutex_mmap: file too "
+			 "short for the mutex area\n"));
+		tdb->ecode = TDB_ERR_CORRUPT;
+		errno = EIO;
+		return -1;
+	}
+
+	ptr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FILE,
+		   tdb->fd, ofs);
+	if (ptr == MAP_FAILED) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_mutex_mmap: mmap failed "
+			 "(%s)\n", strerror(errno)));
+		return -1;
+	}
+	tdb->mutexes = (struct tdb_mutexes *)ptr;
+	return 0;
+}
+
+int tdb_mutex_munmap(struct tdb_context *tdb)
+{
+	tdb_off_t ofs;
+	tdb_len_t len;
+	int ret;
+
+	if (tdb->mutexes == NULL) {
+		return 0;
+	}
+
+	tdb_mutex_area(tdb, tdb->header.hash_size, &ofs, &len);
+
+	ret = munmap(tdb->mutexes, len);
+	tdb->mutexes = NULL;
+	return ret;
+}
+
+/*
+  initialise the mutexes of a new database. The caller holds the open
+  lock and is the only one with the database open (TDB_CLEAR_IF_FIRST),
+  so nobody can use the mutexes before we're done.
+*/
+int tdb_mutex_init(struct tdb_context *tdb)
+{
+	struct tdb_mutexes *m;
+	pthread_mutexattr_t ma;
+	uint32_t i;
+	int ret;
+
+	if (tdb_mutex_mmap(tdb) == -1) {
+		return -1;
+	}
+	m = tdb->mutexes;
+
+	ret = pthread_mutexattr_init(&ma);
+	if (ret != 0) {
+		goto fail_munmap;
+	}
+	ret = pthread_mutexattr_settype(&ma, PTHREAD_MUTEX_ERRORCHECK);
+	if (ret != 0) {
+		goto fail;
+	}
+	ret = pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	if (ret != 0) {
+		goto fail;
+	}
+	ret = pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	if (ret != 0) {
+		goto fail;
+	}
+
+	ret = pthread_mutex_init(&m->allrecord_mutex, &ma);
+	if (ret != 0) {
+		goto fail;
+	}
+	m->allrecord_lock = F_UNLCK;
+
+	for (i=0; i<=tdb->header.hash_size; i++) {
+		ret = pthread_mutex_init(&m->hashchains[i], &ma);
+		if (ret != 0) {
+			goto fail;
+		}
+	}
+
+	pthread_mutexattr_destroy(&ma);
+	return 0;
+
+fail:
+	pthread_mutexattr_destroy(&ma);
+fail_munmap:
+	TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_mutex_init: failed to "
+		 "initialise the mutexes: %s\n", strerror(ret)));
+	tdb_mutex_munmap(tdb);
+	errno = ret;
+	return -1;
+}
+
+static int chain_mutex_lock(pthread_mutex_t *m, bool waitflag)
+{
+	int ret;
+
+	if (waitflag) {
+		ret = pthread_mutex_lock(m);
+	} else {
+		ret = pthread_mutex_trylock(m);
+	}
+	if (ret == EOWNERDEAD) {
+		/*
+		 * The holder died. Just like with the fcntl locks the
+		 * kernel drops on exit, we simply take over.
+		 */
+		ret = pthread_mutex_consistent(m);
+	}
+	return ret;
+}
+
+static int allrecord_mutex_lock(struct tdb_mutexes *m, bool waitflag)
+{
+	int ret;
+
+	if (waitflag) {
+		ret = pthread_mutex_lock(&m->allrecord_mutex);
+	} else {
+		ret = pthread_mutex_trylock(&m->allrecord_mutex);
+	}
+	if (ret == EOWNERDEAD) {
+		/* The allrecord lock died with its holder */
+		m->allrecord_lock = F_UNLCK;
+		ret = pthread_mutex_consistent(&m->allrecord_mutex);
+	}
+	return ret;
+}
+
+/* map a one byte fcntl lock to its mutex, false if it's not a chain */
+static bool tdb_mutex_index(struct tdb_context *tdb, off_t off, off_t len,
+			    unsigned int *idx)
+{
+	if (tdb->mutexes == NULL || len != 1) {
+		return false;
+	}
+	if (off == (off_t)(FREELIST_TOP - sizeof(tdb_off_t))) {
+		*idx = 0;
+		return true;
+	}
+	if (off < (off_t)FREELIST_TOP) {
+		return false;
+	}
+	off -= FREELIST_TOP;
+	if (off % sizeof(tdb_off_t) != 0) {
+		return false;
+	}
+	off /= sizeof(tdb_off_t);
+	if (off >= (off_t)tdb->header.hash_size) {
+		return false;
+	}
+	*idx = off + 1;
+	return true;
+}
+
+/*
+  lock a chain or the freelist. Returns false if the lock is not ours
+  to handle, otherwise true with the fcntl style result in *pret.
+*/
+bool tdb_mutex_lock(struct tdb_context *tdb, int rw, off_t off, off_t len,
+		    bool waitflag, int *pret)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	pthread_mutex_t *chain;
+	unsigned int idx;
+	int ret;
+
+	if (!tdb_mutex_index(tdb, off, len, &idx)) {
+		return false;
+	}
+	chain = &m->hashchains[idx];
+
+again:
+	ret = chain_mutex_lock(chain, waitflag);
+	if (ret == EBUSY) {
+		ret = EAGAIN;
+	}
+	if (ret != 0) {
+		goto fail;
+	}
+
+	if (idx == 0) {
+		/* the freelist is not covered by the allrecord lock */
+		goto done;
+	}
+
+	if (m->allrecord_lock == F_UNLCK) {
+		/* the fast path */
+		goto done;
+	}
+
+	if ((m->allrecord_lock == F_RDLCK) && (rw == F_RDLCK)) {
+		goto done;
+	}
+
+	/* someone holds the allrecord lock, wait for them */
+	ret = pthread_mutex_unlock(chain);
+	if (ret != 0) {
+		goto fail;
+	}
+	if (!waitflag) {
+		ret = EAGAIN;
+		goto fail;
+	}
+
+	ret = allrecord_mutex_lock(m, true);
+	if (ret != 0) {
+		goto fail;
+	}
+	ret = pthread_mutex_unlock(&m->allrecord_mutex);
+	if (ret != 0) {
+		goto fail;
+	}
+	goto again;
+
+done:
+	*pret = 0;
+	return true;
+
+fail:
+	errno = ret;
+	*pret = -1;
+	return true;
+}
+
+bool tdb_mutex_unlock(struct tdb_context *tdb, int rw, off_t off, off_t len,
+		      int *pret)
+{
+	unsigned int idx;
+	int ret;
+
+	if (!tdb_mutex_index(tdb, off, len, &idx)) {
+		return false;
+	}
+
+	ret = pthread_mutex_unlock(&tdb->mutexes->hashchains[idx]);
+	if (ret != 0) {
+		errno = ret;
+		*pret = -1;
+		return true;
+	}
+	*pret = 0;
+	return true;
+}
+
+/* lock and unlock every chain once, waiting for the chain lockers */
+static int tdb_mutex_cycle_chains(struct tdb_context *tdb, bool waitflag)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	uint32_t i;
+	int ret;
+
+	for (i=0; i<tdb->header.hash_size; i++) {
+		pthread_mutex_t *chain = &m->hashchains[i+1];
+
+		ret = chain_mutex_lock(chain, waitflag);
+		if (ret == EBUSY) {
+			ret = EAGAIN;
+		}
+		if (ret != 0) {
+			return ret;
+		}
+		ret = pthread_mutex_unlock(chain);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/* the chain part of the allrecord lock, leaves allrecord_mutex locked */
+int tdb_mutex_allrecord_lock(struct tdb_context *tdb, int ltype,
+			     enum tdb_lock_flags flags)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	bool waitflag = (flags & TDB_LOCK_WAIT);
+	int ret;
+
+	if (flags & TDB_LOCK_MARK_ONLY) {
+		return 0;
+	}
+
+	ret = allrecord_mutex_lock(m, waitflag);
+	if (ret == EBUSY) {
+		ret = EAGAIN;
+	}
+	if (ret != 0) {
+		goto fail;
+	}
+
+	if (m->allrecord_lock != F_UNLCK) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_mutex_allrecord_lock: "
+			 "allrecord_lock == %d\n", (int)m->allrecord_lock));
+		pthread_mutex_unlock(&m->allrecord_mutex);
+		ret = EINVAL;
+		goto fail;
+	}
+
+	m->allrecord_lock = (ltype == F_RDLCK) ? F_RDLCK : F_WRLCK;
+
+	ret = tdb_mutex_cycle_chains(tdb, waitflag);
+	if (ret != 0) {
+		m->allrecord_lock = F_UNLCK;
+		pthread_mutex_unlock(&m->allrecord_mutex);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	if (!(flags & TDB_LOCK_PROBE) && (ret != EAGAIN)) {
+		TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_mutex_allrecord_lock "
+			 "failed: %s\n", strerror(ret)));
+	}
+	tdb->ecode = TDB_ERR_LOCK;
+	errno = ret;
+	return -1;
+}
+
+int tdb_mutex_allrecord_unlock(struct tdb_context *tdb)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	int ret;
+
+	if ((m->allrecord_lock != F_RDLCK) && (m->allrecord_lock != F_WRLCK)) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_mutex_allrecord_unlock: "
+			 "allrecord_lock == %d\n", (int)m->allrecord_lock));
+		tdb->ecode = TDB_ERR_LOCK;
+		return -1;
+	}
+
+	m->allrecord_lock = F_UNLCK;
+
+	ret = pthread_mutex_unlock(&m->allrecord_mutex);
+	if (ret != 0) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_mutex_allrecord_unlock: "
+			 "pthread_mutex_unlock failed: %s\n", strerror(ret)));
+		tdb->ecode = TDB_ERR_LOCK;
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+/* turn our allrecord read lock into a write lock */
+int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	int ret;
+
+	if (m->allrecord_lock != F_RDLCK) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_mutex_allrecord_upgrade: "
+			 "allrecord_lock == %d\n", (int)m->allrecord_lock));
+		tdb->ecode = TDB_ERR_LOCK;
+		return -1;
+	}
+
+	m->allrecord_lock = F_WRLCK;
+
+	/* wait for the chain readers we let in so far */
+	ret = tdb_mutex_cycle_chains(tdb, true);
+	if (ret != 0) {
+		m->allrecord_lock = F_RDLCK;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_mutex_allrecord_upgrade "
+			 "failed: %s\n", strerror(ret)));
+		tdb->ecode = TDB_ERR_LOCK;
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+void tdb_mutex_allrecord_downgrade(struct tdb_context *tdb)
+{
+	tdb->mutexes->allrecord_lock = F_RDLCK;
+}
+
+#else /* USE_TDB_MUTEX_LOCKING */
+
+bool tdb_have_mutexes(struct tdb_context *tdb)
+{
+	return false;
+}
+
+bool tdb_mutex_supported(void)
+{
+	return false;
+}
+
+tdb_len_t tdb_mutex_size(struct tdb_context *tdb, uint32_t hash_size)
+{
+	return 0;
+}
+
+int tdb_mutex_mmap(struct tdb_context *tdb)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int tdb_mutex_munmap(struct tdb_context *tdb)
+{
+	return 0;
+}
+
+int tdb_mutex_init(struct tdb_context *tdb)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+bool tdb_mutex_lock(struct tdb_context *tdb, int rw, off_t off, off_t len,
+		    bool waitflag, int *pret)
+{
+	return false;
+}
+
+bool tdb_mutex_unlock(struct tdb_context *tdb, int rw, off_t off, off_t len,
+		      int *pret)
+{
+	return false;
+}
+
+int tdb_mutex_allrecord_lock(struct tdb_context *tdb, int ltype,
+			     enum tdb_lock_flags flags)
+{
+	tdb->ecode = TDB_ERR_LOCK;
+	errno = ENOSYS;
+	return -1;
+}
+
+int tdb_mutex_allrecord_unlock(struct tdb_context *tdb)
+{
+	tdb->ecode = TDB_ERR_LOCK;
+	errno = ENOSYS;
+	return -1;
+}
+
+int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb)
+{
+	tdb->ecode = TDB_ERR_LOCK;
+	errno = ENOSYS;
+	return -1;
+}
+
+void tdb_mutex_allrecord_downgrade(struct tdb_context *tdb)
+{
+	return;
+}
+
+#endif /* USE_TDB_MUTEX_LOCKING */
@@ -56,6 +56,7 @@ static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 	struct tdb_header *newdb;
 	size_t size;
 	int ret = -1;
+	bool mutexes = (tdb->flags & TDB_MUTEX_LOCKING);
 
 	/* We make it up in memory, then write it out if not internal */
 	size = sizeof(struct tdb_header) + (hash_size+1)*sizeof(tdb_off_t);
@@ -75,6 +76,30 @@ static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 	if (tdb->flags & TDB_INCOMPATIBLE_HASH)
 		newdb->rwlocks = TDB_HASH_RWLOCK_MAGIC;
 
+	/* The same for the feature flags, the mutex area between hash
+	 * table and records would confuse older tdbs. */
+	if (mutexes) {
+		newdb->rwlocks = TDB_FEATURE_FLAG_MAGIC;
+		newdb->feature_flags = TDB_FEATURE_FLAG_MUTEX;
+		newdb->mutex_size = tdb_mutex_size(tdb, hash_size);
+	}
+
+	/* Split buckets in the data area would look like corruption to
+	 * older tdbs as well. */
+	if (tdb->flags & TDB_GROW_HASH) {
+		newdb->rwlocks = TDB_FEATURE_FLAG_MAGIC;
+		newdb->feature_flags |= TDB_FEATURE_FLAG_GROW_HASH;
+	}
+	if (tdb->flags & TDB_SIZE_CLASSES) {
+		newdb->rwlocks = TDB_FEATURE_FLAG_MAGIC;
+		newdb->feature_flags |= TDB_FEATURE_FLAG_SIZE_CLASSES;
+	}
+	/* Older tdbs would roll back an open commit batch. */
+	if (tdb->flags & TDB_GROUP_COMMIT) {
+		newdb->rwlocks = TDB_FEATURE_FLAG_MAGIC;
+		newdb->feature_flags |= TDB_FEATURE_FLAG_GROUP_COMMIT;
+	}
+
 	if (tdb->flags & TDB_INTERNAL) {
 		tdb->map_size = size;
 		tdb->map_ptr = (char *)newdb;
@@ -95,8 +120,17 @@ static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 	/* Don't endian-convert the magic food! */
 	memcpy(newdb->magic_food, TDB_MAGIC_FOOD, strlen(TDB_MAGIC_FOOD)+1);
 	/* we still have "ret == -1" here */
-	if (tdb_write_all(tdb->fd, newdb, size))
-		ret = 0;
+	if (!tdb_write_all(tdb->fd, newdb, size))
+		goto fail;
+
+	if (mutexes) {
+		/* the mutex area is zero filled by extending the file */
+		if (ftruncate(tdb->fd, TDB_HASH_END(hash_size) + newdb->mutex_size) == -1)
+			goto fail;
+		if (tdb_mutex_init(tdb) == -1)
+			goto fail;
+	}
+	ret = 0;
 
   fail:
 	SAFE_FREE(newdb);
@@ -260,6 +294,26 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		tdb->flags &= ~TDB_CLEAR_IF_FIRST;
 	}
 
+	if (tdb->flags & TDB_MUTEX_LOCKING) {
+		/*
+		 * The mutexes are only initialised when the file is
+		 * created, stale mutexes from a crashed machine must
+		 * not survive. So every user wipes the database.
+		 */
+		if (!(tdb->flags & TDB_CLEAR_IF_FIRST) &&
+		    !(tdb->flags & TDB_INTERNAL) && !tdb->read_only) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+				 "mutex locking needs clear_if_first for %s\n",
+				 name));
+			errno = EINVAL;
+			goto fail;
+		}
+		if (!tdb_mutex_supported() || (tdb->flags & TDB_CONVERT)) {
+			/* fall back to fcntl locks */
+			tdb->flags &= ~TDB_MUTEX_LOCKING;
+		}
+	}
+
 	if ((tdb->flags & TDB_ALLOW_NESTING) &&
 	    (tdb->flags & TDB_DISALLOW_NESTING)) {
 		tdb->ecode = TDB_ERR_NESTING;
@@ -284,7 +338,8 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 	/* internal databases don't mmap or lock, and start off cleared */
 	if (tdb->flags & TDB_INTERNAL) {
 		tdb->flags |= (TDB_NOLOCK | TDB_NOMMAP);
-		tdb->flags &= ~TDB_CLEAR_IF_FIRST;
+		tdb->flags &= ~(TDB_CLEAR_IF_FIRST|TDB_MUTEX_LOCKING|
+				TDB_GROUP_COMMIT);
 		if (tdb_new_database(tdb, hash_size) != 0) {
 			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: tdb_new_database failed!"));
 			goto fail;
@@ -351,10 +406,48 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 	if (fstat(tdb->fd, &st) == -1)
 		goto fail;
 
-	if (tdb->header.rwlocks != 0 &&
-	    tdb->header.rwlocks != TDB_HASH_RWLOCK_MAGIC) {
+	if (tdb->header.rwlocks == TDB_FEATURE_FLAG_MAGIC) {
+		if (tdb->header.feature_flags &
+		    ~(TDB_FEATURE_FLAG_MUTEX|TDB_FEATURE_FLAG_GROW_HASH|
+		      TDB_FEATURE_FLAG_SIZE_CLASSES|
+		      TDB_FEATURE_FLAG_GROUP_COMMIT)) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+				 "unknown feature flags 0x%08x in %s\n",
+				 tdb->header.feature_flags, name));
+			errno = EINVAL;
+			goto fail;
+		}
+	} else if (tdb->header.rwlocks != 0 &&
+		   tdb->header.rwlocks != TDB_HASH_RWLOCK_MAGIC) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: spinlocks no longer supported\n"));
 		goto fail;
+	} else {
+		tdb->header.feature_flags = 0;
+		tdb->header.mutex_size = 0;
+	}
+
+	/* The file decides how the chains are locked, not the caller */
+	tdb->flags &= ~(TDB_MUTEX_LOCKING|TDB_GROW_HASH|TDB_SIZE_CLASSES);
+	if (tdb->header.feature_flags & TDB_FEATURE_FLAG_GROW_HASH) {
+		tdb->flags |= TDB_GROW_HASH;
+	}
+	if (tdb->header.feature_flags & TDB_FEATURE_FLAG_SIZE_CLASSES) {
+		tdb->flags |= TDB_SIZE_CLASSES;
+	}
+	if (tdb->header.feature_flags & TDB_FEATURE_FLAG_MUTEX) {
+		if (!tdb_mutex_supported() || (tdb->flags & TDB_CONVERT)) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+				 "%s uses mutexes, which we can't use\n",
+				 name));
+			errno = EINVAL;
+			goto fail;
+		}
+		if (!(tdb->flags & TDB_NOLOCK)) {
+			if (tdb_mutex_mmap(tdb) == -1) {
+				goto fail;
+			}
+			tdb->flags |= TDB_MUTEX_LOCKING;
+		}
 	}
 
 	if ((tdb->header.magic1_hash == 0) && (tdb->header.magic2_hash == 0)) {
@@ -410,8 +503,8 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		}
 	}
 
-	/* if needed, run recovery */
-	if (tdb_transaction_recover(tdb) == -1) {
+	/* if needed, run recovery. An open commit batch is not a crash */
+	if (tdb_needs_recovery(tdb) && tdb_transaction_recover(tdb) == -1) {
 		goto fail;
 	}
 
@@ -457,6 +550,7 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		else
 			tdb_munmap(tdb);
 	}
+	tdb_mutex_munmap(tdb);
 	if (tdb->fd != -1)
 		if (close(tdb->fd) != 0)
 			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: failed to close tdb->fd on error!\n"));
@@ -477,6 +571,15 @@ _PUBLIC_ void tdb_set_max_dead(struct tdb_context *tdb, int max_dead)
 	tdb->max_dead_records = max_dead;
 }
 
+/*
+ * Set how long a TDB_GROUP_COMMIT leader waits for other commits
+ */
+
+_PUBLIC_ void tdb_set_commit_delay(struct tdb_context *tdb, unsigned int usecs)
+{
+	tdb->commit_delay = usecs;
+}
+
 /**
  * Close a database.
  *
@@ -498,6 +601,7 @@ _PUBLIC_ int tdb_close(struct tdb_context *tdb)
 		else
 			tdb_munmap(tdb);
 	}
+	tdb_mutex_munmap(tdb);
 	SAFE_FREE(tdb->name);
 	if (tdb->fd != -1) {
 		ret = close(tdb->fd);
@@ -0,0 +1,479 @@
+ /*
+   Unix SMB/CIFS implementation.
+
+   trivial database library - splitting hash chains as the database grows
+
+     ** NOTE! The following LGPL license applies to the tdb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tdb_private.h"
+
+/*
+ * The number of hash chains is fixed when the file is created. A
+ * database that grows far beyond what its creator expected ends up
+ * with long chains, and every fetch and store walks one of them.
+ *
+ * With TDB_GROW_HASH the chains are split one bucket at a time as the
+ * database grows (linear hashing). num_buckets in the header is the
+ * number of buckets in use. With size = hash_size * 2^L the largest
+ * such number not above num_buckets, a hash lives in bucket
+ * hash % size, or in hash % (2*size) if that bucket has already been
+ * split. Splitting bucket num_buckets - size moves the records that
+ * now belong to the new bucket num_buckets into it, all other records
+ * stay where they are.
+ *
+ * Bucket b < hash_size is chain b of the hash table behind the header.
+ * The buckets from hash_size * 2^k to hash_size * 2^(k+1) - 1 live in
+ * the k-th extension table, a record with TDB_HASH_TABLE_MAGIC in the
+ * data area. The offsets of the extension tables are kept in a
+ * directory record of the same kind, hash_dir in the header points to
+ * it.
+ *
+ * All buckets b with the same b % hash_size are protected by the chain
+ * lock b % hash_size. A split only moves records between two buckets
+ * of the same chain lock and leaves the buckets of all other chain
+ * locks alone, so holding a chain lock keeps its buckets stable just
+ * like before and the locks themselves don't change.
+ *
+ * A store that finds more than TDB_SPLIT_CHAIN_LENGTH records in its
+ * chain splits the next bucket once it dropped the chain lock. The
+ * split only waits for nothing: it takes the transaction lock and the
+ * chain lock without blocking and gives up if someone has a record of
+ * the bucket locked, as tdb_firstkey/tdb_nextkey do with the record
+ * they returned. So splits don't happen during tdb_traverse or a
+ * transaction of another process, and whoever holds a lock gets away
+ * with a short delay instead of a stop-the-world rehash.
+ *
+ * Traversals visit the buckets of a chain lock in bit-reversed order
+ * of bucket / hash_size, see tdb_next_bucket(). Both halves of a split
+ * bucket sort where the bucket was, so splits happening while a
+ * traversal is on its way don't make it see a record twice.
+ */
+
+/* Split a bucket when a store finds more records than this in its chain */
+#define TDB_SPLIT_CHAIN_LENGTH 8
+
+/* Stop splitting at this many buckets, their tables take 256MB */
+#define TDB_MAX_BUCKETS (1U << 26)
+
+/* Slots in the directory of extension tables */
+#define TDB_HASH_DIR_SLOTS 32
+
+bool tdb_hash_grows(struct tdb_context *tdb)
+{
+	return (tdb->header.feature_flags & TDB_FEATURE_FLAG_GROW_HASH);
+}
+
+/*
+ * The number of buckets in use. Other processes split buckets, so this
+ * is read from the file every time.
+ */
+int tdb_hash_buckets(struct tdb_context *tdb, uint32_t *num_buckets)
+{
+	tdb_off_t num = 0;
+
+	if (tdb_hash_grows(tdb) &&
+	    (tdb_ofs_read(tdb, TDB_NUM_BUCKETS_OFS, &num) == -1)) {
+		return -1;
+	}
+	if (num == 0) {
+		*num_buckets = tdb->header.hash_size;
+		return 0;
+	}
+	if ((num < tdb->header.hash_size) || (num > TDB_MAX_BUCKETS)) {
+		tdb->ecode = TDB_ERR_CORRUPT;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_hash_buckets: invalid "
+			 "number of buckets %u\n", num));
+		return -1;
+	}
+	*num_buckets = num;
+	return 0;
+}
+
+/* hash_size * 2^L <= num_buckets < hash_size * 2^(L+1) */
+static uint32_t tdb_level_size(struct tdb_context *tdb,
+			       uint32_t num_buckets)
+{
+	uint32_t size = tdb->header.hash_size;
+
+	while (num_buckets - size >= size) {
+		size *= 2;
+	}
+	return size;
+}
+
+static uint32_t tdb_bucket_of(struct tdb_context *tdb, uint32_t hash,
+			      uint32_t num_buckets)
+{
+	uint32_t size = tdb_level_size(tdb, num_buckets);
+	uint32_t bucket = hash % size;
+
+	if (bucket < num_buckets - size) {
+		/* this one has already been split */
+		bucket = hash % (size * 2);
+	}
+	return bucket;
+}
+
+int tdb_hash_bucket(struct tdb_context *tdb, uint32_t hash, uint32_t *bucket)
+{
+	uint32_t num_buckets;
+
+	if (tdb_hash_buckets(tdb, &num_buckets) == -1) {
+		return -1;
+	}
+	*bucket = tdb_bucket_of(tdb, hash, num_buckets);
+	return 0;
+}
+
+/*
+ * The offset of the pointer to the first record of a bucket, the
+ * equivalent of TDB_HASH_TOP(). Returns 0 on error.
+ */
+tdb_off_t tdb_bucket_top(struct tdb_context *tdb, uint32_t bucket)
+{
+	uint32_t size = tdb->header.hash_size;
+	unsigned int level = 0;
+	tdb_off_t dir, table;
+
+	if (bucket < size) {
+		return TDB_HASH_TOP(bucket);
+	}
+
+	while (bucket - size >= size) {
+		size *= 2;
+		level += 1;
+	}
+
+	if (tdb_ofs_read(tdb, TDB_HASH_DIR_OFS, &dir) == -1) {
+		return 0;
+	}
+	if ((dir == 0) ||
+	    (tdb_ofs_read(tdb, dir + sizeof(struct tdb_record)
+			  + level * sizeof(tdb_off_t), &table) == -1)) {
+		goto corrupt;
+	}
+	if (table == 0) {
+		goto corrupt;
+	}
+	return table + sizeof(struct tdb_record)
+		+ (bucket - size) * sizeof(tdb_off_t);
+
+corrupt:
+	tdb->ecode = TDB_ERR_CORRUPT;
+	TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_bucket_top: no table for "
+		 "bucket %u\n", bucket));
+	return 0;
+}
+
+/*
+ * The offset of the pointer to the first record of the bucket "hash"
+ * lives in. The caller holds its chain lock, so this stays valid.
+ */
+tdb_off_t tdb_hash_top(struct tdb_context *tdb, uint32_t hash)
+{
+	uint32_t bucket;
+
+	if (!tdb_hash_grows(tdb)) {
+		return TDB_HASH_TOP(hash);
+	}
+	if (tdb_hash_bucket(tdb, hash, &bucket) == -1) {
+		return 0;
+	}
+	return tdb_bucket_top(tdb, bucket);
+}
+
+/*
+ * Move a traversal on from tlock->bucket. Called with the chain lock
+ * tlock->hash held.
+ *
+ * The hashes in bucket b of chain c are those with (hash / hash_size)
+ * % 2^d == (b - c) / hash_size, where 2^d is the number of buckets the
+ * chain has at b's level. A split of b makes d one larger, so reading
+ * the low d bits of hash / hash_size backwards as a binary fraction, b
+ * covers an interval that its two halves cover after the split. We walk
+ * through these intervals in order: the next bucket is the one the end
+ * of b's interval falls into. This is also right if that bucket has
+ * been split in the meantime, and splits of buckets we've been through
+ * happen behind us.
+ */
+int tdb_next_bucket(struct tdb_context *tdb, struct tdb_traverse_lock *tlock)
+{
+	uint32_t hash_size = tdb->header.hash_size;
+	uint32_t num_buckets, size, span, bits, bit;
+
+	if (tdb_hash_buckets(tdb, &num_buckets) == -1) {
+		return -1;
+	}
+
+	if (tlock->bucket >= num_buckets) {
+		/* tdb_wipe_all() threw away the split buckets */
+		goto next_chain;
+	}
+
+	size = tdb_level_size(tdb, num_buckets);
+	span = size;
+	if ((tlock->bucket >= size) ||
+	    (tlock->bucket < num_buckets - size)) {
+		span = size * 2;
+	}
+
+	/*
+	 * Add one to the last of the d bits, read backwards, and carry
+	 * into the earlier ones.
+	 */
+	bits = tlock->bucket / hash_size;
+	bit = span / hash_size / 2;
+
+	while ((bit != 0) && ((bits & bit) != 0)) {
+		bits &= ~bit;
+		bit >>= 1;
+	}
+	if (bit == 0) {
+		goto next_chain;
+	}
+	bits |= bit;
+
+	tlock->bucket = tdb_bucket_of(tdb, tlock->hash + bits * hash_size,
+				      num_buckets);
+	return 0;
+
+next_chain:
+	tlock->hash += 1;
+	tlock->bucket = tlock->hash;
+	return 0;
+}
+
+/*
+ * Called with the chain lock held after storing a record: does the
+ * record's chain ask for a split?
+ */
+bool tdb_hash_chain_long(struct tdb_context *tdb, uint32_t hash)
+{
+	struct tdb_record rec;
+	tdb_off_t top, rec_ptr;
+	unsigned int count = 0;
+
+	if (!tdb_hash_grows(tdb)) {
+		return false;
+	}
+
+	top = tdb_hash_top(tdb, hash);
+	if ((top == 0) || (tdb_ofs_read(tdb, top, &rec_ptr) == -1)) {
+		return false;
+	}
+
+	while (rec_ptr != 0) {
+		if (++count > TDB_SPLIT_CHAIN_LENGTH) {
+			return true;
+		}
+		if (tdb_rec_read(tdb, rec_ptr, &rec) == -1) {
+			return false;
+		}
+		rec_ptr = rec.next;
+	}
+	return false;
+}
+
+static tdb_off_t tdb_alloc_hash_table(struct tdb_context *tdb,
+				      uint32_t slots)
+{
+	struct tdb_record rec;
+	tdb_off_t off;
+
+	/*
+	 * The slots are not initialised, a split writes the slot of its
+	 * new bucket before the bucket is used.
+	 */
+	off = tdb_allocate(tdb, slots * sizeof(tdb_off_t), &rec);
+	if (off == 0) {
+		return 0;
+	}
+
+	rec.next = 0;
+	rec.key_len = 0;
+	rec.data_len = slots * sizeof(tdb_off_t);
+	rec.full_hash = 0;
+	rec.magic = TDB_HASH_TABLE_MAGIC;
+
+	if (tdb_rec_write(tdb, off, &rec) == -1) {
+		return 0;
+	}
+	return off;
+}
+
+/* Set up the extension table for the buckets from size to 2*size-1 */
+static int tdb_new_hash_table(struct tdb_context *tdb, uint32_t size)
+{
+	unsigned int level = 0;
+	uint32_t s;
+	tdb_off_t dir, table;
+
+	for (s = tdb->header.hash_size; s < size; s *= 2) {
+		level += 1;
+	}
+
+	if (tdb_ofs_read(tdb, TDB_HASH_DIR_OFS, &dir) == -1) {
+		return -1;
+	}
+	if (dir == 0) {
+		dir = tdb_alloc_hash_table(tdb, TDB_HASH_DIR_SLOTS);
+		if (dir == 0) {
+			return -1;
+		}
+		if (tdb_ofs_write(tdb, TDB_HASH_DIR_OFS, &dir) == -1) {
+			return -1;
+		}
+	}
+
+	table = tdb_alloc_hash_table(tdb, size);
+	if (table == 0) {
+		return -1;
+	}
+	return tdb_ofs_write(tdb, dir + sizeof(struct tdb_record)
+			     + level * sizeof(tdb_off_t), &table);
+}
+
+/*
+ * Split bucket num_buckets - size into itself and bucket num_buckets.
+ * Called with the transaction lock and the chain lock held. Returns 1
+ * if the bucket is busy.
+ */
+static int tdb_split_bucket(struct tdb_context *tdb, uint32_t num_buckets,
+			    uint32_t size)
+{
+	uint32_t from = num_buckets - size;
+	tdb_off_t from_top, to_top, from_last, to_last, rec_ptr, ptr;
+	tdb_off_t zero = 0;
+	tdb_off_t new_num = num_buckets + 1;
+	struct tdb_record rec;
+
+	from_top = tdb_bucket_top(tdb, from);
+	if ((from_top == 0) || (tdb_ofs_read(tdb, from_top, &rec_ptr) == -1)) {
+		return -1;
+	}
+
+	/* Don't pull records away from under someone traversing */
+	for (ptr = rec_ptr; ptr != 0; ptr = rec.next) {
+		if (tdb_write_lock_record(tdb, ptr) != 0) {
+			return 1;
+		}
+		if (tdb_write_unlock_record(tdb, ptr) != 0) {
+			return -1;
+		}
+		if (tdb_rec_read(tdb, ptr, &rec) == -1) {
+			return -1;
+		}
+		if (rec.next == ptr) {
+			tdb->ecode = TDB_ERR_CORRUPT;
+			TDB_LOG((tdb, TDB_DEBUG_FATAL,
+				 "tdb_split_bucket: loop detected.\n"));
+			return -1;
+		}
+	}
+
+	if ((from == 0) && (tdb_new_hash_table(tdb, size) == -1)) {
+		return -1;
+	}
+	to_top = tdb_bucket_top(tdb, num_buckets);
+	if (to_top == 0) {
+		return -1;
+	}
+
+	/* Deal the records out to both buckets, keeping their order */
+	from_last = from_top;
+	to_last = to_top;
+
+	while (rec_ptr != 0) {
+		tdb_off_t *last;
+
+		if (tdb_rec_read(tdb, rec_ptr, &rec) == -1) {
+			return -1;
+		}
+
+		if (tdb_bucket_of(tdb, rec.full_hash, new_num) == from) {
+			last = &from_last;
+		} else {
+			last = &to_last;
+		}
+		/* next ptr is at start of record */
+		if (tdb_ofs_write(tdb, *last, &rec_ptr) == -1) {
+			return -1;
+		}
+		*last = rec_ptr;
+		rec_ptr = rec.next;
+	}
+
+	if ((tdb_ofs_write(tdb, from_last, &zero) == -1) ||
+	    (tdb_ofs_write(tdb, to_last, &zero) == -1)) {
+		return -1;
+	}
+
+	return tdb_ofs_write(tdb, TDB_NUM_BUCKETS_OFS, &new_num);
+}
+
+/*
+ * Split the next bucket, if that's possible without waiting for
+ * anyone. Called without any chain lock held, after a store found its
+ * chain too long. The store succeeded, so this does not report errors.
+ */
+void tdb_hash_split(struct tdb_context *tdb)
+{
+	enum TDB_ERROR ecode = tdb->ecode;
+	uint32_t num_buckets, size, chain;
+	int ret;
+
+	if (tdb->travlocks.next != NULL) {
+		/* a store from a traverse callback */
+		return;
+	}
+	if ((tdb->transaction == NULL) && tdb_have_extra_locks(tdb)) {
+		/* we can't take the transaction lock after chain locks */
+		return;
+	}
+
+	if (tdb_transaction_lock(tdb, F_WRLCK,
+				 TDB_LOCK_NOWAIT|TDB_LOCK_PROBE) == -1) {
+		tdb->ecode = ecode;
+		return;
+	}
+
+	if (tdb_hash_buckets(tdb, &num_buckets) == -1) {
+		goto unlock;
+	}
+	size = tdb_level_size(tdb, num_buckets);
+	if (size > TDB_MAX_BUCKETS / 2) {
+		goto unlock;
+	}
+	chain = (num_buckets - size) % tdb->header.hash_size;
+
+	if (tdb_lock_nonblock(tdb, chain, F_WRLCK) == -1) {
+		goto unlock;
+	}
+
+	ret = tdb_split_bucket(tdb, num_buckets, size);
+	if (ret == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_hash_split: failed to "
+			 "split bucket %u\n", num_buckets - size));
+	}
+
+	tdb_unlock(tdb, chain, F_WRLCK);
+unlock:
+	tdb_transaction_unlock(tdb, F_WRLCK);
+	tdb->ecode = ecode;
+}
@@ -29,6 +29,8 @@
 	"Smallest/average/largest free records: %zu/%zu/%zu\n" \
 	"Number of hash chains: %zu\n" \
 	"Smallest/average/largest hash chains: %zu/%zu/%zu\n" \
+	"Number of split hash chains: %zu\n" \
+	"Number of empty/long hash chains: %zu/%zu\n" \
 	"Number of uncoalesced records: %zu\n" \
 	"Smallest/average/largest uncoalesced runs: %zu/%zu/%zu\n" \
 	"Percentage keys/data/padding/free/dead/rechdrs&tailers/hashes: %.0f/%.0f/%.0f/%.0f/%.0f/%.0f/%.0f\n"
@@ -65,12 +67,16 @@ static size_t tally_mean(const struct tally *tally)
 	return tally->total / tally->num;
 }
 
+/* A chain this long asks for a split with TDB_GROW_HASH */
+#define LONG_HASH_CHAIN 8
+
 static size_t get_hash_length(struct tdb_context *tdb, unsigned int i)
 {
-	tdb_off_t rec_ptr;
+	tdb_off_t rec_ptr, top;
 	size_t count = 0;
 
-	if (tdb_ofs_read(tdb, TDB_HASH_TOP(i), &rec_ptr) == -1)
+	top = tdb_bucket_top(tdb, i);
+	if (top == 0 || tdb_ofs_read(tdb, top, &rec_ptr) == -1)
 		return 0;
 
 	/* keep looking until we find the right record */
@@ -91,7 +97,8 @@ _PUBLIC_ char *tdb_summary(struct tdb_context *tdb)
 	struct tdb_record rec;
 	char *ret = NULL;
 	bool locked;
-	size_t len, unc = 0;
+	size_t len, unc = 0, tables = 0, empty = 0, longer = 0;
+	uint32_t num_buckets;
 	struct tdb_record recovery;
 
 	/* Read-only databases use no locking at all: it's best-effort.
@@ -116,7 +123,7 @@ _PUBLIC_ char *tdb_summary(struct tdb_context *tdb)
 	tally_init(&hash);
 	tally_init(&uncoal);
 
-	for (off = TDB_DATA_START(tdb->header.hash_size);
+	for (off = TDB_DATA_START(tdb);
 	     off < tdb->map_size - 1;
 	     off += sizeof(rec) + rec.rec_len) {
 		if (tdb->methods->tdb_read(tdb, off, &rec, sizeof(rec),
@@ -136,6 +143,12 @@ _PUBLIC_ char *tdb_summary(struct tdb_context *tdb)
 			tally_add(&freet, rec.rec_len);
 			unc++;
 			break;
+		case TDB_HASH_TABLE_MAGIC:
+			tables += sizeof(rec) + rec.rec_len;
+			if (unc > 1)
+				tally_add(&uncoal, unc - 1);
+			unc = 0;
+			break;
 		/* If we crash after ftruncate, we can get zeroes or fill. */
 		case TDB_RECOVERY_INVALID_MAGIC:
 		case 0x42424242:
@@ -159,11 +172,20 @@ _PUBLIC_ char *tdb_summary(struct tdb_context *tdb)
 	if (unc > 1)
 		tally_add(&uncoal, unc - 1);
 
-	for (off = 0; off < tdb->header.hash_size; off++)
-		tally_add(&hash, get_hash_length(tdb, off));
+	if (tdb_hash_buckets(tdb, &num_buckets) == -1)
+		goto unlock;
+
+	for (off = 0; off < num_buckets; off++) {
+		size_t chain = get_hash_length(tdb, off);
+		tally_add(&hash, chain);
+		if (chain == 0)
+			empty++;
+		else if (chain > LONG_HASH_CHAIN)
+			longer++;
+	}
 
 	/* 20 is max length of a %zu. */
-	len = strlen(SUMMARY_FORMAT) + 35*20 + 1;
+	len = strlen(SUMMARY_FORMAT) + 38*20 + 1;
 	ret = (char *)malloc(len);
 	if (!ret)
 		goto unlock;
@@ -180,6 +202,8 @@ _PUBLIC_ char *tdb_summary(struct tdb_context *tdb)
 		 freet.min, tally_mean(&freet), freet.max,
 		 hash.num,
 		 hash.min, tally_mean(&hash), hash.max,
+		 hash.num - tdb->header.hash_size,
+		 empty, longer,
 		 uncoal.total,
 		 uncoal.min, tally_mean(&uncoal), uncoal.max,
 		 keys.total * 100.0 / tdb->map_size,
@@ -190,7 +214,7 @@ _PUBLIC_ char *tdb_summary(struct tdb_context *tdb)
 		 (keys.num + freet.num + dead.num)
 		 * (sizeof(struct tdb_record) + sizeof(uint32_t))
 		 * 100.0 / tdb->map_size,
-		 tdb->header.hash_size * sizeof(tdb_off_t)
+		 (tdb->header.hash_size * sizeof(tdb_off_t) + tables)
 		 * 100.0 / tdb->map_size);
 
 unlock:
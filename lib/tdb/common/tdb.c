@@ -79,10 +79,11 @@ static int tdb_key_compare(TDB_DATA key, TDB_DATA data, void *private_data)
 static tdb_off_t tdb_find(struct tdb_context *tdb, TDB_DATA key, uint32_t hash,
 			struct tdb_record *r)
 {
-	tdb_off_t rec_ptr;
+	tdb_off_t rec_ptr, top;
 
 	/* read in the hash top */
-	if (tdb_ofs_read(tdb, TDB_HASH_TOP(hash), &rec_ptr) == -1)
+	top = tdb_hash_top(tdb, hash);
+	if ((top == 0) || (tdb_ofs_read(tdb, top, &rec_ptr) == -1))
 		return 0;
 
 	/* keep looking until we find the right record */
@@ -283,7 +284,7 @@ _PUBLIC_ int tdb_exists(struct tdb_context *tdb, TDB_DATA key)
 /* actually delete an entry in the database given the offset */
 int tdb_do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr, struct tdb_record *rec)
 {
-	tdb_off_t last_ptr, i;
+	tdb_off_t last_ptr, i, top;
 	struct tdb_record lastrec;
 
 	if (tdb->read_only || tdb->traverse_read) return -1;
@@ -298,7 +299,8 @@ int tdb_do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr, struct tdb_record
 		return -1;
 
 	/* find previous record in hash chain */
-	if (tdb_ofs_read(tdb, TDB_HASH_TOP(rec->full_hash), &i) == -1)
+	top = tdb_hash_top(tdb, rec->full_hash);
+	if ((top == 0) || (tdb_ofs_read(tdb, top, &i) == -1))
 		return -1;
 	for (last_ptr = 0; i != rec_ptr; last_ptr = i, i = lastrec.next)
 		if (tdb_rec_read(tdb, i, &lastrec) == -1)
@@ -306,7 +308,7 @@ int tdb_do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr, struct tdb_record
 
 	/* unlink it: next ptr is at start of record. */
 	if (last_ptr == 0)
-		last_ptr = TDB_HASH_TOP(rec->full_hash);
+		last_ptr = top;
 	if (tdb_ofs_write(tdb, last_ptr, &rec->next) == -1)
 		return -1;
 
@@ -319,11 +321,12 @@ int tdb_do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr, struct tdb_record
 static int tdb_count_dead(struct tdb_context *tdb, uint32_t hash)
 {
 	int res = 0;
-	tdb_off_t rec_ptr;
+	tdb_off_t rec_ptr, top;
 	struct tdb_record rec;
 
 	/* read in the hash top */
-	if (tdb_ofs_read(tdb, TDB_HASH_TOP(hash), &rec_ptr) == -1)
+	top = tdb_hash_top(tdb, hash);
+	if ((top == 0) || (tdb_ofs_read(tdb, top, &rec_ptr) == -1))
 		return 0;
 
 	while (rec_ptr) {
@@ -345,14 +348,15 @@ static int tdb_purge_dead(struct tdb_context *tdb, uint32_t hash)
 {
 	int res = -1;
 	struct tdb_record rec;
-	tdb_off_t rec_ptr;
+	tdb_off_t rec_ptr, top;
 
 	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
 		return -1;
 	}
 
 	/* read in the hash top */
-	if (tdb_ofs_read(tdb, TDB_HASH_TOP(hash), &rec_ptr) == -1)
+	top = tdb_hash_top(tdb, hash);
+	if ((top == 0) || (tdb_ofs_read(tdb, top, &rec_ptr) == -1))
 		goto fail;
 
 	while (rec_ptr) {
@@ -445,10 +449,11 @@ _PUBLIC_ int tdb_delete(struct tdb_context *tdb, TDB_DATA key)
 static tdb_off_t tdb_find_dead(struct tdb_context *tdb, uint32_t hash,
 			       struct tdb_record *r, tdb_len_t length)
 {
-	tdb_off_t rec_ptr;
+	tdb_off_t rec_ptr, top;
 
 	/* read in the hash top */
-	if (tdb_ofs_read(tdb, TDB_HASH_TOP(hash), &rec_ptr) == -1)
+	top = tdb_hash_top(tdb, hash);
+	if ((top == 0) || (tdb_ofs_read(tdb, top, &rec_ptr) == -1))
 		return 0;
 
 	/* keep looking until we find the right record */
@@ -472,7 +477,7 @@ static int _tdb_store(struct tdb_context *tdb, TDB_DATA key,
 		       TDB_DATA dbuf, int flag, uint32_t hash)
 {
 	struct tdb_record rec;
-	tdb_off_t rec_ptr;
+	tdb_off_t rec_ptr, top;
 	char *p = NULL;
 	int ret = -1;
 
@@ -544,10 +549,12 @@ static int _tdb_store(struct tdb_context *tdb, TDB_DATA key,
 	/*
 	 * We have to allocate some space from the freelist, so this means we
 	 * have to lock it. Use the chance to purge all the DEAD records from
-	 * the hash chain under the freelist lock.
+	 * the hash chain under the freelist lock. Without DEAD records
+	 * tdb_allocate() locks just what it needs.
 	 */
 
-	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
+	if ((tdb->max_dead_records != 0)
+	    && (tdb_lock(tdb, -1, F_WRLCK) == -1)) {
 		goto fail;
 	}
 
@@ -560,14 +567,17 @@ static int _tdb_store(struct tdb_context *tdb, TDB_DATA key,
 	/* we have to allocate some space */
 	rec_ptr = tdb_allocate(tdb, key.dsize + dbuf.dsize, &rec);
 
-	tdb_unlock(tdb, -1, F_WRLCK);
+	if (tdb->max_dead_records != 0) {
+		tdb_unlock(tdb, -1, F_WRLCK);
+	}
 
 	if (rec_ptr == 0) {
 		goto fail;
 	}
 
 	/* Read hash top into next ptr */
-	if (tdb_ofs_read(tdb, TDB_HASH_TOP(hash), &rec.next) == -1)
+	top = tdb_hash_top(tdb, hash);
+	if ((top == 0) || (tdb_ofs_read(tdb, top, &rec.next) == -1))
 		goto fail;
 
 	rec.key_len = key.dsize;
@@ -578,7 +588,7 @@ static int _tdb_store(struct tdb_context *tdb, TDB_DATA key,
 	/* write out and point the top of the hash chain at it */
 	if (tdb_rec_write(tdb, rec_ptr, &rec) == -1
 	    || tdb->methods->tdb_write(tdb, rec_ptr+sizeof(rec), p, key.dsize+dbuf.dsize)==-1
-	    || tdb_ofs_write(tdb, TDB_HASH_TOP(hash), &rec_ptr) == -1) {
+	    || tdb_ofs_write(tdb, top, &rec_ptr) == -1) {
 		/* Need to tdb_unallocate() here */
 		goto fail;
 	}
@@ -602,6 +612,7 @@ static int _tdb_store(struct tdb_context *tdb, TDB_DATA key,
 _PUBLIC_ int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int flag)
 {
 	uint32_t hash;
+	bool split;
 	int ret;
 
 	if (tdb->read_only || tdb->traverse_read) {
@@ -617,7 +628,11 @@ _PUBLIC_ int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int
 
 	ret = _tdb_store(tdb, key, dbuf, flag, hash);
 	tdb_trace_2rec_flag_ret(tdb, "tdb_store", key, dbuf, flag, ret);
+	split = (ret == 0) && tdb_hash_chain_long(tdb, hash);
 	tdb_unlock(tdb, BUCKET(hash), F_WRLCK);
+	if (split) {
+		tdb_hash_split(tdb);
+	}
 	return ret;
 }
 
@@ -626,6 +641,7 @@ _PUBLIC_ int tdb_append(struct tdb_context *tdb, TDB_DATA key, TDB_DATA new_dbuf
 {
 	uint32_t hash;
 	TDB_DATA dbuf;
+	bool split = false;
 	int ret = -1;
 
 	/* find which hash bucket it is in */
@@ -661,10 +677,14 @@ _PUBLIC_ int tdb_append(struct tdb_context *tdb, TDB_DATA key, TDB_DATA new_dbuf
 
 	ret = _tdb_store(tdb, key, dbuf, 0, hash);
 	tdb_trace_2rec_retrec(tdb, "tdb_append", key, new_dbuf, dbuf);
+	split = (ret == 0) && tdb_hash_chain_long(tdb, hash);
 
 failed:
 	tdb_unlock(tdb, BUCKET(hash), F_WRLCK);
 	SAFE_FREE(dbuf.dptr);
+	if (split) {
+		tdb_hash_split(tdb);
+	}
 	return ret;
 }
 
@@ -852,9 +872,19 @@ _PUBLIC_ int tdb_wipe_all(struct tdb_context *tdb)
 		}
 	}
 
-	/* wipe the freelist */
-	if (tdb_ofs_write(tdb, FREELIST_TOP, &offset) == -1) {
-		TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_wipe_all: failed to write freelist\n"));
+	/* wipe the freelists */
+	for (i=0;i<tdb_free_lists(tdb);i++) {
+		if (tdb_ofs_write(tdb, TDB_FREELIST_TOP(i), &offset) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_wipe_all: failed to write freelist %d\n", i));
+			goto failed;
+		}
+	}
+
+	/* the tables of split hash chains go with the data */
+	if (tdb_hash_grows(tdb) &&
+	    (tdb_ofs_write(tdb, TDB_NUM_BUCKETS_OFS, &offset) == -1 ||
+	     tdb_ofs_write(tdb, TDB_HASH_DIR_OFS, &offset) == -1)) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_wipe_all: failed to reset split hash chains\n"));
 		goto failed;
 	}
 
@@ -862,8 +892,8 @@ _PUBLIC_ int tdb_wipe_all(struct tdb_context *tdb)
 	   for the recovery area */
 	if (recovery_size == 0) {
 		/* the simple case - the whole file can be used as a freelist */
-		data_len = (tdb->map_size - TDB_DATA_START(tdb->header.hash_size));
-		if (tdb_free_region(tdb, TDB_DATA_START(tdb->header.hash_size), data_len) != 0) {
+		data_len = (tdb->map_size - TDB_DATA_START(tdb));
+		if (tdb_free_region(tdb, TDB_DATA_START(tdb), data_len) != 0) {
 			goto failed;
 		}
 	} else {
@@ -875,8 +905,8 @@ _PUBLIC_ int tdb_wipe_all(struct tdb_context *tdb)
 		   move the recovery area or we risk subtle data
 		   corruption
 		*/
-		data_len = (recovery_head - TDB_DATA_START(tdb->header.hash_size));
-		if (tdb_free_region(tdb, TDB_DATA_START(tdb->header.hash_size), data_len) != 0) {
+		data_len = (recovery_head - TDB_DATA_START(tdb));
+		if (tdb_free_region(tdb, TDB_DATA_START(tdb), data_len) != 0) {
 			goto failed;
 		}
 		/* and the 2nd free list entry after the recovery area - if any */
@@ -31,6 +31,10 @@
 #include "system/wait.h"
 #include "tdb.h"
 
+#if defined(HAVE_ROBUST_MUTEXES) && defined(HAVE_PTHREAD_H)
+#define USE_TDB_MUTEX_LOCKING 1
+#endif
+
 /* #define TDB_TRACE 1 */
 #ifndef HAVE_GETPAGESIZE
 #define getpagesize() 0x2000
@@ -51,8 +55,15 @@ typedef uint32_t tdb_off_t;
 #define TDB_RECOVERY_MAGIC (0xf53bc0e7U)
 #define TDB_RECOVERY_INVALID_MAGIC (0x0)
 #define TDB_HASH_RWLOCK_MAGIC (0xbad1a51U)
+#define TDB_FEATURE_FLAG_MAGIC (0xbad1a52U)
+#define TDB_FEATURE_FLAG_MUTEX 0x00000001
+#define TDB_FEATURE_FLAG_GROW_HASH 0x00000002
+#define TDB_FEATURE_FLAG_SIZE_CLASSES 0x00000004
+#define TDB_FEATURE_FLAG_GROUP_COMMIT 0x00000008
+#define TDB_HASH_TABLE_MAGIC (0x7ab1e5edU)
 #define TDB_ALIGNMENT 4
 #define DEFAULT_HASH_SIZE 131
+#define TDB_FREE_CLASSES 8
 #define FREELIST_TOP (sizeof(struct tdb_header))
 #define TDB_ALIGN(x,a) (((x) + (a)-1) & ~((a)-1))
 #define TDB_BYTEREV(x) (((((x)&0xff)<<24)|((x)&0xFF00)<<8)|(((x)>>8)&0xFF00)|((x)>>24))
@@ -60,9 +71,14 @@ typedef uint32_t tdb_off_t;
 #define TDB_BAD_MAGIC(r) ((r)->magic != TDB_MAGIC && !TDB_DEAD(r))
 #define TDB_HASH_TOP(hash) (FREELIST_TOP + (BUCKET(hash)+1)*sizeof(tdb_off_t))
 #define TDB_HASHTABLE_SIZE(tdb) ((tdb->header.hash_size+1)*sizeof(tdb_off_t))
-#define TDB_DATA_START(hash_size) (TDB_HASH_TOP(hash_size-1) + sizeof(tdb_off_t))
+#define TDB_HASH_END(hash_size) (FREELIST_TOP + ((hash_size)+1)*sizeof(tdb_off_t))
+#define TDB_DATA_START(tdb) (TDB_HASH_END((tdb)->header.hash_size) + (tdb)->header.mutex_size)
 #define TDB_RECOVERY_HEAD offsetof(struct tdb_header, recovery_start)
 #define TDB_SEQNUM_OFS    offsetof(struct tdb_header, sequence_number)
+#define TDB_HASH_DIR_OFS  offsetof(struct tdb_header, hash_dir)
+#define TDB_NUM_BUCKETS_OFS offsetof(struct tdb_header, num_buckets)
+#define TDB_FREELIST_TOP(list) ((list) == 0 ? FREELIST_TOP : \
+	offsetof(struct tdb_header, free_tops) + ((list)-1)*sizeof(tdb_off_t))
 #define TDB_PAD_BYTE 0x42
 #define TDB_PAD_U32  0x42424242
 
@@ -106,6 +122,13 @@ void tdb_trace_2rec_retrec(struct tdb_context *tdb, const char *op,
 #define OPEN_LOCK        0
 #define ACTIVE_LOCK      4
 #define TRANSACTION_LOCK 8
+#define BATCH_LOCK       12 /* read locked by the members of an open commit batch */
+/* write locked by the leader of an open commit batch. Consecutive batches
+ * alternate, so the next leader doesn't hold up those still waking up. */
+#define BATCH_WAIT_LOCK(gen) (16 + 4*((gen) & 1))
+
+/* in the "next" field of the recovery record: a batch member is writing */
+#define TDB_BATCH_WRITING 0x80000000U
 
 /* free memory if the pointer is valid and zero the pointer */
 #ifndef SAFE_FREE
@@ -150,7 +173,12 @@ struct tdb_header {
 	tdb_off_t sequence_number; /* used when TDB_SEQNUM is set */
 	uint32_t magic1_hash; /* hash of TDB_MAGIC_FOOD. */
 	uint32_t magic2_hash; /* hash of TDB_MAGIC. */
-	tdb_off_t reserved[27];
+	uint32_t feature_flags; /* TDB_FEATURE_FLAG_*, if rwlocks == TDB_FEATURE_FLAG_MAGIC */
+	tdb_len_t mutex_size; /* space between the hash table and the first record */
+	tdb_off_t hash_dir; /* tables of split buckets, if TDB_FEATURE_FLAG_GROW_HASH */
+	uint32_t num_buckets; /* buckets in use, 0 means hash_size */
+	tdb_off_t free_tops[TDB_FREE_CLASSES-1]; /* free lists of the larger size classes, if TDB_FEATURE_FLAG_SIZE_CLASSES */
+	tdb_off_t reserved[16];
 };
 
 struct tdb_lock_type {
@@ -164,6 +192,7 @@ struct tdb_traverse_lock {
 	uint32_t off;
 	uint32_t hash;
 	int lock_rw;
+	uint32_t bucket; /* the bucket within chain "hash" */
 };
 
 enum tdb_lock_flags {
@@ -209,6 +238,8 @@ struct tdb_context {
 	struct tdb_transaction *transaction;
 	int page_size;
 	int max_dead_records;
+	struct tdb_mutexes *mutexes; /* chain mutexes, if TDB_MUTEX_LOCKING */
+	unsigned int commit_delay; /* usecs a TDB_GROUP_COMMIT leader waits for others */
 #ifdef TDB_TRACE
 	int tracefd;
 #endif
@@ -253,11 +284,16 @@ int tdb_ofs_write(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
 void *tdb_convert(void *buf, uint32_t size);
 int tdb_free(struct tdb_context *tdb, tdb_off_t offset, struct tdb_record *rec);
 tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_record *rec);
+unsigned int tdb_free_lists(struct tdb_context *tdb);
 int tdb_ofs_read(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
 int tdb_ofs_write(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
 int tdb_lock_record(struct tdb_context *tdb, tdb_off_t off);
 int tdb_unlock_record(struct tdb_context *tdb, tdb_off_t off);
 bool tdb_needs_recovery(struct tdb_context *tdb);
+bool tdb_batch_open(struct tdb_context *tdb);
+bool tdb_batch_pending(struct tdb_context *tdb);
+int tdb_transaction_close_batch(struct tdb_context *tdb);
+int tdb_lock_and_recover(struct tdb_context *tdb);
 int tdb_rec_read(struct tdb_context *tdb, tdb_off_t offset, struct tdb_record *rec);
 int tdb_rec_write(struct tdb_context *tdb, tdb_off_t offset, struct tdb_record *rec);
 int tdb_do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr, struct tdb_record *rec);
@@ -279,3 +315,26 @@ void tdb_header_hash(struct tdb_context *tdb,
 		     uint32_t *magic1_hash, uint32_t *magic2_hash);
 unsigned int tdb_old_hash(TDB_DATA *key);
 size_t tdb_dead_space(struct tdb_context *tdb, tdb_off_t off);
+bool tdb_have_mutexes(struct tdb_context *tdb);
+bool tdb_mutex_supported(void);
+tdb_len_t tdb_mutex_size(struct tdb_context *tdb, uint32_t hash_size);
+bool tdb_hash_grows(struct tdb_context *tdb);
+int tdb_hash_buckets(struct tdb_context *tdb, uint32_t *num_buckets);
+int tdb_hash_bucket(struct tdb_context *tdb, uint32_t hash, uint32_t *bucket);
+tdb_off_t tdb_bucket_top(struct tdb_context *tdb, uint32_t bucket);
+tdb_off_t tdb_hash_top(struct tdb_context *tdb, uint32_t hash);
+int tdb_next_bucket(struct tdb_context *tdb, struct tdb_traverse_lock *tlock);
+bool tdb_hash_chain_long(struct tdb_context *tdb, uint32_t hash);
+void tdb_hash_split(struct tdb_context *tdb);
+int tdb_mutex_init(struct tdb_context *tdb);
+int tdb_mutex_mmap(struct tdb_context *tdb);
+int tdb_mutex_munmap(struct tdb_context *tdb);
+bool tdb_mutex_lock(struct tdb_context *tdb, int rw, off_t off, off_t len,
+		    bool waitflag, int *pret);
+bool tdb_mutex_unlock(struct tdb_context *tdb, int rw, off_t off, off_t len,
+		      int *pret);
+int tdb_mutex_allrecord_lock(struct tdb_context *tdb, int ltype,
+			     enum tdb_lock_flags flags);
+int tdb_mutex_allrecord_unlock(struct tdb_context *tdb);
+int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb);
+void tdb_mutex_allrecord_downgrade(struct tdb_context *tdb);
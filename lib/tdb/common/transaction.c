@@ -75,6 +75,30 @@
     needed per commit to prevent race conditions. It might be possible
     to reduce this to 3 or even 2 with some more work.
 
+  - with TDB_GROUP_COMMIT concurrent commits share their syncs. The
+    first committer (the leader) writes its recovery data and its data,
+    but instead of syncing and removing the recovery magic it leaves the
+    recovery area valid, takes the BATCH_LOCK for reading and the
+    BATCH_WAIT_LOCK for writing, drops the transaction lock and waits
+    up to tdb_set_commit_delay() microseconds. Commits arriving in the
+    meantime find the valid recovery area and join the open batch: they
+    append the old contents of the blocks not saved by earlier members
+    yet, so the recovery area always restores the state before the
+    batch, write their data, hold the BATCH_LOCK for reading and wait
+    for the BATCH_WAIT_LOCK. The leader then syncs the data of all
+    members and removes the recovery magic, which costs 2 syncs for the
+    whole batch instead of 2 per commit. Members only sync when they add
+    recovery data. While a commit writes its data the TDB_BATCH_WRITING
+    bit is set in the recovery record, so a member dying while writing
+    still makes the batch roll back, and the other members then fail
+    their commit.
+
+  - a valid recovery record while another process holds the BATCH_LOCK
+    is an open batch, not a crash. Readers and transactions carry on,
+    other writers and commits without TDB_GROUP_COMMIT finish the batch
+    before touching the data, as their writes would not be covered by
+    the recovery data.
+
   - check for a valid recovery record on open of the tdb, while the
     open lock is held. Automatically recover from the transaction
     recovery area if needed, then continue with the open as
@@ -140,6 +164,15 @@ struct tdb_transaction {
 
 	/* did we expand in this transaction */
 	bool expanded;
+
+	/* TDB_GROUP_COMMIT: the batch generation and the last rolled
+	   back generation kept in the recovery record, whether we take
+	   part in the batch at batch_offset, and whether we opened it */
+	uint32_t batch_gen;
+	uint32_t batch_undone;
+	tdb_off_t batch_offset;
+	bool batch_member;
+	bool batch_leader;
 };
 
 
@@ -610,6 +643,11 @@ static int _tdb_transaction_cancel(struct tdb_context *tdb)
 		}
 	}
 
+	if (tdb->transaction->batch_leader) {
+		tdb_brunlock(tdb, F_WRLCK,
+			     BATCH_WAIT_LOCK(tdb->transaction->batch_gen), 1);
+	}
+
 	/* This also removes the OPEN_LOCK, if we have it. */
 	tdb_release_transaction_locks(tdb);
 
@@ -686,6 +724,57 @@ int tdb_recovery_area(struct tdb_context *tdb,
 	return 0;
 }
 
+/*
+  write the generation of the batch at recovery_offset, with
+  TDB_BATCH_WRITING while our data is not completely written
+*/
+static int transaction_batch_mark(struct tdb_context *tdb,
+				  const struct tdb_methods *methods,
+				  tdb_off_t recovery_offset, uint32_t gen)
+{
+	tdb_off_t offset = recovery_offset + offsetof(struct tdb_record, next);
+
+	CONVERT(gen);
+	if (methods->tdb_write(tdb, offset, &gen, sizeof(gen)) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_batch_mark: failed to write batch generation\n"));
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	if (tdb->transaction != NULL &&
+	    transaction_write_existing(tdb, offset, &gen, sizeof(gen)) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_batch_mark: failed to write secondary batch generation\n"));
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  make the data of all members of the batch at recovery_offset durable
+  and remove the recovery magic. The transaction lock must be held.
+*/
+static int transaction_end_batch(struct tdb_context *tdb,
+				 const struct tdb_methods *methods,
+				 tdb_off_t recovery_offset, tdb_len_t size)
+{
+	tdb_off_t magic_offset = recovery_offset + offsetof(struct tdb_record, magic);
+	const uint32_t invalid = TDB_RECOVERY_INVALID_MAGIC;
+
+	if (transaction_sync(tdb, 0, size) == -1) {
+		return -1;
+	}
+
+	if (methods->tdb_write(tdb, magic_offset, &invalid, 4) == -1 ||
+	    (tdb->transaction != NULL &&
+	     transaction_write_existing(tdb, magic_offset, &invalid, 4) == -1) ||
+	    transaction_sync(tdb, magic_offset, 4) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_end_batch: failed to remove recovery magic\n"));
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
 /*
   allocate the recovery area, or use an existing recovery area if it is
   large enough
@@ -704,6 +793,15 @@ static int tdb_recovery_allocate(struct tdb_context *tdb,
 		return -1;
 	}
 
+	/* the data of an open commit batch must be on disk before we
+	   reuse its recovery area */
+	if (recovery_head != 0 && rec.magic == TDB_RECOVERY_MAGIC) {
+		if (transaction_end_batch(tdb, methods, recovery_head,
+					  tdb->transaction->old_map_size) == -1) {
+			return -1;
+		}
+	}
+
 	*recovery_size = tdb_recovery_size(tdb);
 
 	if (recovery_head != 0 && *recovery_size <= rec.rec_len) {
@@ -800,6 +898,8 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 	rec->data_len = recovery_size;
 	rec->rec_len  = recovery_max_size;
 	rec->key_len  = old_map_size;
+	rec->next     = tdb->transaction->batch_gen | TDB_BATCH_WRITING;
+	rec->full_hash = tdb->transaction->batch_undone;
 	CONVERT(*rec);
 
 	/* build the recovery data into a single blob to allow us to do a single
@@ -896,9 +996,325 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 		return -1;
 	}
 
+	tdb->transaction->batch_offset = recovery_offset;
+
+	return 0;
+}
+
+struct batch_range {
+	tdb_off_t offset;
+	tdb_len_t length;
+};
+
+static int batch_range_cmp(const void *p1, const void *p2)
+{
+	const struct batch_range *r1 = (const struct batch_range *)p1;
+	const struct batch_range *r2 = (const struct batch_range *)p2;
+
+	if (r1->offset < r2->offset) {
+		return -1;
+	}
+	return r1->offset > r2->offset;
+}
+
+/*
+  add recovery entries for the parts of [offset, end) not covered by
+  the sorted ranges, starting at range *idx. Only count the bytes
+  needed if p is NULL.
+*/
+static int batch_add_undo(struct tdb_context *tdb,
+			  const struct batch_range *ranges, uint32_t num_ranges,
+			  uint32_t *idx, tdb_off_t offset, tdb_off_t end,
+			  unsigned char *p, tdb_len_t *added)
+{
+	const struct tdb_methods *methods = tdb->transaction->io_methods;
+
+	while (*idx < num_ranges &&
+	       ranges[*idx].offset + ranges[*idx].length <= offset) {
+		(*idx)++;
+	}
+
+	while (offset < end) {
+		tdb_off_t gap_end = end;
+		uint32_t i = *idx;
+
+		if (i < num_ranges && ranges[i].offset <= offset) {
+			/* already saved by an earlier member */
+			if (ranges[i].offset + ranges[i].length > offset) {
+				offset = ranges[i].offset + ranges[i].length;
+			}
+			(*idx)++;
+			continue;
+		}
+		if (i < num_ranges && ranges[i].offset < end) {
+			gap_end = ranges[i].offset;
+		}
+
+		if (p != NULL) {
+			unsigned char *q = p + *added;
+			uint32_t len = gap_end - offset;
+
+			memcpy(q, &offset, 4);
+			memcpy(q+4, &len, 4);
+			if (DOCONV()) {
+				tdb_convert(q, 8);
+			}
+			if (methods->tdb_read(tdb, offset, q + 8, len, 0) != 0) {
+				tdb->ecode = TDB_ERR_IO;
+				return -1;
+			}
+		}
+		*added += 8 + (gap_end - offset);
+		offset = gap_end;
+	}
+	return 0;
+}
+
+/*
+  join the open batch whose recovery record at recovery_offset is rec:
+  append the old contents of the blocks we change that are not saved
+  yet. Returns 1 if they don't fit into the recovery area.
+*/
+static int transaction_join_batch(struct tdb_context *tdb,
+				  tdb_off_t recovery_offset,
+				  const struct tdb_record *rec)
+{
+	const struct tdb_methods *methods = tdb->transaction->io_methods;
+	tdb_off_t batch_eof = rec->key_len;
+	tdb_off_t data_offset = recovery_offset + sizeof(*rec);
+	struct batch_range *ranges = NULL;
+	uint32_t num_ranges = 0, idx;
+	unsigned char *old = NULL, *data = NULL, *p;
+	tdb_len_t used, added;
+	uint32_t tailer, data_len;
+	int i, pass, ret = -1;
+
+	if (rec->data_len < sizeof(tailer) || rec->data_len > rec->rec_len) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_join_batch: bad recovery data length %u\n", rec->data_len));
+		tdb->ecode = TDB_ERR_CORRUPT;
+		return -1;
+	}
+	used = rec->data_len - sizeof(tailer);
+
+	/* find the ranges saved by the earlier members */
+	old = (unsigned char *)malloc(used + 1);
+	if (old == NULL) {
+		tdb->ecode = TDB_ERR_OOM;
+		return -1;
+	}
+	if (methods->tdb_read(tdb, data_offset, old, used, 0) != 0) {
+		tdb->ecode = TDB_ERR_IO;
+		goto done;
+	}
+	for (p = old; p + 8 <= old + used; ) {
+		struct batch_range *tmp;
+		uint32_t ofs, len;
+
+		memcpy(&ofs, p, 4);
+		memcpy(&len, p+4, 4);
+		if (DOCONV()) {
+			tdb_convert(&ofs, 4);
+			tdb_convert(&len, 4);
+		}
+		if (len > used - (p + 8 - old)) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_join_batch: bad recovery entry at %u\n", ofs));
+			tdb->ecode = TDB_ERR_CORRUPT;
+			goto done;
+		}
+		tmp = (struct batch_range *)realloc(ranges,
+					sizeof(*ranges) * (num_ranges + 1));
+		if (tmp == NULL) {
+			tdb->ecode = TDB_ERR_OOM;
+			goto done;
+		}
+		ranges = tmp;
+		ranges[num_ranges].offset = ofs;
+		ranges[num_ranges].length = len;
+		num_ranges++;
+		p += 8 + len;
+	}
+	if (num_ranges > 1) {
+		qsort(ranges, num_ranges, sizeof(*ranges), batch_range_cmp);
+	}
+
+	/* count the new entries, then build them */
+	for (pass = 0; pass < 2; pass++) {
+		added = 0;
+		idx = 0;
+		for (i=0;i<tdb->transaction->num_blocks;i++) {
+			tdb_off_t offset, end;
+
+			if (tdb->transaction->blocks[i] == NULL) {
+				continue;
+			}
+			offset = i * tdb->transaction->block_size;
+			end = offset + tdb->transaction->block_size;
+			if (i == tdb->transaction->num_blocks-1) {
+				end = offset + tdb->transaction->last_block_size;
+			}
+			if (offset >= batch_eof) {
+				break;
+			}
+			if (end > batch_eof) {
+				end = batch_eof;
+			}
+			if (batch_add_undo(tdb, ranges, num_ranges, &idx,
+					   offset, end, data, &added) == -1) {
+				goto done;
+			}
+		}
+
+		if (added == 0) {
+			/* everything we change is saved already */
+			break;
+		}
+		if (pass == 1) {
+			break;
+		}
+		if (rec->data_len + added > rec->rec_len) {
+			ret = 1;
+			goto done;
+		}
+		data = (unsigned char *)malloc(added + sizeof(tailer));
+		if (data == NULL) {
+			tdb->ecode = TDB_ERR_OOM;
+			goto done;
+		}
+	}
+
+	if (added != 0) {
+		tailer = sizeof(*rec) + rec->rec_len;
+		memcpy(data + added, &tailer, 4);
+		if (DOCONV()) {
+			tdb_convert(data + added, 4);
+		}
+
+		/* the new entries go behind the old ones and are only
+		   used once the data length covers them */
+		if (methods->tdb_write(tdb, data_offset + used, data, added + sizeof(tailer)) == -1 ||
+		    transaction_write_existing(tdb, data_offset + used, data, added + sizeof(tailer)) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_join_batch: failed to write recovery data\n"));
+			tdb->ecode = TDB_ERR_IO;
+			goto done;
+		}
+		if (transaction_sync(tdb, data_offset + used, added + sizeof(tailer)) == -1) {
+			goto done;
+		}
+
+		data_len = rec->data_len + added;
+		CONVERT(data_len);
+		if (methods->tdb_write(tdb, recovery_offset + offsetof(struct tdb_record, data_len),
+				       &data_len, sizeof(data_len)) == -1 ||
+		    transaction_write_existing(tdb, recovery_offset + offsetof(struct tdb_record, data_len),
+					       &data_len, sizeof(data_len)) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_join_batch: failed to write recovery data length\n"));
+			tdb->ecode = TDB_ERR_IO;
+			goto done;
+		}
+		if (transaction_sync(tdb, recovery_offset, sizeof(*rec)) == -1) {
+			goto done;
+		}
+	}
+
+	tdb->transaction->batch_gen = rec->next & ~TDB_BATCH_WRITING;
+	tdb->transaction->batch_offset = recovery_offset;
+	tdb->transaction->batch_member = true;
+	ret = 0;
+
+done:
+	free(data);
+	free(ranges);
+	free(old);
+	return ret;
+}
+
+/*
+  mark the file, so older tdbs refuse it instead of rolling back an
+  open batch
+*/
+static int transaction_set_group_commit(struct tdb_context *tdb)
+{
+	tdb_off_t rwlocks;
+	uint32_t feature_flags;
+
+	if (tdb->header.feature_flags & TDB_FEATURE_FLAG_GROUP_COMMIT) {
+		return 0;
+	}
+
+	if (tdb_ofs_read(tdb, offsetof(struct tdb_header, rwlocks), &rwlocks) == -1 ||
+	    tdb_ofs_read(tdb, offsetof(struct tdb_header, feature_flags), &feature_flags) == -1) {
+		return -1;
+	}
+	if (rwlocks != TDB_FEATURE_FLAG_MAGIC) {
+		feature_flags = 0;
+	}
+	if (feature_flags & TDB_FEATURE_FLAG_GROUP_COMMIT) {
+		tdb->header.feature_flags = feature_flags;
+		return 0;
+	}
+
+	rwlocks = TDB_FEATURE_FLAG_MAGIC;
+	feature_flags |= TDB_FEATURE_FLAG_GROUP_COMMIT;
+	if (tdb_ofs_write(tdb, offsetof(struct tdb_header, rwlocks), &rwlocks) == -1 ||
+	    tdb_ofs_write(tdb, offsetof(struct tdb_header, feature_flags), &feature_flags) == -1) {
+		return -1;
+	}
 	return 0;
 }
 
+/*
+  setup the recovery data for a TDB_GROUP_COMMIT commit: join an open
+  batch, open a new one, or commit on our own if the last leader is
+  still busy
+*/
+static int transaction_setup_batch(struct tdb_context *tdb)
+{
+	const struct tdb_methods *methods = tdb->transaction->io_methods;
+	tdb_off_t recovery_head;
+	struct tdb_record rec;
+	uint32_t gen;
+	int ret;
+
+	if (transaction_set_group_commit(tdb) == -1) {
+		return -1;
+	}
+
+	if (tdb_recovery_area(tdb, methods, &recovery_head, &rec) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_setup_batch: failed to read recovery head\n"));
+		return -1;
+	}
+
+	if (recovery_head != 0) {
+		tdb->transaction->batch_gen = rec.next & ~TDB_BATCH_WRITING;
+		tdb->transaction->batch_undone = rec.full_hash;
+	}
+
+	if (recovery_head != 0 && rec.magic == TDB_RECOVERY_MAGIC) {
+		ret = transaction_join_batch(tdb, recovery_head, &rec);
+		if (ret != 1) {
+			return ret;
+		}
+		/* no room left, finish the batch and open a new one */
+		if (transaction_end_batch(tdb, methods, recovery_head,
+					  tdb->transaction->old_map_size) == -1) {
+			return -1;
+		}
+	}
+
+	gen = (tdb->transaction->batch_gen + 1) & ~TDB_BATCH_WRITING;
+	if (gen == 0) {
+		gen = 1;
+	}
+	if (tdb_brlock(tdb, F_WRLCK, BATCH_WAIT_LOCK(gen), 1,
+		       TDB_LOCK_NOWAIT|TDB_LOCK_PROBE) == 0) {
+		tdb->transaction->batch_gen = gen;
+		tdb->transaction->batch_member = true;
+		tdb->transaction->batch_leader = true;
+	}
+
+	return transaction_setup_recovery(tdb, &tdb->transaction->magic_offset);
+}
+
 static int _tdb_transaction_prepare_commit(struct tdb_context *tdb)
 {	
 	const struct tdb_methods *methods;
@@ -958,7 +1374,13 @@ static int _tdb_transaction_prepare_commit(struct tdb_context *tdb)
 		return -1;
 	}
 
-	if (!(tdb->flags & TDB_NOSYNC)) {
+	if (!(tdb->flags & TDB_NOSYNC) && (tdb->flags & TDB_GROUP_COMMIT)) {
+		if (transaction_setup_batch(tdb) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_prepare_commit: failed to setup batch recovery data\n"));
+			_tdb_transaction_cancel(tdb);
+			return -1;
+		}
+	} else if (!(tdb->flags & TDB_NOSYNC)) {
 		/* write the recovery data to the end of the file */
 		if (transaction_setup_recovery(tdb, &tdb->transaction->magic_offset) == -1) {
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_prepare_commit: failed to setup recovery data\n"));
@@ -1003,22 +1425,159 @@ static bool repack_worthwhile(struct tdb_context *tdb)
 	tdb_off_t ptr;
 	struct tdb_record rec;
 	tdb_len_t total = 0, largest = 0;
+	unsigned int list;
 
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &ptr) == -1) {
-		return false;
-	}
+	for (list = 0; list < tdb_free_lists(tdb); list++) {
+		if (tdb_ofs_read(tdb, TDB_FREELIST_TOP(list), &ptr) == -1) {
+			return false;
+		}
 
-	while (ptr != 0 && tdb_rec_free_read(tdb, ptr, &rec) == 0) {
-		total += rec.rec_len;
-		if (rec.rec_len > largest) {
-			largest = rec.rec_len;
+		while (ptr != 0 && tdb_rec_free_read(tdb, ptr, &rec) == 0) {
+			total += rec.rec_len;
+			if (rec.rec_len > largest) {
+				largest = rec.rec_len;
+			}
+			ptr = rec.next;
 		}
-		ptr = rec.next;
 	}
 
 	return total > largest * 2;
 }
 
+/*
+  did a rollback undo the batch with generation gen? Look at the
+  current recovery record and at the one of the batch, which is no
+  longer used if the rollback removed it
+*/
+static bool transaction_batch_undone(struct tdb_context *tdb,
+				     tdb_off_t batch_offset, uint32_t gen)
+{
+	tdb_off_t recovery_head;
+	struct tdb_record rec;
+
+	if (tdb_recovery_area(tdb, tdb->methods, &recovery_head, &rec) == 0 &&
+	    recovery_head != 0 && rec.full_hash == gen) {
+		return true;
+	}
+
+	if (tdb->methods->tdb_read(tdb, batch_offset, &rec, sizeof(rec),
+				   DOCONV()) == 0 &&
+	    (rec.magic == TDB_RECOVERY_MAGIC ||
+	     rec.magic == TDB_RECOVERY_INVALID_MAGIC) &&
+	    rec.full_hash == gen) {
+		return true;
+	}
+
+	return false;
+}
+
+/*
+  finish the open commit batch, if any. Called without a transaction,
+  by the batch members and by writers that can't wait for the batch.
+*/
+int tdb_transaction_close_batch(struct tdb_context *tdb)
+{
+	tdb_off_t recovery_head;
+	struct tdb_record rec;
+	int ret = 0;
+
+	if (tdb_transaction_lock(tdb, F_WRLCK, TDB_LOCK_WAIT) == -1) {
+		return -1;
+	}
+
+	if (tdb_recovery_area(tdb, tdb->methods, &recovery_head, &rec) == -1) {
+		ret = -1;
+	} else if (recovery_head != 0 && rec.magic == TDB_RECOVERY_MAGIC) {
+		if (rec.next & TDB_BATCH_WRITING) {
+			/* a member died while writing its data */
+			ret = tdb_lock_and_recover(tdb);
+		} else {
+			/* make sure we sync all the data written */
+			tdb->methods->tdb_oob(tdb, tdb->map_size + 1, 1);
+			ret = transaction_end_batch(tdb, tdb->methods,
+						    recovery_head, tdb->map_size);
+		}
+	}
+
+	tdb_transaction_unlock(tdb, F_WRLCK);
+	return ret;
+}
+
+/*
+  our data is written as part of the batch: wait until the batch is
+  finished, or finish it ourselves as the leader
+*/
+static int transaction_commit_batch(struct tdb_context *tdb, bool need_repack)
+{
+	const struct tdb_methods *methods = tdb->transaction->io_methods;
+	tdb_off_t batch_offset = tdb->transaction->batch_offset;
+	uint32_t gen = tdb->transaction->batch_gen;
+	bool leader = tdb->transaction->batch_leader;
+	tdb_off_t recovery_head;
+	struct tdb_record rec;
+	int ret = 0;
+
+	if (transaction_batch_mark(tdb, methods, batch_offset, gen) == -1 ||
+	    tdb_brlock(tdb, F_RDLCK, BATCH_LOCK, 1, TDB_LOCK_WAIT) == -1) {
+		/* we can't leave the batch to others, finish it now */
+		if (transaction_end_batch(tdb, methods, batch_offset,
+					  tdb->map_size) == -1) {
+			_tdb_transaction_cancel(tdb);
+			return -1;
+		}
+		tdb->transaction->magic_offset = 0;
+		_tdb_transaction_cancel(tdb);
+		return 0;
+	}
+
+#ifdef HAVE_UTIME
+	utime(tdb->name, NULL);
+#endif
+
+	/* keep the recovery magic and the wait lock, drop the rest */
+	tdb->transaction->magic_offset = 0;
+	tdb->transaction->batch_leader = false;
+	_tdb_transaction_cancel(tdb);
+
+	if (leader) {
+		if (tdb->commit_delay != 0) {
+			struct timeval tv;
+
+			tv.tv_sec = tdb->commit_delay / 1000000;
+			tv.tv_usec = tdb->commit_delay % 1000000;
+			select(0, NULL, NULL, NULL, &tv);
+		}
+		ret = tdb_transaction_close_batch(tdb);
+		tdb_brunlock(tdb, F_WRLCK, BATCH_WAIT_LOCK(gen), 1);
+	} else {
+		/* the leader holds this until the batch is finished */
+		if (tdb_brlock(tdb, F_RDLCK, BATCH_WAIT_LOCK(gen), 1,
+			       TDB_LOCK_WAIT) == 0) {
+			tdb_brunlock(tdb, F_RDLCK, BATCH_WAIT_LOCK(gen), 1);
+		}
+
+		/* if our batch is still open its leader is gone */
+		if (tdb_recovery_area(tdb, tdb->methods, &recovery_head, &rec) == -1 ||
+		    (recovery_head != 0 && rec.magic == TDB_RECOVERY_MAGIC &&
+		     (rec.next & ~TDB_BATCH_WRITING) == gen)) {
+			ret = tdb_transaction_close_batch(tdb);
+		}
+	}
+
+	tdb_brunlock(tdb, F_RDLCK, BATCH_LOCK, 1);
+
+	if (ret == 0 && transaction_batch_undone(tdb, batch_offset, gen)) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_commit: commit batch %u was rolled back\n", gen));
+		tdb->ecode = TDB_ERR_IO;
+		ret = -1;
+	}
+
+	if (ret == 0 && need_repack) {
+		return tdb_repack(tdb);
+	}
+	return ret;
+}
+
 /*
   commit the current transaction
 */
@@ -1062,6 +1621,16 @@ _PUBLIC_ int tdb_transaction_commit(struct tdb_context *tdb)
 
 	methods = tdb->transaction->io_methods;
 
+	/* until our data is written the batch has to roll back if we die */
+	if (tdb->transaction->batch_member && !tdb->transaction->batch_leader) {
+		if (transaction_batch_mark(tdb, methods,
+					   tdb->transaction->batch_offset,
+					   tdb->transaction->batch_gen | TDB_BATCH_WRITING) == -1) {
+			_tdb_transaction_cancel(tdb);
+			return -1;
+		}
+	}
+
 	/* perform all the writes */
 	for (i=0;i<tdb->transaction->num_blocks;i++) {
 		tdb_off_t offset;
@@ -1102,6 +1671,10 @@ _PUBLIC_ int tdb_transaction_commit(struct tdb_context *tdb)
 	SAFE_FREE(tdb->transaction->blocks);
 	tdb->transaction->num_blocks = 0;
 
+	if (tdb->transaction->batch_member) {
+		return transaction_commit_batch(tdb, need_repack);
+	}
+
 	/* ensure the new data is on disk */
 	if (transaction_sync(tdb, 0, tdb->map_size) == -1) {
 		return -1;
@@ -1230,6 +1803,17 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 		}
 	}
 
+	/* let the members of a rolled back batch know */
+	if (rec.next != 0) {
+		uint32_t undone = rec.next & ~TDB_BATCH_WRITING;
+		if (tdb_ofs_write(tdb, recovery_head + offsetof(struct tdb_record, full_hash),
+				  &undone) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to mark rolled back batch\n"));
+			tdb->ecode = TDB_ERR_IO;
+			return -1;
+		}
+	}
+
 	/* remove the recovery magic */
 	if (tdb_ofs_write(tdb, recovery_head + offsetof(struct tdb_record, magic),
 			  &zero) == -1) {
@@ -1257,21 +1841,32 @@ bool tdb_needs_recovery(struct tdb_context *tdb)
 	tdb_off_t recovery_head;
 	struct tdb_record rec;
 
-	/* find the recovery area */
-	if (tdb_ofs_read(tdb, TDB_RECOVERY_HEAD, &recovery_head) == -1) {
+	/* find and read the recovery area */
+	if (tdb_recovery_area(tdb, tdb->methods, &recovery_head, &rec) == -1) {
 		return true;
 	}
 
-	if (recovery_head == 0) {
-		/* we have never allocated a recovery record */
+	if (recovery_head == 0 || rec.magic != TDB_RECOVERY_MAGIC) {
 		return false;
 	}
 
-	/* read the recovery record */
-	if (tdb->methods->tdb_read(tdb, recovery_head, &rec,
-				   sizeof(rec), DOCONV()) == -1) {
-		return true;
+	/* an open commit batch, unless a member died writing its data */
+	if (!(rec.next & TDB_BATCH_WRITING) && tdb_batch_open(tdb)) {
+		return false;
+	}
+
+	return true;
+}
+
+/* Is there an open commit batch whose data is not synced yet? */
+bool tdb_batch_pending(struct tdb_context *tdb)
+{
+	tdb_off_t recovery_head;
+	struct tdb_record rec;
+
+	if (tdb_recovery_area(tdb, tdb->methods, &recovery_head, &rec) == -1) {
+		return false;
 	}
 
-	return (rec.magic == TDB_RECOVERY_MAGIC);
+	return recovery_head != 0 && rec.magic == TDB_RECOVERY_MAGIC;
 }
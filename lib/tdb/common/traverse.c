@@ -35,10 +35,14 @@ static tdb_off_t tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock
 			 struct tdb_record *rec)
 {
 	int want_next = (tlock->off != 0);
+	uint32_t num_buckets, hash;
 
 	/* Lock each chain from the start one. */
-	for (; tlock->hash < tdb->header.hash_size; tlock->hash++) {
-		if (!tlock->off && tlock->hash != 0) {
+	while (tlock->hash < tdb->header.hash_size) {
+		if (!tlock->off && tlock->hash != 0 &&
+		    tlock->bucket == tlock->hash &&
+		    tdb_hash_buckets(tdb, &num_buckets) == 0 &&
+		    num_buckets == tdb->header.hash_size) {
 			/* this is an optimisation for the common case where
 			   the hash chain is empty, which is particularly
 			   common for the use of tdb with ldb, where large
@@ -66,8 +70,13 @@ static tdb_off_t tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock
 			   With a non-indexed ldb search this trick gains us a
 			   factor of around 80 in speed on a linux 2.6.x
 			   system (testing using ldbtest).
+
+			   Once hash chains have been split (TDB_GROW_HASH)
+			   the hash table heads are not all there is, so we
+			   don't do this.
 			*/
 			tdb->methods->next_hash_chain(tdb, &tlock->hash);
+			tlock->bucket = tlock->hash;
 			if (tlock->hash == tdb->header.hash_size) {
 				continue;
 			}
@@ -78,8 +87,8 @@ static tdb_off_t tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock
 
 		/* No previous record?  Start at top of chain. */
 		if (!tlock->off) {
-			if (tdb_ofs_read(tdb, TDB_HASH_TOP(tlock->hash),
-				     &tlock->off) == -1)
+			tdb_off_t top = tdb_bucket_top(tdb, tlock->bucket);
+			if (top == 0 || tdb_ofs_read(tdb, top, &tlock->off) == -1)
 				goto fail;
 		} else {
 			/* Otherwise unlock the previous record. */
@@ -121,7 +130,11 @@ static tdb_off_t tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock
 			    tdb_do_delete(tdb, current, rec) != 0)
 				goto fail;
 		}
-		tdb_unlock(tdb, tlock->hash, tlock->lock_rw);
+		/* Move on while we hold the chain, see tdb_next_bucket() */
+		hash = tlock->hash;
+		if (tdb_next_bucket(tdb, tlock) == -1)
+			goto fail;
+		tdb_unlock(tdb, hash, tlock->lock_rw);
 		want_next = 0;
 	}
 	/* We finished iteration without finding anything */
@@ -215,7 +228,7 @@ out:
 _PUBLIC_ int tdb_traverse_read(struct tdb_context *tdb, 
 		      tdb_traverse_func fn, void *private_data)
 {
-	struct tdb_traverse_lock tl = { NULL, 0, 0, F_RDLCK };
+	struct tdb_traverse_lock tl = { NULL, 0, 0, F_RDLCK, 0 };
 	int ret;
 
 	/* we need to get a read lock on the transaction lock here to
@@ -244,7 +257,7 @@ _PUBLIC_ int tdb_traverse_read(struct tdb_context *tdb,
 _PUBLIC_ int tdb_traverse(struct tdb_context *tdb, 
 		 tdb_traverse_func fn, void *private_data)
 {
-	struct tdb_traverse_lock tl = { NULL, 0, 0, F_WRLCK };
+	struct tdb_traverse_lock tl = { NULL, 0, 0, F_WRLCK, 0 };
 	int ret;
 
 	if (tdb->read_only || tdb->traverse_read) {
@@ -277,6 +290,7 @@ _PUBLIC_ TDB_DATA tdb_firstkey(struct tdb_context *tdb)
 	if (tdb_unlock_record(tdb, tdb->travlocks.off) != 0)
 		return tdb_null;
 	tdb->travlocks.off = tdb->travlocks.hash = 0;
+	tdb->travlocks.bucket = 0;
 	tdb->travlocks.lock_rw = F_RDLCK;
 
 	/* Grab first record: locks chain and returned record. */
@@ -339,6 +353,13 @@ _PUBLIC_ TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA oldkey)
 			return tdb_null;
 		}
 		tdb->travlocks.hash = BUCKET(rec.full_hash);
+		if (tdb_hash_bucket(tdb, rec.full_hash,
+				    &tdb->travlocks.bucket) == -1) {
+			tdb_unlock(tdb, tdb->travlocks.hash,
+				   tdb->travlocks.lock_rw);
+			tdb->travlocks.off = 0;
+			return tdb_null;
+		}
 		if (tdb_lock_record(tdb, tdb->travlocks.off) != 0) {
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_nextkey: lock_record failed (%s)!\n", strerror(errno)));
 			return tdb_null;
@@ -80,6 +80,10 @@ extern "C" {
 #define TDB_ALLOW_NESTING 512 /** Allow transactions to nest */
 #define TDB_DISALLOW_NESTING 1024 /** Disallow transactions to nest */
 #define TDB_INCOMPATIBLE_HASH 2048 /** Better hashing: can't be opened by tdb < 1.2.6. */
+#define TDB_MUTEX_LOCKING 4096 /** Chain locks as robust mutexes in the file, needs TDB_CLEAR_IF_FIRST */
+#define TDB_GROW_HASH 8192 /** Split hash chains as the database grows, set when the file is created */
+#define TDB_SIZE_CLASSES 16384 /** Free lists by record size, set when the file is created */
+#define TDB_GROUP_COMMIT 32768 /** Share the syncs of concurrent transaction commits */
 
 /** The tdb error codes */
 enum TDB_ERROR {TDB_SUCCESS=0, TDB_ERR_CORRUPT, TDB_ERR_IO, TDB_ERR_LOCK, 
@@ -206,6 +210,21 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
  */
 void tdb_set_max_dead(struct tdb_context *tdb, int max_dead);
 
+/**
+ * @brief Set how long a group commit waits for other commits.
+ *
+ * With TDB_GROUP_COMMIT the first committer syncs the file for all
+ * transactions committed by other processes within this delay. Their
+ * tdb_transaction_commit() calls return once that sync is done.
+ *
+ * @param[in]  tdb      The database handle to set the delay.
+ *
+ * @param[in]  usecs    The maximum delay in microseconds. The default of 0
+ *                      only batches the commits already waiting for the
+ *                      database.
+ */
+void tdb_set_commit_delay(struct tdb_context *tdb, unsigned int usecs);
+
 /**
  * @brief Reopen a tdb.
  *
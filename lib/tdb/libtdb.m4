@@ -13,7 +13,7 @@ if test x"$tdbdir" = "x"; then
    AC_MSG_ERROR([cannot find tdb source in $tdbpaths])
 fi
 TDB_OBJ="common/tdb.o common/dump.o common/transaction.o common/error.o common/traverse.o"
-TDB_OBJ="$TDB_OBJ common/freelist.o common/freelistcheck.o common/io.o common/lock.o common/open.o common/check.o common/hash.o common/summary.o"
+TDB_OBJ="$TDB_OBJ common/freelist.o common/freelistcheck.o common/io.o common/lock.o common/open.o common/check.o common/hash.o common/summary.o common/mutex.o common/rehash.o"
 AC_SUBST(TDB_OBJ)
 AC_SUBST(LIBREPLACEOBJ)
 
@@ -24,6 +24,36 @@ TDB_DEPS=""
 if test x$libreplace_cv_HAVE_FDATASYNC_IN_LIBRT = xyes ; then
 	TDB_DEPS="$TDB_DEPS -lrt"
 fi
+
+AC_CACHE_CHECK([for robust process shared mutexes],tdb_cv_HAVE_ROBUST_MUTEXES,[
+	tdb_save_LIBS="$LIBS"
+	LIBS="$LIBS -lpthread"
+	AC_TRY_RUN([
+#include <errno.h>
+#include <pthread.h>
+int main(void)
+{
+	pthread_mutexattr_t ma;
+	pthread_mutex_t m;
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	if (pthread_mutex_init(&m, &ma) != 0) {
+		return 1;
+	}
+	if (pthread_mutex_lock(&m) == EOWNERDEAD) {
+		pthread_mutex_consistent(&m);
+	}
+	return 0;
+}],
+	tdb_cv_HAVE_ROBUST_MUTEXES=yes,tdb_cv_HAVE_ROBUST_MUTEXES=no,
+	tdb_cv_HAVE_ROBUST_MUTEXES=cross)
+	LIBS="$tdb_save_LIBS"
+])
+if test x"$tdb_cv_HAVE_ROBUST_MUTEXES" = x"yes"; then
+	AC_DEFINE(HAVE_ROBUST_MUTEXES,1,[Whether we have robust process shared mutexes])
+	TDB_DEPS="$TDB_DEPS -lpthread"
+fi
 AC_SUBST(TDB_DEPS)
 
 TDB_CFLAGS="-I$tdbdir/include"
@@ -0,0 +1,265 @@
+/* measure the commit rate of many processes doing small transactions,
+   like the idmap allocation or secrets updates do, with and without
+   TDB_GROUP_COMMIT.
+*/
+
+#include "replace.h"
+#include "system/time.h"
+#include "system/wait.h"
+#include "system/filesys.h"
+#include "tdb.h"
+
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+struct commit_stats {
+	unsigned int commits;
+	unsigned int failures;
+	double usec;
+	double max_usec;
+};
+
+static struct tdb_logging_context log_ctx;
+
+#ifdef PRINTF_ATTRIBUTE
+static void tdb_log(struct tdb_context *tdb, enum tdb_debug_level level, const char *format, ...) PRINTF_ATTRIBUTE(3,4);
+#endif
+static void tdb_log(struct tdb_context *tdb, enum tdb_debug_level level, const char *format, ...)
+{
+	va_list ap;
+
+	if (level == TDB_DEBUG_TRACE) {
+		return;
+	}
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+}
+
+static double timeval_usec(const struct timeval *t1, const struct timeval *t2)
+{
+	return (t2->tv_sec - t1->tv_sec) * 1.0e6 + (t2->tv_usec - t1->tv_usec);
+}
+
+/* allocate the next id and store both mappings, like idmap_tdb does */
+static int allocate_id(struct tdb_context *db, int child, unsigned int i)
+{
+	const char *hwm_key = "USER HWM";
+	TDB_DATA key, data;
+	uint32_t hwm = 0;
+	char sid[64], id[32];
+
+	key.dptr = (unsigned char *)discard_const_p(char, hwm_key);
+	key.dsize = strlen(hwm_key);
+	data = tdb_fetch(db, key);
+	if (data.dptr != NULL) {
+		if (data.dsize == sizeof(hwm)) {
+			memcpy(&hwm, data.dptr, sizeof(hwm));
+		}
+		free(data.dptr);
+	}
+	hwm++;
+
+	data.dptr = (unsigned char *)&hwm;
+	data.dsize = sizeof(hwm);
+	if (tdb_store(db, key, data, TDB_REPLACE) != 0) {
+		return -1;
+	}
+
+	snprintf(sid, sizeof(sid), "S-1-5-21-1-2-3-%d-%u", child, i);
+	snprintf(id, sizeof(id), "UID %u", (unsigned int)hwm);
+
+	key.dptr = (unsigned char *)sid;
+	key.dsize = strlen(sid) + 1;
+	data.dptr = (unsigned char *)id;
+	data.dsize = strlen(id) + 1;
+	if (tdb_store(db, key, data, TDB_REPLACE) != 0) {
+		return -1;
+	}
+	return tdb_store(db, data, key, TDB_REPLACE);
+}
+
+static void run_child(const char *filename, int tdb_flags, int delay,
+		      int child, unsigned int num_commits, int fd)
+{
+	struct tdb_context *db;
+	struct commit_stats stats;
+	unsigned int i;
+
+	memset(&stats, 0, sizeof(stats));
+
+	db = tdb_open_ex(filename, 0, tdb_flags, O_RDWR | O_CREAT, 0600,
+			 &log_ctx, NULL);
+	if (db == NULL) {
+		perror("tdb_open_ex");
+		exit(1);
+	}
+	if (delay != -1) {
+		tdb_set_commit_delay(db, delay);
+	}
+
+	for (i = 0; i < num_commits; i++) {
+		struct timeval t1, t2;
+		double usec;
+
+		gettimeofday(&t1, NULL);
+		if (tdb_transaction_start(db) != 0) {
+			stats.failures++;
+			continue;
+		}
+		if (allocate_id(db, child, i) != 0) {
+			tdb_transaction_cancel(db);
+			stats.failures++;
+			continue;
+		}
+		if (tdb_transaction_commit(db) != 0) {
+			stats.failures++;
+			continue;
+		}
+		gettimeofday(&t2, NULL);
+
+		usec = timeval_usec(&t1, &t2);
+		stats.commits++;
+		stats.usec += usec;
+		if (usec > stats.max_usec) {
+			stats.max_usec = usec;
+		}
+	}
+
+	tdb_close(db);
+
+	if (write(fd, &stats, sizeof(stats)) != sizeof(stats)) {
+		exit(1);
+	}
+	exit(0);
+}
+
+static char *test_path(const char *filename)
+{
+	const char *prefix = getenv("TEST_DATA_PREFIX");
+
+	if (prefix) {
+		char *path = NULL;
+		int ret;
+
+		ret = asprintf(&path, "%s/%s", prefix, filename);
+		if (ret == -1) {
+			return NULL;
+		}
+		return path;
+	}
+
+	return strdup(filename);
+}
+
+static void usage(void)
+{
+	printf("Usage: tdbcommitbench [-G] [-d DELAY_USEC] [-n NUM_PROCS] [-l NUM_COMMITS]\n");
+	printf("  -G  use TDB_GROUP_COMMIT\n");
+	printf("  -d  maximum delay a group commit waits for other commits\n");
+	exit(0);
+}
+
+int main(int argc, char * const *argv)
+{
+	int num_procs = 8;
+	unsigned int num_commits = 200;
+	int tdb_flags = TDB_DEFAULT;
+	int delay = -1;
+	int c, i, pfds[2];
+	int ret = 0;
+	struct commit_stats total;
+	struct timeval start, end;
+	double secs;
+	char *test_tdb;
+
+	log_ctx.log_fn = tdb_log;
+
+	while ((c = getopt(argc, argv, "Gd:n:l:h")) != -1) {
+		switch (c) {
+		case 'G':
+			tdb_flags |= TDB_GROUP_COMMIT;
+			break;
+		case 'd':
+			delay = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			num_procs = strtol(optarg, NULL, 0);
+			break;
+		case 'l':
+			num_commits = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	test_tdb = test_path("commitbench.tdb");
+	if (test_tdb == NULL) {
+		exit(1);
+	}
+	unlink(test_tdb);
+
+	if (pipe(pfds) != 0) {
+		perror("Creating pipe");
+		exit(1);
+	}
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < num_procs; i++) {
+		pid_t pid = fork();
+
+		if (pid == -1) {
+			perror("fork");
+			exit(1);
+		}
+		if (pid == 0) {
+			close(pfds[0]);
+			run_child(test_tdb, tdb_flags, delay, i,
+				  num_commits, pfds[1]);
+		}
+	}
+	close(pfds[1]);
+
+	memset(&total, 0, sizeof(total));
+
+	for (i = 0; i < num_procs; i++) {
+		struct commit_stats stats;
+		int status;
+
+		if (read(pfds[0], &stats, sizeof(stats)) != sizeof(stats)) {
+			ret = 1;
+			continue;
+		}
+		total.commits += stats.commits;
+		total.failures += stats.failures;
+		total.usec += stats.usec;
+		if (stats.max_usec > total.max_usec) {
+			total.max_usec = stats.max_usec;
+		}
+		wait(&status);
+	}
+
+	gettimeofday(&end, NULL);
+	secs = timeval_usec(&start, &end) / 1.0e6;
+
+	printf("%d processes%s: %u commits in %.2f seconds, "
+	       "%.1f commits/sec, %.1f usec average, %.1f usec max\n",
+	       num_procs,
+	       (tdb_flags & TDB_GROUP_COMMIT) ? " (group commit)" : "",
+	       total.commits, secs, total.commits / secs,
+	       total.commits ? total.usec / total.commits : 0.0,
+	       total.max_usec);
+
+	if (total.failures != 0) {
+		printf("%u commits failed\n", total.failures);
+		ret = 1;
+	}
+
+	unlink(test_tdb);
+	free(test_tdb);
+	return ret;
+}
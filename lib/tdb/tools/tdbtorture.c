@@ -31,7 +31,11 @@ static int in_transaction;
 static int error_count;
 static int always_transaction = 0;
 static int hash_size = 2;
+static int tdb_flags = TDB_DEFAULT;
 static int loopnum;
+static int benchmark = 0;
+static unsigned int num_stores;
+static double store_usec, max_store_usec;
 static int count_pipe;
 static struct tdb_logging_context log_ctx;
 
@@ -81,6 +85,43 @@ static char *randbuf(int len)
 	return buf;
 }
 
+static double usec_since(const struct timeval *tv)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - tv->tv_sec) * 1000000.0
+		+ (now.tv_usec - tv->tv_usec);
+}
+
+/*
+ * tdb_store() and tdb_append() allocate, so with -b we take their
+ * time. The random sizes and deletes fragment the free space.
+ */
+static int timed_store(TDB_DATA key, TDB_DATA data, bool append)
+{
+	struct timeval start;
+	double usec;
+	int ret;
+
+	if (!benchmark || in_transaction) {
+		return append ? tdb_append(db, key, data)
+			: tdb_store(db, key, data, TDB_REPLACE);
+	}
+
+	gettimeofday(&start, NULL);
+	ret = append ? tdb_append(db, key, data)
+		: tdb_store(db, key, data, TDB_REPLACE);
+	usec = usec_since(&start);
+
+	num_stores++;
+	store_usec += usec;
+	if (usec > max_store_usec) {
+		max_store_usec = usec;
+	}
+	return ret;
+}
+
 static int cull_traverse(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
 			 void *state)
 {
@@ -156,7 +197,7 @@ static void addrec_db(void)
 
 #if STORE_PROB
 	if (random() % STORE_PROB == 0) {
-		if (tdb_store(db, key, data, TDB_REPLACE) != 0) {
+		if (timed_store(key, data, false) != 0) {
 			fatal("tdb_store failed");
 		}
 		goto next;
@@ -165,7 +206,7 @@ static void addrec_db(void)
 
 #if APPEND_PROB
 	if (random() % APPEND_PROB == 0) {
-		if (tdb_append(db, key, data) != 0) {
+		if (timed_store(key, data, true) != 0) {
 			fatal("tdb_append failed");
 		}
 		goto next;
@@ -176,7 +217,7 @@ static void addrec_db(void)
 	if (random() % LOCKSTORE_PROB == 0) {
 		tdb_chainlock(db, key);
 		data = tdb_fetch(db, key);
-		if (tdb_store(db, key, data, TDB_REPLACE) != 0) {
+		if (timed_store(key, data, false) != 0) {
 			fatal("tdb_store failed");
 		}
 		if (data.dptr) free(data.dptr);
@@ -216,7 +257,7 @@ static int traverse_fn(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
 
 static void usage(void)
 {
-	printf("Usage: tdbtorture [-t] [-k] [-n NUM_PROCS] [-l NUM_LOOPS] [-s SEED] [-H HASH_SIZE]\n");
+	printf("Usage: tdbtorture [-t] [-k] [-m] [-g] [-c] [-G] [-b] [-n NUM_PROCS] [-l NUM_LOOPS] [-s SEED] [-H HASH_SIZE]\n");
 	exit(0);
 }
 
@@ -230,7 +271,7 @@ static void send_count_and_suicide(int sig)
 
 static int run_child(const char *filename, int i, int seed, unsigned num_loops, unsigned start)
 {
-	db = tdb_open_ex(filename, hash_size, TDB_DEFAULT,
+	db = tdb_open_ex(filename, hash_size, tdb_flags,
 			 O_RDWR | O_CREAT, 0600, &log_ctx, NULL);
 	if (!db) {
 		fatal("db open failed");
@@ -247,6 +288,13 @@ static int run_child(const char *filename, int i, int seed, unsigned num_loops,
 		addrec_db();
 	}
 
+	if (benchmark && num_stores != 0) {
+		printf("child %d: %u stores, %.1f usec average, %.1f usec max, "
+		       "%d free records\n", i, num_stores,
+		       store_usec / num_stores, max_store_usec,
+		       tdb_freelist_size(db));
+	}
+
 	if (error_count == 0) {
 		tdb_traverse_read(db, NULL, NULL);
 		if (always_transaction) {
@@ -302,7 +350,7 @@ int main(int argc, char * const *argv)
 
 	log_ctx.log_fn = tdb_log;
 
-	while ((c = getopt(argc, argv, "n:l:s:H:thk")) != -1) {
+	while ((c = getopt(argc, argv, "n:l:s:H:thkmgcGb")) != -1) {
 		switch (c) {
 		case 'n':
 			num_procs = strtol(optarg, NULL, 0);
@@ -322,6 +370,21 @@ int main(int argc, char * const *argv)
 		case 'k':
 			kill_random = 1;
 			break;
+		case 'm':
+			tdb_flags |= TDB_CLEAR_IF_FIRST | TDB_MUTEX_LOCKING;
+			break;
+		case 'g':
+			tdb_flags |= TDB_GROW_HASH;
+			break;
+		case 'c':
+			tdb_flags |= TDB_SIZE_CLASSES;
+			break;
+		case 'G':
+			tdb_flags |= TDB_GROUP_COMMIT;
+			break;
+		case 'b':
+			benchmark = 1;
+			break;
 		default:
 			usage();
 		}
@@ -354,8 +417,13 @@ int main(int argc, char * const *argv)
 		if ((pids[i]=fork()) == 0) {
 			close(pfds[0]);
 			if (i == 0) {
-				printf("Testing with %d processes, %d loops, %d hash_size, seed=%d%s\n",
-				       num_procs, num_loops, hash_size, seed, always_transaction ? " (all within transactions)" : "");
+				printf("Testing with %d processes, %d loops, %d hash_size, seed=%d%s%s%s%s%s\n",
+				       num_procs, num_loops, hash_size, seed,
+				       always_transaction ? " (all within transactions)" : "",
+				       (tdb_flags & TDB_MUTEX_LOCKING) ? " (mutex locking)" : "",
+				       (tdb_flags & TDB_GROW_HASH) ? " (growing hash)" : "",
+				       (tdb_flags & TDB_SIZE_CLASSES) ? " (size classes)" : "",
+				       (tdb_flags & TDB_GROUP_COMMIT) ? " (group commit)" : "");
 			}
 			exit(run_child(test_tdb, i, seed, num_loops, 0));
 		}
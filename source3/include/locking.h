@@ -44,6 +44,7 @@ struct lock_context {
 };
 
 struct files_struct;
+struct brl_page;
 
 #include "../librpc/gen_ndr/file_id.h"
 
@@ -53,14 +54,20 @@ struct byte_range_lock {
 	bool modified;
 	bool read_only;
 	struct file_id key;
-	struct lock_struct *lock_data;
 	struct db_record *record;
+
+	/* The locks, in pages sorted by start offset, see brlock.c */
+	unsigned int num_pages;
+	struct brl_page *pages;
+	bool paged;
+	uint32_t next_page_id;
+	unsigned int num_stale_pages;
+	uint32_t *stale_pages;
 };
 
-/* Internal structure in brlock.tdb. 
-   The data in brlock records is an unsorted linear array of these
-   records.  It is unnecessary to store the count as tdb provides the
-   size of the record */
+/* Internal structure in brlock.tdb.
+   The locks are kept sorted by start offset. See brlock.c for how
+   they are stored in the records. */
 
 struct lock_struct {
 	struct lock_context context;
@@ -44,7 +44,8 @@ enum memcache_number {
 	MANGLE_HASH2_CACHE,
 	PDB_GETPWSID_CACHE,	/* talloc */
 	SINGLETON_CACHE_TALLOC,	/* talloc */
-	SINGLETON_CACHE
+	SINGLETON_CACHE,
+	DIRNAME_INDEX_CACHE
 };
 
 /*
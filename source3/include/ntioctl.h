@@ -59,6 +59,9 @@
 #define FSCTL_SIS_LINK_FILES         0x0009C104
 
 #define FSCTL_GET_SHADOW_COPY_DATA   0x00144064   /* KJC -- Shadow Copy information */
+#define FSCTL_SRV_REQUEST_RESUME_KEY 0x00140078
+#define FSCTL_SRV_COPYCHUNK          0x001440F2
+#define FSCTL_SRV_COPYCHUNK_WRITE    0x001480F2
 
 #if 0
 #define FSCTL_SECURITY_ID_CHECK
@@ -254,6 +254,9 @@ typedef struct files_struct {
 	struct fd_handle *fh;
 	unsigned int num_smb_operations;
 	struct file_id file_id;
+	struct files_struct *file_id_hash_next; /* chain in sconn->file_id_hash */
+	struct files_struct *fd_hash_next;	/* chain in sconn->fd_hash */
+	int fd_hash_key;			/* fd we are hashed under or -1 */
 	uint64_t initial_allocation_size; /* Faked up initial allocation on disk. */
 	mode_t mode;
 	uint16 file_pid;
@@ -277,6 +280,7 @@ typedef struct files_struct {
 
 	struct share_mode_entry *pending_break_messages;
 	int num_pending_break_messages;
+	struct smbd_smb2_lease *lease; /* SMB2.1 lease shared with other opens */
 
 	bool can_lock;
 	bool can_read;
@@ -518,6 +522,11 @@ struct smb_request {
 	 * Back pointer to smb2 request.
 	 */
 	struct smbd_smb2_request *smb2req;
+
+	/*
+	 * SMB2.1 lease requested by the create, NULL otherwise.
+	 */
+	const struct smb2_lease *lease;
 };
 
 /* Defines for the sent_oplock_break field above. */
@@ -564,9 +573,23 @@ struct pending_message_list {
 };
 
 #define SHARE_MODE_FLAG_POSIX_OPEN	0x1
+#define SHARE_MODE_FLAG_LEASE		0x2
+#define SHARE_MODE_FLAG_SHARING_WAIT	0x4 /* deferred open waiting for a close */
 
 #include "librpc/gen_ndr/server_id.h"
 
+/* SMB2.1 lease, see MS-SMB2 2.2.13.2.8 */
+struct smb2_lease_key {
+	uint64_t data[2];
+};
+
+struct smb2_lease {
+	struct smb2_lease_key lease_key;
+	uint32_t lease_state;
+	uint32_t lease_flags;
+	uint64_t lease_duration;
+};
+
 /* struct returned by get_share_modes */
 struct share_mode_entry {
 	struct server_id pid;
@@ -584,6 +607,13 @@ struct share_mode_entry {
 	uint32 uid;		/* uid of file opener. */
 	uint16 flags;		/* See SHARE_MODE_XX above. */
 	uint32_t name_hash;		/* Jenkins hash of full pathname. */
+	/*
+	 * Only valid with SHARE_MODE_FLAG_LEASE. All opens of one
+	 * client sharing a lease key share the lease state.
+	 */
+	struct GUID client_guid;
+	struct smb2_lease_key lease_key;
+	uint32_t lease_state;
 };
 
 /* oplock break message definition - linearization of share_mode_entry.
@@ -645,6 +675,17 @@ struct share_mode_lock {
 	struct timespec changed_write_time;
 	bool fresh;
 	bool modified;
+	/*
+	 * share_modes points into the record we read and is changed
+	 * there in place. As long as no entry is appended and neither
+	 * the delete tokens nor the names change, the record is
+	 * written back as it is.
+	 */
+	bool share_modes_in_record;
+	bool layout_modified;
+	/* delete tokens not decoded into delete_tokens yet */
+	uint32_t num_raw_delete_tokens;
+	DATA_BLOB raw_delete_tokens;
 	struct db_record *record;
 };
 
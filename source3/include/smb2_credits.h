@@ -0,0 +1,69 @@
+/*
+   Unix SMB/CIFS implementation.
+   SMB2 credit statistics shared between smbd processes
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SMB2_CREDITS_H_
+#define _SMB2_CREDITS_H_
+
+/* how often (in seconds) smbd publishes and re-reads the statistics */
+#define SMB2_CREDITS_UPDATE_INTERVAL 2
+
+/*
+ * a record is rewritten at once when the credit numbers change, but
+ * for new request counts and latencies alone at most this often
+ */
+#define SMB2_CREDITS_PUBLISH_INTERVAL 30
+
+/*
+ * Each SMB2 connection periodically stores one of these in
+ * smb2_credits.tdb, keyed by its server_id. The parent smbd sums
+ * them up into a struct smb2_credits_global, which all connections
+ * use to judge the load of the whole server.
+ */
+struct smb2_credit_stats {
+	struct server_id pid;
+	fstring addr;
+	uint16_t dialect;
+	uint32_t max_credits;
+	uint32_t target;
+	uint32_t granted;
+	uint32_t in_flight;
+	uint32_t async_pending;
+	uint32_t avg_latency_usec;
+	uint32_t throttled;
+	uint64_t num_requests;
+	uint64_t credits_total;
+};
+
+struct smb2_credits_global {
+	uint32_t num_connections;
+	uint32_t in_flight;
+	uint32_t async_pending;
+};
+
+/* The following definitions come from lib/smb2_credits_tdb.c  */
+
+bool smb2_credits_init(bool rw);
+bool smb2_credits_store(const struct smb2_credit_stats *stats);
+bool smb2_credits_delete(struct server_id pid);
+bool smb2_credits_fetch_global(struct smb2_credits_global *global);
+bool smb2_credits_update_global(void);
+int smb2_credits_traverse_read(int (*fn)(const struct smb2_credit_stats *stats,
+					 void *private_data),
+			       void *private_data);
+
+#endif /* _SMB2_CREDITS_H_ */
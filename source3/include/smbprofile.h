@@ -26,7 +26,7 @@
 
 #define PROF_SHMEM_KEY ((key_t)0x07021999)
 #define PROF_SHM_MAGIC 0x6349985
-#define PROF_SHM_VERSION 12
+#define PROF_SHM_VERSION 16
 
 /* time values in the following structure are in microseconds */
 
@@ -846,6 +846,13 @@ enum profile_stats_values
 
 const char * profile_value_name(enum profile_stats_values val);
 
+/*
+ * Latency histograms: bucket 0 counts calls that took less than a
+ * microsecond, bucket n > 0 those that took [2^(n-1), 2^n) usec. The
+ * last bucket also takes everything slower (> 67 seconds).
+ */
+#define PROFILE_HIST_BUCKETS 28
+
 struct profile_stats {
 /* general counters */
 	unsigned smb_count; /* how many SMB packets we have processed */
@@ -855,6 +862,9 @@ struct profile_stats {
 	unsigned count[PR_VALUE_MAX];
 	unsigned time[PR_VALUE_MAX];
 
+/* latency histograms, only filled with full profiling turned on */
+	unsigned hist[PR_VALUE_MAX][PROFILE_HIST_BUCKETS];
+
 /* cumulative byte counts */
 	unsigned syscall_pread_bytes;
 	unsigned syscall_pwrite_bytes;
@@ -868,6 +878,20 @@ struct profile_stats {
 	unsigned statcache_misses;
 	unsigned statcache_hits;
 
+/* SMB2 request cache counters */
+	unsigned smb2_req_cache_lookups;
+	unsigned smb2_req_cache_misses;
+	unsigned smb2_req_cache_hits;
+
+/* share mode checks done without the record lock */
+	unsigned share_mode_fast_lookups;
+	unsigned share_mode_fast_hits;
+	unsigned share_mode_fast_retries;
+
+/* SMB2 reply batching counters */
+	unsigned smb2_send_batches;
+	unsigned smb2_send_replies;
+
 /* write cache counters */
 	unsigned writecache_read_hits;
 	unsigned writecache_abutted_writes;
@@ -902,6 +926,32 @@ extern bool do_profile_times;
 #define DEC_PROFILE_COUNT(x) profile_p->x--
 #define ADD_PROFILE_COUNT(x,y) profile_p->x += (y)
 
+/*
+ * The histograms are shared by all smbds, bump them with an atomic
+ * increment instead of taking a lock.
+ */
+#ifdef HAVE___SYNC_FETCH_AND_ADD
+#define INC_PROFILE_HIST(v, b) __sync_fetch_and_add(&profile_p->hist[v][b], 1)
+#else
+#define INC_PROFILE_HIST(v, b) profile_p->hist[v][b]++
+#endif
+
+static inline unsigned profile_hist_bucket(uint64_t usec)
+{
+	unsigned bucket = 0;
+
+	while ((usec != 0) && (bucket < PROFILE_HIST_BUCKETS - 1)) {
+		usec >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/* x is the time value of the operation, e.g. syscall_open_time */
+#define ADD_PROFILE_HIST(x, usec) \
+	INC_PROFILE_HIST(&profile_p->x - profile_p->time, \
+			 profile_hist_bucket(usec))
+
 static inline uint64_t profile_timestamp(void)
 {
 	struct timespec ts;
@@ -952,8 +1002,17 @@ static inline uint64_t profile_timestamp(void)
 
 #define END_PROFILE(x) \
 	if (do_profile_times) { \
-		ADD_PROFILE_COUNT(x##_time, \
-		    profile_timestamp() - __profstamp_##x); \
+		uint64_t __profdelta_##x = \
+		    profile_timestamp() - __profstamp_##x; \
+		ADD_PROFILE_COUNT(x##_time, __profdelta_##x); \
+		ADD_PROFILE_HIST(x##_time, __profdelta_##x); \
+	}
+
+/* account a call whose duration was measured by the caller */
+#define DO_PROFILE_TIME(val, usec) \
+	if (do_profile_times) { \
+		ADD_PROFILE_COUNT(time[val], usec); \
+		INC_PROFILE_HIST(val, profile_hist_bucket(usec)); \
 	}
 #else /* WITH_PROFILE */
 
@@ -964,11 +1023,13 @@ static inline uint64_t profile_timestamp(void)
 #define START_PROFILE(x)
 #define START_PROFILE_BYTES(x,n)
 #define END_PROFILE(x)
+#define DO_PROFILE_TIME(val, usec)
 #endif /* WITH_PROFILE */
 
 /* The following definitions come from profile/profile.c  */
 
 void set_profile_level(int level, struct server_id src);
 bool profile_setup(struct messaging_context *msg_ctx, bool rdonly);
+char *profile_latency_string(TALLOC_CTX *mem_ctx);
 
 #endif
@@ -136,6 +136,7 @@
 /* Leave at 28 - not yet released. Rename open function to open_fn. - gd */
 /* Leave at 28 - not yet released. Make getwd function always return malloced memory. JRA. */
 /* Bump to version 29 - Samba 3.6.0 will ship with interface version 28. */
+/* Leave at 29 - not yet released. Add copy_chunk for server side copy. */
 #define SMB_VFS_INTERFACE_VERSION 29
 
 /*
@@ -262,6 +263,12 @@ struct vfs_fn_pointers {
 				enum vfs_fallocate_mode mode,
 				SMB_OFF_T offset,
 				SMB_OFF_T len);
+	ssize_t (*copy_chunk)(struct vfs_handle_struct *handle,
+			      struct files_struct *src_fsp,
+			      SMB_OFF_T src_off,
+			      struct files_struct *dest_fsp,
+			      SMB_OFF_T dest_off,
+			      size_t num);
 	bool (*lock)(struct vfs_handle_struct *handle, struct files_struct *fsp, int op, SMB_OFF_T offset, SMB_OFF_T count, int type);
 	int (*kernel_flock)(struct vfs_handle_struct *handle, struct files_struct *fsp,
 			    uint32 share_mode, uint32_t access_mask);
@@ -626,6 +633,12 @@ int smb_vfs_call_fallocate(struct vfs_handle_struct *handle,
 			enum vfs_fallocate_mode mode,
 			SMB_OFF_T offset,
 			SMB_OFF_T len);
+ssize_t smb_vfs_call_copy_chunk(struct vfs_handle_struct *handle,
+				struct files_struct *src_fsp,
+				SMB_OFF_T src_off,
+				struct files_struct *dest_fsp,
+				SMB_OFF_T dest_off,
+				size_t num);
 bool smb_vfs_call_lock(struct vfs_handle_struct *handle,
 		       struct files_struct *fsp, int op, SMB_OFF_T offset,
 		       SMB_OFF_T count, int type);
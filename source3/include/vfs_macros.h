@@ -259,6 +259,11 @@
 #define SMB_VFS_NEXT_FALLOCATE(handle, fsp, mode, offset, len) \
 	smb_vfs_call_fallocate((handle)->next, (fsp), (mode), (offset), (len))
 
+#define SMB_VFS_COPY_CHUNK(src_fsp, src_off, dest_fsp, dest_off, num) \
+	smb_vfs_call_copy_chunk((dest_fsp)->conn->vfs_handles, (src_fsp), (src_off), (dest_fsp), (dest_off), (num))
+#define SMB_VFS_NEXT_COPY_CHUNK(handle, src_fsp, src_off, dest_fsp, dest_off, num) \
+	smb_vfs_call_copy_chunk((handle)->next, (src_fsp), (src_off), (dest_fsp), (dest_off), (num))
+
 #define SMB_VFS_LOCK(fsp, op, offset, count, type) \
 	smb_vfs_call_lock((fsp)->conn->vfs_handles, (fsp), (op), (offset), (count), (type))
 #define SMB_VFS_NEXT_LOCK(handle, fsp, op, offset, count, type) \
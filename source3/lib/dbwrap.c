@@ -144,6 +144,44 @@ struct db_context *db_open(TALLOC_CTX *mem_ctx,
 #endif
 
 	if (result == NULL) {
+		const char *base = strrchr(name, '/');
+
+		base = (base != NULL) ? base + 1 : name;
+
+		/*
+		 * "tdb_mutexes:locking.tdb = yes" lets the chain locks
+		 * of a CLEAR_IF_FIRST database be robust mutexes in the
+		 * file instead of fcntl locks.
+		 */
+		if ((tdb_flags & TDB_CLEAR_IF_FIRST) &&
+		    lp_parm_bool(-1, "tdb_mutexes", base, false)) {
+			tdb_flags |= TDB_MUTEX_LOCKING;
+		}
+
+		/*
+		 * "tdb_grow_hash:winbindd_idmap.tdb = yes" splits the hash
+		 * chains of a newly created database as it grows.
+		 */
+		if (lp_parm_bool(-1, "tdb_grow_hash", base, false)) {
+			tdb_flags |= TDB_GROW_HASH;
+		}
+
+		/*
+		 * "tdb_size_classes:locking.tdb = yes" keeps the free
+		 * records of a newly created database on lists by size.
+		 */
+		if (lp_parm_bool(-1, "tdb_size_classes", base, false)) {
+			tdb_flags |= TDB_SIZE_CLASSES;
+		}
+
+		/*
+		 * "tdb_group_commit:registry.tdb = yes" lets concurrent
+		 * transactions on a persistent database share their syncs.
+		 */
+		if (lp_parm_bool(-1, "tdb_group_commit", base, false)) {
+			tdb_flags |= TDB_GROUP_COMMIT;
+		}
+
 		result = db_open_tdb(mem_ctx, name, hash_size,
 				     tdb_flags, open_flags, mode);
 	}
@@ -177,6 +177,32 @@ struct event_context *messaging_event_context(struct messaging_context *msg_ctx)
 	return msg_ctx->event_ctx;
 }
 
+/*
+ * Set up msg_ctx->local: messages.tdb, with the datagram sockets on top
+ * if "messaging:dgm" is set. Failing to set up the sockets is not
+ * fatal, we just keep using messages.tdb.
+ */
+static NTSTATUS messaging_local_init(struct messaging_context *msg_ctx)
+{
+	NTSTATUS status;
+
+	status = messaging_tdb_init(msg_ctx, msg_ctx, &msg_ctx->local);
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
+	}
+
+	if (lp_parm_bool(-1, "messaging", "dgm", false)) {
+		status = messaging_dgm_init(msg_ctx, msg_ctx, msg_ctx->local,
+					    &msg_ctx->local);
+		if (!NT_STATUS_IS_OK(status)) {
+			DEBUG(1, ("messaging_dgm_init failed: %s, using "
+				  "messages.tdb only\n", nt_errstr(status)));
+		}
+	}
+
+	return NT_STATUS_OK;
+}
+
 struct messaging_context *messaging_init(TALLOC_CTX *mem_ctx, 
 					 struct server_id server_id, 
 					 struct event_context *ev)
@@ -191,7 +217,7 @@ struct messaging_context *messaging_init(TALLOC_CTX *mem_ctx,
 	ctx->id = server_id;
 	ctx->event_ctx = ev;
 
-	status = messaging_tdb_init(ctx, ctx, &ctx->local);
+	status = messaging_local_init(ctx);
 
 	if (!NT_STATUS_IS_OK(status)) {
 		DEBUG(2, ("messaging_tdb_init failed: %s\n",
@@ -242,7 +268,7 @@ NTSTATUS messaging_reinit(struct messaging_context *msg_ctx,
 
 	msg_ctx->id = id;
 
-	status = messaging_tdb_init(msg_ctx, msg_ctx, &msg_ctx->local);
+	status = messaging_local_init(msg_ctx);
 	if (!NT_STATUS_IS_OK(status)) {
 		DEBUG(0, ("messaging_tdb_init failed: %s\n",
 			  nt_errstr(status)));
@@ -0,0 +1,342 @@
+/*
+   Unix SMB/CIFS implementation.
+   Samba internal messaging over unix datagram sockets
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The tdb backend stores every message in the recipient's record in
+ * messages.tdb and sends it a SIGUSR1, the recipient then locks and
+ * deletes that record. With many processes exchanging oplock breaks,
+ * lock releases and change notifies, messages.tdb becomes a hot spot.
+ *
+ * With "messaging:dgm = yes" every process binds a unix datagram
+ * socket named after its pid in lock_path("msg") and sends the ndr
+ * encoded messaging_rec straight to the recipient's socket. The kernel
+ * queues the datagrams, no shared lock is taken and no signal is sent.
+ *
+ * The tdb backend is kept underneath and used when the recipient has
+ * no socket (it does not use this backend), when the message is too
+ * large for a datagram or when the recipient's socket queue is full.
+ * A process using this backend still receives messages sent via
+ * messages.tdb, so processes with and without it can be mixed.
+ */
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "system/network.h"
+#include "messages.h"
+
+/*
+ * Larger messages go through messages.tdb
+ */
+#define MESSAGING_DGM_MAX_MSG 65536
+
+struct messaging_dgm_context {
+	struct messaging_context *msg_ctx;
+	struct messaging_backend *fallback;
+	pid_t pid;
+	int sock;
+	struct tevent_fd *fde;
+	char *sockname;
+	uint8_t *buf;
+};
+
+static NTSTATUS messaging_dgm_send(struct messaging_context *msg_ctx,
+				   struct server_id pid, int msg_type,
+				   const DATA_BLOB *data,
+				   struct messaging_backend *backend);
+static void messaging_dgm_read_handler(struct tevent_context *ev,
+				       struct tevent_fd *fde,
+				       uint16_t flags,
+				       void *private_data);
+
+static const char *messaging_dgm_dir(void)
+{
+	return lock_path("msg");
+}
+
+static bool messaging_dgm_addr(struct sockaddr_un *addr, pid_t pid)
+{
+	int len;
+
+	ZERO_STRUCTP(addr);
+	addr->sun_family = AF_UNIX;
+
+	len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%u",
+		       messaging_dgm_dir(), (unsigned)pid);
+	return ((len > 0) && (len < sizeof(addr->sun_path)));
+}
+
+static int messaging_dgm_destructor(struct messaging_dgm_context *ctx)
+{
+	/*
+	 * A child freeing the context inherited from its parent after
+	 * fork must not remove the parent's socket.
+	 */
+	if ((ctx->sockname != NULL) && (ctx->pid == getpid())) {
+		unlink(ctx->sockname);
+	}
+	if (ctx->sock != -1) {
+		TALLOC_FREE(ctx->fde);
+		close(ctx->sock);
+		ctx->sock = -1;
+	}
+	return 0;
+}
+
+/****************************************************************************
+ Initialise the datagram backend on top of the tdb backend "fallback",
+ which is taken over by the result.
+****************************************************************************/
+
+NTSTATUS messaging_dgm_init(struct messaging_context *msg_ctx,
+			    TALLOC_CTX *mem_ctx,
+			    struct messaging_backend *fallback,
+			    struct messaging_backend **presult)
+{
+	struct messaging_backend *result;
+	struct messaging_dgm_context *ctx;
+	struct sockaddr_un addr;
+	NTSTATUS status;
+	int ret;
+
+	if (!(result = talloc(mem_ctx, struct messaging_backend))) {
+		DEBUG(0, ("talloc failed\n"));
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	ctx = talloc_zero(result, struct messaging_dgm_context);
+	if (!ctx) {
+		DEBUG(0, ("talloc failed\n"));
+		TALLOC_FREE(result);
+		return NT_STATUS_NO_MEMORY;
+	}
+	result->private_data = ctx;
+	result->send_fn = messaging_dgm_send;
+
+	ctx->msg_ctx = msg_ctx;
+	ctx->pid = getpid();
+	ctx->sock = -1;
+	talloc_set_destructor(ctx, messaging_dgm_destructor);
+
+	ctx->buf = talloc_array(ctx, uint8_t, MESSAGING_DGM_MAX_MSG);
+	if (ctx->buf == NULL) {
+		TALLOC_FREE(result);
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	if (!directory_create_or_exist(messaging_dgm_dir(), geteuid(),
+				       0700)) {
+		status = map_nt_error_from_unix(errno);
+		DEBUG(1, ("Could not create %s: %s\n", messaging_dgm_dir(),
+			  strerror(errno)));
+		TALLOC_FREE(result);
+		return status;
+	}
+
+	if (!messaging_dgm_addr(&addr, ctx->pid)) {
+		DEBUG(1, ("%s is too long for a socket name\n",
+			  messaging_dgm_dir()));
+		TALLOC_FREE(result);
+		return NT_STATUS_NAME_TOO_LONG;
+	}
+
+	ctx->sockname = talloc_strdup(ctx, addr.sun_path);
+	if (ctx->sockname == NULL) {
+		TALLOC_FREE(result);
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	ctx->sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (ctx->sock == -1) {
+		status = map_nt_error_from_unix(errno);
+		TALLOC_FREE(result);
+		return status;
+	}
+	set_blocking(ctx->sock, false);
+	fcntl(ctx->sock, F_SETFD, FD_CLOEXEC);
+
+	/* A leftover from an earlier process with our pid */
+	unlink(ctx->sockname);
+
+	ret = bind(ctx->sock, (struct sockaddr *)(void *)&addr, sizeof(addr));
+	if (ret == -1) {
+		status = map_nt_error_from_unix(errno);
+		DEBUG(1, ("bind to %s failed: %s\n", ctx->sockname,
+			  strerror(errno)));
+		TALLOC_FREE(result);
+		return status;
+	}
+
+	ctx->fde = tevent_add_fd(msg_ctx->event_ctx, ctx, ctx->sock,
+				 TEVENT_FD_READ, messaging_dgm_read_handler,
+				 ctx);
+	if (ctx->fde == NULL) {
+		TALLOC_FREE(result);
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	ctx->fallback = talloc_move(ctx, &fallback);
+
+	*presult = result;
+	return NT_STATUS_OK;
+}
+
+/****************************************************************************
+ Send a message to a particular pid.
+****************************************************************************/
+
+static NTSTATUS messaging_dgm_send(struct messaging_context *msg_ctx,
+				   struct server_id pid, int msg_type,
+				   const DATA_BLOB *data,
+				   struct messaging_backend *backend)
+{
+	struct messaging_dgm_context *ctx = talloc_get_type_abort(
+		backend->private_data, struct messaging_dgm_context);
+	struct messaging_rec rec;
+	struct sockaddr_un addr;
+	enum ndr_err_code ndr_err;
+	DATA_BLOB blob;
+	ssize_t sent;
+	uid_t euid;
+	int err;
+
+	/* NULL pointer means implicit length zero. */
+	if (!data->data) {
+		SMB_ASSERT(data->length == 0);
+	}
+
+	SMB_ASSERT(procid_to_pid(&pid) > 0);
+
+	if (!messaging_dgm_addr(&addr, procid_to_pid(&pid))) {
+		goto fallback;
+	}
+
+	rec.msg_version = MESSAGE_VERSION;
+	rec.msg_type = msg_type & MSG_TYPE_MASK;
+	rec.dest = pid;
+	rec.src = msg_ctx->id;
+	rec.buf = *data;
+
+	ndr_err = ndr_push_struct_blob(
+		&blob, talloc_tos(), &rec,
+		(ndr_push_flags_fn_t)ndr_push_messaging_rec);
+	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
+		return ndr_map_error2ntstatus(ndr_err);
+	}
+	if (blob.length > MESSAGING_DGM_MAX_MSG) {
+		TALLOC_FREE(blob.data);
+		goto fallback;
+	}
+
+	euid = geteuid();
+	if (euid != 0) {
+		/*
+		 * The sockets are only accessible to root, as with
+		 * kill() in the tdb backend
+		 */
+		save_re_uid();
+		set_effective_uid(0);
+	}
+
+	sent = sendto(ctx->sock, blob.data, blob.length, 0,
+		      (struct sockaddr *)(void *)&addr, sizeof(addr));
+	err = errno;
+
+	if (euid != 0) {
+		restore_re_uid_fromroot();
+	}
+
+	TALLOC_FREE(blob.data);
+
+	if (sent == blob.length) {
+		return NT_STATUS_OK;
+	}
+
+	if ((err == EAGAIN) && (msg_type & MSG_FLAG_LOWPRIORITY)) {
+		DEBUG(5, ("Dropping message for PID %s\n",
+			  procid_str_static(&pid)));
+		return NT_STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (err == ECONNREFUSED) {
+		/*
+		 * Nobody listens anymore, the process is gone. Let the
+		 * tdb backend figure out whether the pid has been
+		 * reused.
+		 */
+		unlink(addr.sun_path);
+	}
+
+	DEBUG(10, ("sendto %s failed: %s, using messages.tdb\n",
+		   addr.sun_path, strerror(err)));
+
+fallback:
+	return ctx->fallback->send_fn(msg_ctx, pid, msg_type, data,
+				      ctx->fallback);
+}
+
+/****************************************************************************
+ Receive and dispatch one datagram. If more are queued, tevent calls us
+ again. A callback might reinitialise messaging and free ctx, so we
+ don't loop here.
+****************************************************************************/
+
+static void messaging_dgm_read_handler(struct tevent_context *ev,
+				       struct tevent_fd *fde,
+				       uint16_t flags,
+				       void *private_data)
+{
+	struct messaging_dgm_context *ctx = talloc_get_type_abort(
+		private_data, struct messaging_dgm_context);
+	struct messaging_context *msg_ctx = ctx->msg_ctx;
+	struct messaging_rec rec;
+	enum ndr_err_code ndr_err;
+	DATA_BLOB blob;
+	ssize_t received;
+	TALLOC_CTX *frame;
+
+	received = recv(ctx->sock, ctx->buf, MESSAGING_DGM_MAX_MSG, 0);
+	if (received == -1) {
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+		    (errno != EINTR)) {
+			DEBUG(1, ("recv on %s failed: %s\n",
+				  ctx->sockname, strerror(errno)));
+		}
+		return;
+	}
+
+	frame = talloc_stackframe();
+
+	blob = data_blob_const(ctx->buf, received);
+
+	ndr_err = ndr_pull_struct_blob(
+		&blob, frame, &rec,
+		(ndr_pull_flags_fn_t)ndr_pull_messaging_rec);
+	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
+		DEBUG(1, ("Invalid message on %s\n", ctx->sockname));
+		TALLOC_FREE(frame);
+		return;
+	}
+
+	if (DEBUGLEVEL >= 10) {
+		DEBUG(10, ("messaging_dgm_read_handler:\n"));
+		NDR_PRINT_DEBUG(messaging_rec, &rec);
+	}
+
+	messaging_dispatch_rec(msg_ctx, &rec);
+	TALLOC_FREE(frame);
+}
@@ -58,7 +58,7 @@ static NTSTATUS messaging_tdb_send(struct messaging_context *msg_ctx,
 				   struct server_id pid, int msg_type,
 				   const DATA_BLOB *data,
 				   struct messaging_backend *backend);
-static void message_dispatch(struct messaging_context *msg_ctx);
+static void message_dispatch(struct messaging_tdb_context *ctx);
 
 static void messaging_tdb_signal_handler(struct tevent_context *ev_ctx,
 					 struct tevent_signal *se,
@@ -73,11 +73,31 @@ static void messaging_tdb_signal_handler(struct tevent_context *ev_ctx,
 	DEBUG(10, ("messaging_tdb_signal_handler: sig[%d] count[%d] msgs[%d]\n",
 		   signum, count, ctx->received_messages));
 
-	message_dispatch(ctx->msg_ctx);
+	message_dispatch(ctx);
 }
 
 /****************************************************************************
- Initialise the messaging functions. 
+ With "tdb_mutexes:messages.tdb = yes" the chain locks are robust
+ mutexes in the file instead of fcntl locks, "tdb_size_classes:messages.tdb
+ = yes" keeps the free records on lists by size.
+****************************************************************************/
+
+static int messaging_tdb_flags(void)
+{
+	int tdb_flags = TDB_CLEAR_IF_FIRST|TDB_DEFAULT|TDB_VOLATILE|
+		TDB_INCOMPATIBLE_HASH;
+
+	if (lp_parm_bool(-1, "tdb_mutexes", "messages.tdb", false)) {
+		tdb_flags |= TDB_MUTEX_LOCKING;
+	}
+	if (lp_parm_bool(-1, "tdb_size_classes", "messages.tdb", false)) {
+		tdb_flags |= TDB_SIZE_CLASSES;
+	}
+	return tdb_flags;
+}
+
+/****************************************************************************
+ Initialise the messaging functions.
 ****************************************************************************/
 
 NTSTATUS messaging_tdb_init(struct messaging_context *msg_ctx,
@@ -104,8 +124,7 @@ NTSTATUS messaging_tdb_init(struct messaging_context *msg_ctx,
 	ctx->msg_ctx = msg_ctx;
 
 	ctx->tdb = tdb_wrap_open(ctx, lock_path("messages.tdb"), 0,
-				 TDB_CLEAR_IF_FIRST|TDB_DEFAULT|TDB_VOLATILE|TDB_INCOMPATIBLE_HASH,
-				 O_RDWR|O_CREAT,0600);
+				 messaging_tdb_flags(), O_RDWR|O_CREAT,0600);
 
 	if (!ctx->tdb) {
 		NTSTATUS status = map_nt_error_from_unix(errno);
@@ -145,8 +164,7 @@ bool messaging_tdb_parent_init(TALLOC_CTX *mem_ctx)
 	 */
 
 	db = tdb_wrap_open(mem_ctx, lock_path("messages.tdb"), 0,
-			   TDB_CLEAR_IF_FIRST|TDB_DEFAULT|TDB_VOLATILE|TDB_INCOMPATIBLE_HASH,
-			   O_RDWR|O_CREAT,0600);
+			   messaging_tdb_flags(), O_RDWR|O_CREAT,0600);
 	if (db == NULL) {
 		DEBUG(1, ("could not open messaging.tdb: %s\n",
 			  strerror(errno)));
@@ -449,10 +467,9 @@ static NTSTATUS retrieve_all_messages(TDB_CONTEXT *msg_tdb,
  messages on an *odd* byte boundary.
 ****************************************************************************/
 
-static void message_dispatch(struct messaging_context *msg_ctx)
+static void message_dispatch(struct messaging_tdb_context *ctx)
 {
-	struct messaging_tdb_context *ctx = talloc_get_type(msg_ctx->local->private_data,
-					    struct messaging_tdb_context);
+	struct messaging_context *msg_ctx = ctx->msg_ctx;
 	struct messaging_array *msg_array = NULL;
 	struct tdb_wrap *tdb = ctx->tdb;
 	NTSTATUS status;
@@ -0,0 +1,238 @@
+/*
+   Unix SMB/CIFS implementation.
+   Low-level smb2_credits.tdb access functions
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "dbwrap.h"
+#include "smb2_credits.h"
+#include "util_tdb.h"
+
+#define SMB2_CREDITS_GLOBAL_KEY "SMB2_CREDITS_GLOBAL"
+
+/*
+ * smbstatus opens read-only and without TDB_CLEAR_IF_FIRST, so it
+ * neither creates the database nor holds the lock that would keep a
+ * starting smbd from wiping it.
+ */
+static struct db_context *smb2_credits_db_ctx(bool rw)
+{
+	static struct db_context *smb2_credits_db_ctx_ptr;
+
+	if (smb2_credits_db_ctx_ptr != NULL) {
+		return smb2_credits_db_ctx_ptr;
+	}
+
+	if (rw) {
+		smb2_credits_db_ctx_ptr = db_open(
+			NULL, lock_path("smb2_credits.tdb"), 0,
+			TDB_CLEAR_IF_FIRST|TDB_DEFAULT|TDB_INCOMPATIBLE_HASH,
+			O_RDWR | O_CREAT, 0644);
+	} else {
+		smb2_credits_db_ctx_ptr = db_open(
+			NULL, lock_path("smb2_credits.tdb"), 0,
+			TDB_DEFAULT|TDB_INCOMPATIBLE_HASH,
+			O_RDONLY, 0);
+	}
+	return smb2_credits_db_ctx_ptr;
+}
+
+bool smb2_credits_init(bool rw)
+{
+	if (smb2_credits_db_ctx(rw) == NULL) {
+		DEBUG(1,("smb2_credits_init: failed to open "
+			 "smb2_credits tdb\n"));
+		return false;
+	}
+
+	return true;
+}
+
+bool smb2_credits_store(const struct smb2_credit_stats *stats)
+{
+	struct db_context *db;
+	NTSTATUS status;
+
+	db = smb2_credits_db_ctx(true);
+	if (db == NULL) {
+		return false;
+	}
+
+	status = dbwrap_store_bystring(
+		db, procid_str_static(&stats->pid),
+		make_tdb_data((const uint8_t *)stats, sizeof(*stats)),
+		TDB_REPLACE);
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(5, ("smb2_credits_store: failed to store record for "
+			  "%s: %s\n", procid_str_static(&stats->pid),
+			  nt_errstr(status)));
+		return false;
+	}
+	return true;
+}
+
+bool smb2_credits_delete(struct server_id pid)
+{
+	struct db_context *db;
+	NTSTATUS status;
+
+	db = smb2_credits_db_ctx(true);
+	if (db == NULL) {
+		return false;
+	}
+
+	status = dbwrap_delete_bystring(db, procid_str_static(&pid));
+	if (!NT_STATUS_IS_OK(status) &&
+	    !NT_STATUS_EQUAL(status, NT_STATUS_NOT_FOUND)) {
+		DEBUG(5, ("smb2_credits_delete: failed to delete record "
+			  "for %s: %s\n", procid_str_static(&pid),
+			  nt_errstr(status)));
+		return false;
+	}
+	return true;
+}
+
+static int smb2_credits_fetch_global_parser(TDB_DATA key, TDB_DATA data,
+					    void *private_data)
+{
+	struct smb2_credits_global *global =
+		(struct smb2_credits_global *)private_data;
+
+	if (data.dsize != sizeof(struct smb2_credits_global)) {
+		DEBUG(1, ("Found invalid global record in "
+			  "smb2_credits.tdb\n"));
+		return -1;
+	}
+	memcpy(global, data.dptr, sizeof(*global));
+	return 0;
+}
+
+bool smb2_credits_fetch_global(struct smb2_credits_global *global)
+{
+	struct db_context *db;
+	int ret;
+
+	ZERO_STRUCTP(global);
+
+	db = smb2_credits_db_ctx(false);
+	if (db == NULL) {
+		return false;
+	}
+
+	ret = db->parse_record(db, string_term_tdb_data(
+				       SMB2_CREDITS_GLOBAL_KEY),
+			       smb2_credits_fetch_global_parser, global);
+	return (ret == 0);
+}
+
+struct smb2_credits_traverse_read_state {
+	int (*fn)(const struct smb2_credit_stats *stats,
+		  void *private_data);
+	void *private_data;
+};
+
+static int smb2_credits_traverse_read_fn(struct db_record *rec,
+					 void *private_data)
+{
+	struct smb2_credits_traverse_read_state *state =
+		(struct smb2_credits_traverse_read_state *)private_data;
+	struct smb2_credit_stats stats;
+
+	if ((rec->key.dsize == 0)
+	    || (rec->key.dptr[rec->key.dsize-1] != '\0')) {
+		DEBUG(1, ("Found invalid record in smb2_credits.tdb\n"));
+		return 0;
+	}
+
+	if (strcmp((const char *)rec->key.dptr,
+		   SMB2_CREDITS_GLOBAL_KEY) == 0) {
+		return 0;
+	}
+
+	if (rec->value.dsize != sizeof(struct smb2_credit_stats)) {
+		DEBUG(1, ("Found invalid record in smb2_credits.tdb\n"));
+		return 0;
+	}
+
+	memcpy(&stats, rec->value.dptr, sizeof(stats));
+
+	return state->fn(&stats, state->private_data);
+}
+
+int smb2_credits_traverse_read(int (*fn)(const struct smb2_credit_stats *stats,
+					 void *private_data),
+			       void *private_data)
+{
+	struct db_context *db;
+	struct smb2_credits_traverse_read_state state;
+
+	db = smb2_credits_db_ctx(false);
+	if (db == NULL) {
+		return -1;
+	}
+	state.fn = fn;
+	state.private_data = private_data;
+	return db->traverse_read(db, smb2_credits_traverse_read_fn, &state);
+}
+
+static int smb2_credits_sum_fn(const struct smb2_credit_stats *stats,
+			       void *private_data)
+{
+	struct smb2_credits_global *global =
+		(struct smb2_credits_global *)private_data;
+
+	global->num_connections += 1;
+	global->in_flight += stats->in_flight;
+	global->async_pending += stats->async_pending;
+	return 0;
+}
+
+/*
+ * Called by the parent smbd: sum up the per-connection records into
+ * the global record, so that the children only need a single fetch
+ * to learn about the load of the whole server.
+ */
+bool smb2_credits_update_global(void)
+{
+	struct smb2_credits_global global;
+	struct db_context *db;
+	NTSTATUS status;
+	int ret;
+
+	db = smb2_credits_db_ctx(true);
+	if (db == NULL) {
+		return false;
+	}
+
+	ZERO_STRUCT(global);
+
+	ret = smb2_credits_traverse_read(smb2_credits_sum_fn, &global);
+	if (ret == -1) {
+		return false;
+	}
+
+	status = dbwrap_store_bystring(
+		db, SMB2_CREDITS_GLOBAL_KEY,
+		make_tdb_data((const uint8_t *)&global, sizeof(global)),
+		TDB_REPLACE);
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(5, ("smb2_credits_update_global: store failed: %s\n",
+			  nt_errstr(status)));
+		return false;
+	}
+	return true;
+}
@@ -31,21 +31,78 @@
 #include "dbwrap.h"
 #include "serverid.h"
 #include "messages.h"
+#include "util_tdb.h"
 
 #undef DBGC_CLASS
 #define DBGC_CLASS DBGC_LOCKING
 
 #define ZERO_ZERO 0
 
+/*
+ * A brlock.tdb record starts with a struct brl_header, the locks are
+ * kept sorted by start offset. Files with few locks store them inline
+ * behind the header. Once a file has more than BRL_PAGE_LOCKS locks,
+ * they are split into pages stored in brlock_pages.tdb and the record
+ * holds a struct brl_page_desc per page instead. The page descriptors
+ * carry the lowest start and the highest end offset of their locks, so
+ * lock checks only look at the pages that can overlap the range in
+ * question, and a change only rewrites the pages it touched.
+ *
+ * In memory the locks stay in their pages. brl_get_locks() only reads
+ * the descriptors, a page is fetched from brlock_pages.tdb the first
+ * time a lookup needs it. Adding or removing a lock only moves the
+ * locks within its page, a page is split once it reaches twice
+ * BRL_PAGE_LOCKS.
+ *
+ * Pages are never overwritten. A changed page is stored under a new id
+ * before the header is updated, the old page is deleted afterwards.
+ * Readers not holding the record lock either see a consistent set of
+ * pages or find one missing and retry with the lock held, they fetch
+ * all pages up front. Page records are only accessed with the
+ * brlock.tdb record locked or without any lock held, so the two
+ * databases can't deadlock.
+ *
+ * The page bounds are only recalculated when a page is stored, in
+ * between they may be wider than the locks in the page. min_start
+ * never exceeds the start of a lock in its page and is never below the
+ * start of a lock in an earlier page, so the pages stay sorted by it.
+ */
+
+#define BRL_PAGE_LOCKS 128
+
+struct brl_header {
+	uint32_t num_locks;
+	uint32_t num_pages;
+	uint32_t next_page_id;
+	uint32_t reserved;
+};
+
+struct brl_page_desc {
+	uint32_t page_id;	/* 0 if the page needs to be stored */
+	uint32_t num_locks;
+	br_off min_start;
+	br_off max_end;
+};
+
+struct brl_page {
+	struct brl_page_desc desc;
+	struct lock_struct *locks;	/* NULL until fetched */
+};
+
+struct brl_page_key {
+	uint8_t buf[sizeof(struct file_id) + sizeof(uint32_t)];
+};
+
 /* The open brlock.tdb database. */
 
 static struct db_context *brlock_db;
+static struct db_context *brlock_pages_db;
 
 /****************************************************************************
  Debug info at level 10 for lock struct.
 ****************************************************************************/
 
-static void print_lock_struct(unsigned int i, struct lock_struct *pls)
+static void print_lock_struct(unsigned int i, const struct lock_struct *pls)
 {
 	DEBUG(10,("[%u]: smblctx = %llu, tid = %u, pid = %s, ",
 			i,
@@ -287,23 +344,1005 @@ void brl_init(bool read_only)
 		tdb_flags |= TDB_SEQNUM;
 	}
 
-	brlock_db = db_open(NULL, lock_path("brlock.tdb"),
-			    lp_open_files_db_hash_size(), tdb_flags,
-			    read_only?O_RDONLY:(O_RDWR|O_CREAT), 0644 );
-	if (!brlock_db) {
-		DEBUG(0,("Failed to open byte range locking database %s\n",
-			lock_path("brlock.tdb")));
-		return;
+	brlock_db = db_open(NULL, lock_path("brlock.tdb"),
+			    lp_open_files_db_hash_size(), tdb_flags,
+			    read_only?O_RDONLY:(O_RDWR|O_CREAT), 0644 );
+	if (!brlock_db) {
+		DEBUG(0,("Failed to open byte range locking database %s\n",
+			lock_path("brlock.tdb")));
+		return;
+	}
+
+	if (lp_clustering()) {
+		/* Keep each file's locks in a single record. */
+		return;
+	}
+
+	brlock_pages_db = db_open(NULL, lock_path("brlock_pages.tdb"),
+				  lp_open_files_db_hash_size(),
+				  TDB_DEFAULT|TDB_VOLATILE|TDB_CLEAR_IF_FIRST|
+				  TDB_INCOMPATIBLE_HASH,
+				  read_only?O_RDONLY:(O_RDWR|O_CREAT), 0644);
+	if (!brlock_pages_db) {
+		DEBUG(3,("Failed to open byte range lock pages database %s\n",
+			 lock_path("brlock_pages.tdb")));
+	}
+}
+
+/****************************************************************************
+ Close down the brlock.tdb database.
+****************************************************************************/
+
+void brl_shutdown(void)
+{
+	TALLOC_FREE(brlock_pages_db);
+	TALLOC_FREE(brlock_db);
+}
+/****************************************************************************
+ The end of a lock range, not wrapping around at the end of 64 bit space.
+****************************************************************************/
+
+static br_off brl_end(const struct lock_struct *lck)
+{
+	br_off end = lck->start + lck->size;
+
+	if (end < lck->start) {
+		return (br_off)-1;
+	}
+	return end;
+}
+
+/****************************************************************************
+ Index of the first lock starting at or after start.
+****************************************************************************/
+
+static unsigned int brl_find_start(const struct lock_struct *locks,
+				   unsigned int num_locks, br_off start)
+{
+	unsigned int lo = 0, hi = num_locks;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (locks[mid].start < start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/****************************************************************************
+ Index of the first lock starting after start. New locks go there, so
+ locks with the same start stay in the order they were added.
+****************************************************************************/
+
+static unsigned int brl_insert_pos(const struct lock_struct *locks,
+				   unsigned int num_locks, br_off start)
+{
+	unsigned int lo = 0, hi = num_locks;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (locks[mid].start <= start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/****************************************************************************
+ The first page that may hold a lock starting at start. Earlier pages
+ only hold locks starting before it.
+****************************************************************************/
+
+static unsigned int brl_find_start_page(const struct byte_range_lock *br_lck,
+					br_off start)
+{
+	unsigned int lo = 0, hi = br_lck->num_pages;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (br_lck->pages[mid].desc.min_start < start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo > 0) ? lo - 1 : 0;
+}
+
+/****************************************************************************
+ The page a new lock starting at start goes into, the last one whose
+ locks may start at or before it.
+****************************************************************************/
+
+static unsigned int brl_insert_page(const struct byte_range_lock *br_lck,
+				    br_off start)
+{
+	unsigned int lo = 0, hi = br_lck->num_pages;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (br_lck->pages[mid].desc.min_start <= start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo > 0) ? lo - 1 : 0;
+}
+
+/****************************************************************************
+ Sort a lock array by start offset, keeping the order of locks with the
+ same start. The arrays we get here are almost sorted.
+****************************************************************************/
+
+static void brl_sort_locks(struct lock_struct *locks, unsigned int num_locks)
+{
+	unsigned int i, j;
+
+	for (i = 1; i < num_locks; i++) {
+		struct lock_struct tmp;
+
+		if (locks[i-1].start <= locks[i].start) {
+			continue;
+		}
+		tmp = locks[i];
+		for (j = i; (j > 0) && (locks[j-1].start > tmp.start); j--) {
+			locks[j] = locks[j-1];
+		}
+		locks[j] = tmp;
+	}
+}
+
+static TDB_DATA brl_page_key(struct brl_page_key *buf,
+			     const struct file_id *id, uint32_t page_id)
+{
+	memcpy(buf->buf, id, sizeof(*id));
+	SIVAL(buf->buf, sizeof(*id), page_id);
+	return make_tdb_data(buf->buf, sizeof(buf->buf));
+}
+
+/****************************************************************************
+ Remember that a page has to be stored under a new id.
+****************************************************************************/
+
+static void brl_page_dirty(struct byte_range_lock *br_lck,
+			   struct brl_page *page)
+{
+	uint32_t *stale;
+
+	if (page->desc.page_id == 0) {
+		return;
+	}
+
+	stale = talloc_realloc(br_lck, br_lck->stale_pages, uint32_t,
+			       br_lck->num_stale_pages + 1);
+	if (stale == NULL) {
+		/* The old page leaks until brlock_pages.tdb is cleared. */
+		DEBUG(1, ("brl_page_dirty: talloc failed\n"));
+	} else {
+		stale[br_lck->num_stale_pages++] = page->desc.page_id;
+		br_lck->stale_pages = stale;
+	}
+	page->desc.page_id = 0;
+}
+
+/****************************************************************************
+ The locks of a page, fetched from brlock_pages.tdb on first use. The
+ lock arrays of the pages are talloc children of br_lck->pages.
+****************************************************************************/
+
+static struct lock_struct *brl_page_locks(struct byte_range_lock *br_lck,
+					  struct brl_page *page)
+{
+	struct brl_page_key keybuf;
+	TDB_DATA data;
+
+	if (page->locks != NULL) {
+		return page->locks;
+	}
+	if (brlock_pages_db == NULL) {
+		return NULL;
+	}
+
+	if (brlock_pages_db->fetch(
+		    brlock_pages_db, br_lck->pages,
+		    brl_page_key(&keybuf, &br_lck->key, page->desc.page_id),
+		    &data) != 0) {
+		return NULL;
+	}
+	if (data.dsize != page->desc.num_locks * sizeof(struct lock_struct)) {
+		/* Page gone, replaced by a concurrent writer. */
+		TALLOC_FREE(data.dptr);
+		return NULL;
+	}
+
+	page->locks = (struct lock_struct *)data.dptr;
+	return page->locks;
+}
+
+/****************************************************************************
+ Fetch all pages not in memory yet.
+****************************************************************************/
+
+static bool brl_load_pages(struct byte_range_lock *br_lck)
+{
+	unsigned int p;
+
+	for (p = 0; p < br_lck->num_pages; p++) {
+		if (brl_page_locks(br_lck, &br_lck->pages[p]) == NULL) {
+			DEBUG(5, ("brl_load_pages: could not read page %u "
+				  "of %s\n", p,
+				  file_id_string_tos(&br_lck->key)));
+			return false;
+		}
+	}
+	return true;
+}
+
+static void brl_page_bounds(struct brl_page *page)
+{
+	unsigned int i;
+
+	page->desc.min_start = page->locks[0].start;
+	page->desc.max_end = 0;
+	for (i = 0; i < page->desc.num_locks; i++) {
+		page->desc.max_end = MAX(page->desc.max_end,
+					 brl_end(&page->locks[i]));
+	}
+}
+
+/****************************************************************************
+ Remove page p, its locks are gone.
+****************************************************************************/
+
+static void brl_drop_page(struct byte_range_lock *br_lck, unsigned int p)
+{
+	brl_page_dirty(br_lck, &br_lck->pages[p]);
+	TALLOC_FREE(br_lck->pages[p].locks);
+	if (p < br_lck->num_pages - 1) {
+		memmove(&br_lck->pages[p], &br_lck->pages[p+1],
+			(br_lck->num_pages - p - 1) *
+			sizeof(struct brl_page));
+	}
+	br_lck->num_pages -= 1;
+}
+
+/****************************************************************************
+ Only the first num locks of page p are left. Returns false if that
+ removed the page.
+****************************************************************************/
+
+static bool brl_page_shrink(struct byte_range_lock *br_lck, unsigned int p,
+			    unsigned int num)
+{
+	struct brl_page *page = &br_lck->pages[p];
+
+	if (num == page->desc.num_locks) {
+		return true;
+	}
+
+	brl_page_dirty(br_lck, page);
+	br_lck->num_locks -= page->desc.num_locks - num;
+	br_lck->modified = true;
+	page->desc.num_locks = num;
+
+	if (num == 0) {
+		brl_drop_page(br_lck, p);
+		return false;
+	}
+	return true;
+}
+
+/****************************************************************************
+ Drop all pages, the locks are gone or have been rebuilt.
+****************************************************************************/
+
+static void brl_forget_pages(struct byte_range_lock *br_lck)
+{
+	unsigned int p;
+
+	for (p = 0; p < br_lck->num_pages; p++) {
+		brl_page_dirty(br_lck, &br_lck->pages[p]);
+	}
+	br_lck->num_pages = 0;
+	TALLOC_FREE(br_lck->pages);
+}
+
+/****************************************************************************
+ Replace the locks of br_lck by a sorted lock array, split into pages of
+ BRL_PAGE_LOCKS.
+****************************************************************************/
+
+static bool brl_set_locks(struct byte_range_lock *br_lck,
+			  const struct lock_struct *locks,
+			  unsigned int num_locks)
+{
+	struct brl_page *pages = NULL;
+	unsigned int p, num_pages;
+
+	num_pages = (num_locks + BRL_PAGE_LOCKS - 1) / BRL_PAGE_LOCKS;
+
+	if (num_pages != 0) {
+		pages = talloc_zero_array(br_lck, struct brl_page, num_pages);
+		if (pages == NULL) {
+			return false;
+		}
+	}
+
+	for (p = 0; p < num_pages; p++) {
+		struct brl_page *page = &pages[p];
+		unsigned int first = p * BRL_PAGE_LOCKS;
+
+		page->desc.num_locks = MIN(BRL_PAGE_LOCKS, num_locks - first);
+		page->locks = talloc_array(pages, struct lock_struct,
+					   page->desc.num_locks);
+		if (page->locks == NULL) {
+			TALLOC_FREE(pages);
+			return false;
+		}
+		memcpy(page->locks, &locks[first],
+		       page->desc.num_locks * sizeof(struct lock_struct));
+		brl_page_bounds(page);
+	}
+
+	brl_forget_pages(br_lck);
+	br_lck->pages = pages;
+	br_lck->num_pages = num_pages;
+	br_lck->num_locks = num_locks;
+	return true;
+}
+
+/****************************************************************************
+ Copy all locks into one malloc'ed array, for the code paths that need
+ to look at every lock. *plocks is NULL if there are none.
+****************************************************************************/
+
+static bool brl_all_locks(struct byte_range_lock *br_lck,
+			  struct lock_struct **plocks)
+{
+	struct lock_struct *locks;
+	unsigned int p, num = 0;
+
+	*plocks = NULL;
+
+	if (br_lck->num_locks == 0) {
+		return true;
+	}
+	if (!brl_load_pages(br_lck)) {
+		return false;
+	}
+
+	locks = SMB_MALLOC_ARRAY(struct lock_struct, br_lck->num_locks);
+	if (locks == NULL) {
+		DEBUG(0, ("malloc failed\n"));
+		return false;
+	}
+
+	for (p = 0; p < br_lck->num_pages; p++) {
+		const struct brl_page *page = &br_lck->pages[p];
+
+		memcpy(&locks[num], page->locks,
+		       page->desc.num_locks * sizeof(struct lock_struct));
+		num += page->desc.num_locks;
+	}
+
+	*plocks = locks;
+	return true;
+}
+
+/****************************************************************************
+ Split page p in two halves.
+****************************************************************************/
+
+static void brl_split_page(struct byte_range_lock *br_lck, unsigned int p)
+{
+	struct brl_page *pages;
+	struct lock_struct *upper, *lower;
+	unsigned int num = br_lck->pages[p].desc.num_locks;
+	unsigned int half = num / 2;
+
+	pages = talloc_realloc(br_lck, br_lck->pages, struct brl_page,
+			       br_lck->num_pages + 1);
+	if (pages == NULL) {
+		/* Keep the big page, it still is correct. */
+		return;
+	}
+	br_lck->pages = pages;
+
+	upper = talloc_array(pages, struct lock_struct, num - half);
+	if (upper == NULL) {
+		return;
+	}
+	memcpy(upper, &pages[p].locks[half],
+	       (num - half) * sizeof(struct lock_struct));
+
+	lower = talloc_realloc(pages, pages[p].locks, struct lock_struct,
+			       half);
+	if (lower != NULL) {
+		pages[p].locks = lower;
+	}
+
+	memmove(&pages[p+2], &pages[p+1],
+		(br_lck->num_pages - p - 1) * sizeof(struct brl_page));
+	br_lck->num_pages += 1;
+
+	ZERO_STRUCT(pages[p+1]);
+	pages[p+1].desc.num_locks = num - half;
+	pages[p+1].locks = upper;
+	pages[p].desc.num_locks = half;
+
+	brl_page_bounds(&pages[p]);
+	brl_page_bounds(&pages[p+1]);
+}
+
+/****************************************************************************
+ Add a lock at its place in the sorted locks. Only its page is fetched
+ and changed.
+****************************************************************************/
+
+static bool brl_add_lock(struct byte_range_lock *br_lck,
+			 const struct lock_struct *plock)
+{
+	struct brl_page *page;
+	struct lock_struct *locks;
+	unsigned int p, i, num;
+
+	if (br_lck->num_pages == 0) {
+		br_lck->pages = talloc_zero_array(br_lck, struct brl_page, 1);
+		if (br_lck->pages == NULL) {
+			return false;
+		}
+		br_lck->num_pages = 1;
+	}
+
+	p = brl_insert_page(br_lck, plock->start);
+	page = &br_lck->pages[p];
+	num = page->desc.num_locks;
+
+	if ((num != 0) && (brl_page_locks(br_lck, page) == NULL)) {
+		DEBUG(0, ("brl_add_lock: could not read page %u of %s\n",
+			  p, file_id_string_tos(&br_lck->key)));
+		return false;
+	}
+
+	locks = talloc_realloc(br_lck->pages, page->locks,
+			       struct lock_struct, num + 1);
+	if (locks == NULL) {
+		return false;
+	}
+	page->locks = locks;
+
+	i = brl_insert_pos(locks, num, plock->start);
+	if (i < num) {
+		memmove(&locks[i+1], &locks[i], (num - i) * sizeof(*locks));
+	}
+	memcpy(&locks[i], plock, sizeof(*plock));
+
+	brl_page_dirty(br_lck, page);
+	if (num == 0) {
+		page->desc.min_start = plock->start;
+		page->desc.max_end = brl_end(plock);
+	} else {
+		page->desc.min_start = MIN(page->desc.min_start,
+					   plock->start);
+		page->desc.max_end = MAX(page->desc.max_end,
+					 brl_end(plock));
+	}
+	page->desc.num_locks = num + 1;
+
+	br_lck->num_locks += 1;
+	br_lck->modified = true;
+
+	if (page->desc.num_locks > 2 * BRL_PAGE_LOCKS) {
+		brl_split_page(br_lck, p);
+	}
+
+	return true;
+}
+
+/****************************************************************************
+ Remove lock i of page p.
+****************************************************************************/
+
+static void brl_delete_lock(struct byte_range_lock *br_lck,
+			    unsigned int p, unsigned int i)
+{
+	struct brl_page *page = &br_lck->pages[p];
+	unsigned int num = page->desc.num_locks;
+
+	if (i < num - 1) {
+		memmove(&page->locks[i], &page->locks[i+1],
+			sizeof(struct lock_struct) * ((num - 1) - i));
+	}
+	brl_page_shrink(br_lck, p, num - 1);
+}
+
+/****************************************************************************
+ Find a lock starting at start that match() accepts. Only the pages that
+ can hold locks with this start are fetched.
+****************************************************************************/
+
+static bool brl_find_lock(struct byte_range_lock *br_lck,
+			  const struct lock_struct *plock,
+			  bool (*match)(const struct lock_struct *lock,
+					const struct lock_struct *plock),
+			  unsigned int *ppage, unsigned int *pidx)
+{
+	unsigned int p, i;
+
+	for (p = brl_find_start_page(br_lck, plock->start);
+	     (p < br_lck->num_pages) &&
+		     (br_lck->pages[p].desc.min_start <= plock->start);
+	     p++) {
+		struct brl_page *page = &br_lck->pages[p];
+		const struct lock_struct *locks;
+
+		locks = brl_page_locks(br_lck, page);
+		if (locks == NULL) {
+			DEBUG(0, ("brl_find_lock: could not read page %u "
+				  "of %s\n", p,
+				  file_id_string_tos(&br_lck->key)));
+			return false;
+		}
+
+		for (i = brl_find_start(locks, page->desc.num_locks,
+					plock->start);
+		     (i < page->desc.num_locks) &&
+			     (locks[i].start == plock->start);
+		     i++) {
+			if (match(&locks[i], plock)) {
+				*ppage = p;
+				*pidx = i;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/****************************************************************************
+ Walk the pages that may contain locks overlapping plock, fetching them
+ as needed. The page bounds include the end offset to also catch the
+ adjacent locks brl_pending_overlap() cares about. If a page can't be
+ read, the walk stops with scan->failed set.
+****************************************************************************/
+
+struct brl_scan {
+	unsigned int page;
+	bool failed;
+};
+
+static bool brl_scan_next(struct byte_range_lock *br_lck,
+			  const struct lock_struct *plock,
+			  struct brl_scan *scan,
+			  struct lock_struct **plocks,
+			  unsigned int *pnum)
+{
+	br_off end = brl_end(plock);
+
+	while (scan->page < br_lck->num_pages) {
+		struct brl_page *page = &br_lck->pages[scan->page];
+
+		if (page->desc.min_start > end) {
+			/* Sorted by start, no later page overlaps. */
+			scan->page = br_lck->num_pages;
+			return false;
+		}
+
+		scan->page += 1;
+
+		if (page->desc.max_end < plock->start) {
+			continue;
+		}
+
+		*plocks = brl_page_locks(br_lck, page);
+		if (*plocks == NULL) {
+			DEBUG(0, ("brl_scan_next: could not read page %u "
+				  "of %s\n", scan->page - 1,
+				  file_id_string_tos(&br_lck->key)));
+			scan->page = br_lck->num_pages;
+			scan->failed = true;
+			return false;
+		}
+		*pnum = page->desc.num_locks;
+		return true;
+	}
+	return false;
+}
+
+/****************************************************************************
+ Collect the locks brl_scan_next() finds for plock into one talloc'ed
+ array. The POSIX mapping of Windows locks only looks at the locks
+ overlapping the range.
+****************************************************************************/
+
+static bool brl_scan_locks(TALLOC_CTX *mem_ctx,
+			   struct byte_range_lock *br_lck,
+			   const struct lock_struct *plock,
+			   struct lock_struct **plocks,
+			   unsigned int *pnum)
+{
+	struct lock_struct *locks = NULL;
+	struct lock_struct *page_locks;
+	unsigned int num = 0, num_page_locks;
+	struct brl_scan scan;
+
+	ZERO_STRUCT(scan);
+	while (brl_scan_next(br_lck, plock, &scan, &page_locks,
+			     &num_page_locks)) {
+		struct lock_struct *tmp;
+
+		tmp = talloc_realloc(mem_ctx, locks, struct lock_struct,
+				     num + num_page_locks);
+		if (tmp == NULL) {
+			TALLOC_FREE(locks);
+			return false;
+		}
+		locks = tmp;
+		memcpy(&locks[num], page_locks,
+		       num_page_locks * sizeof(struct lock_struct));
+		num += num_page_locks;
+	}
+
+	if (scan.failed) {
+		TALLOC_FREE(locks);
+		return false;
+	}
+
+	*plocks = locks;
+	*pnum = num;
+	return true;
+}
+
+/****************************************************************************
+ Can the pending lock pend be granted now? Locks in woken are treated as
+ granted, their owners have been told to go ahead.
+****************************************************************************/
+
+static bool brl_pending_can_proceed(struct byte_range_lock *br_lck,
+				    const struct lock_struct *pend,
+				    const struct lock_struct *woken,
+				    unsigned int num_woken)
+{
+	struct lock_struct want = *pend;
+	struct lock_struct *locks;
+	struct brl_scan scan;
+	unsigned int i, num;
+
+	want.lock_type = (pend->lock_type == PENDING_READ_LOCK) ?
+		READ_LOCK : WRITE_LOCK;
+
+	ZERO_STRUCT(scan);
+	while (brl_scan_next(br_lck, &want, &scan, &locks, &num)) {
+		for (i = 0; i < num; i++) {
+			const struct lock_struct *lock = &locks[i];
+			bool conflict;
+
+			if ((lock->lock_flav == POSIX_LOCK) &&
+			    (want.lock_flav == POSIX_LOCK)) {
+				conflict = brl_conflict_posix(lock, &want);
+			} else {
+				conflict = brl_conflict(lock, &want);
+			}
+			if (conflict) {
+				return false;
+			}
+		}
+	}
+	if (scan.failed) {
+		return false;
+	}
+
+	for (i = 0; i < num_woken; i++) {
+		if (brl_conflict(&woken[i], &want)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/****************************************************************************
+ Wake the waiters for locks overlapping plock that can get their lock now.
+ Of several waiters for the same range only the first in line is woken,
+ the others would just block again. If it gives up instead of taking the
+ lock, brl_lock_cancel() wakes the next one. Every process gets one
+ message, carrying the file id so only its requests on this file retry.
+****************************************************************************/
+
+static void brl_wake_waiters(struct messaging_context *msg_ctx,
+			     struct byte_range_lock *br_lck,
+			     const struct lock_struct *plock)
+{
+	struct lock_struct *locks;
+	struct lock_struct *woken = NULL;
+	unsigned int num_woken = 0;
+	struct brl_scan scan;
+	unsigned int i, j, num;
+	char msg[24];
+	DATA_BLOB blob;
+
+	push_file_id_24(msg, &br_lck->fsp->file_id);
+	blob = data_blob_const(msg, sizeof(msg));
+
+	ZERO_STRUCT(scan);
+	while (brl_scan_next(br_lck, plock, &scan, &locks, &num)) {
+		for (i = 0; i < num; i++) {
+			struct lock_struct *pend_lock = &locks[i];
+			struct lock_struct *tmp;
+
+			if (!IS_PENDING_LOCK(pend_lock->lock_type) ||
+			    !brl_pending_overlap(plock, pend_lock)) {
+				continue;
+			}
+
+			if (!brl_pending_can_proceed(br_lck, pend_lock,
+						     woken, num_woken)) {
+				continue;
+			}
+
+			tmp = talloc_realloc(talloc_tos(), woken,
+					     struct lock_struct,
+					     num_woken + 1);
+			if (tmp == NULL) {
+				/* Better wake too many than none. */
+				messaging_send(msg_ctx, pend_lock->context.pid,
+					       MSG_SMB_UNLOCK, &blob);
+				continue;
+			}
+			woken = tmp;
+			woken[num_woken] = *pend_lock;
+			woken[num_woken].lock_type =
+				(pend_lock->lock_type == PENDING_READ_LOCK) ?
+				READ_LOCK : WRITE_LOCK;
+			num_woken += 1;
+
+			for (j = 0; j < num_woken - 1; j++) {
+				if (procid_equal(&woken[j].context.pid,
+						 &pend_lock->context.pid)) {
+					break;
+				}
+			}
+			if (j < num_woken - 1) {
+				/* Already told this process */
+				continue;
+			}
+
+			DEBUG(10,("brl_wake_waiters: sending unlock message "
+				  "to pid %s\n",
+				  procid_str_static(&pend_lock->context.pid)));
+
+			messaging_send(msg_ctx, pend_lock->context.pid,
+				       MSG_SMB_UNLOCK, &blob);
+		}
+	}
+
+	TALLOC_FREE(woken);
+}
+
+
+/****************************************************************************
+ Set up br_lck from a brlock.tdb record. Inline locks are split into
+ pages right away, of a paged record only the page descriptors are
+ read.
+****************************************************************************/
+
+static bool brl_parse_locks(struct byte_range_lock *br_lck, TDB_DATA data)
+{
+	struct brl_header hdr;
+	unsigned int p, num;
+
+	br_lck->num_locks = 0;
+	br_lck->num_pages = 0;
+	br_lck->next_page_id = 0;
+	br_lck->paged = false;
+	TALLOC_FREE(br_lck->pages);
+
+	if (data.dsize == 0) {
+		return true;
+	}
+	if (data.dsize < sizeof(hdr)) {
+		DEBUG(0, ("brl_parse_locks: invalid record size %u\n",
+			  (unsigned int)data.dsize));
+		return false;
+	}
+	memcpy(&hdr, data.dptr, sizeof(hdr));
+
+	if (hdr.num_pages == 0) {
+		if (data.dsize != sizeof(hdr) +
+		    (size_t)hdr.num_locks * sizeof(struct lock_struct)) {
+			DEBUG(0, ("brl_parse_locks: invalid record size %u "
+				  "for %u locks\n", (unsigned int)data.dsize,
+				  (unsigned int)hdr.num_locks));
+			return false;
+		}
+	} else if (data.dsize != sizeof(hdr) +
+		   (size_t)hdr.num_pages * sizeof(struct brl_page_desc)) {
+		DEBUG(0, ("brl_parse_locks: invalid record size %u "
+			  "for %u pages\n", (unsigned int)data.dsize,
+			  (unsigned int)hdr.num_pages));
+		return false;
+	}
+
+	br_lck->next_page_id = hdr.next_page_id;
+
+	if (hdr.num_pages == 0) {
+		if (!brl_set_locks(br_lck,
+				   (const struct lock_struct *)
+				   (data.dptr + sizeof(hdr)),
+				   hdr.num_locks)) {
+			DEBUG(0, ("talloc failed\n"));
+			return false;
+		}
+		return true;
+	}
+
+	if (brlock_pages_db == NULL) {
+		DEBUG(0, ("brl_parse_locks: paged record of %s without "
+			  "brlock_pages.tdb\n",
+			  file_id_string_tos(&br_lck->key)));
+		return false;
+	}
+
+	br_lck->pages = talloc_zero_array(br_lck, struct brl_page,
+					  hdr.num_pages);
+	if (br_lck->pages == NULL) {
+		DEBUG(0, ("talloc failed\n"));
+		return false;
+	}
+
+	for (p = 0, num = 0; p < hdr.num_pages; p++) {
+		struct brl_page_desc *desc = &br_lck->pages[p].desc;
+
+		memcpy(desc, data.dptr + sizeof(hdr) + p * sizeof(*desc),
+		       sizeof(*desc));
+		if (desc->num_locks == 0) {
+			break;
+		}
+		num += desc->num_locks;
+	}
+
+	if ((p != hdr.num_pages) || (num != hdr.num_locks)) {
+		DEBUG(0, ("brl_parse_locks: invalid pages in record of %s\n",
+			  file_id_string_tos(&br_lck->key)));
+		TALLOC_FREE(br_lck->pages);
+		return false;
+	}
+
+	br_lck->num_pages = hdr.num_pages;
+	br_lck->num_locks = hdr.num_locks;
+	br_lck->paged = true;
+	return true;
+}
+
+static void brl_delete_stale_pages(struct byte_range_lock *br_lck)
+{
+	unsigned int i;
+
+	for (i = 0; (brlock_pages_db != NULL) &&
+		    (i < br_lck->num_stale_pages); i++) {
+		struct brl_page_key keybuf;
+
+		dbwrap_delete(brlock_pages_db,
+			      brl_page_key(&keybuf, &br_lck->key,
+					   br_lck->stale_pages[i]));
+	}
+	br_lck->num_stale_pages = 0;
+	TALLOC_FREE(br_lck->stale_pages);
+}
+
+/****************************************************************************
+ Store the locks of br_lck, inline or as pages.
+****************************************************************************/
+
+static NTSTATUS brl_store_locks(struct byte_range_lock *br_lck)
+{
+	struct brl_header hdr;
+	DATA_BLOB blob;
+	size_t ofs;
+	unsigned int p;
+	bool paged;
+	NTSTATUS status;
+
+	paged = ((brlock_pages_db != NULL) &&
+		 ((br_lck->num_locks > BRL_PAGE_LOCKS) ||
+		  (br_lck->paged &&
+		   (br_lck->num_locks > BRL_PAGE_LOCKS / 2))));
+
+	if (!paged) {
+		/* The few locks left go back into the record. */
+		if (!brl_load_pages(br_lck)) {
+			return NT_STATUS_INTERNAL_DB_CORRUPTION;
+		}
+		for (p = 0; p < br_lck->num_pages; p++) {
+			brl_page_dirty(br_lck, &br_lck->pages[p]);
+		}
+	}
+
+	/* Store the changed pages first, the header refers to them. */
+
+	for (p = 0; paged && (p < br_lck->num_pages); p++) {
+		struct brl_page *page = &br_lck->pages[p];
+		struct brl_page_key keybuf;
+
+		if (page->desc.page_id != 0) {
+			continue;
+		}
+
+		br_lck->next_page_id += 1;
+		if (br_lck->next_page_id == 0) {
+			br_lck->next_page_id = 1;
+		}
+		page->desc.page_id = br_lck->next_page_id;
+		brl_page_bounds(page);
+
+		status = dbwrap_store(
+			brlock_pages_db,
+			brl_page_key(&keybuf, &br_lck->key,
+				     page->desc.page_id),
+			make_tdb_data((uint8_t *)page->locks,
+				      page->desc.num_locks *
+				      sizeof(struct lock_struct)),
+			TDB_REPLACE);
+		if (!NT_STATUS_IS_OK(status)) {
+			return status;
+		}
+	}
+
+	ZERO_STRUCT(hdr);
+	hdr.num_locks = br_lck->num_locks;
+	hdr.num_pages = paged ? br_lck->num_pages : 0;
+	hdr.next_page_id = br_lck->next_page_id;
+
+	blob = data_blob_talloc(
+		talloc_tos(), NULL,
+		sizeof(hdr) + (paged ?
+			       br_lck->num_pages * sizeof(struct brl_page_desc) :
+			       br_lck->num_locks * sizeof(struct lock_struct)));
+	if (blob.data == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+	memcpy(blob.data, &hdr, sizeof(hdr));
+	ofs = sizeof(hdr);
+
+	for (p = 0; p < br_lck->num_pages; p++) {
+		const struct brl_page *page = &br_lck->pages[p];
+
+		if (paged) {
+			memcpy(blob.data + ofs, &page->desc,
+			       sizeof(page->desc));
+			ofs += sizeof(page->desc);
+		} else {
+			memcpy(blob.data + ofs, page->locks,
+			       page->desc.num_locks *
+			       sizeof(struct lock_struct));
+			ofs += page->desc.num_locks *
+				sizeof(struct lock_struct);
+		}
+	}
+
+	status = br_lck->record->store(br_lck->record,
+				       make_tdb_data(blob.data, blob.length),
+				       TDB_REPLACE);
+	data_blob_free(&blob);
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
 	}
-}
+	br_lck->paged = paged;
 
-/****************************************************************************
- Close down the brlock.tdb database.
-****************************************************************************/
+	/* Nobody can find the old pages anymore, remove them. */
+	brl_delete_stale_pages(br_lck);
 
-void brl_shutdown(void)
-{
-	TALLOC_FREE(brlock_db);
+	return NT_STATUS_OK;
 }
 
 #if ZERO_ZERO
@@ -331,9 +1370,10 @@ static int lock_compare(const struct lock_struct *lck1,
 NTSTATUS brl_lock_windows_default(struct byte_range_lock *br_lck,
     struct lock_struct *plock, bool blocking_lock)
 {
-	unsigned int i;
+	unsigned int i, num;
 	files_struct *fsp = br_lck->fsp;
-	struct lock_struct *locks = br_lck->lock_data;
+	struct lock_struct *locks;
+	struct brl_scan scan;
 	NTSTATUS status;
 
 	SMB_ASSERT(plock->lock_type != UNLOCK_LOCK);
@@ -343,19 +1383,21 @@ NTSTATUS brl_lock_windows_default(struct byte_range_lock *br_lck,
 		return NT_STATUS_INVALID_LOCK_RANGE;
 	}
 
-	for (i=0; i < br_lck->num_locks; i++) {
-		/* Do any Windows or POSIX locks conflict ? */
-		if (brl_conflict(&locks[i], plock)) {
-			/* Remember who blocked us. */
-			plock->context.smblctx = locks[i].context.smblctx;
-			return brl_lock_failed(fsp,plock,blocking_lock);
-		}
-#if ZERO_ZERO
-		if (plock->start == 0 && plock->size == 0 && 
-				locks[i].size == 0) {
-			break;
+	ZERO_STRUCT(scan);
+	while (brl_scan_next(br_lck, plock, &scan, &locks, &num)) {
+		for (i = 0; i < num; i++) {
+			/* Do any Windows or POSIX locks conflict ? */
+			if (brl_conflict(&locks[i], plock)) {
+				/* Remember who blocked us. */
+				plock->context.smblctx =
+					locks[i].context.smblctx;
+				return brl_lock_failed(fsp,plock,
+						       blocking_lock);
+			}
 		}
-#endif
+	}
+	if (scan.failed) {
+		return NT_STATUS_INTERNAL_DB_CORRUPTION;
 	}
 
 	if (!IS_PENDING_LOCK(plock->lock_type)) {
@@ -368,14 +1410,24 @@ NTSTATUS brl_lock_windows_default(struct byte_range_lock *br_lck,
 
 	if (!IS_PENDING_LOCK(plock->lock_type) && lp_posix_locking(fsp->conn->params)) {
 		int errno_ret;
-		if (!set_posix_lock_windows_flavour(fsp,
+		bool ok;
+
+		/* Only the locks overlapping the range matter. */
+		if (!brl_scan_locks(talloc_tos(), br_lck, plock, &locks,
+				    &num)) {
+			status = NT_STATUS_NO_MEMORY;
+			goto fail;
+		}
+		ok = set_posix_lock_windows_flavour(fsp,
 				plock->start,
 				plock->size,
 				plock->lock_type,
 				&plock->context,
 				locks,
-				br_lck->num_locks,
-				&errno_ret)) {
+				num,
+				&errno_ret);
+		TALLOC_FREE(locks);
+		if (!ok) {
 
 			/* We don't know who blocked us. */
 			plock->context.smblctx = 0xFFFFFFFFFFFFFFFFLL;
@@ -391,17 +1443,11 @@ NTSTATUS brl_lock_windows_default(struct byte_range_lock *br_lck,
 	}
 
 	/* no conflicts - add it to the list of locks */
-	locks = (struct lock_struct *)SMB_REALLOC(locks, (br_lck->num_locks + 1) * sizeof(*locks));
-	if (!locks) {
+	if (!brl_add_lock(br_lck, plock)) {
 		status = NT_STATUS_NO_MEMORY;
 		goto fail;
 	}
 
-	memcpy(&locks[br_lck->num_locks], plock, sizeof(struct lock_struct));
-	br_lck->num_locks += 1;
-	br_lck->lock_data = locks;
-	br_lck->modified = True;
-
 	return NT_STATUS_OK;
  fail:
 	if (!IS_PENDING_LOCK(plock->lock_type)) {
@@ -709,7 +1755,7 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 			       struct lock_struct *plock)
 {
 	unsigned int i, count, posix_count;
-	struct lock_struct *locks = br_lck->lock_data;
+	struct lock_struct *locks;
 	struct lock_struct *tp;
 	bool signal_pending_read = False;
 	bool break_oplocks = false;
@@ -725,12 +1771,18 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 		return NT_STATUS_INVALID_PARAMETER;
 	}
 
+	/* POSIX splits and merges rebuild the whole lock array. */
+	if (!brl_all_locks(br_lck, &locks)) {
+		return NT_STATUS_NO_MEMORY;
+	}
+
 	/* The worst case scenario here is we have to split an
 	   existing POSIX lock range into two, and add our lock,
 	   so we need at most 2 more entries. */
 
 	tp = SMB_MALLOC_ARRAY(struct lock_struct, (br_lck->num_locks + 2));
 	if (!tp) {
+		SAFE_FREE(locks);
 		return NT_STATUS_NO_MEMORY;
 	}
 
@@ -750,9 +1802,10 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 			/* Do any Windows flavour locks conflict ? */
 			if (brl_conflict(curr_lock, plock)) {
 				/* No games with error messages. */
-				SAFE_FREE(tp);
 				/* Remember who blocked us. */
 				plock->context.smblctx = curr_lock->context.smblctx;
+				SAFE_FREE(tp);
+				SAFE_FREE(locks);
 				return NT_STATUS_FILE_LOCK_CONFLICT;
 			}
 			/* Just copy the Windows lock into the new array. */
@@ -765,9 +1818,10 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 			if (brl_conflict_posix(curr_lock, plock)) {
 				/* Can't block ourselves with POSIX locks. */
 				/* No games with error messages. */
-				SAFE_FREE(tp);
 				/* Remember who blocked us. */
 				plock->context.smblctx = curr_lock->context.smblctx;
+				SAFE_FREE(tp);
+				SAFE_FREE(locks);
 				return NT_STATUS_FILE_LOCK_CONFLICT;
 			}
 
@@ -778,6 +1832,8 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 		}
 	}
 
+	SAFE_FREE(locks);
+
 	/*
 	 * Break oplocks while we hold a brl. Since lock() and unlock() calls
 	 * are not symetric with POSIX semantics, we cannot guarantee our
@@ -797,8 +1853,8 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 	for (i=0; i < count; i++) {
 		struct lock_struct *curr_lock = &tp[i];
 
-		if (curr_lock->start <= plock->start) {
-			continue;
+		if (curr_lock->start > plock->start) {
+			break;
 		}
 	}
 
@@ -841,44 +1897,23 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 		}
 	}
 
-	/* If we didn't use all the allocated size,
-	 * Realloc so we don't leak entries per lock call. */
-	if (count < br_lck->num_locks + 2) {
-		tp = (struct lock_struct *)SMB_REALLOC(tp, count * sizeof(*locks));
-		if (!tp) {
-			status = NT_STATUS_NO_MEMORY;
-			goto fail;
-		}
-	}
+	/* Split ranges may have moved behind their neighbours. */
+	brl_sort_locks(tp, count);
 
-	br_lck->num_locks = count;
-	SAFE_FREE(br_lck->lock_data);
-	br_lck->lock_data = tp;
-	locks = tp;
+	if (!brl_set_locks(br_lck, tp, count)) {
+		SAFE_FREE(tp);
+		status = NT_STATUS_NO_MEMORY;
+		goto fail;
+	}
+	SAFE_FREE(tp);
 	br_lck->modified = True;
 
 	/* A successful downgrade from write to read lock can trigger a lock
 	   re-evalutation where waiting readers can now proceed. */
 
 	if (signal_pending_read) {
-		/* Send unlock messages to any pending read waiters that overlap. */
-		for (i=0; i < br_lck->num_locks; i++) {
-			struct lock_struct *pend_lock = &locks[i];
-
-			/* Ignore non-pending locks. */
-			if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
-				continue;
-			}
-
-			if (pend_lock->lock_type == PENDING_READ_LOCK &&
-					brl_pending_overlap(plock, pend_lock)) {
-				DEBUG(10,("brl_lock_posix: sending unlock message to pid %s\n",
-					procid_str_static(&pend_lock->context.pid )));
-
-				messaging_send(msg_ctx, pend_lock->context.pid,
-					       MSG_SMB_UNLOCK, &data_blob_null);
-			}
-		}
+		/* Wake pending read waiters that overlap. */
+		brl_wake_waiters(msg_ctx, br_lck, plock);
 	}
 
 	return NT_STATUS_OK;
@@ -959,6 +1994,24 @@ NTSTATUS brl_lock(struct messaging_context *msg_ctx,
 	return ret;
 }
 
+/****************************************************************************
+ Is lock the Windows lock plock unlocks?
+****************************************************************************/
+
+static bool brl_unlock_windows_match(const struct lock_struct *lock,
+				     const struct lock_struct *plock)
+{
+	if (IS_PENDING_LOCK(lock->lock_type)) {
+		return false;
+	}
+
+	/* Only remove our own locks that match in start, size, and flavour. */
+	return (brl_same_context(&lock->context, &plock->context) &&
+		lock->fnum == plock->fnum &&
+		lock->lock_flav == WINDOWS_LOCK &&
+		lock->size == plock->size);
+}
+
 /****************************************************************************
  Unlock a range of bytes - Windows semantics.
 ****************************************************************************/
@@ -967,8 +2020,9 @@ bool brl_unlock_windows_default(struct messaging_context *msg_ctx,
 			       struct byte_range_lock *br_lck,
 			       const struct lock_struct *plock)
 {
-	unsigned int i, j;
-	struct lock_struct *locks = br_lck->lock_data;
+	unsigned int i, p;
+	struct lock_struct *locks;
+	unsigned int num_locks;
 	enum brl_type deleted_lock_type = READ_LOCK; /* shut the compiler up.... */
 
 	SMB_ASSERT(plock->lock_type == UNLOCK_LOCK);
@@ -999,71 +2053,40 @@ bool brl_unlock_windows_default(struct messaging_context *msg_ctx,
 	}
 #endif
 
-	for (i = 0; i < br_lck->num_locks; i++) {
-		struct lock_struct *lock = &locks[i];
-
-		if (IS_PENDING_LOCK(lock->lock_type)) {
-			continue;
-		}
-
-		/* Only remove our own locks that match in start, size, and flavour. */
-		if (brl_same_context(&lock->context, &plock->context) &&
-					lock->fnum == plock->fnum &&
-					lock->lock_flav == WINDOWS_LOCK &&
-					lock->start == plock->start &&
-					lock->size == plock->size ) {
-			deleted_lock_type = lock->lock_type;
-			break;
-		}
-	}
-
-	if (i == br_lck->num_locks) {
+	/* The locks are sorted, only look at the ones with our start. */
+	if (!brl_find_lock(br_lck, plock, brl_unlock_windows_match, &p, &i)) {
 		/* we didn't find it */
 		return False;
 	}
+	deleted_lock_type = br_lck->pages[p].locks[i].lock_type;
 
 #if ZERO_ZERO
   unlock_continue:
 #endif
 
 	/* Actually delete the lock. */
-	if (i < br_lck->num_locks - 1) {
-		memmove(&locks[i], &locks[i+1], 
-			sizeof(*locks)*((br_lck->num_locks-1) - i));
-	}
-
-	br_lck->num_locks -= 1;
-	br_lck->modified = True;
+	brl_delete_lock(br_lck, p, i);
 
 	/* Unlock the underlying POSIX regions. */
 	if(lp_posix_locking(br_lck->fsp->conn->params)) {
+		/* Only the locks overlapping the range matter. */
+		if (!brl_scan_locks(talloc_tos(), br_lck, plock, &locks,
+				    &num_locks)) {
+			smb_panic("brl_unlock_windows_default: could not "
+				  "collect the locks");
+		}
 		release_posix_lock_windows_flavour(br_lck->fsp,
 				plock->start,
 				plock->size,
 				deleted_lock_type,
 				&plock->context,
 				locks,
-				br_lck->num_locks);
+				num_locks);
+		TALLOC_FREE(locks);
 	}
 
-	/* Send unlock messages to any pending waiters that overlap. */
-	for (j=0; j < br_lck->num_locks; j++) {
-		struct lock_struct *pend_lock = &locks[j];
-
-		/* Ignore non-pending locks. */
-		if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
-			continue;
-		}
-
-		/* We could send specific lock info here... */
-		if (brl_pending_overlap(plock, pend_lock)) {
-			DEBUG(10,("brl_unlock: sending unlock message to pid %s\n",
-				procid_str_static(&pend_lock->context.pid )));
-
-			messaging_send(msg_ctx, pend_lock->context.pid,
-				       MSG_SMB_UNLOCK, &data_blob_null);
-		}
-	}
+	/* Wake the pending waiters that can now get their lock. */
+	brl_wake_waiters(msg_ctx, br_lck, plock);
 
 	contend_level2_oplocks_end(br_lck->fsp, LEVEL2_CONTEND_WINDOWS_BRL);
 	return True;
@@ -1077,9 +2100,9 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 			     struct byte_range_lock *br_lck,
 			     struct lock_struct *plock)
 {
-	unsigned int i, j, count;
+	unsigned int i, count;
 	struct lock_struct *tp;
-	struct lock_struct *locks = br_lck->lock_data;
+	struct lock_struct *locks;
 	bool overlap_found = False;
 
 	/* No zero-zero locks for POSIX. */
@@ -1094,6 +2117,11 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 		return False;
 	}
 
+	/* POSIX splits and merges rebuild the whole lock array. */
+	if (!brl_all_locks(br_lck, &locks)) {
+		return False;
+	}
+
 	/* The worst case scenario here is we have to split an
 	   existing POSIX lock range into two, so we need at most
 	   1 more entry. */
@@ -1101,6 +2129,7 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 	tp = SMB_MALLOC_ARRAY(struct lock_struct, (br_lck->num_locks + 1));
 	if (!tp) {
 		DEBUG(10,("brl_unlock_posix: malloc fail\n"));
+		SAFE_FREE(locks);
 		return False;
 	}
 
@@ -1121,6 +2150,7 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 			/* Do any Windows flavour locks conflict ? */
 			if (brl_conflict(lock, plock)) {
 				SAFE_FREE(tp);
+				SAFE_FREE(locks);
 				return false;
 			}
 			/* Just copy the Windows lock into the new array. */
@@ -1163,6 +2193,8 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 
 	}
 
+	SAFE_FREE(locks);
+
 	if (!overlap_found) {
 		/* Just ignore - no change. */
 		SAFE_FREE(tp);
@@ -1180,47 +2212,21 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 						count);
 	}
 
-	/* Realloc so we don't leak entries per unlock call. */
-	if (count) {
-		tp = (struct lock_struct *)SMB_REALLOC(tp, count * sizeof(*locks));
-		if (!tp) {
-			DEBUG(10,("brl_unlock_posix: realloc fail\n"));
-			return False;
-		}
-	} else {
-		/* We deleted the last lock. */
-		SAFE_FREE(tp);
-		tp = NULL;
-	}
-
 	contend_level2_oplocks_end(br_lck->fsp,
 				   LEVEL2_CONTEND_POSIX_BRL);
 
-	br_lck->num_locks = count;
-	SAFE_FREE(br_lck->lock_data);
-	locks = tp;
-	br_lck->lock_data = tp;
-	br_lck->modified = True;
-
-	/* Send unlock messages to any pending waiters that overlap. */
+	brl_sort_locks(tp, count);
 
-	for (j=0; j < br_lck->num_locks; j++) {
-		struct lock_struct *pend_lock = &locks[j];
-
-		/* Ignore non-pending locks. */
-		if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
-			continue;
-		}
-
-		/* We could send specific lock info here... */
-		if (brl_pending_overlap(plock, pend_lock)) {
-			DEBUG(10,("brl_unlock: sending unlock message to pid %s\n",
-				procid_str_static(&pend_lock->context.pid )));
-
-			messaging_send(msg_ctx, pend_lock->context.pid,
-				       MSG_SMB_UNLOCK, &data_blob_null);
-		}
+	if (!brl_set_locks(br_lck, tp, count)) {
+		DEBUG(10,("brl_unlock_posix: talloc fail\n"));
+		SAFE_FREE(tp);
+		return False;
 	}
+	SAFE_FREE(tp);
+	br_lck->modified = True;
+
+	/* Wake the pending waiters that can now get their lock. */
+	brl_wake_waiters(msg_ctx, br_lck, plock);
 
 	return True;
 }
@@ -1279,10 +2285,11 @@ bool brl_locktest(struct byte_range_lock *br_lck,
 		enum brl_flavour lock_flav)
 {
 	bool ret = True;
-	unsigned int i;
+	unsigned int i, num;
 	struct lock_struct lock;
-	const struct lock_struct *locks = br_lck->lock_data;
+	struct lock_struct *locks;
 	files_struct *fsp = br_lck->fsp;
+	struct brl_scan scan;
 
 	lock.context.smblctx = smblctx;
 	lock.context.pid = pid;
@@ -1294,14 +2301,20 @@ bool brl_locktest(struct byte_range_lock *br_lck,
 	lock.lock_flav = lock_flav;
 
 	/* Make sure existing locks don't conflict */
-	for (i=0; i < br_lck->num_locks; i++) {
-		/*
-		 * Our own locks don't conflict.
-		 */
-		if (brl_conflict_other(&locks[i], &lock)) {
-			return False;
+	ZERO_STRUCT(scan);
+	while (brl_scan_next(br_lck, &lock, &scan, &locks, &num)) {
+		for (i = 0; i < num; i++) {
+			/*
+			 * Our own locks don't conflict.
+			 */
+			if (brl_conflict_other(&locks[i], &lock)) {
+				return False;
+			}
 		}
 	}
+	if (scan.failed) {
+		return False;
+	}
 
 	/*
 	 * There is no lock held by an SMB daemon, check to
@@ -1336,10 +2349,11 @@ NTSTATUS brl_lockquery(struct byte_range_lock *br_lck,
 		enum brl_type *plock_type,
 		enum brl_flavour lock_flav)
 {
-	unsigned int i;
+	unsigned int i, num;
 	struct lock_struct lock;
-	const struct lock_struct *locks = br_lck->lock_data;
+	struct lock_struct *locks;
 	files_struct *fsp = br_lck->fsp;
+	struct brl_scan scan;
 
 	lock.context.smblctx = *psmblctx;
 	lock.context.pid = pid;
@@ -1351,24 +2365,30 @@ NTSTATUS brl_lockquery(struct byte_range_lock *br_lck,
 	lock.lock_flav = lock_flav;
 
 	/* Make sure existing locks don't conflict */
-	for (i=0; i < br_lck->num_locks; i++) {
-		const struct lock_struct *exlock = &locks[i];
-		bool conflict = False;
-
-		if (exlock->lock_flav == WINDOWS_LOCK) {
-			conflict = brl_conflict(exlock, &lock);
-		} else {	
-			conflict = brl_conflict_posix(exlock, &lock);
-		}
+	ZERO_STRUCT(scan);
+	while (brl_scan_next(br_lck, &lock, &scan, &locks, &num)) {
+		for (i = 0; i < num; i++) {
+			const struct lock_struct *exlock = &locks[i];
+			bool conflict = False;
+
+			if (exlock->lock_flav == WINDOWS_LOCK) {
+				conflict = brl_conflict(exlock, &lock);
+			} else {
+				conflict = brl_conflict_posix(exlock, &lock);
+			}
 
-		if (conflict) {
-			*psmblctx = exlock->context.smblctx;
-        		*pstart = exlock->start;
-		        *psize = exlock->size;
-        		*plock_type = exlock->lock_type;
-			return NT_STATUS_LOCK_NOT_GRANTED;
+			if (conflict) {
+				*psmblctx = exlock->context.smblctx;
+				*pstart = exlock->start;
+				*psize = exlock->size;
+				*plock_type = exlock->lock_type;
+				return NT_STATUS_LOCK_NOT_GRANTED;
+			}
 		}
 	}
+	if (scan.failed) {
+		return NT_STATUS_INTERNAL_DB_CORRUPTION;
+	}
 
 	/*
 	 * There is no lock held by an SMB daemon, check to
@@ -1432,44 +2452,44 @@ bool brl_lock_cancel(struct byte_range_lock *br_lck,
 		ret = brl_lock_cancel_default(br_lck, &lock);
 	}
 
+	if (ret) {
+		/*
+		 * We might have been woken instead of someone else waiting
+		 * for this range. If we got our lock the others conflict
+		 * with it and are left alone.
+		 */
+		brl_wake_waiters(br_lck->fsp->conn->sconn->msg_ctx, br_lck,
+				 &lock);
+	}
+
 	return ret;
 }
 
+static bool brl_lock_cancel_match(const struct lock_struct *lock,
+				  const struct lock_struct *plock)
+{
+	/* For pending locks we *always* care about the fnum. */
+	return (brl_same_context(&lock->context, &plock->context) &&
+		lock->fnum == plock->fnum &&
+		IS_PENDING_LOCK(lock->lock_type) &&
+		lock->lock_flav == plock->lock_flav &&
+		lock->size == plock->size);
+}
+
 bool brl_lock_cancel_default(struct byte_range_lock *br_lck,
 		struct lock_struct *plock)
 {
-	unsigned int i;
-	struct lock_struct *locks = br_lck->lock_data;
+	unsigned int i, p;
 
 	SMB_ASSERT(plock);
 
-	for (i = 0; i < br_lck->num_locks; i++) {
-		struct lock_struct *lock = &locks[i];
-
-		/* For pending locks we *always* care about the fnum. */
-		if (brl_same_context(&lock->context, &plock->context) &&
-				lock->fnum == plock->fnum &&
-				IS_PENDING_LOCK(lock->lock_type) &&
-				lock->lock_flav == plock->lock_flav &&
-				lock->start == plock->start &&
-				lock->size == plock->size) {
-			break;
-		}
-	}
-
-	if (i == br_lck->num_locks) {
+	if (!brl_find_lock(br_lck, plock, brl_lock_cancel_match, &p, &i)) {
 		/* Didn't find it. */
 		return False;
 	}
 
-	if (i < br_lck->num_locks - 1) {
-		/* Found this particular pending lock - delete it */
-		memmove(&locks[i], &locks[i+1], 
-			sizeof(*locks)*((br_lck->num_locks-1) - i));
-	}
-
-	br_lck->num_locks -= 1;
-	br_lck->modified = True;
+	/* Found this particular pending lock - delete it */
+	brl_delete_lock(br_lck, p, i);
 	return True;
 }
 
@@ -1485,66 +2505,80 @@ void brl_close_fnum(struct messaging_context *msg_ctx,
 	files_struct *fsp = br_lck->fsp;
 	uint16 tid = fsp->conn->cnum;
 	int fnum = fsp->fnum;
-	unsigned int i, j, dcount=0;
+	unsigned int i, j, p, dcount=0;
 	int num_deleted_windows_locks = 0;
-	struct lock_struct *locks = br_lck->lock_data;
 	struct server_id pid = sconn_server_id(fsp->conn->sconn);
 	bool unlock_individually = False;
 	bool posix_level2_contention_ended = false;
 
+	/* The locks of this fnum can be anywhere. */
+	if (!brl_load_pages(br_lck)) {
+		smb_panic("brl_close_fnum: could not read the locks");
+	}
+
 	if(lp_posix_locking(fsp->conn->params)) {
 
 		/* Check if there are any Windows locks associated with this dev/ino
 		   pair that are not this fnum. If so we need to call unlock on each
 		   one in order to release the system POSIX locks correctly. */
 
-		for (i=0; i < br_lck->num_locks; i++) {
-			struct lock_struct *lock = &locks[i];
+		for (p = 0; p < br_lck->num_pages && !unlock_individually; p++) {
+			const struct brl_page *page = &br_lck->pages[p];
 
-			if (!procid_equal(&lock->context.pid, &pid)) {
-				continue;
-			}
+			for (i = 0; i < page->desc.num_locks; i++) {
+				const struct lock_struct *lock = &page->locks[i];
 
-			if (lock->lock_type != READ_LOCK && lock->lock_type != WRITE_LOCK) {
-				continue; /* Ignore pending. */
-			}
+				if (!procid_equal(&lock->context.pid, &pid)) {
+					continue;
+				}
+
+				if (lock->lock_type != READ_LOCK && lock->lock_type != WRITE_LOCK) {
+					continue; /* Ignore pending. */
+				}
 
-			if (lock->context.tid != tid || lock->fnum != fnum) {
-				unlock_individually = True;
-				break;
+				if (lock->context.tid != tid || lock->fnum != fnum) {
+					unlock_individually = True;
+					break;
+				}
 			}
 		}
 
 		if (unlock_individually) {
 			struct lock_struct *locks_copy;
-			unsigned int num_locks_copy;
-
-			/* Copy the current lock array. */
-			if (br_lck->num_locks) {
-				locks_copy = (struct lock_struct *)talloc_memdup(br_lck, locks, br_lck->num_locks * sizeof(struct lock_struct));
-				if (!locks_copy) {
-					smb_panic("brl_close_fnum: talloc failed");
-	 			}
-			} else {	
-				locks_copy = NULL;
+			unsigned int num_locks_copy = 0;
+
+			/* Copy our locks, brl_unlock() changes the pages. */
+			locks_copy = talloc_array(br_lck, struct lock_struct,
+						  br_lck->num_locks);
+			if ((locks_copy == NULL) && (br_lck->num_locks != 0)) {
+				smb_panic("brl_close_fnum: talloc failed");
 			}
 
-			num_locks_copy = br_lck->num_locks;
+			for (p = 0; p < br_lck->num_pages; p++) {
+				const struct brl_page *page = &br_lck->pages[p];
+
+				for (i = 0; i < page->desc.num_locks; i++) {
+					const struct lock_struct *lock = &page->locks[i];
+
+					if (lock->context.tid == tid && procid_equal(&lock->context.pid, &pid) &&
+							(lock->fnum == fnum)) {
+						locks_copy[num_locks_copy++] = *lock;
+					}
+				}
+			}
 
 			for (i=0; i < num_locks_copy; i++) {
 				struct lock_struct *lock = &locks_copy[i];
 
-				if (lock->context.tid == tid && procid_equal(&lock->context.pid, &pid) &&
-						(lock->fnum == fnum)) {
-					brl_unlock(msg_ctx,
-						br_lck,
-						lock->context.smblctx,
-						pid,
-						lock->start,
-						lock->size,
-						lock->lock_flav);
-				}
+				brl_unlock(msg_ctx,
+					br_lck,
+					lock->context.smblctx,
+					pid,
+					lock->start,
+					lock->size,
+					lock->lock_flav);
 			}
+			TALLOC_FREE(locks_copy);
 			return;
 		}
 	}
@@ -1553,63 +2587,55 @@ void brl_close_fnum(struct messaging_context *msg_ctx,
 
 	/* Remove any existing locks for this fnum (or any fnum if they're POSIX). */
 
-	for (i=0; i < br_lck->num_locks; i++) {
-		struct lock_struct *lock = &locks[i];
-		bool del_this_lock = False;
-
-		if (lock->context.tid == tid && procid_equal(&lock->context.pid, &pid)) {
-			if ((lock->lock_flav == WINDOWS_LOCK) && (lock->fnum == fnum)) {
-				del_this_lock = True;
-				num_deleted_windows_locks++;
-				contend_level2_oplocks_end(br_lck->fsp,
-				    LEVEL2_CONTEND_WINDOWS_BRL);
-			} else if (lock->lock_flav == POSIX_LOCK) {
-				del_this_lock = True;
-
-				/* Only end level2 contention once for posix */
-				if (!posix_level2_contention_ended) {
-					posix_level2_contention_ended = true;
-					contend_level2_oplocks_end(br_lck->fsp,
-					    LEVEL2_CONTEND_POSIX_BRL);
-				}
-			}
-		}
-
-		if (del_this_lock) {
-			/* Send unlock messages to any pending waiters that overlap. */
-			for (j=0; j < br_lck->num_locks; j++) {
-				struct lock_struct *pend_lock = &locks[j];
-
-				/* Ignore our own or non-pending locks. */
-				if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
-					continue;
-				}
+	p = 0;
+	while (p < br_lck->num_pages) {
+		struct brl_page *page = &br_lck->pages[p];
 
-				/* Optimisation - don't send to this fnum as we're
-				   closing it. */
-				if (pend_lock->context.tid == tid &&
-				    procid_equal(&pend_lock->context.pid, &pid) &&
-				    pend_lock->fnum == fnum) {
-					continue;
-				}
+		for (i = 0, j = 0; i < page->desc.num_locks; i++) {
+			struct lock_struct *lock = &page->locks[i];
+			bool del_this_lock = False;
 
-				/* We could send specific lock info here... */
-				if (brl_pending_overlap(lock, pend_lock)) {
-					messaging_send(msg_ctx, pend_lock->context.pid,
-						       MSG_SMB_UNLOCK, &data_blob_null);
+			if (lock->context.tid == tid && procid_equal(&lock->context.pid, &pid)) {
+				if ((lock->lock_flav == WINDOWS_LOCK) && (lock->fnum == fnum)) {
+					del_this_lock = True;
+					num_deleted_windows_locks++;
+					contend_level2_oplocks_end(br_lck->fsp,
+					    LEVEL2_CONTEND_WINDOWS_BRL);
+				} else if (lock->lock_flav == POSIX_LOCK) {
+					del_this_lock = True;
+
+					/* Only end level2 contention once for posix */
+					if (!posix_level2_contention_ended) {
+						posix_level2_contention_ended = true;
+						contend_level2_oplocks_end(br_lck->fsp,
+						    LEVEL2_CONTEND_POSIX_BRL);
+					}
 				}
 			}
 
-			/* found it - delete it */
-			if (br_lck->num_locks > 1 && i < br_lck->num_locks - 1) {
-				memmove(&locks[i], &locks[i+1], 
-					sizeof(*locks)*((br_lck->num_locks-1) - i));
+			if (del_this_lock) {
+				/* found it - delete it */
+				dcount++;
+				continue;
+			}
+			if (i != j) {
+				page->locks[j] = *lock;
 			}
-			br_lck->num_locks--;
-			br_lck->modified = True;
-			i--;
-			dcount++;
+			j++;
 		}
+
+		if (brl_page_shrink(br_lck, p, j)) {
+			p++;
+		}
+	}
+
+	if (dcount != 0) {
+		struct lock_struct whole_file;
+
+		/* Wake the pending waiters that can now get their lock. */
+		ZERO_STRUCT(whole_file);
+		whole_file.size = (br_off)-1;
+		brl_wake_waiters(msg_ctx, br_lck, &whole_file);
 	}
 
 	if(lp_posix_locking(fsp->conn->params) && num_deleted_windows_locks) {
@@ -1619,51 +2645,35 @@ void brl_close_fnum(struct messaging_context *msg_ctx,
 }
 
 /****************************************************************************
- Ensure this set of lock entries is valid.
+ Ensure this set of lock entries is valid, remove the locks of processes
+ that no longer exist.
 ****************************************************************************/
-static bool validate_lock_entries(unsigned int *pnum_entries, struct lock_struct **pplocks)
+static bool brl_validate_locks(struct byte_range_lock *br_lck)
 {
-	unsigned int i;
-	unsigned int num_valid_entries = 0;
-	struct lock_struct *locks = *pplocks;
-
-	for (i = 0; i < *pnum_entries; i++) {
-		struct lock_struct *lock_data = &locks[i];
-		if (!serverid_exists(&lock_data->context.pid)) {
-			/* This process no longer exists - mark this
-			   entry as invalid by zeroing it. */
-			ZERO_STRUCTP(lock_data);
-		} else {
-			num_valid_entries++;
-		}
+	unsigned int i, j, p;
+
+	if (!brl_load_pages(br_lck)) {
+		return False;
 	}
 
-	if (num_valid_entries != *pnum_entries) {
-		struct lock_struct *new_lock_data = NULL;
+	p = 0;
+	while (p < br_lck->num_pages) {
+		struct brl_page *page = &br_lck->pages[p];
 
-		if (num_valid_entries) {
-			new_lock_data = SMB_MALLOC_ARRAY(struct lock_struct, num_valid_entries);
-			if (!new_lock_data) {
-				DEBUG(3, ("malloc fail\n"));
-				return False;
+		for (i = 0, j = 0; i < page->desc.num_locks; i++) {
+			if (!serverid_exists(&page->locks[i].context.pid)) {
+				/* This process no longer exists. */
+				continue;
 			}
-
-			num_valid_entries = 0;
-			for (i = 0; i < *pnum_entries; i++) {
-				struct lock_struct *lock_data = &locks[i];
-				if (lock_data->context.smblctx &&
-						lock_data->context.tid) {
-					/* Valid (nonzero) entry - copy it. */
-					memcpy(&new_lock_data[num_valid_entries],
-						lock_data, sizeof(struct lock_struct));
-					num_valid_entries++;
-				}
+			if (i != j) {
+				page->locks[j] = page->locks[i];
 			}
+			j++;
 		}
 
-		SAFE_FREE(*pplocks);
-		*pplocks = new_lock_data;
-		*pnum_entries = num_valid_entries;
+		if (brl_page_shrink(br_lck, p, j)) {
+			p++;
+		}
 	}
 
 	return True;
@@ -1686,55 +2696,69 @@ struct brl_forall_cb {
 static int traverse_fn(struct db_record *rec, void *state)
 {
 	struct brl_forall_cb *cb = (struct brl_forall_cb *)state;
-	struct lock_struct *locks;
-	struct file_id *key;
-	unsigned int i;
-	unsigned int num_locks = 0;
-	unsigned int orig_num_locks = 0;
+	struct byte_range_lock *br_lck;
+	unsigned int i, p;
 
-	/* In a traverse function we must make a copy of
-	   dbuf before modifying it. */
+	if (rec->key.dsize != sizeof(struct file_id)) {
+		return 0;
+	}
 
-	locks = (struct lock_struct *)memdup(rec->value.dptr,
-					     rec->value.dsize);
-	if (!locks) {
-		return -1; /* Terminate traversal. */
+	br_lck = talloc_zero(talloc_tos(), struct byte_range_lock);
+	if (br_lck == NULL) {
+		return -1; /* Terminate traversal */
 	}
+	memcpy(&br_lck->key, rec->key.dptr, sizeof(br_lck->key));
+
+	/* In a traverse function we must make a copy of
+	   dbuf before modifying it, brl_parse_locks() does. */
 
-	key = (struct file_id *)rec->key.dptr;
-	orig_num_locks = num_locks = rec->value.dsize/sizeof(*locks);
+	if (!brl_parse_locks(br_lck, rec->value) ||
+	    !brl_load_pages(br_lck)) {
+		/* A paged record being changed right now, skip it. */
+		TALLOC_FREE(br_lck);
+		return 0;
+	}
 
 	/* Ensure the lock db is clean of entries from invalid processes. */
 
-	if (!validate_lock_entries(&num_locks, &locks)) {
-		SAFE_FREE(locks);
-		return -1; /* Terminate traversal */
-	}
+	brl_validate_locks(br_lck);
 
-	if (orig_num_locks != num_locks) {
-		if (num_locks) {
-			TDB_DATA data;
-			data.dptr = (uint8_t *)locks;
-			data.dsize = num_locks*sizeof(struct lock_struct);
-			rec->store(rec, data, TDB_REPLACE);
-		} else {
+	/*
+	 * Paged records are cleaned up by the next brl_get_locks(), we
+	 * can't rewrite their pages from within the traverse.
+	 */
+	if (br_lck->modified && !br_lck->paged) {
+		if (br_lck->num_locks == 0) {
 			rec->delete_rec(rec);
+		} else if ((brlock_pages_db == NULL) ||
+			   (br_lck->num_locks <= BRL_PAGE_LOCKS)) {
+			/* Stays inline, brl_store_locks() writes no pages. */
+			br_lck->record = rec;
+			brl_store_locks(br_lck);
+			br_lck->record = NULL;
 		}
 	}
 
 	if (cb->fn) {
-		for ( i=0; i<num_locks; i++) {
-			cb->fn(*key,
-				locks[i].context.pid,
-				locks[i].lock_type,
-				locks[i].lock_flav,
-				locks[i].start,
-				locks[i].size,
-				cb->private_data);
+		for (p = 0; p < br_lck->num_pages; p++) {
+			const struct brl_page *page = &br_lck->pages[p];
+
+			for (i = 0; i < page->desc.num_locks; i++) {
+				const struct lock_struct *lock =
+					&page->locks[i];
+
+				cb->fn(br_lck->key,
+					lock->context.pid,
+					lock->lock_type,
+					lock->lock_flav,
+					lock->start,
+					lock->size,
+					cb->private_data);
+			}
 		}
 	}
 
-	SAFE_FREE(locks);
+	TALLOC_FREE(br_lck);
 	return 0;
 }
 
@@ -1783,15 +2807,12 @@ static void byte_range_lock_flush(struct byte_range_lock *br_lck)
 				  nt_errstr(status)));
 			smb_panic("Could not delete byte range lock entry");
 		}
+		brl_forget_pages(br_lck);
+		brl_delete_stale_pages(br_lck);
 	} else {
-		TDB_DATA data;
 		NTSTATUS status;
 
-		data.dptr = (uint8 *)br_lck->lock_data;
-		data.dsize = br_lck->num_locks * sizeof(struct lock_struct);
-
-		status = br_lck->record->store(br_lck->record, data,
-					       TDB_REPLACE);
+		status = brl_store_locks(br_lck);
 		if (!NT_STATUS_IS_OK(status)) {
 			DEBUG(0, ("store returned %s\n", nt_errstr(status)));
 			smb_panic("Could not store byte range mode entry");
@@ -1809,7 +2830,6 @@ static void byte_range_lock_flush(struct byte_range_lock *br_lck)
 static int byte_range_lock_destructor(struct byte_range_lock *br_lck)
 {
 	byte_range_lock_flush(br_lck);
-	SAFE_FREE(br_lck->lock_data);
 	return 0;
 }
 
@@ -1823,7 +2843,7 @@ static struct byte_range_lock *brl_get_locks_internal(TALLOC_CTX *mem_ctx,
 					files_struct *fsp, bool read_only)
 {
 	TDB_DATA key, data;
-	struct byte_range_lock *br_lck = talloc(mem_ctx, struct byte_range_lock);
+	struct byte_range_lock *br_lck = talloc_zero(mem_ctx, struct byte_range_lock);
 	bool do_read_only = read_only;
 
 	if (br_lck == NULL) {
@@ -1851,7 +2871,21 @@ static struct byte_range_lock *brl_get_locks_internal(TALLOC_CTX *mem_ctx,
 			return NULL;
 		}
 		br_lck->record = NULL;
-	} else {
+
+		/*
+		 * Without the record lock a writer can replace the
+		 * pages any time, so fetch them all right away. If one
+		 * is gone already, read them again with the record
+		 * locked.
+		 */
+		if (!brl_parse_locks(br_lck, data) ||
+		    !brl_load_pages(br_lck)) {
+			do_read_only = false;
+		}
+		TALLOC_FREE(data.dptr);
+	}
+
+	if (!do_read_only) {
 		br_lck->record = brlock_db->fetch_locked(brlock_db, br_lck, key);
 
 		if (br_lck->record == NULL) {
@@ -1860,59 +2894,57 @@ static struct byte_range_lock *brl_get_locks_internal(TALLOC_CTX *mem_ctx,
 			return NULL;
 		}
 
-		data = br_lck->record->value;
+		/*
+		 * Only the page descriptors are read, brl_scan_next()
+		 * and friends fetch the pages they need. A read only
+		 * copy outlives the record lock, it needs all of them.
+		 */
+		if (!brl_parse_locks(br_lck, br_lck->record->value) ||
+		    (read_only && !brl_load_pages(br_lck))) {
+			DEBUG(0, ("Could not parse byte range lock record "
+				  "of %s\n", file_id_string_tos(&br_lck->key)));
+			TALLOC_FREE(br_lck);
+			return NULL;
+		}
 	}
 
 	br_lck->read_only = do_read_only;
-	br_lck->lock_data = NULL;
 
 	talloc_set_destructor(br_lck, byte_range_lock_destructor);
 
-	br_lck->num_locks = data.dsize / sizeof(struct lock_struct);
-
-	if (br_lck->num_locks != 0) {
-		br_lck->lock_data = SMB_MALLOC_ARRAY(struct lock_struct,
-						     br_lck->num_locks);
-		if (br_lck->lock_data == NULL) {
-			DEBUG(0, ("malloc failed\n"));
-			TALLOC_FREE(br_lck);
-			return NULL;
-		}
-
-		memcpy(br_lck->lock_data, data.dptr, data.dsize);
-	}
-
 	if (!fsp->lockdb_clean) {
-		int orig_num_locks = br_lck->num_locks;
-
 		/* This is the first time we've accessed this. */
 		/* Go through and ensure all entries exist - remove any that don't. */
 		/* Makes the lockdb self cleaning at low cost. */
+		/* Invalid locks are cleaned up in the destructor. */
 
-		if (!validate_lock_entries(&br_lck->num_locks,
-					   &br_lck->lock_data)) {
-			SAFE_FREE(br_lck->lock_data);
+		if (!brl_validate_locks(br_lck)) {
 			TALLOC_FREE(br_lck);
 			return NULL;
 		}
 
-		/* Ensure invalid locks are cleaned up in the destructor. */
-		if (orig_num_locks != br_lck->num_locks) {
-			br_lck->modified = True;
-		}
-
 		/* Mark the lockdb as "clean" as seen from this open file. */
 		fsp->lockdb_clean = True;
 	}
 
 	if (DEBUGLEVEL >= 10) {
-		unsigned int i;
-		struct lock_struct *locks = br_lck->lock_data;
+		unsigned int i, p, n = 0;
 		DEBUG(10,("brl_get_locks_internal: %u current locks on file_id %s\n",
 			br_lck->num_locks,
 			  file_id_string_tos(&fsp->file_id)));
-		for( i = 0; i < br_lck->num_locks; i++) {
-			print_lock_struct(i, &locks[i]);
+		for (p = 0; p < br_lck->num_pages; p++) {
+			const struct brl_page *page = &br_lck->pages[p];
+
+			if (page->locks == NULL) {
+				/* Not fetched, don't read it just for this. */
+				DEBUG(10, ("page %u: %u locks\n", p,
+					   (unsigned int)page->desc.num_locks));
+				n += page->desc.num_locks;
+				continue;
+			}
+			for (i = 0; i < page->desc.num_locks; i++) {
+				print_lock_struct(n++, &page->locks[i]);
+			}
 		}
 	}
 
@@ -537,52 +537,33 @@ static void print_share_mode_table(struct locking_data *data)
 	}
 }
 
-static int parse_delete_tokens_list(struct share_mode_lock *lck,
-		struct locking_data *pdata,
-		const TDB_DATA dbuf)
+/*******************************************************************
+ Decode the delete tokens we kept in raw form in parse_share_modes.
+********************************************************************/
+
+static bool parse_delete_tokens_list(struct share_mode_lock *lck)
 {
-	uint8_t *p = dbuf.dptr + sizeof(struct locking_data) +
-			(lck->num_share_modes *
-			sizeof(struct share_mode_entry));
-	uint8_t *end_ptr = dbuf.dptr + (dbuf.dsize - 2);
-	int delete_tokens_size = 0;
-	int i;
+	const uint8_t *p = lck->raw_delete_tokens.data;
+	uint32_t i;
 
-	lck->delete_tokens = NULL;
+	if (p == NULL) {
+		/* Nothing pending */
+		return true;
+	}
+
+	/* The lengths have been checked in parse_share_modes */
 
-	for (i = 0; i < pdata->u.s.num_delete_token_entries; i++) {
+	for (i = 0; i < lck->num_raw_delete_tokens; i++) {
 		uint32_t token_len;
 		struct delete_token_list *pdtl;
 
-		if (end_ptr - p < (sizeof(uint32_t) + sizeof(uint32_t) +
-					sizeof(uid_t) + sizeof(gid_t))) {
-			DEBUG(0,("parse_delete_tokens_list: "
-				"corrupt token list (%u)",
-				(unsigned int)(end_ptr - p)));
-			smb_panic("corrupt token list");
-			return -1;
-		}
-
 		memcpy(&token_len, p, sizeof(token_len));
-		delete_tokens_size += token_len;
-
-		if (p + token_len > end_ptr || token_len < sizeof(token_len) +
-						sizeof(pdtl->name_hash) +
-						sizeof(uid_t) +
-						sizeof(gid_t)) {
-			DEBUG(0,("parse_delete_tokens_list: "
-				"invalid token length (%u)\n",
-				(unsigned int)token_len ));
-			smb_panic("invalid token length");
-			return -1;
-		}
-
 		p += sizeof(token_len);
 
 		pdtl = talloc_zero(lck, struct delete_token_list);
 		if (pdtl == NULL) {
 			DEBUG(0,("parse_delete_tokens_list: talloc failed"));
-			return -1;
+			return false;
 		}
 		/* Copy out the name_hash. */
 		memcpy(&pdtl->name_hash, p, sizeof(pdtl->name_hash));
@@ -591,7 +572,7 @@ static int parse_delete_tokens_list(struct share_mode_lock *lck,
 		pdtl->delete_token = talloc_zero(pdtl, struct security_unix_token);
 		if (pdtl->delete_token == NULL) {
 			DEBUG(0,("parse_delete_tokens_list: talloc failed"));
-			return -1;
+			return false;
 		}
 
 		/* Copy out the uid and gid. */
@@ -607,20 +588,12 @@ static int parse_delete_tokens_list(struct share_mode_lock *lck,
 		if (token_len) {
 			int j;
 
-			if (token_len % sizeof(gid_t) != 0) {
-				DEBUG(0,("parse_delete_tokens_list: "
-					"corrupt group list (%u)",
-					(unsigned int)(token_len % sizeof(gid_t)) ));
-				smb_panic("corrupt group list");
-				return -1;
-			}
-
 			pdtl->delete_token->ngroups = token_len / sizeof(gid_t);
 			pdtl->delete_token->groups = talloc_array(pdtl->delete_token, gid_t,
 						pdtl->delete_token->ngroups);
 			if (pdtl->delete_token->groups == NULL) {
 				DEBUG(0,("parse_delete_tokens_list: talloc failed"));
-				return -1;
+				return false;
 			}
 
 			for (j = 0; j < pdtl->delete_token->ngroups; j++) {
@@ -632,16 +605,75 @@ static int parse_delete_tokens_list(struct share_mode_lock *lck,
 		DLIST_ADD(lck->delete_tokens, pdtl);
 	}
 
+	lck->num_raw_delete_tokens = 0;
+	lck->raw_delete_tokens = data_blob_null;
+	return true;
+}
+
+/*******************************************************************
+ Check the delete token lengths and return the size of the token list.
+********************************************************************/
+
+static int delete_tokens_list_size(const uint8_t *p, const uint8_t *end_ptr,
+				   uint32_t num_tokens)
+{
+	int delete_tokens_size = 0;
+	uint32_t i;
+
+	for (i = 0; i < num_tokens; i++) {
+		uint32_t token_len;
+
+		if (end_ptr - p < (sizeof(uint32_t) + sizeof(uint32_t) +
+					sizeof(uid_t) + sizeof(gid_t))) {
+			DEBUG(0,("parse_delete_tokens_list: "
+				"corrupt token list (%u)",
+				(unsigned int)(end_ptr - p)));
+			smb_panic("corrupt token list");
+			return -1;
+		}
+
+		memcpy(&token_len, p, sizeof(token_len));
+
+		if (token_len > end_ptr - p || token_len < sizeof(token_len) +
+						sizeof(uint32_t) +
+						sizeof(uid_t) +
+						sizeof(gid_t)) {
+			DEBUG(0,("parse_delete_tokens_list: "
+				"invalid token length (%u)\n",
+				(unsigned int)token_len ));
+			smb_panic("invalid token length");
+			return -1;
+		}
+
+		if ((token_len - (sizeof(token_len) + sizeof(uint32_t) +
+				  sizeof(uid_t) + sizeof(gid_t)))
+		    % sizeof(gid_t) != 0) {
+			DEBUG(0,("parse_delete_tokens_list: "
+				"corrupt group list (%u)",
+				(unsigned int)token_len ));
+			smb_panic("corrupt group list");
+			return -1;
+		}
+
+		delete_tokens_size += token_len;
+		p += token_len;
+	}
+
 	return delete_tokens_size;
 }
 
 /*******************************************************************
  Get all share mode entries for a dev/inode pair.
+
+ The entries are used where they are in dbuf, so callers changing
+ them change dbuf. Only the validity of the entries is checked here,
+ the delete tokens are decoded on first use.
 ********************************************************************/
 
 static bool parse_share_modes(const TDB_DATA dbuf, struct share_mode_lock *lck)
 {
 	struct locking_data data;
+	uint8_t *entries;
 	int delete_tokens_size;
 	int i;
 
@@ -672,6 +704,7 @@ static bool parse_share_modes(const TDB_DATA dbuf, struct share_mode_lock *lck)
 	}
 
 	lck->share_modes = NULL;
+	entries = dbuf.dptr + sizeof(struct locking_data);
 
 	if (lck->num_share_modes != 0) {
 
@@ -681,23 +714,39 @@ static bool parse_share_modes(const TDB_DATA dbuf, struct share_mode_lock *lck)
 			smb_panic("parse_share_modes: buffer too short");
 		}
 
-		lck->share_modes = (struct share_mode_entry *)
-			talloc_memdup(lck,
-				      dbuf.dptr+sizeof(struct locking_data),
-				      lck->num_share_modes *
-				      sizeof(struct share_mode_entry));
+		if (((uintptr_t)entries % sizeof(uint64_t)) == 0) {
+			lck->share_modes = (struct share_mode_entry *)entries;
+			lck->share_modes_in_record = true;
+		} else {
+			lck->share_modes = (struct share_mode_entry *)
+				talloc_memdup(lck, entries,
+					      lck->num_share_modes *
+					      sizeof(struct share_mode_entry));
 
-		if (lck->share_modes == NULL) {
-			smb_panic("parse_share_modes: talloc failed");
+			if (lck->share_modes == NULL) {
+				smb_panic("parse_share_modes: talloc failed");
+			}
 		}
 	}
 
-	/* Get any delete tokens. */
-	delete_tokens_size = parse_delete_tokens_list(lck, &data, dbuf);
+	/* Check the delete tokens, they are decoded when needed. */
+	delete_tokens_size = delete_tokens_list_size(
+		entries + lck->num_share_modes *
+		sizeof(struct share_mode_entry),
+		dbuf.dptr + (dbuf.dsize - 2),
+		data.u.s.num_delete_token_entries);
 	if (delete_tokens_size < 0) {
 		smb_panic("parse_share_modes: parse_delete_tokens_list failed");
 	}
 
+	if (data.u.s.num_delete_token_entries != 0) {
+		lck->num_raw_delete_tokens = data.u.s.num_delete_token_entries;
+		lck->raw_delete_tokens = data_blob_const(
+			entries + lck->num_share_modes *
+			sizeof(struct share_mode_entry),
+			delete_tokens_size);
+	}
+
 	/* Save off the associated service path and filename. */
 	lck->servicepath = (const char *)dbuf.dptr + sizeof(struct locking_data) +
 		(lck->num_share_modes *	sizeof(struct share_mode_entry)) +
@@ -776,6 +825,10 @@ static TDB_DATA unparse_share_modes(const struct share_mode_lock *lck)
 				pdtl->delete_token->ngroups*sizeof(gid_t));
 	}
 
+	/* Tokens nobody looked at are copied as they are */
+	num_delete_token_entries += lck->num_raw_delete_tokens;
+	delete_tokens_size += lck->raw_delete_tokens.length;
+
 	result.dsize = sizeof(*data) +
 		lck->num_share_modes * sizeof(struct share_mode_entry) +
 		delete_tokens_size +
@@ -810,6 +863,12 @@ static TDB_DATA unparse_share_modes(const struct share_mode_lock *lck)
 	offset = sizeof(*data) +
 		sizeof(struct share_mode_entry)*lck->num_share_modes;
 
+	if (lck->raw_delete_tokens.length != 0) {
+		memcpy(result.dptr + offset, lck->raw_delete_tokens.data,
+		       lck->raw_delete_tokens.length);
+		offset += lck->raw_delete_tokens.length;
+	}
+
 	/* Store any delete on close tokens. */
 	for (pdtl = lck->delete_tokens; pdtl; pdtl = pdtl->next) {
 		struct security_unix_token *pdt = pdtl->delete_token;
@@ -858,6 +917,39 @@ static TDB_DATA unparse_share_modes(const struct share_mode_lock *lck)
 	return result;
 }
 
+/*******************************************************************
+ The record only changed in place: update the header and hand back
+ the buffer we read. Returns tdb_null if no valid entry is left.
+********************************************************************/
+
+static TDB_DATA share_modes_in_place(struct share_mode_lock *lck)
+{
+	struct locking_data *data;
+	int i;
+
+	for (i=0; i<lck->num_share_modes; i++) {
+		if (!is_unused_share_mode_entry(&lck->share_modes[i])) {
+			break;
+		}
+	}
+	if (i == lck->num_share_modes) {
+		return tdb_null;
+	}
+
+	data = (struct locking_data *)lck->record->value.dptr;
+	data->u.s.old_write_time = lck->old_write_time;
+	data->u.s.changed_write_time = lck->changed_write_time;
+
+	DEBUG(10, ("share_modes_in_place: num: %d\n",
+		   lck->num_share_modes));
+
+	if (DEBUGLEVEL >= 10) {
+		print_share_mode_table(data);
+	}
+
+	return lck->record->value;
+}
+
 static int share_mode_lock_destructor(struct share_mode_lock *lck)
 {
 	NTSTATUS status;
@@ -867,7 +959,12 @@ static int share_mode_lock_destructor(struct share_mode_lock *lck)
 		return 0;
 	}
 
-	data = unparse_share_modes(lck);
+	if (!lck->fresh && lck->share_modes_in_record &&
+	    !lck->layout_modified) {
+		data = share_modes_in_place(lck);
+	} else {
+		data = unparse_share_modes(lck);
+	}
 
 	if (data.dptr == NULL) {
 		if (!lck->fresh) {
@@ -931,6 +1028,10 @@ static bool fill_share_mode_lock(struct share_mode_lock *lck,
 	ZERO_STRUCT(lck->changed_write_time);
 	lck->fresh = False;
 	lck->modified = False;
+	lck->share_modes_in_record = false;
+	lck->layout_modified = false;
+	lck->num_raw_delete_tokens = 0;
+	lck->raw_delete_tokens = data_blob_null;
 
 	lck->fresh = (share_mode_data.dptr == NULL);
 
@@ -1073,6 +1174,7 @@ bool rename_share_filename(struct messaging_context *msg_ctx,
 		return False;
 	}
 	lck->modified = True;
+	lck->layout_modified = true;
 
 	sp_len = strlen(lck->servicepath);
 	bn_len = strlen(lck->base_name);
@@ -1225,6 +1327,12 @@ static void fill_share_mode_entry(struct share_mode_entry *e,
 	e->uid = (uint32)uid;
 	e->flags = fsp->posix_open ? SHARE_MODE_FLAG_POSIX_OPEN : 0;
 	e->name_hash = fsp->name_hash;
+	if (fsp->lease != NULL) {
+		e->flags |= SHARE_MODE_FLAG_LEASE;
+		e->client_guid = fsp->conn->sconn->smb2.client_guid;
+		e->lease_key = fsp->lease->lease_key;
+		e->lease_state = fsp->lease->lease_state;
+	}
 }
 
 static void fill_deferred_open_entry(struct share_mode_entry *e,
@@ -1258,9 +1366,21 @@ static void add_share_mode_entry(struct share_mode_lock *lck,
 	}
 
 	if (i == lck->num_share_modes) {
-		/* No unused entry found */
+		/* No unused entry found, the record has to grow */
+		if (lck->share_modes_in_record) {
+			lck->share_modes = (struct share_mode_entry *)
+				talloc_memdup(lck, lck->share_modes,
+					      lck->num_share_modes *
+					      sizeof(struct share_mode_entry));
+			if (lck->share_modes == NULL) {
+				smb_panic("add_share_mode_entry: talloc "
+					  "failed");
+			}
+			lck->share_modes_in_record = false;
+		}
 		ADD_TO_ARRAY(lck, struct share_mode_entry, *entry,
 			     &lck->share_modes, &lck->num_share_modes);
+		lck->layout_modified = true;
 	}
 	lck->modified = True;
 }
@@ -1273,12 +1393,26 @@ void set_share_mode(struct share_mode_lock *lck, files_struct *fsp,
 	add_share_mode_entry(lck, &entry);
 }
 
+/*******************************************************************
+ Add a deferred open entry. A non-zero access_mask marks an open that
+ waits for conflicting share modes to go away: the close path only
+ wakes it once it no longer conflicts with the remaining opens.
+********************************************************************/
+
 void add_deferred_open(struct share_mode_lock *lck, uint64_t mid,
 		       struct timeval request_time,
-		       struct server_id pid, struct file_id id)
+		       struct server_id pid, struct file_id id,
+		       uint32_t name_hash, uint32_t access_mask,
+		       uint32_t share_access)
 {
 	struct share_mode_entry entry;
 	fill_deferred_open_entry(&entry, request_time, id, pid, mid);
+	if (access_mask != 0) {
+		entry.flags |= SHARE_MODE_FLAG_SHARING_WAIT;
+		entry.name_hash = name_hash;
+		entry.access_mask = access_mask;
+		entry.share_access = share_access;
+	}
 	add_share_mode_entry(lck, &entry);
 }
 
@@ -1423,6 +1557,48 @@ bool downgrade_share_oplock(struct share_mode_lock *lck, files_struct *fsp)
 	return True;
 }
 
+/*******************************************************************
+ Store the oplock type and lease state of a leased open.
+********************************************************************/
+
+bool set_share_mode_lease(struct share_mode_lock *lck, files_struct *fsp)
+{
+	struct share_mode_entry entry, *e;
+
+	if (fsp->lease == NULL) {
+		return False;
+	}
+
+	/* Don't care about the pid owner being correct here - just a search. */
+	fill_share_mode_entry(&entry, fsp, (uid_t)-1, 0, NO_OPLOCK);
+
+	e = find_share_mode_entry(lck, &entry);
+	if (e == NULL) {
+		return False;
+	}
+
+	e->op_type = fsp->oplock_type;
+	e->lease_state = fsp->lease->lease_state;
+	lck->modified = True;
+	return True;
+}
+
+/*******************************************************************
+ Does this share mode entry belong to the given lease ?
+********************************************************************/
+
+bool share_mode_entry_is_lease(const struct share_mode_entry *e,
+			       const struct GUID *client_guid,
+			       const struct smb2_lease_key *lease_key)
+{
+	if (!(e->flags & SHARE_MODE_FLAG_LEASE)) {
+		return False;
+	}
+	return (GUID_equal(&e->client_guid, client_guid) &&
+		(e->lease_key.data[0] == lease_key->data[0]) &&
+		(e->lease_key.data[1] == lease_key->data[1]));
+}
+
 /****************************************************************************
  Check if setting delete on close is allowed on this fsp.
 ****************************************************************************/
@@ -1526,6 +1702,7 @@ static bool add_delete_on_close_token(struct share_mode_lock *lck,
 	}
 	DLIST_ADD(lck->delete_tokens, dtl);
 	lck->modified = true;
+	lck->layout_modified = true;
 	return true;
 }
 
@@ -1554,9 +1731,15 @@ void set_delete_on_close_lck(files_struct *fsp,
 		SMB_ASSERT(tok == NULL);
 	}
 
+	if (!parse_delete_tokens_list(lck)) {
+		smb_panic("set_delete_on_close_lck: "
+			  "parse_delete_tokens_list failed");
+	}
+
 	for (dtl = lck->delete_tokens; dtl; dtl = dtl->next) {
 		if (dtl->name_hash == fsp->name_hash) {
 			lck->modified = true;
+			lck->layout_modified = true;
 			if (delete_on_close == false) {
 				/* Delete this entry. */
 				DLIST_REMOVE(lck->delete_tokens, dtl);
@@ -1618,6 +1801,11 @@ const struct security_unix_token *get_delete_on_close_token(struct share_mode_lo
 	DEBUG(10,("get_delete_on_close_token: name_hash = 0x%x\n",
 			(unsigned int)name_hash ));
 
+	if (!parse_delete_tokens_list(lck)) {
+		smb_panic("get_delete_on_close_token: "
+			  "parse_delete_tokens_list failed");
+	}
+
 	for (dtl = lck->delete_tokens; dtl; dtl = dtl->next) {
 		DEBUG(10,("get_delete_on_close_token: dtl->name_hash = 0x%x\n",
 				(unsigned int)dtl->name_hash ));
@@ -1630,7 +1818,25 @@ const struct security_unix_token *get_delete_on_close_token(struct share_mode_lo
 
 bool is_delete_on_close_set(struct share_mode_lock *lck, uint32_t name_hash)
 {
-	return (get_delete_on_close_token(lck, name_hash) != NULL);
+	const uint8_t *p = lck->raw_delete_tokens.data;
+	uint32_t i;
+
+	if (lck->delete_tokens != NULL) {
+		return (get_delete_on_close_token(lck, name_hash) != NULL);
+	}
+
+	/* Look at the name hashes without decoding the tokens. */
+	for (i = 0; i < lck->num_raw_delete_tokens; i++) {
+		uint32_t token_len, token_hash;
+
+		memcpy(&token_len, p, sizeof(token_len));
+		memcpy(&token_hash, p + sizeof(token_len), sizeof(token_hash));
+		if (token_hash == name_hash) {
+			return true;
+		}
+		p += token_len;
+	}
+	return false;
 }
 
 bool set_sticky_write_time(struct file_id fileid, struct timespec write_time)
@@ -166,12 +166,18 @@ void set_share_mode(struct share_mode_lock *lck, files_struct *fsp,
 		    uid_t uid, uint64_t mid, uint16 op_type);
 void add_deferred_open(struct share_mode_lock *lck, uint64_t mid,
 		       struct timeval request_time,
-		       struct server_id pid, struct file_id id);
+		       struct server_id pid, struct file_id id,
+		       uint32_t name_hash, uint32_t access_mask,
+		       uint32_t share_access);
 bool del_share_mode(struct share_mode_lock *lck, files_struct *fsp);
 void del_deferred_open_entry(struct share_mode_lock *lck, uint64_t mid,
 			     struct server_id pid);
 bool remove_share_oplock(struct share_mode_lock *lck, files_struct *fsp);
 bool downgrade_share_oplock(struct share_mode_lock *lck, files_struct *fsp);
+bool set_share_mode_lease(struct share_mode_lock *lck, files_struct *fsp);
+bool share_mode_entry_is_lease(const struct share_mode_entry *e,
+			       const struct GUID *client_guid,
+			       const struct smb2_lease_key *lease_key);
 NTSTATUS can_set_delete_on_close(files_struct *fsp, uint32 dosmode);
 const struct security_unix_token *get_delete_on_close_token(struct share_mode_lock *lck, uint32_t name_hash);
 void set_delete_on_close_lck(files_struct *fsp,
@@ -224,6 +224,7 @@ static NTSTATUS onefs_open_file(files_struct *fsp,
 					    sd,
 					    new_dos_attributes,
 					    granted_oplock);
+	fsp_update_fd_hash(fsp);
 	TALLOC_FREE(smb_fname_onefs);
 
 	if (fsp->fh->fd == -1) {
@@ -303,7 +304,7 @@ static NTSTATUS onefs_open_file(files_struct *fsp,
 	}
 
 	fsp->mode = smb_fname->st.st_ex_mode;
-	fsp->file_id = vfs_file_id_from_sbuf(conn, &smb_fname->st);
+	fsp_set_file_id(fsp, vfs_file_id_from_sbuf(conn, &smb_fname->st));
 	fsp->vuid = req ? req->vuid : UID_FIELD_INVALID;
 	fsp->file_pid = req ? req->smbpid : 0;
 	fsp->can_lock = True;
@@ -1518,6 +1519,7 @@ static NTSTATUS onefs_open_directory(connection_struct *conn,
 					    sd,
 					    file_attributes,
 					    NULL);
+	fsp_update_fd_hash(fsp);
 
 	if (fsp->fh->fd == -1) {
 		DEBUG(3, ("Error opening %s. Errno=%d (%s).\n",
@@ -1616,7 +1618,7 @@ static NTSTATUS onefs_open_directory(connection_struct *conn,
 
 	/* Setup the files_struct for it. */
 	fsp->mode = smb_dname->st.st_ex_mode;
-	fsp->file_id = vfs_file_id_from_sbuf(conn, &smb_dname->st);
+	fsp_set_file_id(fsp, vfs_file_id_from_sbuf(conn, &smb_dname->st));
 	fsp->vuid = req ? req->vuid : UID_FIELD_INVALID;
 	fsp->file_pid = req ? req->smbpid : 0;
 	fsp->can_lock = False;
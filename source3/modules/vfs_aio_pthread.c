@@ -0,0 +1,712 @@
+/*
+ * Simulate Posix AIO using pthreads.
+ *
+ * Based on the aio_fork work from Volker and Jeremy.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "system/select.h"
+#include "smbd/smbd.h"
+#include "smbd/globals.h"
+#include "../lib/util/select.h"
+#include "lib/pthreadpool/pthreadpool.h"
+
+struct aio_pthread_conn;
+
+struct aio_private_data {
+	struct aio_private_data *prev, *next;
+	int jobid;
+	SMB_STRUCT_AIOCB *aiocb;
+	struct aio_pthread_conn *conn_state;
+
+	/* Copied from the aiocb, only touched by the worker thread */
+	int fd;
+	void *buf;
+	size_t nbytes;
+	SMB_OFF_T offset;
+	enum { AIO_PTHREAD_READ, AIO_PTHREAD_WRITE, AIO_PTHREAD_FSYNC } cmd;
+
+	/* Results, only valid once completed is set */
+	ssize_t ret_size;
+	int ret_errno;
+	bool completed;
+	bool cancelled;
+};
+
+/*
+ * Per tree connect state, used to limit the number of outstanding
+ * requests of a single share.
+ */
+struct aio_pthread_conn {
+	int queue_depth;
+	int active;
+};
+
+static struct pthreadpool *pool;
+static int aio_pthread_jobid;
+static struct aio_private_data *pd_list;
+static struct tevent_immediate *aio_pthread_im;
+
+static void aio_pthread_handle_completion(struct event_context *event_ctx,
+				struct fd_event *event,
+				uint16 flags,
+				void *p);
+
+/************************************************************************
+ Ensure thread pool is initialized.
+***********************************************************************/
+
+static bool init_aio_threadpool(void)
+{
+	struct fd_event *sock_event = NULL;
+	int ret = 0;
+	int num_threads;
+	int pending;
+
+	if (pool) {
+		return true;
+	}
+
+	num_threads = lp_parm_int(-1, "aio_pthread", "aio num threads", 100);
+	if (num_threads <= 0) {
+		num_threads = 100;
+	}
+
+	ret = pthreadpool_init(num_threads, &pool);
+	if (ret) {
+		errno = ret;
+		return false;
+	}
+	sock_event = tevent_add_fd(server_event_context(),
+				NULL,
+				pthreadpool_signal_fd(pool),
+				TEVENT_FD_READ,
+				aio_pthread_handle_completion,
+				NULL);
+	if (sock_event == NULL) {
+		pthreadpool_destroy(pool);
+		pool = NULL;
+		return false;
+	}
+
+	/*
+	 * Completion doesn't go through RT signals, so we're not
+	 * bound by the tevent limit of 100 pending signals. Let
+	 * the smbd aio code queue as much as we're told to.
+	 */
+	pending = lp_parm_int(-1, "aio_pthread", "aio pending size",
+			      aio_pending_size);
+	if (pending > aio_pending_size) {
+		aio_pending_size = pending;
+	}
+
+	DEBUG(10,("init_aio_threadpool: initialized with up to %d threads, "
+		  "%d pending requests\n", num_threads, aio_pending_size));
+
+	return true;
+}
+
+/************************************************************************
+ Per-share state handling. Jobs still running when the share is
+ disconnected simply stop being accounted for.
+***********************************************************************/
+
+static int aio_pthread_conn_destructor(struct aio_pthread_conn *conn_state)
+{
+	struct aio_private_data *pd;
+
+	for (pd = pd_list; pd != NULL; pd = pd->next) {
+		if (pd->conn_state == conn_state) {
+			pd->conn_state = NULL;
+		}
+	}
+	return 0;
+}
+
+static int aio_pthread_connect(vfs_handle_struct *handle,
+			       const char *service,
+			       const char *user)
+{
+	struct aio_pthread_conn *conn_state;
+	int ret;
+
+	ret = SMB_VFS_NEXT_CONNECT(handle, service, user);
+	if (ret < 0) {
+		return ret;
+	}
+
+	conn_state = talloc_zero(handle->conn, struct aio_pthread_conn);
+	if (conn_state == NULL) {
+		SMB_VFS_NEXT_DISCONNECT(handle);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* 0 means the share is only limited by "aio pending size" */
+	conn_state->queue_depth = lp_parm_int(SNUM(handle->conn),
+					      "aio_pthread",
+					      "aio queue depth",
+					      0);
+	talloc_set_destructor(conn_state, aio_pthread_conn_destructor);
+
+	SMB_VFS_HANDLE_SET_DATA(handle, conn_state, NULL,
+				struct aio_pthread_conn, return -1);
+
+	return 0;
+}
+
+/************************************************************************
+ Worker function - core of the pthread aio engine.
+ This is the function that actually does the IO.
+ Only the fields copied from the aiocb and the result
+ fields of the private data may be touched here.
+***********************************************************************/
+
+static void aio_worker(void *private_data)
+{
+	struct aio_private_data *pd =
+			(struct aio_private_data *)private_data;
+
+	switch (pd->cmd) {
+	case AIO_PTHREAD_WRITE:
+		pd->ret_size = sys_pwrite(pd->fd,
+				(const void *)pd->buf,
+				pd->nbytes,
+				pd->offset);
+		if (pd->ret_size == -1 && errno == ESPIPE) {
+			/* Maintain the fiction that pipes can
+			   be seeked (sought?) on. */
+			pd->ret_size = sys_write(pd->fd,
+					(const void *)pd->buf,
+					pd->nbytes);
+		}
+		break;
+	case AIO_PTHREAD_READ:
+		pd->ret_size = sys_pread(pd->fd,
+				pd->buf,
+				pd->nbytes,
+				pd->offset);
+		if (pd->ret_size == -1 && errno == ESPIPE) {
+			/* Maintain the fiction that pipes can
+			   be seeked (sought?) on. */
+			pd->ret_size = sys_read(pd->fd,
+					pd->buf,
+					pd->nbytes);
+		}
+		break;
+	case AIO_PTHREAD_FSYNC:
+		pd->ret_size = fsync(pd->fd);
+		break;
+	}
+
+	if (pd->ret_size == -1) {
+		pd->ret_errno = errno;
+	} else {
+		pd->ret_errno = 0;
+	}
+}
+
+/************************************************************************
+ Private data destructor. A job the worker is still busy with must
+ not go away, it's left to aio_pthread_reap_job to free it. The
+ buffer the job works on is owned by the smbd aio code, which keeps
+ it until the job has been reaped even if the request goes away.
+***********************************************************************/
+
+static int pd_destructor(struct aio_private_data *pd)
+{
+	if (!pd->completed) {
+		pd->aiocb = NULL;
+		return -1;
+	}
+	DLIST_REMOVE(pd_list, pd);
+	return 0;
+}
+
+/************************************************************************
+ Create and initialize a private data struct.
+***********************************************************************/
+
+static struct aio_private_data *create_private_data(TALLOC_CTX *ctx,
+					struct aio_pthread_conn *conn_state,
+					SMB_STRUCT_AIOCB *aiocb)
+{
+	struct aio_private_data *pd = talloc_zero(ctx, struct aio_private_data);
+	if (!pd) {
+		return NULL;
+	}
+	pd->jobid = ++aio_pthread_jobid;
+	pd->aiocb = aiocb;
+	pd->conn_state = conn_state;
+	pd->fd = aiocb->aio_fildes;
+	pd->buf = discard_const_p(void, aiocb->aio_buf);
+	pd->nbytes = aiocb->aio_nbytes;
+	pd->offset = aiocb->aio_offset;
+	pd->ret_size = -1;
+	pd->ret_errno = EINPROGRESS;
+
+	talloc_set_destructor(pd, pd_destructor);
+	DLIST_ADD_END(pd_list, pd, struct aio_private_data *);
+	return pd;
+}
+
+/************************************************************************
+ Hand a request to the thread pool, unless the share is over its limit.
+***********************************************************************/
+
+static int aio_pthread_submit(struct vfs_handle_struct *handle,
+			      struct files_struct *fsp,
+			      SMB_STRUCT_AIOCB *aiocb,
+			      int cmd)
+{
+	struct aio_extra *aio_ex = (struct aio_extra *)aiocb->aio_sigevent.sigev_value.sival_ptr;
+	struct aio_private_data *pd = NULL;
+	struct aio_pthread_conn *conn_state = NULL;
+	int ret;
+
+	if (!init_aio_threadpool()) {
+		return -1;
+	}
+
+	SMB_VFS_HANDLE_GET_DATA(handle, conn_state,
+				struct aio_pthread_conn, return -1);
+
+	if ((conn_state->queue_depth > 0) &&
+	    (conn_state->active >= conn_state->queue_depth)) {
+		DEBUG(10, ("aio_pthread_submit: %d requests active on "
+			   "share %s, queue depth exhausted\n",
+			   conn_state->active,
+			   lp_servicename(SNUM(handle->conn))));
+		errno = EAGAIN;
+		return -1;
+	}
+
+	pd = create_private_data(aio_ex, conn_state, aiocb);
+	if (pd == NULL) {
+		DEBUG(10, ("aio_pthread_submit: Could not create private "
+			   "data.\n"));
+		errno = ENOMEM;
+		return -1;
+	}
+	pd->cmd = cmd;
+
+	ret = pthreadpool_add_job(pool, pd->jobid, aio_worker, (void *)pd);
+	if (ret) {
+		pd->completed = true;
+		TALLOC_FREE(pd);
+		errno = ret;
+		return -1;
+	}
+
+	conn_state->active++;
+
+	DEBUG(10, ("aio_pthread_submit: jobid=%d cmd=%d of %llu bytes at "
+		   "offset %llu for file %s\n",
+		   pd->jobid,
+		   cmd,
+		   (unsigned long long)pd->nbytes,
+		   (unsigned long long)pd->offset,
+		   fsp_str_dbg(fsp)));
+
+	return 0;
+}
+
+/************************************************************************
+ Spin off a threadpool (if needed) and initiate a pread call.
+***********************************************************************/
+
+static int aio_pthread_read(struct vfs_handle_struct *handle,
+				struct files_struct *fsp,
+				SMB_STRUCT_AIOCB *aiocb)
+{
+	return aio_pthread_submit(handle, fsp, aiocb, AIO_PTHREAD_READ);
+}
+
+/************************************************************************
+ Spin off a threadpool (if needed) and initiate a pwrite call.
+***********************************************************************/
+
+static int aio_pthread_write(struct vfs_handle_struct *handle,
+				struct files_struct *fsp,
+				SMB_STRUCT_AIOCB *aiocb)
+{
+	return aio_pthread_submit(handle, fsp, aiocb, AIO_PTHREAD_WRITE);
+}
+
+/************************************************************************
+ Spin off a threadpool (if needed) and initiate a fsync call.
+***********************************************************************/
+
+static int aio_pthread_fsync(struct vfs_handle_struct *handle,
+				struct files_struct *fsp,
+				int op,
+				SMB_STRUCT_AIOCB *aiocb)
+{
+	return aio_pthread_submit(handle, fsp, aiocb, AIO_PTHREAD_FSYNC);
+}
+
+/************************************************************************
+ Find the private data by jobid.
+***********************************************************************/
+
+static struct aio_private_data *find_private_data_by_jobid(int jobid)
+{
+	struct aio_private_data *pd;
+
+	for (pd = pd_list; pd != NULL; pd = pd->next) {
+		if (pd->jobid == jobid) {
+			return pd;
+		}
+	}
+
+	return NULL;
+}
+
+/************************************************************************
+ Find the private data by aiocb.
+***********************************************************************/
+
+static struct aio_private_data *find_private_data_by_aiocb(
+					const SMB_STRUCT_AIOCB *aiocb)
+{
+	struct aio_private_data *pd;
+
+	for (pd = pd_list; pd != NULL; pd = pd->next) {
+		if (pd->aiocb == aiocb) {
+			return pd;
+		}
+	}
+
+	return NULL;
+}
+
+/************************************************************************
+ Fetch one finished job from the pool and mark it completed.
+ Returns NULL if there is nothing to be done for the job.
+***********************************************************************/
+
+static struct aio_private_data *aio_pthread_reap_job(void)
+{
+	struct aio_private_data *pd = NULL;
+	int jobid;
+
+	jobid = pthreadpool_finished_job(pool);
+	pd = find_private_data_by_jobid(jobid);
+	if (pd == NULL) {
+		DEBUG(1, ("aio_pthread_reap_job cannot find jobid %d\n",
+			  jobid));
+		return NULL;
+	}
+
+	pd->completed = true;
+	if (pd->conn_state != NULL) {
+		pd->conn_state->active--;
+	}
+
+	if (pd->aiocb == NULL) {
+		/* The request is gone. */
+		DEBUG(10, ("aio_pthread_reap_job: jobid %d orphaned\n",
+			   jobid));
+		TALLOC_FREE(pd);
+		return NULL;
+	}
+
+	DEBUG(10, ("aio_pthread_reap_job: jobid %d completed, "
+		   "ret_size = %d, errno = %d\n",
+		   jobid, (int)pd->ret_size, pd->ret_errno));
+
+	return pd;
+}
+
+/************************************************************************
+ Tell the smbd aio code about a completed job.
+***********************************************************************/
+
+static void aio_pthread_deliver(struct aio_private_data *pd)
+{
+	struct aio_extra *aio_ex = (struct aio_extra *)
+				pd->aiocb->aio_sigevent.sigev_value.sival_ptr;
+
+	if (pd->cancelled) {
+		/*
+		 * The file was closed. smbd_aio_complete_aio_ex()
+		 * only accounts for the request, we have to free it.
+		 */
+		smbd_aio_complete_aio_ex(aio_ex);
+		TALLOC_FREE(aio_ex);
+		return;
+	}
+
+	smbd_aio_complete_aio_ex(aio_ex);
+}
+
+/************************************************************************
+ Handle a job completion.
+***********************************************************************/
+
+static void aio_pthread_handle_completion(struct event_context *event_ctx,
+				struct fd_event *event,
+				uint16 flags,
+				void *p)
+{
+	struct aio_private_data *pd = NULL;
+
+	DEBUG(10, ("aio_pthread_handle_completion called with flags=%d\n",
+			(int)flags));
+
+	if ((flags & EVENT_FD_READ) == 0) {
+		return;
+	}
+
+	pd = aio_pthread_reap_job();
+	if (pd == NULL) {
+		return;
+	}
+
+	aio_pthread_deliver(pd);
+}
+
+/************************************************************************
+ Deliver jobs that completed while we were waiting in aio_suspend
+ for others.
+***********************************************************************/
+
+static void aio_pthread_deliver_pending(struct tevent_context *ctx,
+					struct tevent_immediate *im,
+					void *private_data)
+{
+	struct aio_private_data *pd, *next;
+
+	for (pd = pd_list; pd != NULL; pd = next) {
+		next = pd->next;
+
+		if (!pd->completed || pd->aiocb == NULL) {
+			continue;
+		}
+		aio_pthread_deliver(pd);
+	}
+}
+
+/************************************************************************
+ Get the return value for a job. The private data goes away with
+ the aio_extra struct it hangs off.
+***********************************************************************/
+
+static ssize_t aio_pthread_return_fn(struct vfs_handle_struct *handle,
+				struct files_struct *fsp,
+				SMB_STRUCT_AIOCB *aiocb)
+{
+	struct aio_private_data *pd = find_private_data_by_aiocb(aiocb);
+
+	if (pd == NULL) {
+		errno = EINVAL;
+		DEBUG(0, ("aio_pthread_return_fn: returning EINVAL\n"));
+		return -1;
+	}
+
+	pd->aiocb = NULL;
+
+	if (pd->cancelled) {
+		errno = ECANCELED;
+		return -1;
+	}
+
+	if (pd->ret_size == -1) {
+		errno = pd->ret_errno;
+	}
+
+	return pd->ret_size;
+}
+
+/************************************************************************
+ Get the error value for a job.
+***********************************************************************/
+
+static int aio_pthread_error_fn(struct vfs_handle_struct *handle,
+			     struct files_struct *fsp,
+			     SMB_STRUCT_AIOCB *aiocb)
+{
+	struct aio_private_data *pd = find_private_data_by_aiocb(aiocb);
+
+	if (pd == NULL) {
+		return EINVAL;
+	}
+	if (!pd->completed) {
+		return EINPROGRESS;
+	}
+	if (pd->cancelled) {
+		return ECANCELED;
+	}
+	return pd->ret_errno;
+}
+
+/************************************************************************
+ Cancel a job. The worker can't be stopped, we only make sure
+ its result is thrown away.
+***********************************************************************/
+
+static int aio_pthread_cancel(struct vfs_handle_struct *handle,
+			struct files_struct *fsp,
+			SMB_STRUCT_AIOCB *aiocb)
+{
+	struct aio_private_data *pd = NULL;
+
+	for (pd = pd_list; pd != NULL; pd = pd->next) {
+		if (pd->aiocb == NULL) {
+			continue;
+		}
+		if (pd->aiocb->aio_fildes != fsp->fh->fd) {
+			continue;
+		}
+		if ((aiocb != NULL) && (pd->aiocb != aiocb)) {
+			continue;
+		}
+
+		/*
+		 * We let the worker do its job, but we discard the result
+		 * when it's finished.
+		 */
+
+		pd->cancelled = true;
+	}
+
+	return AIO_CANCELED;
+}
+
+/************************************************************************
+ Wait for the given jobs to finish, used when closing a file.
+***********************************************************************/
+
+static int aio_pthread_suspend(struct vfs_handle_struct *handle,
+			struct files_struct *fsp,
+			const SMB_STRUCT_AIOCB * const aiocb_array[],
+			int n,
+			const struct timespec *timeout)
+{
+	struct timeval end_time;
+	int num_pending;
+	int i;
+
+	if (pool == NULL) {
+		/* Nothing was ever submitted */
+		return 0;
+	}
+
+	if (timeout != NULL) {
+		end_time = timeval_current_ofs(timeout->tv_sec,
+					       timeout->tv_nsec / 1000);
+	}
+
+	while (true) {
+		struct pollfd pfd;
+		int poll_timeout = -1;
+		int ret;
+		struct aio_private_data *pd;
+
+		num_pending = 0;
+
+		for (i = 0; i < n; i++) {
+			if (aiocb_array[i] == NULL) {
+				continue;
+			}
+			pd = find_private_data_by_aiocb(aiocb_array[i]);
+			if ((pd != NULL) && !pd->completed) {
+				num_pending += 1;
+			}
+		}
+
+		if (num_pending == 0) {
+			return 0;
+		}
+
+		if (timeout != NULL) {
+			struct timeval now = timeval_current();
+
+			if (timeval_compare(&now, &end_time) >= 0) {
+				errno = EAGAIN;
+				return -1;
+			}
+			poll_timeout = timeval_elapsed2(&now, &end_time)
+				* 1000;
+			poll_timeout = MAX(poll_timeout, 1);
+		}
+
+		/*
+		 * This is a blocking call, and must not call back into
+		 * smbd. Jobs we're not waiting for are delivered from
+		 * the main event loop later.
+		 */
+
+		ZERO_STRUCT(pfd);
+		pfd.fd = pthreadpool_signal_fd(pool);
+		pfd.events = POLLIN|POLLHUP;
+
+		ret = sys_poll(&pfd, 1, poll_timeout);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (ret == 0) {
+			continue;
+		}
+
+		pd = aio_pthread_reap_job();
+		if (pd == NULL) {
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (aiocb_array[i] == pd->aiocb) {
+				break;
+			}
+		}
+
+		if (i == n) {
+			if (aio_pthread_im == NULL) {
+				aio_pthread_im = tevent_create_immediate(NULL);
+				if (aio_pthread_im == NULL) {
+					errno = ENOMEM;
+					return -1;
+				}
+			}
+			tevent_schedule_immediate(aio_pthread_im,
+						  server_event_context(),
+						  aio_pthread_deliver_pending,
+						  NULL);
+		}
+	}
+}
+
+static struct vfs_fn_pointers vfs_aio_pthread_fns = {
+	.connect_fn = aio_pthread_connect,
+	.aio_read = aio_pthread_read,
+	.aio_write = aio_pthread_write,
+	.aio_fsync = aio_pthread_fsync,
+	.aio_return_fn = aio_pthread_return_fn,
+	.aio_cancel = aio_pthread_cancel,
+	.aio_error_fn = aio_pthread_error_fn,
+	.aio_suspend = aio_pthread_suspend,
+};
+
+NTSTATUS vfs_aio_pthread_init(void);
+NTSTATUS vfs_aio_pthread_init(void)
+{
+	return smb_register_vfs(SMB_VFS_INTERFACE_VERSION,
+				"aio_pthread", &vfs_aio_pthread_fns);
+}
@@ -25,6 +25,10 @@
 #include "ntioctl.h"
 #include "smbprofile.h"
 
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
 #undef DBGC_CLASS
 #define DBGC_CLASS DBGC_VFS
 
@@ -1007,6 +1011,118 @@ static int vfswrap_fallocate(vfs_handle_struct *handle,
 	return result;
 }
 
+/*
+ * Server side copy. The data is copied within the kernel with
+ * copy_file_range(2) where possible, filesystems supporting it
+ * (btrfs, xfs, nfs 4.2) share the extents instead of copying
+ * them. Otherwise fall back to bouncing the data through a buffer.
+ *
+ * Returns the number of bytes copied, which is short if the source
+ * file ends within the range or an error stopped the copy after some
+ * data was copied. Like for write(2), the next call reports the error.
+ */
+
+#define VFSWRAP_COPY_CHUNK_BUFSIZE (1024*1024)
+
+static ssize_t vfswrap_copy_chunk(vfs_handle_struct *handle,
+				  files_struct *src_fsp,
+				  SMB_OFF_T src_off,
+				  files_struct *dest_fsp,
+				  SMB_OFF_T dest_off,
+				  size_t num)
+{
+	size_t copied = 0;
+	size_t bufsize;
+	char *buf;
+	int saved_errno;
+
+#ifdef __NR_copy_file_range
+	static bool try_copy_file_range = true;
+
+	/*
+	 * Streams are left to the generic code, their fd does
+	 * not necessarily point at the stream data.
+	 */
+	if (try_copy_file_range &&
+	    (src_fsp->base_fsp == NULL) && (dest_fsp->base_fsp == NULL) &&
+	    (src_fsp->fh->fd != -1) && (dest_fsp->fh->fd != -1)) {
+		while (copied < num) {
+			loff_t in_off = src_off + copied;
+			loff_t out_off = dest_off + copied;
+			long ret;
+
+			ret = syscall(__NR_copy_file_range,
+				      src_fsp->fh->fd, &in_off,
+				      dest_fsp->fh->fd, &out_off,
+				      num - copied, 0);
+			if (ret == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == ENOSYS) {
+					try_copy_file_range = false;
+				}
+				DEBUG(10, ("vfswrap_copy_chunk: copy_file_range "
+					   "failed: %s, falling back\n",
+					   strerror(errno)));
+				break;
+			}
+			if (ret == 0) {
+				/* end of the source file */
+				return copied;
+			}
+			copied += ret;
+		}
+		if (copied == num) {
+			return copied;
+		}
+	}
+#endif
+
+	bufsize = MIN(num - copied, VFSWRAP_COPY_CHUNK_BUFSIZE);
+	buf = talloc_array(talloc_tos(), char, bufsize);
+	if (buf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	while (copied < num) {
+		size_t thistime = MIN(num - copied, bufsize);
+		ssize_t nread, nwritten;
+
+		nread = SMB_VFS_PREAD(src_fsp, buf, thistime,
+				      src_off + copied);
+		if (nread == -1) {
+			goto fail;
+		}
+		if (nread == 0) {
+			break;
+		}
+
+		nwritten = vfs_pwrite_data(NULL, dest_fsp, buf, nread,
+					   dest_off + copied);
+		if (nwritten == -1) {
+			goto fail;
+		}
+		copied += nwritten;
+		if (nwritten != nread) {
+			break;
+		}
+	}
+
+	TALLOC_FREE(buf);
+	return copied;
+
+ fail:
+	saved_errno = errno;
+	TALLOC_FREE(buf);
+	if (copied > 0) {
+		return copied;
+	}
+	errno = saved_errno;
+	return -1;
+}
+
 static bool vfswrap_lock(vfs_handle_struct *handle, files_struct *fsp, int op, SMB_OFF_T offset, SMB_OFF_T count, int type)
 {
 	bool result;
@@ -1706,6 +1822,7 @@ static struct vfs_fn_pointers vfs_default_fns = {
 	.ntimes = vfswrap_ntimes,
 	.ftruncate = vfswrap_ftruncate,
 	.fallocate = vfswrap_fallocate,
+	.copy_chunk = vfswrap_copy_chunk,
 	.lock = vfswrap_lock,
 	.kernel_flock = vfswrap_kernel_flock,
 	.linux_setlease = vfswrap_linux_setlease,
@@ -132,6 +132,7 @@ typedef enum _vfs_op_type {
 	SMB_VFS_OP_NTIMES,
 	SMB_VFS_OP_FTRUNCATE,
 	SMB_VFS_OP_FALLOCATE,
+	SMB_VFS_OP_COPY_CHUNK,
 	SMB_VFS_OP_LOCK,
 	SMB_VFS_OP_KERNEL_FLOCK,
 	SMB_VFS_OP_LINUX_SETLEASE,
@@ -272,6 +273,7 @@ static struct {
 	{ SMB_VFS_OP_NTIMES,	"ntimes" },
 	{ SMB_VFS_OP_FTRUNCATE,	"ftruncate" },
 	{ SMB_VFS_OP_FALLOCATE,"fallocate" },
+	{ SMB_VFS_OP_COPY_CHUNK,"copy_chunk" },
 	{ SMB_VFS_OP_LOCK,	"lock" },
 	{ SMB_VFS_OP_KERNEL_FLOCK,	"kernel_flock" },
 	{ SMB_VFS_OP_LINUX_SETLEASE, "linux_setlease" },
@@ -1263,6 +1265,24 @@ static int smb_full_audit_fallocate(vfs_handle_struct *handle, files_struct *fsp
 	return result;
 }
 
+static ssize_t smb_full_audit_copy_chunk(vfs_handle_struct *handle,
+					 files_struct *src_fsp,
+					 SMB_OFF_T src_off,
+					 files_struct *dest_fsp,
+					 SMB_OFF_T dest_off,
+					 size_t num)
+{
+	ssize_t result;
+
+	result = SMB_VFS_NEXT_COPY_CHUNK(handle, src_fsp, src_off,
+					 dest_fsp, dest_off, num);
+
+	do_log(SMB_VFS_OP_COPY_CHUNK, (result >= 0), handle,
+	       "%s|%s", fsp_str_do_log(src_fsp), fsp_str_do_log(dest_fsp));
+
+	return result;
+}
+
 static bool smb_full_audit_lock(vfs_handle_struct *handle, files_struct *fsp,
 		       int op, SMB_OFF_T offset, SMB_OFF_T count, int type)
 {
@@ -2284,6 +2304,7 @@ static struct vfs_fn_pointers vfs_full_audit_fns = {
 	.ntimes = smb_full_audit_ntimes,
 	.ftruncate = smb_full_audit_ftruncate,
 	.fallocate = smb_full_audit_fallocate,
+	.copy_chunk = smb_full_audit_copy_chunk,
 	.lock = smb_full_audit_lock,
 	.kernel_flock = smb_full_audit_kernel_flock,
 	.linux_setlease = smb_full_audit_linux_setlease,
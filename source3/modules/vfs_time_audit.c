@@ -949,6 +949,30 @@ static int smb_time_audit_fallocate(vfs_handle_struct *handle,
 	return result;
 }
 
+static ssize_t smb_time_audit_copy_chunk(vfs_handle_struct *handle,
+					 files_struct *src_fsp,
+					 SMB_OFF_T src_off,
+					 files_struct *dest_fsp,
+					 SMB_OFF_T dest_off,
+					 size_t num)
+{
+	ssize_t result;
+	struct timespec ts1,ts2;
+	double timediff;
+
+	clock_gettime_mono(&ts1);
+	result = SMB_VFS_NEXT_COPY_CHUNK(handle, src_fsp, src_off,
+					 dest_fsp, dest_off, num);
+	clock_gettime_mono(&ts2);
+	timediff = nsec_time_diff(&ts2,&ts1)*1.0e-9;
+
+	if (timediff > audit_timeout) {
+		smb_time_audit_log("copy_chunk", timediff);
+	}
+
+	return result;
+}
+
 static bool smb_time_audit_lock(vfs_handle_struct *handle, files_struct *fsp,
 				int op, SMB_OFF_T offset, SMB_OFF_T count,
 				int type)
@@ -2382,6 +2406,7 @@ static struct vfs_fn_pointers vfs_time_audit_fns = {
 	.ntimes = smb_time_audit_ntimes,
 	.ftruncate = smb_time_audit_ftruncate,
 	.fallocate = smb_time_audit_fallocate,
+	.copy_chunk = smb_time_audit_copy_chunk,
 	.lock = smb_time_audit_lock,
 	.kernel_flock = smb_time_audit_kernel_flock,
 	.linux_setlease = smb_time_audit_linux_setlease,
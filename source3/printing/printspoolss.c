@@ -22,6 +22,7 @@
 #include "rpc_client/rpc_client.h"
 #include "../librpc/gen_ndr/ndr_spoolss_c.h"
 #include "rpc_server/rpc_ncacn_np.h"
+#include "smbd/smbd.h"
 #include "smbd/globals.h"
 #include "../libcli/security/security.h"
 
@@ -188,9 +189,11 @@ NTSTATUS print_spool_open(files_struct *fsp,
 		goto done;
 	}
 
-	fsp->file_id = vfs_file_id_from_sbuf(fsp->conn, &fsp->fsp_name->st);
+	fsp_set_file_id(fsp, vfs_file_id_from_sbuf(fsp->conn,
+						   &fsp->fsp_name->st));
 	fsp->mode = fsp->fsp_name->st.st_ex_mode;
 	fsp->fh->fd = fd;
+	fsp_update_fd_hash(fsp);
 
 	fsp->vuid = current_vuid;
 	fsp->can_lock = false;
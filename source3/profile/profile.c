@@ -70,6 +70,11 @@ void set_profile_level(int level, struct server_id src)
 		DEBUG(1,("INFO: Profiling values cleared from pid %d\n",
 			 (int)procid_to_pid(&src)));
 		break;
+	case 4:		/* reset the latency histograms only */
+		memset((char *)profile_p->hist, 0, sizeof(profile_p->hist));
+		DEBUG(1,("INFO: Latency histograms cleared from pid %d\n",
+			 (int)procid_to_pid(&src)));
+		break;
 	}
 #else /* WITH_PROFILE */
 	DEBUG(1,("INFO: Profiling support unavailable in this build.\n"));
@@ -120,6 +125,96 @@ static void reqprofile_message(struct messaging_context *msg_ctx,
 			   (uint8 *)&level, sizeof(level));
 }
 
+/*
+ * Return the upper bound (in usec) of the histogram bucket the
+ * given fraction of the samples falls into.
+ */
+static void profile_percentile(const unsigned *hist, uint64_t total,
+			       double fraction, char *buf, size_t buflen)
+{
+	uint64_t rank = (uint64_t)(total * fraction + 0.999);
+	uint64_t sum = 0;
+	unsigned i;
+
+	for (i = 0; i < PROFILE_HIST_BUCKETS; i++) {
+		sum += hist[i];
+		if (sum >= rank) {
+			break;
+		}
+	}
+
+	if (i >= PROFILE_HIST_BUCKETS - 1) {
+		snprintf(buf, buflen, ">%llu",
+			 (unsigned long long)1 << (PROFILE_HIST_BUCKETS - 2));
+		return;
+	}
+	snprintf(buf, buflen, "%llu", (unsigned long long)1 << i);
+}
+
+/*******************************************************************
+ format the latency percentiles of all operations that have samples
+  ******************************************************************/
+char *profile_latency_string(TALLOC_CTX *mem_ctx)
+{
+	char *s;
+	int i;
+
+	s = talloc_asprintf(mem_ctx, "%-32s %10s %10s %10s %10s\n",
+			    "operation", "samples", "p50", "p99", "p999");
+
+	for (i = 0; (s != NULL) && (i < PR_VALUE_MAX); i++) {
+		unsigned hist[PROFILE_HIST_BUCKETS];
+		uint64_t total = 0;
+		char p50[16], p99[16], p999[16];
+		unsigned j;
+
+		/* take a copy, the smbds keep updating it */
+		memcpy(hist, profile_p->hist[i], sizeof(hist));
+
+		for (j = 0; j < PROFILE_HIST_BUCKETS; j++) {
+			total += hist[j];
+		}
+		if (total == 0) {
+			continue;
+		}
+
+		profile_percentile(hist, total, 0.5, p50, sizeof(p50));
+		profile_percentile(hist, total, 0.99, p99, sizeof(p99));
+		profile_percentile(hist, total, 0.999, p999, sizeof(p999));
+
+		s = talloc_asprintf_append_buffer(
+			s, "%-32s %10llu %10s %10s %10s\n",
+			profile_value_name(i), (unsigned long long)total,
+			p50, p99, p999);
+	}
+
+	return s;
+}
+
+/****************************************************************************
+receive a request for the latency percentiles
+****************************************************************************/
+static void reqlatency_message(struct messaging_context *msg_ctx,
+			       void *private_data,
+			       uint32_t msg_type,
+			       struct server_id src,
+			       DATA_BLOB *data)
+{
+	char *s;
+
+	DEBUG(1,("INFO: Received REQ_PROFILE_LATENCY message from PID %u\n",
+		 (unsigned int)procid_to_pid(&src)));
+
+	s = profile_latency_string(NULL);
+	if (s == NULL) {
+		return;
+	}
+
+	messaging_send_buf(msg_ctx, src, MSG_PROFILE_LATENCY,
+			   (uint8 *)s, strlen(s)+1);
+	TALLOC_FREE(s);
+}
+
 /*******************************************************************
   open the profiling shared memory area
   ******************************************************************/
@@ -195,6 +290,8 @@ bool profile_setup(struct messaging_context *msg_ctx, bool rdonly)
 				   profile_message);
 		messaging_register(msg_ctx, NULL, MSG_REQ_PROFILELEVEL,
 				   reqprofile_message);
+		messaging_register(msg_ctx, NULL, MSG_REQ_PROFILE_LATENCY,
+				   reqlatency_message);
 	}
 	return True;
 }
@@ -205,6 +302,7 @@ bool profile_setup(struct messaging_context *msg_ctx, bool rdonly)
 	{
 	    "smbd_idle",		/* PR_VALUE_SMBD_IDLE */
 	    "syscall_opendir",		/* PR_VALUE_SYSCALL_OPENDIR */
+	    "syscall_fdopendir",	/* PR_VALUE_SYSCALL_FDOPENDIR */
 	    "syscall_readdir",		/* PR_VALUE_SYSCALL_READDIR */
 	    "syscall_seekdir",		/* PR_VALUE_SYSCALL_SEEKDIR */
 	    "syscall_telldir",		/* PR_VALUE_SYSCALL_TELLDIR */
@@ -228,11 +326,13 @@ bool profile_setup(struct messaging_context *msg_ctx, bool rdonly)
 	    "syscall_stat",		/* PR_VALUE_SYSCALL_STAT */
 	    "syscall_fstat",		/* PR_VALUE_SYSCALL_FSTAT */
 	    "syscall_lstat",		/* PR_VALUE_SYSCALL_LSTAT */
+	    "syscall_get_alloc_size",	/* PR_VALUE_SYSCALL_GET_ALLOC_SIZE */
 	    "syscall_unlink",		/* PR_VALUE_SYSCALL_UNLINK */
 	    "syscall_chmod",		/* PR_VALUE_SYSCALL_CHMOD */
 	    "syscall_fchmod",		/* PR_VALUE_SYSCALL_FCHMOD */
 	    "syscall_chown",		/* PR_VALUE_SYSCALL_CHOWN */
 	    "syscall_fchown",		/* PR_VALUE_SYSCALL_FCHOWN */
+	    "syscall_lchown",		/* PR_VALUE_SYSCALL_LCHOWN */
 	    "syscall_chdir",		/* PR_VALUE_SYSCALL_CHDIR */
 	    "syscall_getwd",		/* PR_VALUE_SYSCALL_GETWD */
 	    "syscall_ntimes",		/* PR_VALUE_SYSCALL_NTIMES */
@@ -254,6 +354,8 @@ bool profile_setup(struct messaging_context *msg_ctx, bool rdonly)
 	    "syscall_brl_lock",		/* PR_VALUE_SYSCALL_BRL_LOCK */
 	    "syscall_brl_unlock",	/* PR_VALUE_SYSCALL_BRL_UNLOCK */
 	    "syscall_brl_cancel",	/* PR_VALUE_SYSCALL_BRL_CANCEL */
+	    "syscall_strict_lock",	/* PR_VALUE_SYSCALL_STRICT_LOCK */
+	    "syscall_strict_unlock",	/* PR_VALUE_SYSCALL_STRICT_UNLOCK */
 	    "SMBmkdir",		/* PR_VALUE_SMBMKDIR */
 	    "SMBrmdir",		/* PR_VALUE_SMBRMDIR */
 	    "SMBopen",		/* PR_VALUE_SMBOPEN */
@@ -379,7 +481,7 @@ bool profile_setup(struct messaging_context *msg_ctx, bool rdonly)
 	    "run_elections",		/* PR_VALUE_RUN_ELECTIONS */
 	    "election",			/* PR_VALUE_ELECTION */
 	    "smb2_negprot",		/* PR_VALUE_SMB2_NEGPROT */
-	    "smb2_sesssetup",		/* PR_VALUE_SMB2_SESSETUP */
+	    "smb2_sesssetup",		/* PR_VALUE_SMB2_SESSSETUP */
 	    "smb2_logoff",		/* PR_VALUE_SMB2_LOGOFF */
 	    "smb2_tcon",		/* PR_VALUE_SMB2_TCON */
 	    "smb2_tdis",		/* PR_VALUE_SMB2_TDIS */
@@ -395,7 +497,7 @@ bool profile_setup(struct messaging_context *msg_ctx, bool rdonly)
 	    "smb2_find",		/* PR_VALUE_SMB2_FIND */
 	    "smb2_notify",		/* PR_VALUE_SMB2_NOTIFY */
 	    "smb2_getinfo",		/* PR_VALUE_SMB2_GETINFO */
-	    "smb2_setinfo"		/* PR_VALUE_SMB2_SETINFO */
+	    "smb2_setinfo",		/* PR_VALUE_SMB2_SETINFO */
 	    "smb2_break",		/* PR_VALUE_SMB2_BREAK */
 	    "" /* PR_VALUE_MAX */
 	};
@@ -19,6 +19,7 @@
 */
 
 #include "includes.h"
+#include "system/filesys.h"
 #include "smbd/smbd.h"
 #include "smbd/globals.h"
 #include "../lib/util/tevent_ntstatus.h"
@@ -50,6 +51,21 @@ struct aio_extra {
 	struct lock_struct lock;
 	bool write_through;
 	int (*handle_completion)(struct aio_extra *ex, int errcode);
+
+	/*
+	 * An SMB2 request can go away whilst its I/O is still running,
+	 * for example when wait_for_aio_completion() gave up on it. So
+	 * the aio_extra of an SMB2 request is not a child of the request
+	 * but lives until the I/O is reaped, and the memory the I/O works
+	 * on is moved under it until then.
+	 */
+	struct aio_smb2_link *smb2_link;
+	void *smb2_buf;
+	TALLOC_CTX *smb2_buf_ctx;
+};
+
+struct aio_smb2_link {
+	struct aio_extra *aio_ex;
 };
 
 /****************************************************************************
@@ -98,15 +114,87 @@ static bool initialize_async_io_handler(void)
 
 static int handle_aio_read_complete(struct aio_extra *aio_ex, int errcode);
 static int handle_aio_write_complete(struct aio_extra *aio_ex, int errcode);
+static int handle_aio_flush_complete(struct aio_extra *aio_ex, int errcode);
 static int handle_aio_smb2_read_complete(struct aio_extra *aio_ex, int errcode);
 static int handle_aio_smb2_write_complete(struct aio_extra *aio_ex, int errcode);
+static int handle_aio_smb2_flush_complete(struct aio_extra *aio_ex, int errcode);
+
+/****************************************************************************
+ Hand the I/O buffer back to the SMB2 request once we're done with it.
+*****************************************************************************/
+
+static void aio_extra_return_smb2_buf(struct aio_extra *aio_ex)
+{
+	if ((aio_ex->smb2_link != NULL) && (aio_ex->smb2_buf != NULL)) {
+		talloc_steal(aio_ex->smb2_buf_ctx, aio_ex->smb2_buf);
+	}
+	aio_ex->smb2_buf = NULL;
+	aio_ex->smb2_buf_ctx = NULL;
+}
 
 static int aio_extra_destructor(struct aio_extra *aio_ex)
 {
 	DLIST_REMOVE(aio_list_head, aio_ex);
+
+	aio_extra_return_smb2_buf(aio_ex);
+	if (aio_ex->smb2_link != NULL) {
+		aio_ex->smb2_link->aio_ex = NULL;
+		TALLOC_FREE(aio_ex->smb2_link);
+	}
 	return 0;
 }
 
+/****************************************************************************
+ The SMB2 request goes away before its I/O was reaped. The buffer stays
+ with the aio_extra and is freed when the I/O has completed.
+*****************************************************************************/
+
+static int aio_smb2_link_destructor(struct aio_smb2_link *link)
+{
+	if (link->aio_ex != NULL) {
+		link->aio_ex->smbreq = NULL;
+		link->aio_ex->smb2_link = NULL;
+	}
+	return 0;
+}
+
+/****************************************************************************
+ Tie an aio_extra to its SMB2 request. "buf" is the talloc chunk holding
+ the memory the I/O works on, it belongs to the aio_extra until the I/O
+ has completed and is then given back to "buf_ctx".
+*****************************************************************************/
+
+static bool aio_extra_link_smb2(struct aio_extra *aio_ex,
+				struct smb_request *smbreq,
+				void *buf, TALLOC_CTX *buf_ctx)
+{
+	struct aio_smb2_link *link;
+
+	link = talloc(smbreq->smb2req, struct aio_smb2_link);
+	if (link == NULL) {
+		return false;
+	}
+	link->aio_ex = aio_ex;
+	talloc_set_destructor(link, aio_smb2_link_destructor);
+
+	aio_ex->smb2_link = link;
+	aio_ex->smbreq = smbreq;
+
+	if (buf != NULL) {
+		aio_ex->smb2_buf = talloc_steal(aio_ex, buf);
+		aio_ex->smb2_buf_ctx = buf_ctx;
+	}
+	return true;
+}
+
+static unsigned long long aio_extra_mid(struct aio_extra *aio_ex)
+{
+	if (aio_ex->smbreq == NULL) {
+		return 0;
+	}
+	return (unsigned long long)aio_ex->smbreq->mid;
+}
+
 /****************************************************************************
  Create the extended aio struct we must keep around for the lifetime
  of the aio call.
@@ -436,11 +524,16 @@ NTSTATUS schedule_smb2_aio_read(connection_struct *conn,
 		return NT_STATUS_NO_MEMORY;
 	}
 
-	if (!(aio_ex = create_aio_extra(smbreq->smb2req, fsp, 0))) {
+	if (!(aio_ex = create_aio_extra(NULL, fsp, 0))) {
 		return NT_STATUS_NO_MEMORY;
 	}
 	aio_ex->handle_completion = handle_aio_smb2_read_complete;
 
+	if (!aio_extra_link_smb2(aio_ex, smbreq, preadbuf->data, ctx)) {
+		TALLOC_FREE(aio_ex);
+		return NT_STATUS_NO_MEMORY;
+	}
+
 	init_strict_lock_struct(fsp, (uint64_t)smbreq->smbpid,
 		(uint64_t)startpos, (uint64_t)smb_maxcnt, READ_LOCK,
 		&aio_ex->lock);
@@ -473,9 +566,6 @@ NTSTATUS schedule_smb2_aio_read(connection_struct *conn,
 	}
 
 	outstanding_aio_calls++;
-	/* We don't need talloc_move here as both aio_ex and
-	 * smbreq are children of smbreq->smb2req. */
-	aio_ex->smbreq = smbreq;
 
 	DEBUG(10,("smb2: scheduled aio_read for file %s, "
 		"offset %.0f, len = %u (mid = %u)\n",
@@ -534,13 +624,21 @@ NTSTATUS schedule_aio_smb2_write(connection_struct *conn,
 		return NT_STATUS_RETRY;
 	}
 
-	if (!(aio_ex = create_aio_extra(smbreq->smb2req, fsp, 0))) {
+	if (!(aio_ex = create_aio_extra(NULL, fsp, 0))) {
 		return NT_STATUS_NO_MEMORY;
 	}
 
 	aio_ex->handle_completion = handle_aio_smb2_write_complete;
 	aio_ex->write_through = write_through;
 
+	/* in_data points into the buffers hanging off the in vector. */
+	if (!aio_extra_link_smb2(aio_ex, smbreq,
+				 smbreq->smb2req->in.vector,
+				 smbreq->smb2req)) {
+		TALLOC_FREE(aio_ex);
+		return NT_STATUS_NO_MEMORY;
+	}
+
 	init_strict_lock_struct(fsp, (uint64_t)smbreq->smbpid,
 		in_offset, (uint64_t)in_data.length, WRITE_LOCK,
 		&aio_ex->lock);
@@ -573,9 +671,6 @@ NTSTATUS schedule_aio_smb2_write(connection_struct *conn,
 	}
 
 	outstanding_aio_calls++;
-	/* We don't need talloc_move here as both aio_ex and
-	* smbreq are children of smbreq->smb2req. */
-	aio_ex->smbreq = smbreq;
 
 	/* This should actually be improved to span the write. */
 	contend_level2_oplocks_begin(fsp, LEVEL2_CONTEND_WRITE);
@@ -599,6 +694,92 @@ NTSTATUS schedule_aio_smb2_write(connection_struct *conn,
 	return NT_STATUS_OK;
 }
 
+/****************************************************************************
+ Set up an aio request from a SMBflush call for a single file.
+*****************************************************************************/
+
+NTSTATUS schedule_aio_flush(connection_struct *conn,
+			    struct smb_request *smbreq,
+			    files_struct *fsp)
+{
+	struct aio_extra *aio_ex;
+	SMB_STRUCT_AIOCB *a;
+	int ret;
+
+	/* Ensure aio is initialized. */
+	if (!initialize_async_io_handler()) {
+		return NT_STATUS_RETRY;
+	}
+
+	if (fsp->base_fsp != NULL) {
+		/* No AIO on streams yet */
+		DEBUG(10, ("AIO on streams not yet supported\n"));
+		return NT_STATUS_RETRY;
+	}
+
+	if (!lp_aio_write_size(SNUM(conn)) && !SMB_VFS_AIO_FORCE(fsp)) {
+		/* No aio writes, no aio flushes. */
+		return NT_STATUS_RETRY;
+	}
+
+	/*
+	 * Only do this on non-chained requests when sync_file() would
+	 * really call fsync and there is no write cache to flush first.
+	 */
+	if (req_is_in_chain(smbreq) || !lp_strict_sync(SNUM(conn)) ||
+	    (lp_write_cache_size(SNUM(conn)) != 0)) {
+		return NT_STATUS_RETRY;
+	}
+
+	if (outstanding_aio_calls >= aio_pending_size) {
+		DEBUG(3,("schedule_aio_flush: Already have %d aio "
+			 "activities outstanding.\n",
+			  outstanding_aio_calls ));
+		return NT_STATUS_RETRY;
+	}
+
+	if (!(aio_ex = create_aio_extra(NULL, fsp, smb_size))) {
+		DEBUG(0,("schedule_aio_flush: malloc fail.\n"));
+		return NT_STATUS_NO_MEMORY;
+	}
+	aio_ex->handle_completion = handle_aio_flush_complete;
+
+	construct_reply_common_req(smbreq, (char *)aio_ex->outbuf.data);
+	srv_set_message((char *)aio_ex->outbuf.data, 0, 0, True);
+
+	/*
+	 * aio_ex->lock stays zeroed, a zero length lock is
+	 * never checked or released.
+	 */
+
+	a = &aio_ex->acb;
+
+	/* Now set up the aio record for the fsync call. */
+
+	a->aio_fildes = fsp->fh->fd;
+	a->aio_sigevent.sigev_notify = SIGEV_SIGNAL;
+	a->aio_sigevent.sigev_signo  = RT_SIGNAL_AIO;
+	a->aio_sigevent.sigev_value.sival_ptr = aio_ex;
+
+	ret = SMB_VFS_AIO_FSYNC(fsp, O_SYNC, a);
+	if (ret == -1) {
+		DEBUG(3,("schedule_aio_flush: aio_fsync failed. "
+			 "Error %s\n", strerror(errno) ));
+		TALLOC_FREE(aio_ex);
+		return NT_STATUS_RETRY;
+	}
+
+	outstanding_aio_calls++;
+	aio_ex->smbreq = talloc_move(aio_ex, &smbreq);
+
+	DEBUG(10,("schedule_aio_flush: scheduled aio_fsync for file %s "
+		  "(mid = %u) outstanding_aio_calls = %d\n",
+		  fsp_str_dbg(fsp), (unsigned int)aio_ex->smbreq->mid,
+		  outstanding_aio_calls ));
+
+	return NT_STATUS_OK;
+}
+
 /****************************************************************************
  Complete the read and return the data or error back to the client.
  Returns errno or zero if all ok.
@@ -747,6 +928,128 @@ static int handle_aio_write_complete(struct aio_extra *aio_ex, int errcode)
 	return errcode;
 }
 
+/****************************************************************************
+ Complete the flush and return the result back to the client.
+ Returns error code or zero if all ok.
+*****************************************************************************/
+
+static int handle_aio_flush_complete(struct aio_extra *aio_ex, int errcode)
+{
+	files_struct *fsp = aio_ex->fsp;
+	char *outbuf = (char *)aio_ex->outbuf.data;
+	ssize_t ret = SMB_VFS_AIO_RETURN(fsp,&aio_ex->acb);
+
+	if (ret == -1) {
+		DEBUG(5,("handle_aio_flush_complete: fsync for %s returned "
+			 "%s\n", fsp_str_dbg(fsp), strerror(errcode)));
+		ERROR_NT(map_nt_error_from_unix(errcode));
+		srv_set_message(outbuf,0,0,true);
+	}
+
+	show_msg(outbuf);
+	if (!srv_send_smb(aio_ex->smbreq->sconn, outbuf,
+			  true, aio_ex->smbreq->seqnum+1,
+			  IS_CONN_ENCRYPTED(fsp->conn),
+			  NULL)) {
+		exit_server_cleanly("handle_aio_flush_complete: "
+				    "srv_send_smb failed.");
+	}
+
+	DEBUG(10,("handle_aio_flush_complete: scheduled aio_fsync completed "
+		  "for file %s (errcode = %d)\n",
+		  fsp_str_dbg(fsp), errcode ));
+
+	return errcode;
+}
+
+/****************************************************************************
+ Set up an aio request from a SMB2flush call.
+*****************************************************************************/
+
+NTSTATUS schedule_aio_smb2_flush(connection_struct *conn,
+				struct smb_request *smbreq,
+				files_struct *fsp)
+{
+	struct aio_extra *aio_ex = NULL;
+	SMB_STRUCT_AIOCB *a = NULL;
+	int ret;
+
+	/* Ensure aio is initialized. */
+	if (!initialize_async_io_handler()) {
+		return NT_STATUS_RETRY;
+	}
+
+	if (fsp->base_fsp != NULL) {
+		/* No AIO on streams yet */
+		DEBUG(10, ("AIO on streams not yet supported\n"));
+		return NT_STATUS_RETRY;
+	}
+
+	if (!lp_aio_write_size(SNUM(conn)) && !SMB_VFS_AIO_FORCE(fsp)) {
+		/* No aio writes, no aio flushes. */
+		return NT_STATUS_RETRY;
+	}
+
+	/*
+	 * Only do this when sync_file() would really call fsync
+	 * and there is no write cache to flush first.
+	 */
+	if (!lp_strict_sync(SNUM(conn)) ||
+	    (lp_write_cache_size(SNUM(conn)) != 0)) {
+		return NT_STATUS_RETRY;
+	}
+
+	if (outstanding_aio_calls >= aio_pending_size) {
+		DEBUG(3,("smb2: Already have %d aio "
+			"activities outstanding.\n",
+			outstanding_aio_calls ));
+		return NT_STATUS_RETRY;
+	}
+
+	if (!(aio_ex = create_aio_extra(NULL, fsp, 0))) {
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	aio_ex->handle_completion = handle_aio_smb2_flush_complete;
+
+	if (!aio_extra_link_smb2(aio_ex, smbreq, NULL, NULL)) {
+		TALLOC_FREE(aio_ex);
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	/*
+	 * aio_ex->lock stays zeroed, a zero length lock is
+	 * never checked or released.
+	 */
+
+	a = &aio_ex->acb;
+
+	/* Now set up the aio record for the fsync call. */
+
+	a->aio_fildes = fsp->fh->fd;
+	a->aio_sigevent.sigev_notify = SIGEV_SIGNAL;
+	a->aio_sigevent.sigev_signo  = RT_SIGNAL_AIO;
+	a->aio_sigevent.sigev_value.sival_ptr = aio_ex;
+
+	ret = SMB_VFS_AIO_FSYNC(fsp, O_SYNC, a);
+	if (ret == -1) {
+		DEBUG(3,("smb2: aio_fsync failed. "
+			"Error %s\n", strerror(errno) ));
+		TALLOC_FREE(aio_ex);
+		return NT_STATUS_RETRY;
+	}
+
+	outstanding_aio_calls++;
+
+	DEBUG(10,("smb2: scheduled aio_fsync for file "
+		"%s (mid = %u) outstanding_aio_calls = %d\n",
+		fsp_str_dbg(fsp),
+		(unsigned int)aio_ex->smbreq->mid,
+		outstanding_aio_calls ));
+
+	return NT_STATUS_OK;
+}
+
 /****************************************************************************
  Complete the read and return the data or error back to the client.
  Returns errno or zero if all ok.
@@ -818,6 +1121,37 @@ static int handle_aio_smb2_write_complete(struct aio_extra *aio_ex, int errcode)
 	return errcode;
 }
 
+/****************************************************************************
+ Complete the SMB2 flush and return the result back to the client.
+ Returns error code or zero if all ok.
+*****************************************************************************/
+
+static int handle_aio_smb2_flush_complete(struct aio_extra *aio_ex, int errcode)
+{
+	files_struct *fsp = aio_ex->fsp;
+	ssize_t ret = SMB_VFS_AIO_RETURN(fsp,&aio_ex->acb);
+	struct tevent_req *subreq = aio_ex->smbreq->smb2req->subreq;
+	NTSTATUS status = NT_STATUS_OK;
+
+	if (ret == -1) {
+		status = map_nt_error_from_unix(errcode);
+	}
+
+	DEBUG(10,("smb2: scheduled aio_fsync completed "
+		"for file %s (errcode = %d, NTSTATUS = %s)\n",
+		fsp_str_dbg(fsp),
+		errcode,
+		nt_errstr(status) ));
+
+	if (!NT_STATUS_IS_OK(status)) {
+		tevent_req_nterror(subreq, status);
+		return errcode;
+	}
+
+	tevent_req_done(subreq);
+	return errcode;
+}
+
 /****************************************************************************
  Handle any aio completion. Returns True if finished (and sets *perr if err
  was non-zero), False if not.
@@ -840,7 +1174,7 @@ static bool handle_aio_completed(struct aio_extra *aio_ex, int *perr)
 	if (err == EINPROGRESS) {
 		DEBUG(10,( "handle_aio_completed: operation mid %llu still in "
 			"process for file %s\n",
-			(unsigned long long)aio_ex->smbreq->mid,
+			aio_extra_mid(aio_ex),
 			fsp_str_dbg(aio_ex->fsp)));
 		return False;
 	}
@@ -848,15 +1182,26 @@ static bool handle_aio_completed(struct aio_extra *aio_ex, int *perr)
 	/* Unlock now we're done. */
 	SMB_VFS_STRICT_UNLOCK(fsp->conn, fsp, &aio_ex->lock);
 
+	aio_extra_return_smb2_buf(aio_ex);
+
 	if (err == ECANCELED) {
 		/* If error is ECANCELED then don't return anything to the
 		 * client. */
 	        DEBUG(10,( "handle_aio_completed: operation mid %llu"
 			" canceled\n",
-			(unsigned long long)aio_ex->smbreq->mid));
+			aio_extra_mid(aio_ex)));
 		return True;
         }
 
+	if (aio_ex->smbreq == NULL) {
+		/* The request went away whilst the I/O was running. */
+		DEBUG(3, ("handle_aio_completed: request for file %s gone "
+			  "whilst aio outstanding\n",
+			  fsp_str_dbg(aio_ex->fsp)));
+		SMB_VFS_AIO_RETURN(fsp, &aio_ex->acb);
+		return True;
+	}
+
 	err = aio_ex->handle_completion(aio_ex, err);
 	if (err) {
 		*perr = err; /* Only save non-zero errors. */
@@ -877,7 +1222,7 @@ void smbd_aio_complete_aio_ex(struct aio_extra *aio_ex)
 	outstanding_aio_calls--;
 
 	DEBUG(10,("smbd_aio_complete_mid: mid[%llu]\n",
-		(unsigned long long)aio_ex->smbreq->mid));
+		aio_extra_mid(aio_ex)));
 
 	fsp = aio_ex->fsp;
 	if (fsp == NULL) {
@@ -885,7 +1230,7 @@ void smbd_aio_complete_aio_ex(struct aio_extra *aio_ex)
 		 * ignore. */
 		DEBUG( 3,( "smbd_aio_complete_mid: file closed whilst "
 			"aio outstanding (mid[%llu]).\n",
-			(unsigned long long)aio_ex->smbreq->mid));
+			aio_extra_mid(aio_ex)));
 		return;
 	}
 
@@ -1037,6 +1382,13 @@ NTSTATUS schedule_aio_write_and_X(connection_struct *conn,
 	return NT_STATUS_RETRY;
 }
 
+NTSTATUS schedule_aio_flush(connection_struct *conn,
+			    struct smb_request *smbreq,
+			    files_struct *fsp)
+{
+	return NT_STATUS_RETRY;
+}
+
 NTSTATUS schedule_smb2_aio_read(connection_struct *conn,
                                 struct smb_request *smbreq,
                                 files_struct *fsp,
@@ -1058,6 +1410,13 @@ NTSTATUS schedule_aio_smb2_write(connection_struct *conn,
 	return NT_STATUS_RETRY;
 }
 
+NTSTATUS schedule_aio_smb2_flush(connection_struct *conn,
+				struct smb_request *smbreq,
+				files_struct *fsp)
+{
+	return NT_STATUS_RETRY;
+}
+
 void cancel_aio_by_fsp(files_struct *fsp)
 {
 }
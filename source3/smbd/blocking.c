@@ -693,7 +693,8 @@ bool blocking_lock_was_deferred_smb1(
 }
 
 /****************************************************************************
-  Set a flag as an unlock request affects one of our pending locks.
+ An unlock request affects one of our pending locks. brlock tells us the
+ file, older senders don't.
 *****************************************************************************/
 
 static void received_unlock_msg(struct messaging_context *msg,
@@ -703,6 +704,7 @@ static void received_unlock_msg(struct messaging_context *msg,
 				DATA_BLOB *data)
 {
 	struct smbd_server_connection *sconn;
+	struct file_id id;
 
 	sconn = msg_ctx_to_sconn(msg);
 	if (sconn == NULL) {
@@ -710,8 +712,16 @@ static void received_unlock_msg(struct messaging_context *msg,
 		return;
 	}
 
-	DEBUG(10,("received_unlock_msg\n"));
-	process_blocking_lock_queue(sconn);
+	if (data->length != 24) {
+		DEBUG(10,("received_unlock_msg\n"));
+		process_blocking_lock_queue(sconn);
+		return;
+	}
+
+	pull_file_id_24((char *)data->data, &id);
+	DEBUG(10,("received_unlock_msg for file %s\n",
+		  file_id_string_tos(&id)));
+	process_blocking_lock_queue_file(sconn, &id);
 }
 
 /****************************************************************************
@@ -719,12 +729,22 @@ static void received_unlock_msg(struct messaging_context *msg,
 *****************************************************************************/
 
 void process_blocking_lock_queue(struct smbd_server_connection *sconn)
+{
+	process_blocking_lock_queue_file(sconn, NULL);
+}
+
+/****************************************************************************
+ Process the blocking locks on one file, on all files if id is NULL.
+*****************************************************************************/
+
+void process_blocking_lock_queue_file(struct smbd_server_connection *sconn,
+				      const struct file_id *id)
 {
 	struct timeval tv_curr = timeval_current();
 	struct blocking_lock_record *blr, *next = NULL;
 
 	if (sconn->using_smb2) {
-		process_blocking_lock_queue_smb2(sconn, tv_curr);
+		process_blocking_lock_queue_smb2(sconn, tv_curr, id);
 		return;
 	}
 
@@ -736,6 +756,10 @@ void process_blocking_lock_queue(struct smbd_server_connection *sconn)
 
 		next = blr->next;
 
+		if ((id != NULL) && !file_id_equal(&blr->fsp->file_id, id)) {
+			continue;
+		}
+
 		/*
 		 * Go through the remaining locks and try and obtain them.
 		 * The call returns True if all locks were obtained successfully
@@ -156,7 +156,10 @@ static NTSTATUS close_filestruct(files_struct *fsp)
 }
 
 /****************************************************************************
- If any deferred opens are waiting on this close, notify them.
+ If any deferred opens are waiting on this close, notify them. Opens
+ deferred for a sharing violation are only woken once they would get past
+ the share mode check, the others stay parked until the next close or
+ their timeout.
 ****************************************************************************/
 
 static void notify_deferred_opens(struct messaging_context *msg_ctx,
@@ -174,6 +177,13 @@ static void notify_deferred_opens(struct messaging_context *msg_ctx,
  		if (!is_deferred_open_entry(e)) {
  			continue;
  		}
+
+		if (!deferred_open_can_proceed(lck, e)) {
+			DEBUG(10, ("notify_deferred_opens: mid %llu still "
+				   "conflicts, not waking it\n",
+				   (unsigned long long)e->op_mid));
+			continue;
+		}
  
  		if (procid_is_me(&e->pid)) {
  			/*
@@ -49,6 +49,11 @@ struct smb_Dir {
 	struct name_cache_entry *name_cache;
 	unsigned int name_cache_index;
 	unsigned int file_number;
+
+	/* entries come from a dircache snapshot instead of readdir */
+	struct dircache_snapshot *snap;
+	bool snap_mode_valid;
+	uint32_t snap_mode;
 };
 
 struct dptr_struct {
@@ -554,6 +559,18 @@ NTSTATUS dptr_create(connection_struct *conn, files_struct *fsp,
 
 	dptr->attr = attr;
 
+	if (dptr->has_wild && dircache_enabled(conn)) {
+		dir_hnd->snap = dircache_fetch(dir_hnd, conn, path);
+		if ((dir_hnd->snap == NULL) && (strequal(wcard, "*") || strequal(wcard, "*.*"))) {
+			/*
+			 * A search for all entries reads and stats the
+			 * whole directory anyway, take a snapshot of it
+			 * on the way.
+			 */
+			dir_hnd->snap = dircache_build(dir_hnd, conn, path);
+		}
+	}
+
 	DLIST_ADD(sconn->searches.dirptrs, dptr);
 
 	DEBUG(3,("creating new dirptr %d for path %s, expect_close = %d\n",
@@ -650,6 +667,7 @@ char *dptr_ReadDirName(TALLOC_CTX *ctx,
 	int ret;
 
 	SET_STAT_INVALID(*pst);
+	dptr->dir_hnd->snap_mode_valid = false;
 
 	if (dptr->has_wild || dptr->did_stat) {
 		name_temp = dptr_normal_ReadDirName(dptr, poffset, pst,
@@ -787,6 +805,80 @@ void dptr_DirCacheAdd(struct dptr_struct *dptr, const char *name, long offset)
 	DirCacheAdd(dptr->dir_hnd, name, offset);
 }
 
+/****************************************************************************
+ Return the DOS attributes of the entry just read, if they came from a
+ dircache snapshot together with its stat information.
+****************************************************************************/
+
+bool dptr_cached_dos_mode(struct dptr_struct *dptr, uint32_t *mode)
+{
+	if (!dptr->dir_hnd->snap_mode_valid) {
+		return false;
+	}
+	*mode = dptr->dir_hnd->snap_mode;
+	return true;
+}
+
+/****************************************************************************
+ Return the names of up to max_names directory entries following the next
+ skip entries, without moving the current position. Used to prefetch the
+ metadata of entries the next dptr_ReadDirName() calls will return.
+****************************************************************************/
+
+char **dptr_peek_names(TALLOC_CTX *mem_ctx, struct dptr_struct *dptr,
+		       unsigned int skip, unsigned int max_names,
+		       unsigned int *num_names)
+{
+	struct smb_Dir *dirp = dptr->dir_hnd;
+	long saved_offset = dirp->offset;
+	unsigned int saved_file_number = dirp->file_number;
+	long offset = dirp->offset;
+	char **names;
+	const char *n;
+	char *talloced = NULL;
+	unsigned int num = 0;
+
+	*num_names = 0;
+
+	if ((dirp->snap != NULL) ||
+	    (saved_offset == END_OF_DIRECTORY_OFFSET)) {
+		/* Snapshots carry their own stat information. */
+		return NULL;
+	}
+
+	names = talloc_array(mem_ctx, char *, max_names);
+	if (names == NULL) {
+		return NULL;
+	}
+
+	while ((num < max_names) &&
+	       ((n = ReadDirName(dirp, &offset, NULL, &talloced)) != NULL)) {
+		if ((strcmp(n, ".") == 0) || (strcmp(n, "..") == 0)) {
+			continue;
+		}
+		if (skip > 0) {
+			skip -= 1;
+			TALLOC_FREE(talloced);
+			continue;
+		}
+		names[num] = talloc_strdup(names, n);
+		TALLOC_FREE(talloced);
+		if (names[num] == NULL) {
+			break;
+		}
+		num += 1;
+	}
+
+	SeekDir(dirp, saved_offset);
+	dirp->file_number = saved_file_number;
+
+	if (num == 0) {
+		TALLOC_FREE(names);
+	}
+	*num_names = num;
+	return names;
+}
+
 /****************************************************************************
  Initialize variables & state data at the beginning of all search SMB requests.
 ****************************************************************************/
@@ -1051,7 +1143,8 @@ static bool smbd_dirptr_8_3_match_fn(TALLOC_CTX *ctx,
 				     const char *mask,
 				     char **_fname)
 {
-	connection_struct *conn = (connection_struct *)private_data;
+	struct dptr_struct *dirptr = (struct dptr_struct *)private_data;
+	connection_struct *conn = dirptr->conn;
 
 	if ((strcmp(mask,"*.*") == 0) ||
 	    mask_match_search(dname, mask, false) ||
@@ -1086,7 +1179,13 @@ static bool smbd_dirptr_8_3_mode_fn(TALLOC_CTX *ctx,
 				    struct smb_filename *smb_fname,
 				    uint32_t *_mode)
 {
-	connection_struct *conn = (connection_struct *)private_data;
+	struct dptr_struct *dirptr = (struct dptr_struct *)private_data;
+	connection_struct *conn = dirptr->conn;
+
+	if (VALID_STAT(smb_fname->st) &&
+	    dptr_cached_dos_mode(dirptr, _mode)) {
+		return true;
+	}
 
 	if (!VALID_STAT(smb_fname->st)) {
 		if ((SMB_VFS_STAT(conn, smb_fname)) != 0) {
@@ -1114,7 +1213,6 @@ bool get_dir_entry(TALLOC_CTX *ctx,
 		bool check_descend,
 		bool ask_sharemode)
 {
-	connection_struct *conn = dirptr->conn;
 	char *fname = NULL;
 	struct smb_filename *smb_fname = NULL;
 	uint32_t mode = 0;
@@ -1129,7 +1227,7 @@ bool get_dir_entry(TALLOC_CTX *ctx,
 				   ask_sharemode,
 				   smbd_dirptr_8_3_match_fn,
 				   smbd_dirptr_8_3_mode_fn,
-				   conn,
+				   dirptr,
 				   &fname,
 				   &smb_fname,
 				   &mode,
@@ -1439,6 +1537,40 @@ static struct smb_Dir *OpenDir_fsp(TALLOC_CTX *mem_ctx, connection_struct *conn,
 }
 
 
+/*******************************************************************
+ Read the next entry from a dircache snapshot. The offset of the
+ n-th entry is n+1, so the offset we return is the index of the next
+ entry to read, just like telldir() after readdir().
+********************************************************************/
+
+static const char *ReadDirName_snapshot(struct smb_Dir *dirp, long *poffset,
+					SMB_STRUCT_STAT *sbuf,
+					char **ptalloced)
+{
+	const char *n;
+	uint32_t idx = 0;
+
+	if ((dirp->offset != START_OF_DIRECTORY_OFFSET) &&
+	    (dirp->offset != DOT_DOT_DIRECTORY_OFFSET)) {
+		idx = dirp->offset;
+	}
+
+	*ptalloced = NULL;
+
+	if (!dircache_snapshot_entry(dirp->snap, idx, &n, sbuf,
+				     &dirp->snap_mode)) {
+		*poffset = dirp->offset = END_OF_DIRECTORY_OFFSET;
+		return NULL;
+	}
+	if (sbuf != NULL) {
+		dirp->snap_mode_valid = VALID_STAT(*sbuf);
+	}
+
+	*poffset = dirp->offset = idx + 1;
+	dirp->file_number++;
+	return n;
+}
+
 /*******************************************************************
  Read from a directory.
  Return directory entry, current offset, and optional stat information.
@@ -1474,6 +1606,10 @@ const char *ReadDirName(struct smb_Dir *dirp, long *poffset,
 		SeekDir(dirp, *poffset);
 	}
 
+	if (dirp->snap != NULL) {
+		return ReadDirName_snapshot(dirp, poffset, sbuf, ptalloced);
+	}
+
 	while ((n = vfs_readdirname(conn, dirp->dir, sbuf, &talloced))) {
 		/* Ignore . and .. - we've already returned them. */
 		if (*n == '.') {
@@ -1498,6 +1634,11 @@ const char *ReadDirName(struct smb_Dir *dirp, long *poffset,
 
 void RewindDir(struct smb_Dir *dirp, long *poffset)
 {
+	if ((dirp->snap != NULL) &&
+	    !dircache_valid(dirp->conn, dirp->dir_path, dirp->snap)) {
+		/* The directory changed, read it directly from now on. */
+		TALLOC_FREE(dirp->snap);
+	}
 	SMB_VFS_REWINDDIR(dirp->conn, dirp->dir);
 	dirp->file_number = 0;
 	dirp->offset = START_OF_DIRECTORY_OFFSET;
@@ -1530,7 +1671,7 @@ void SeekDir(struct smb_Dir *dirp, long offset)
 			dirp->file_number = 2;
 		} else if (offset == END_OF_DIRECTORY_OFFSET) {
 			; /* Don't seek in this case. */
-		} else {
+		} else if (dirp->snap == NULL) {
 			SMB_VFS_SEEKDIR(dirp->conn, dirp->dir, offset);
 		}
 		dirp->offset = offset;
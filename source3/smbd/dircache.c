@@ -0,0 +1,507 @@
+/*
+   Unix SMB/CIFS implementation.
+   Directory listing cache shared between smbd processes
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * When many users list the same large directories, every smbd reads the
+ * directory, stats every entry and reads its DOS attributes. With
+ * "smbd:dircache = yes" on a share, the first wildcard search of a
+ * directory stores a snapshot of its entries (name, stat and DOS
+ * attributes) in dircache.tdb, keyed by the file_id of the directory.
+ * Searches of all smbds then read the snapshot instead of the directory.
+ *
+ * A snapshot is used as long as the mtime and ctime of the directory
+ * are unchanged and it is younger than "smbd:dircache ttl" seconds.
+ * Changes done through smbd remove it immediately via notify_fname(),
+ * the ttl bounds how long changes of the entries themselves made
+ * outside of smbd can go unnoticed.
+ */
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "smbd/smbd.h"
+#include "smbd/globals.h"
+#include "dbwrap.h"
+#include "util_tdb.h"
+
+/*
+ * The record layout. dircache.tdb is cleared on startup, so storing
+ * the structs in host format is fine.
+ */
+
+struct dircache_header {
+	uint32_t snum;
+	uint32_t num_entries;
+	uint32_t names_len;
+	uint32_t reserved;
+	struct timespec mtime;
+	struct timespec ctime;
+	struct timespec created;
+};
+
+struct dircache_entry {
+	SMB_STRUCT_STAT st;
+	uint32_t mode;
+	uint32_t name_ofs;
+};
+
+struct dircache_snapshot {
+	struct file_id id;
+	struct dircache_header hdr;
+	struct dircache_entry *entries;
+	char *names;
+};
+
+static struct db_context *dircache_db_ctx(void)
+{
+	static struct db_context *dircache_db_ctx_ptr;
+
+	if (dircache_db_ctx_ptr != NULL) {
+		return dircache_db_ctx_ptr;
+	}
+
+	dircache_db_ctx_ptr = db_open(NULL, lock_path("dircache.tdb"), 0,
+				      TDB_CLEAR_IF_FIRST|TDB_DEFAULT|
+				      TDB_INCOMPATIBLE_HASH,
+				      O_RDWR | O_CREAT, 0644);
+	if (dircache_db_ctx_ptr == NULL) {
+		DEBUG(1, ("dircache_db_ctx: failed to open dircache.tdb\n"));
+	}
+	return dircache_db_ctx_ptr;
+}
+
+bool dircache_enabled(connection_struct *conn)
+{
+	return lp_parm_bool(SNUM(conn), "smbd", "dircache", false);
+}
+
+static TDB_DATA dircache_key(const struct file_id *id)
+{
+	return make_tdb_data((const uint8_t *)id, sizeof(*id));
+}
+
+static bool dircache_stat_dir(connection_struct *conn, const char *path,
+			      SMB_STRUCT_STAT *st)
+{
+	struct smb_filename smb_dname;
+
+	ZERO_STRUCT(smb_dname);
+	smb_dname.base_name = discard_const_p(char, path);
+
+	if (SMB_VFS_STAT(conn, &smb_dname) != 0) {
+		return false;
+	}
+	if (!S_ISDIR(smb_dname.st.st_ex_mode)) {
+		return false;
+	}
+	*st = smb_dname.st;
+	return true;
+}
+
+/*
+ * Does the header describe the current state of the directory?
+ */
+
+static bool dircache_header_valid(connection_struct *conn,
+				  const struct dircache_header *hdr,
+				  const SMB_STRUCT_STAT *st)
+{
+	struct timespec now = timespec_current();
+	int ttl = lp_parm_int(SNUM(conn), "smbd", "dircache ttl", 10);
+
+	if (hdr->snum != SNUM(conn)) {
+		return false;
+	}
+	if ((timespec_compare(&hdr->mtime, &st->st_ex_mtime) != 0) ||
+	    (timespec_compare(&hdr->ctime, &st->st_ex_ctime) != 0)) {
+		return false;
+	}
+	if ((now.tv_sec < hdr->created.tv_sec) ||
+	    (now.tv_sec - hdr->created.tv_sec >= ttl)) {
+		return false;
+	}
+	return true;
+}
+
+struct dircache_fetch_state {
+	TALLOC_CTX *mem_ctx;
+	connection_struct *conn;
+	const SMB_STRUCT_STAT *st;
+	struct dircache_snapshot *snap;
+	bool header_only;
+};
+
+static int dircache_fetch_parser(TDB_DATA key, TDB_DATA data,
+				 void *private_data)
+{
+	struct dircache_fetch_state *state =
+		(struct dircache_fetch_state *)private_data;
+	struct dircache_header hdr;
+	struct dircache_snapshot *snap;
+	size_t entries_len;
+
+	if (data.dsize < sizeof(hdr)) {
+		DEBUG(1, ("Found invalid record in dircache.tdb\n"));
+		return -1;
+	}
+	memcpy(&hdr, data.dptr, sizeof(hdr));
+
+	entries_len = (size_t)hdr.num_entries * sizeof(struct dircache_entry);
+	if (data.dsize != sizeof(hdr) + entries_len + hdr.names_len) {
+		DEBUG(1, ("Found invalid record in dircache.tdb\n"));
+		return -1;
+	}
+
+	if (!dircache_header_valid(state->conn, &hdr, state->st)) {
+		return -1;
+	}
+
+	if (state->header_only) {
+		/* the caller only checks the snapshot is still current */
+		if ((state->snap == NULL) ||
+		    (timespec_compare(&hdr.created,
+				      &state->snap->hdr.created) != 0)) {
+			return -1;
+		}
+		return 0;
+	}
+
+	snap = talloc_zero(state->mem_ctx, struct dircache_snapshot);
+	if (snap == NULL) {
+		return -1;
+	}
+	snap->hdr = hdr;
+	snap->entries = talloc_array(snap, struct dircache_entry,
+				     hdr.num_entries);
+	snap->names = talloc_array(snap, char, hdr.names_len);
+	if ((snap->entries == NULL && hdr.num_entries != 0) ||
+	    (snap->names == NULL && hdr.names_len != 0)) {
+		TALLOC_FREE(snap);
+		return -1;
+	}
+	memcpy(snap->entries, data.dptr + sizeof(hdr), entries_len);
+	memcpy(snap->names, data.dptr + sizeof(hdr) + entries_len,
+	       hdr.names_len);
+
+	state->snap = snap;
+	return 0;
+}
+
+/**
+ * Fetch the snapshot of a directory if there is a valid one.
+ *
+ * @param path	The directory, relative to the share
+ */
+
+struct dircache_snapshot *dircache_fetch(TALLOC_CTX *mem_ctx,
+					 connection_struct *conn,
+					 const char *path)
+{
+	struct db_context *db = dircache_db_ctx();
+	struct dircache_fetch_state state;
+	SMB_STRUCT_STAT st;
+	struct file_id id;
+
+	if (db == NULL) {
+		return NULL;
+	}
+	if (!dircache_stat_dir(conn, path, &st)) {
+		return NULL;
+	}
+	id = vfs_file_id_from_sbuf(conn, &st);
+
+	ZERO_STRUCT(state);
+	state.mem_ctx = mem_ctx;
+	state.conn = conn;
+	state.st = &st;
+
+	if (db->parse_record(db, dircache_key(&id), dircache_fetch_parser,
+			     &state) != 0) {
+		return NULL;
+	}
+	if (state.snap == NULL) {
+		return NULL;
+	}
+	state.snap->id = id;
+
+	DEBUG(10, ("dircache_fetch: using snapshot of [%s] with %u "
+		   "entries\n", path, (unsigned)state.snap->hdr.num_entries));
+
+	return state.snap;
+}
+
+/**
+ * Check that a snapshot we use is still current, before a search is
+ * restarted from the beginning.
+ */
+
+bool dircache_valid(connection_struct *conn, const char *path,
+		    struct dircache_snapshot *snap)
+{
+	struct db_context *db = dircache_db_ctx();
+	struct dircache_fetch_state state;
+	SMB_STRUCT_STAT st;
+	struct file_id id;
+
+	if (db == NULL) {
+		return false;
+	}
+	if (!dircache_stat_dir(conn, path, &st)) {
+		return false;
+	}
+	id = vfs_file_id_from_sbuf(conn, &st);
+	if (!file_id_equal(&snap->id, &id)) {
+		return false;
+	}
+
+	ZERO_STRUCT(state);
+	state.conn = conn;
+	state.st = &st;
+	state.snap = snap;
+	state.header_only = true;
+
+	return (db->parse_record(db, dircache_key(&snap->id),
+				 dircache_fetch_parser, &state) == 0);
+}
+
+static void dircache_store(connection_struct *conn,
+			   struct dircache_snapshot *snap)
+{
+	struct db_context *db = dircache_db_ctx();
+	size_t entries_len, len;
+	uint8_t *buf;
+	NTSTATUS status;
+
+	if (db == NULL) {
+		return;
+	}
+
+	entries_len = (size_t)snap->hdr.num_entries *
+		sizeof(struct dircache_entry);
+	len = sizeof(snap->hdr) + entries_len + snap->hdr.names_len;
+
+	buf = talloc_array(talloc_tos(), uint8_t, len);
+	if (buf == NULL) {
+		return;
+	}
+	memcpy(buf, &snap->hdr, sizeof(snap->hdr));
+	memcpy(buf + sizeof(snap->hdr), snap->entries, entries_len);
+	memcpy(buf + sizeof(snap->hdr) + entries_len, snap->names,
+	       snap->hdr.names_len);
+
+	status = dbwrap_store(db, dircache_key(&snap->id),
+			      make_tdb_data(buf, len), TDB_REPLACE);
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(5, ("dircache_store: store failed: %s\n",
+			  nt_errstr(status)));
+	}
+	TALLOC_FREE(buf);
+}
+
+/**
+ * Read a directory with the stat information and DOS attributes of
+ * all entries, and store it for other searches.
+ */
+
+struct dircache_snapshot *dircache_build(TALLOC_CTX *mem_ctx,
+					 connection_struct *conn,
+					 const char *path)
+{
+	TALLOC_CTX *frame = talloc_stackframe();
+	int max_entries = lp_parm_int(SNUM(conn), "smbd",
+				      "dircache max entries", 100000);
+	struct dircache_snapshot *snap;
+	struct smb_Dir *dir_hnd;
+	SMB_STRUCT_STAT st;
+	const char *dname;
+	char *talloced = NULL;
+	struct timespec now;
+	long offset = 0;
+	size_t names_len = 0;
+	bool needslash;
+
+	if (!dircache_stat_dir(conn, path, &st)) {
+		TALLOC_FREE(frame);
+		return NULL;
+	}
+
+	snap = talloc_zero(frame, struct dircache_snapshot);
+	if (snap == NULL) {
+		TALLOC_FREE(frame);
+		return NULL;
+	}
+	snap->id = vfs_file_id_from_sbuf(conn, &st);
+	snap->hdr.snum = SNUM(conn);
+	snap->hdr.mtime = st.st_ex_mtime;
+	snap->hdr.ctime = st.st_ex_ctime;
+	snap->hdr.created = timespec_current();
+
+	dir_hnd = OpenDir(frame, conn, path, NULL, 0);
+	if (dir_hnd == NULL) {
+		TALLOC_FREE(frame);
+		return NULL;
+	}
+
+	needslash = (path[strlen(path)-1] != '/');
+
+	while ((dname = ReadDirName(dir_hnd, &offset, NULL, &talloced))) {
+		struct dircache_entry *e;
+		struct smb_filename smb_fname;
+		size_t len;
+
+		if (ISDOT(dname) || ISDOTDOT(dname)) {
+			TALLOC_FREE(talloced);
+			continue;
+		}
+
+		if (snap->hdr.num_entries >= max_entries) {
+			DEBUG(10, ("dircache_build: [%s] has more than %d "
+				   "entries, not caching it\n", path,
+				   max_entries));
+			TALLOC_FREE(talloced);
+			TALLOC_FREE(frame);
+			return NULL;
+		}
+
+		if ((snap->hdr.num_entries % 1024) == 0) {
+			struct dircache_entry *tmp;
+
+			tmp = talloc_realloc(snap, snap->entries,
+					     struct dircache_entry,
+					     snap->hdr.num_entries + 1024);
+			if (tmp == NULL) {
+				goto nomem;
+			}
+			snap->entries = tmp;
+		}
+
+		len = strlen(dname) + 1;
+		if (names_len + len > talloc_get_size(snap->names)) {
+			char *tmp;
+
+			tmp = talloc_realloc(snap, snap->names, char,
+					     MAX(names_len + len,
+						 2 * names_len + 4096));
+			if (tmp == NULL) {
+				goto nomem;
+			}
+			snap->names = tmp;
+		}
+
+		e = &snap->entries[snap->hdr.num_entries];
+		ZERO_STRUCTP(e);
+		e->name_ofs = names_len;
+		memcpy(snap->names + names_len, dname, len);
+		names_len += len;
+
+		ZERO_STRUCT(smb_fname);
+		smb_fname.base_name = talloc_asprintf(
+			talloc_tos(), "%s%s%s", path, needslash ? "/" : "",
+			dname);
+		TALLOC_FREE(talloced);
+		if (smb_fname.base_name == NULL) {
+			goto nomem;
+		}
+
+		/*
+		 * Entries we can't stat are returned without stat
+		 * information, the search looks at them itself.
+		 */
+		if (SMB_VFS_STAT(conn, &smb_fname) == 0) {
+			e->st = smb_fname.st;
+			e->mode = dos_mode(conn, &smb_fname);
+		} else {
+			SET_STAT_INVALID(e->st);
+		}
+		TALLOC_FREE(smb_fname.base_name);
+
+		snap->hdr.num_entries += 1;
+	}
+
+	snap->hdr.names_len = names_len;
+
+	/*
+	 * A directory changed within the granularity of its timestamps
+	 * could change again without them changing. Use the snapshot
+	 * for this search only.
+	 */
+	now = timespec_current();
+	if ((snap->hdr.mtime.tv_sec + 2 < now.tv_sec) &&
+	    (snap->hdr.ctime.tv_sec + 2 < now.tv_sec)) {
+		dircache_store(conn, snap);
+	}
+
+	DEBUG(10, ("dircache_build: [%s] has %u entries\n", path,
+		   (unsigned)snap->hdr.num_entries));
+
+	snap = talloc_move(mem_ctx, &snap);
+	TALLOC_FREE(frame);
+	return snap;
+
+nomem:
+	TALLOC_FREE(talloced);
+	TALLOC_FREE(frame);
+	return NULL;
+}
+
+/**
+ * Return an entry of a snapshot, false beyond the end. Entries which
+ * could not be stat'ed have an invalid st.
+ */
+
+bool dircache_snapshot_entry(const struct dircache_snapshot *snap,
+			     uint32_t idx, const char **name,
+			     SMB_STRUCT_STAT *st, uint32_t *mode)
+{
+	const struct dircache_entry *e;
+
+	if (idx >= snap->hdr.num_entries) {
+		return false;
+	}
+	e = &snap->entries[idx];
+
+	*name = snap->names + e->name_ofs;
+	if (st != NULL) {
+		*st = e->st;
+	}
+	*mode = e->mode;
+	return true;
+}
+
+/***************************************************************************
+ Forget the snapshot of a directory we changed.
+**************************************************************************/
+
+void dircache_delete(connection_struct *conn, const struct file_id *id)
+{
+	struct db_context *db;
+	NTSTATUS status;
+
+	if (!dircache_enabled(conn)) {
+		return;
+	}
+	db = dircache_db_ctx();
+	if (db == NULL) {
+		return;
+	}
+	status = dbwrap_delete(db, dircache_key(id));
+	if (!NT_STATUS_IS_OK(status) &&
+	    !NT_STATUS_EQUAL(status, NT_STATUS_NOT_FOUND)) {
+		DEBUG(5, ("dircache_delete: delete failed: %s\n",
+			  nt_errstr(status)));
+	}
+}
@@ -0,0 +1,250 @@
+/*
+   Unix SMB/CIFS implementation.
+   Prefetch directory entry metadata in helper threads
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Listing a directory stats every entry and reads its DOS attributes
+ * one after the other. On storage where each of these has to go to
+ * disk or to a server the latency adds up per entry.
+ *
+ * With "smbd:dir prefetch = <n>" on a share, SMB2 QUERY_DIRECTORY
+ * hands the names of the next <n> entries to helper threads that stat
+ * them and read their user.DOSATTRIB xattr, while the main thread
+ * marshalls the current batch. The VFS is not thread safe, so the
+ * helpers use plain system calls and throw the results away: their
+ * only purpose is to get the metadata into the kernel caches, so the
+ * stat and getxattr calls done later through the VFS return quickly.
+ * A failing prefetch is harmless for the same reason.
+ */
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "smbd/smbd.h"
+#include "smbd/globals.h"
+#include "lib/util/tevent_unix.h"
+
+#if WITH_PTHREADPOOL
+
+static struct fncall_context *dir_prefetch_ctx;
+
+struct dir_prefetch_job {
+	bool read_dos_attrib;
+	unsigned int num_paths;
+	char **paths;
+};
+
+struct dir_prefetch_state {
+	unsigned int num_pending;
+};
+
+static void dir_prefetch_do(void *private_data);
+static void dir_prefetch_done(struct tevent_req *subreq);
+
+/****************************************************************************
+ Return the number of entries to prefetch per batch, 0 if disabled.
+****************************************************************************/
+
+unsigned int dir_prefetch_batch(connection_struct *conn)
+{
+	int batch = lp_parm_int(SNUM(conn), "smbd", "dir prefetch", 0);
+
+	if (batch <= 0) {
+		return 0;
+	}
+	return MIN(batch, 4096);
+}
+
+struct tevent_req *dir_prefetch_send(TALLOC_CTX *mem_ctx,
+				     struct tevent_context *ev,
+				     connection_struct *conn,
+				     struct dptr_struct *dptr,
+				     const char *dir_path,
+				     unsigned int skip,
+				     unsigned int num)
+{
+	struct tevent_req *req;
+	struct dir_prefetch_state *state;
+	char **names;
+	const char *base;
+	unsigned int i, num_names, num_jobs, per_job;
+	int num_threads;
+
+	req = tevent_req_create(mem_ctx, &state, struct dir_prefetch_state);
+	if (req == NULL) {
+		return NULL;
+	}
+
+	num_threads = lp_parm_int(-1, "smbd", "dir prefetch threads", 4);
+	if (num_threads <= 0) {
+		num_threads = 1;
+	}
+
+	if (dir_prefetch_ctx == NULL) {
+		dir_prefetch_ctx = fncall_context_init(NULL, num_threads);
+		if (tevent_req_nomem(dir_prefetch_ctx, req)) {
+			return tevent_req_post(req, ev);
+		}
+	}
+
+	names = dptr_peek_names(state, dptr, skip, num, &num_names);
+	if (names == NULL) {
+		tevent_req_done(req);
+		return tevent_req_post(req, ev);
+	}
+
+	if (strequal(dir_path, ".")) {
+		base = conn->connectpath;
+	} else {
+		base = talloc_asprintf(state, "%s/%s", conn->connectpath,
+				       dir_path);
+		if (tevent_req_nomem(base, req)) {
+			return tevent_req_post(req, ev);
+		}
+	}
+
+	/* Spread the names over the helper threads. */
+	num_jobs = MIN(num_names, (unsigned int)num_threads);
+	per_job = (num_names + num_jobs - 1) / num_jobs;
+
+	for (i = 0; i < num_names; i += per_job) {
+		struct dir_prefetch_job *job;
+		struct tevent_req *subreq;
+		unsigned int j;
+
+		job = talloc_zero(state, struct dir_prefetch_job);
+		if (tevent_req_nomem(job, req)) {
+			return tevent_req_post(req, ev);
+		}
+		job->read_dos_attrib = lp_store_dos_attributes(SNUM(conn));
+		job->num_paths = MIN(per_job, num_names - i);
+		job->paths = talloc_array(job, char *, job->num_paths);
+		if (tevent_req_nomem(job->paths, req)) {
+			return tevent_req_post(req, ev);
+		}
+		for (j = 0; j < job->num_paths; j++) {
+			job->paths[j] = talloc_asprintf(job->paths, "%s/%s",
+							base, names[i+j]);
+			if (tevent_req_nomem(job->paths[j], req)) {
+				return tevent_req_post(req, ev);
+			}
+		}
+
+		subreq = fncall_send(state, ev, dir_prefetch_ctx,
+				     dir_prefetch_do, job);
+		if (tevent_req_nomem(subreq, req)) {
+			return tevent_req_post(req, ev);
+		}
+		tevent_req_set_callback(subreq, dir_prefetch_done, req);
+		state->num_pending += 1;
+	}
+
+	DEBUG(10, ("dir_prefetch_send: %u entries of %s in %u jobs\n",
+		   num_names, base, state->num_pending));
+
+	TALLOC_FREE(names);
+	return req;
+}
+
+/*
+ * Runs in a helper thread, so only system calls here.
+ */
+
+static void dir_prefetch_do(void *private_data)
+{
+	struct dir_prefetch_job *job =
+		(struct dir_prefetch_job *)private_data;
+	unsigned int i;
+
+	for (i = 0; i < job->num_paths; i++) {
+		struct stat st;
+		char buf[256];
+
+		if (stat(job->paths[i], &st) != 0) {
+			continue;
+		}
+		if (job->read_dos_attrib) {
+			sys_getxattr(job->paths[i], SAMBA_XATTR_DOS_ATTRIB,
+				     buf, sizeof(buf));
+		}
+	}
+}
+
+static void dir_prefetch_done(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(
+		subreq, struct tevent_req);
+	struct dir_prefetch_state *state = tevent_req_data(
+		req, struct dir_prefetch_state);
+	int ret, err;
+
+	ret = fncall_recv(subreq, &err);
+	TALLOC_FREE(subreq);
+	if (ret == -1) {
+		tevent_req_error(req, err);
+		return;
+	}
+
+	state->num_pending -= 1;
+	if (state->num_pending == 0) {
+		tevent_req_done(req);
+	}
+}
+
+int dir_prefetch_recv(struct tevent_req *req)
+{
+	int err;
+
+	if (tevent_req_is_unix_error(req, &err)) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+#else /* WITH_PTHREADPOOL */
+
+unsigned int dir_prefetch_batch(connection_struct *conn)
+{
+	/* Without helper threads there is nothing to overlap with. */
+	return 0;
+}
+
+struct tevent_req *dir_prefetch_send(TALLOC_CTX *mem_ctx,
+				     struct tevent_context *ev,
+				     connection_struct *conn,
+				     struct dptr_struct *dptr,
+				     const char *dir_path,
+				     unsigned int skip,
+				     unsigned int num)
+{
+	struct tevent_req *req;
+	int *state;
+
+	req = tevent_req_create(mem_ctx, &state, int);
+	if (req == NULL) {
+		return NULL;
+	}
+	tevent_req_done(req);
+	return tevent_req_post(req, ev);
+}
+
+int dir_prefetch_recv(struct tevent_req *req)
+{
+	return 0;
+}
+
+#endif /* WITH_PTHREADPOOL */
@@ -280,6 +280,33 @@ void trigger_write_time_update_immediate(struct files_struct *fsp)
 	(void)smb_set_file_time(fsp->conn, fsp, fsp->fsp_name, &ft, false);
 }
 
+/****************************************************************************
+ Mark a file as modified on its first write: kick off the write time
+ update and set the archive bit. Returns false if the file could not
+ be stat'ed.
+****************************************************************************/
+
+static bool mark_file_modified(files_struct *fsp)
+{
+	fsp->modified = True;
+
+	if (SMB_VFS_FSTAT(fsp, &fsp->fsp_name->st) != 0) {
+		return false;
+	}
+
+	trigger_write_time_update(fsp);
+	if (!fsp->posix_open &&
+			(lp_store_dos_attributes(SNUM(fsp->conn)) ||
+			MAP_ARCHIVE(fsp->conn))) {
+		int dosmode = dos_mode(fsp->conn, fsp->fsp_name);
+		if (!IS_DOS_ARCHIVE(dosmode)) {
+			file_set_dosmode(fsp->conn, fsp->fsp_name,
+				 dosmode | FILE_ATTRIBUTE_ARCHIVE, NULL, false);
+		}
+	}
+	return true;
+}
+
 /****************************************************************************
  Write to a file.
 ****************************************************************************/
@@ -312,20 +339,7 @@ ssize_t write_file(struct smb_request *req,
 	}
 
 	if (!fsp->modified) {
-		fsp->modified = True;
-
-		if (SMB_VFS_FSTAT(fsp, &fsp->fsp_name->st) == 0) {
-			trigger_write_time_update(fsp);
-			if (!fsp->posix_open &&
-					(lp_store_dos_attributes(SNUM(fsp->conn)) ||
-					MAP_ARCHIVE(fsp->conn))) {
-				int dosmode = dos_mode(fsp->conn, fsp->fsp_name);
-				if (!IS_DOS_ARCHIVE(dosmode)) {
-					file_set_dosmode(fsp->conn, fsp->fsp_name,
-						 dosmode | FILE_ATTRIBUTE_ARCHIVE, NULL, false);
-				}
-			}
-
+		if (mark_file_modified(fsp)) {
 			/*
 			 * If this is the first write and we have an exclusive oplock then setup
 			 * the write cache.
@@ -873,6 +887,58 @@ n = %u, wcp->offset=%.0f, wcp->data_size=%u\n",
 	return total_written;
 }
 
+/****************************************************************************
+ Server side copy of a range of one file into another, for
+ FSCTL_SRV_COPYCHUNK. The data never passes through smbd if the VFS
+ can copy it by itself.
+****************************************************************************/
+
+ssize_t copy_file_chunk(files_struct *src_fsp,
+			SMB_OFF_T src_off,
+			files_struct *dest_fsp,
+			SMB_OFF_T dest_off,
+			size_t n)
+{
+	ssize_t ret;
+
+	if (dest_fsp->print_file || !dest_fsp->can_write) {
+		errno = EPERM;
+		return -1;
+	}
+
+	/*
+	 * The copy goes around the write caches, so both files have
+	 * to be on disk before. The cached size of the destination
+	 * would be stale afterwards, so get rid of its cache.
+	 */
+	flush_write_cache(src_fsp, READ_FLUSH);
+	flush_write_cache(dest_fsp, WRITE_FLUSH);
+	delete_write_cache(dest_fsp);
+
+	if (!dest_fsp->modified) {
+		mark_file_modified(dest_fsp);
+	}
+
+	contend_level2_oplocks_begin(dest_fsp, LEVEL2_CONTEND_WRITE);
+	contend_level2_oplocks_end(dest_fsp, LEVEL2_CONTEND_WRITE);
+
+	if (dest_off && lp_strict_allocate(SNUM(dest_fsp->conn)) &&
+	    !dest_fsp->is_sparse) {
+		if (vfs_fill_sparse(dest_fsp, dest_off) == -1) {
+			return -1;
+		}
+	}
+
+	ret = SMB_VFS_COPY_CHUNK(src_fsp, src_off, dest_fsp, dest_off, n);
+
+	DEBUG(10,("copy_file_chunk: %s:%.0f -> %s:%.0f, size = %lu, "
+		  "returned %ld\n", fsp_str_dbg(src_fsp), (double)src_off,
+		  fsp_str_dbg(dest_fsp), (double)dest_off, (unsigned long)n,
+		  (long)ret));
+
+	return ret;
+}
+
 /****************************************************************************
  Delete the write cache structure.
 ****************************************************************************/
@@ -1078,6 +1078,20 @@ static int get_real_filename_full_scan(connection_struct *conn,
 		}
 	}
 
+	/*
+	 * Large directories are searched via an index of their case
+	 * folded names, so that misses don't cost a full scan.
+	 */
+	if (!mangled && !conn->case_sensitive &&
+	    dirname_index_lookup(conn, path, name, mem_ctx, found_name)) {
+		TALLOC_FREE(unmangled_name);
+		if (*found_name == NULL) {
+			errno = ENOENT;
+			return -1;
+		}
+		return 0;
+	}
+
 	/* open the directory */
 	if (!(cur_dir = OpenDir(talloc_tos(), conn, path, NULL, 0))) {
 		DEBUG(3,("scan dir didn't open dir [%s]\n",path));
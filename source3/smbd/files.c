@@ -28,6 +28,120 @@
 
 #define FILE_HANDLE_OFFSET 0x1000
 
+/*
+ * Open files are indexed by fnum in an idtree and hashed by file_id and
+ * by fd, so that resolving a handle does not depend on the number of
+ * open files. Both hash tables have the same power of two number of
+ * buckets and are doubled when the number of open files grows past
+ * twice that.
+ */
+
+#define FILE_HASH_INITIAL_SIZE 64
+
+static unsigned int file_id_bucket(struct smbd_server_connection *sconn,
+				   const struct file_id *id)
+{
+	return hash_any(id, sizeof(*id), 0) & (sconn->file_hash_size - 1);
+}
+
+static unsigned int fd_bucket(struct smbd_server_connection *sconn, int fd)
+{
+	return (unsigned int)fd & (sconn->file_hash_size - 1);
+}
+
+static void file_id_hash_add(struct smbd_server_connection *sconn,
+			     files_struct *fsp)
+{
+	unsigned int b = file_id_bucket(sconn, &fsp->file_id);
+
+	fsp->file_id_hash_next = sconn->file_id_hash[b];
+	sconn->file_id_hash[b] = fsp;
+}
+
+static void file_id_hash_del(struct smbd_server_connection *sconn,
+			     files_struct *fsp)
+{
+	files_struct **p = &sconn->file_id_hash[
+		file_id_bucket(sconn, &fsp->file_id)];
+
+	for (; *p != NULL; p = &(*p)->file_id_hash_next) {
+		if (*p == fsp) {
+			*p = fsp->file_id_hash_next;
+			fsp->file_id_hash_next = NULL;
+			return;
+		}
+	}
+}
+
+static void fd_hash_add(struct smbd_server_connection *sconn,
+			files_struct *fsp)
+{
+	unsigned int b;
+
+	fsp->fd_hash_key = fsp->fh->fd;
+	if (fsp->fd_hash_key == -1) {
+		return;
+	}
+	b = fd_bucket(sconn, fsp->fd_hash_key);
+	fsp->fd_hash_next = sconn->fd_hash[b];
+	sconn->fd_hash[b] = fsp;
+}
+
+static void fd_hash_del(struct smbd_server_connection *sconn,
+			files_struct *fsp)
+{
+	files_struct **p;
+
+	if (fsp->fd_hash_key == -1) {
+		return;
+	}
+
+	p = &sconn->fd_hash[fd_bucket(sconn, fsp->fd_hash_key)];
+	for (; *p != NULL; p = &(*p)->fd_hash_next) {
+		if (*p == fsp) {
+			*p = fsp->fd_hash_next;
+			break;
+		}
+	}
+	fsp->fd_hash_next = NULL;
+	fsp->fd_hash_key = -1;
+}
+
+/****************************************************************************
+ Allocate the hash tables with "size" buckets and hash all open files.
+ The files list is walked from its tail so that each hash chain keeps the
+ newest-first order of the list.
+****************************************************************************/
+
+static bool file_hash_init(struct smbd_server_connection *sconn,
+			   unsigned int size)
+{
+	files_struct **file_id_hash, **fd_hash;
+	files_struct *fsp;
+
+	file_id_hash = talloc_zero_array(sconn, files_struct *, size);
+	fd_hash = talloc_zero_array(sconn, files_struct *, size);
+	if ((file_id_hash == NULL) || (fd_hash == NULL)) {
+		TALLOC_FREE(file_id_hash);
+		TALLOC_FREE(fd_hash);
+		return false;
+	}
+
+	TALLOC_FREE(sconn->file_id_hash);
+	TALLOC_FREE(sconn->fd_hash);
+	sconn->file_id_hash = file_id_hash;
+	sconn->fd_hash = fd_hash;
+	sconn->file_hash_size = size;
+
+	fsp = (sconn->files != NULL) ? sconn->files->prev : NULL;
+	while (fsp != NULL) {
+		file_id_hash_add(sconn, fsp);
+		fd_hash_add(sconn, fsp);
+		fsp = (fsp == sconn->files) ? NULL : fsp->prev;
+	}
+	return true;
+}
+
 /****************************************************************************
  Return a unique number identifying this fsp over the life of this pid.
 ****************************************************************************/
@@ -63,8 +177,6 @@ NTSTATUS file_new(struct smb_request *req, connection_struct *conn,
 		sconn->first_file %= sconn->real_max_open_files;
 	}
 
-	/* TODO: Port the id-tree implementation from Samba4 */
-
 	i = bitmap_find(sconn->file_bmap, sconn->first_file);
 	if (i == -1) {
 		DEBUG(0,("ERROR! Out of file structures\n"));
@@ -96,6 +208,7 @@ NTSTATUS file_new(struct smb_request *req, connection_struct *conn,
 
 	fsp->fh->ref_count = 1;
 	fsp->fh->fd = -1;
+	fsp->fd_hash_key = -1;
 
 	fsp->conn = conn;
 	fsp->fh->gen_id = get_gen_count(sconn);
@@ -103,12 +216,19 @@ NTSTATUS file_new(struct smb_request *req, connection_struct *conn,
 
 	sconn->first_file = (i+1) % (sconn->real_max_open_files);
 
-	bitmap_set(sconn->file_bmap, i);
-	sconn->files_used += 1;
-
 	fsp->fnum = i + FILE_HANDLE_OFFSET;
 	SMB_ASSERT(fsp->fnum < 65536);
 
+	if (idr_get_new_above(sconn->file_idtree, fsp, fsp->fnum,
+			      fsp->fnum) != fsp->fnum) {
+		TALLOC_FREE(fsp->fh);
+		TALLOC_FREE(fsp);
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	bitmap_set(sconn->file_bmap, i);
+	sconn->files_used += 1;
+
 	/*
 	 * Create an smb_filename with "" for the base_name.  There are very
 	 * few NULL checks, so make sure it's initialized with something. to
@@ -121,7 +241,13 @@ NTSTATUS file_new(struct smb_request *req, connection_struct *conn,
 		TALLOC_FREE(fsp->fh);
 	}
 
+	if ((unsigned int)sconn->files_used > sconn->file_hash_size * 2) {
+		/* Keep going with the old tables if this fails. */
+		file_hash_init(sconn, sconn->file_hash_size * 2);
+	}
+
 	DLIST_ADD(sconn->files, fsp);
+	file_id_hash_add(sconn, fsp);
 
 	DEBUG(5,("allocated file structure %d, fnum = %d (%d used)\n",
 		 i, fsp->fnum, sconn->files_used));
@@ -130,13 +256,6 @@ NTSTATUS file_new(struct smb_request *req, connection_struct *conn,
 		req->chain_fsp = fsp;
 	}
 
-	/* A new fsp invalidates the positive and
-	  negative fsp_fi_cache as the new fsp is pushed
-	  at the start of the list and we search from
-	  a cache hit to the *end* of the list. */
-
-	ZERO_STRUCT(sconn->fsp_fi_cache);
-
 	conn->num_files_open++;
 
 	*result = fsp;
@@ -212,7 +331,12 @@ bool file_init(struct smbd_server_connection *sconn)
 	if (!sconn->file_bmap) {
 		return false;
 	}
-	return true;
+
+	sconn->file_idtree = idr_init(sconn);
+	if (sconn->file_idtree == NULL) {
+		return false;
+	}
+	return file_hash_init(sconn, FILE_HASH_INITIAL_SIZE);
 }
 
 /****************************************************************************
@@ -260,14 +384,16 @@ struct files_struct *files_forall(
 
 files_struct *file_find_fd(struct smbd_server_connection *sconn, int fd)
 {
-	int count=0;
 	files_struct *fsp;
 
-	for (fsp=sconn->files; fsp; fsp=fsp->next,count++) {
-		if (fsp->fh->fd == fd) {
-			if (count > 10) {
-				DLIST_PROMOTE(sconn->files, fsp);
-			}
+	if (fd == -1) {
+		return NULL;
+	}
+
+	for (fsp = sconn->fd_hash[fd_bucket(sconn, fd)]; fsp;
+	     fsp = fsp->fd_hash_next) {
+		/* The fd might have been closed behind our back. */
+		if ((fsp->fd_hash_key == fd) && (fsp->fh->fd == fd)) {
 			return fsp;
 		}
 	}
@@ -282,16 +408,13 @@ files_struct *file_find_fd(struct smbd_server_connection *sconn, int fd)
 files_struct *file_find_dif(struct smbd_server_connection *sconn,
 			    struct file_id id, unsigned long gen_id)
 {
-	int count=0;
 	files_struct *fsp;
 
-	for (fsp=sconn->files; fsp; fsp=fsp->next,count++) {
+	for (fsp = sconn->file_id_hash[file_id_bucket(sconn, &id)]; fsp;
+	     fsp = fsp->file_id_hash_next) {
 		/* We can have a fsp->fh->fd == -1 here as it could be a stat open. */
 		if (file_id_equal(&fsp->file_id, &id) &&
 		    fsp->fh->gen_id == gen_id ) {
-			if (count > 10) {
-				DLIST_PROMOTE(sconn->files, fsp);
-			}
 			/* Paranoia check. */
 			if ((fsp->fh->fd == -1) &&
 			    (fsp->oplock_type != NO_OPLOCK) &&
@@ -314,8 +437,6 @@ files_struct *file_find_dif(struct smbd_server_connection *sconn,
 
 /****************************************************************************
  Find the first fsp given a device and inode.
- We use a singleton cache here to speed up searching from getfilepathinfo
- calls.
 ****************************************************************************/
 
 files_struct *file_find_di_first(struct smbd_server_connection *sconn,
@@ -323,23 +444,13 @@ files_struct *file_find_di_first(struct smbd_server_connection *sconn,
 {
 	files_struct *fsp;
 
-	if (file_id_equal(&sconn->fsp_fi_cache.id, &id)) {
-		/* Positive or negative cache hit. */
-		return sconn->fsp_fi_cache.fsp;
-	}
-
-	sconn->fsp_fi_cache.id = id;
-
-	for (fsp=sconn->files;fsp;fsp=fsp->next) {
+	for (fsp = sconn->file_id_hash[file_id_bucket(sconn, &id)]; fsp;
+	     fsp = fsp->file_id_hash_next) {
 		if (file_id_equal(&fsp->file_id, &id)) {
-			/* Setup positive cache. */
-			sconn->fsp_fi_cache.fsp = fsp;
 			return fsp;
 		}
 	}
 
-	/* Setup negative cache. */
-	sconn->fsp_fi_cache.fsp = NULL;
 	return NULL;
 }
 
@@ -351,7 +462,8 @@ files_struct *file_find_di_next(files_struct *start_fsp)
 {
 	files_struct *fsp;
 
-	for (fsp = start_fsp->next;fsp;fsp=fsp->next) {
+	for (fsp = start_fsp->file_id_hash_next; fsp;
+	     fsp = fsp->file_id_hash_next) {
 		if (file_id_equal(&fsp->file_id, &start_fsp->file_id)) {
 			return fsp;
 		}
@@ -434,6 +546,8 @@ void file_free(struct smb_request *req, files_struct *fsp)
 	struct smbd_server_connection *sconn = fsp->conn->sconn;
 
 	DLIST_REMOVE(sconn->files, fsp);
+	file_id_hash_del(sconn, fsp);
+	fd_hash_del(sconn, fsp);
 
 	TALLOC_FREE(fsp->fake_file_handle);
 
@@ -455,9 +569,12 @@ void file_free(struct smb_request *req, files_struct *fsp)
 	/* Ensure this event will never fire. */
 	TALLOC_FREE(fsp->oplock_timeout);
 
+	smbd_smb2_lease_detach(fsp);
+
 	/* Ensure this event will never fire. */
 	TALLOC_FREE(fsp->update_write_time_event);
 
+	idr_remove(sconn->file_idtree, fsp->fnum);
 	bitmap_clear(sconn->file_bmap, fsp->fnum - FILE_HANDLE_OFFSET);
 	sconn->files_used--;
 
@@ -478,11 +595,6 @@ void file_free(struct smb_request *req, files_struct *fsp)
 		remove_smb2_chained_fsp(fsp);
 	}
 
-	/* Closing a file can invalidate the positive cache. */
-	if (fsp == sconn->fsp_fi_cache.fsp) {
-		ZERO_STRUCT(sconn->fsp_fi_cache);
-	}
-
 	/* Drop all remaining extensions. */
 	while (fsp->vfs_extension) {
 		vfs_remove_fsp_extension(fsp->vfs_extension->owner, fsp);
@@ -503,18 +615,7 @@ void file_free(struct smb_request *req, files_struct *fsp)
 static struct files_struct *file_fnum(struct smbd_server_connection *sconn,
 				      uint16 fnum)
 {
-	files_struct *fsp;
-	int count=0;
-
-	for (fsp=sconn->files; fsp; fsp=fsp->next, count++) {
-		if (fsp->fnum == fnum) {
-			if (count > 10) {
-				DLIST_PROMOTE(sconn->files, fsp);
-			}
-			return fsp;
-		}
-	}
-	return NULL;
+	return (struct files_struct *)idr_find(sconn->file_idtree, fnum);
 }
 
 /****************************************************************************
@@ -562,7 +663,7 @@ NTSTATUS dup_file_fsp(struct smb_request *req, files_struct *from,
 	to->fh = from->fh;
 	to->fh->ref_count++;
 
-	to->file_id = from->file_id;
+	fsp_set_file_id(to, from->file_id);
 	to->initial_allocation_size = from->initial_allocation_size;
 	to->mode = from->mode;
 	to->file_pid = from->file_pid;
@@ -581,6 +682,7 @@ NTSTATUS dup_file_fsp(struct smb_request *req, files_struct *from,
 	to->modified = from->modified;
 	to->is_directory = from->is_directory;
 	to->aio_write_behind = from->aio_write_behind;
+	fsp_update_fd_hash(to);
 
 	if (from->print_file) {
 		to->print_file = talloc(to, struct print_file_data);
@@ -641,3 +743,27 @@ NTSTATUS fsp_set_smb_fname(struct files_struct *fsp,
 			smb_fname_str_dbg(fsp->fsp_name),
 			&fsp->name_hash);
 }
+
+/**
+ * The only way that the fsp->file_id field should ever be set, it keeps
+ * the file_id hash up to date.
+ */
+void fsp_set_file_id(struct files_struct *fsp, struct file_id id)
+{
+	struct smbd_server_connection *sconn = fsp->conn->sconn;
+
+	file_id_hash_del(sconn, fsp);
+	fsp->file_id = id;
+	file_id_hash_add(sconn, fsp);
+}
+
+/**
+ * Rehash fsp after fsp->fh->fd has changed.
+ */
+void fsp_update_fd_hash(struct files_struct *fsp)
+{
+	struct smbd_server_connection *sconn = fsp->conn->sconn;
+
+	fd_hash_del(sconn, fsp);
+	fd_hash_add(sconn, fsp);
+}
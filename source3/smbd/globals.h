@@ -38,12 +38,6 @@ extern bool dfree_broken;
 /* how many write cache buffers have been allocated */
 extern unsigned int allocated_write_caches;
 
-/* A singleton cache to speed up searching by dev/inode. */
-struct fsp_singleton_cache {
-	files_struct *fsp;
-	struct file_id id;
-};
-
 extern const struct mangle_fns *mangle_fns;
 
 extern unsigned char *chartest;
@@ -243,6 +237,7 @@ const char *smb2_opcode_name(uint16_t opcode);
 bool smbd_is_smb2_header(const uint8_t *inbuf, size_t size);
 
 void reply_smb2002(struct smb_request *req, uint16_t choice);
+void reply_smb20ff(struct smb_request *req, uint16_t choice);
 void smbd_smb2_first_negprot(struct smbd_server_connection *sconn,
 			     const uint8_t *inbuf, size_t size);
 
@@ -263,11 +258,21 @@ NTSTATUS smbd_smb2_send_oplock_break(struct smbd_server_connection *sconn,
 				     uint64_t file_id_persistent,
 				     uint64_t file_id_volatile,
 				     uint8_t oplock_level);
+NTSTATUS smbd_smb2_send_lease_break(struct smbd_server_connection *sconn,
+				    uint32_t flags,
+				    const struct smb2_lease_key *lease_key,
+				    uint32_t current_lease_state,
+				    uint32_t new_lease_state);
 
 NTSTATUS smbd_smb2_request_pending_queue(struct smbd_smb2_request *req,
 					 struct tevent_req *subreq);
 
 NTSTATUS smbd_smb2_request_check_session(struct smbd_smb2_request *req);
+NTSTATUS smbd_smb2_request_verify_creditcharge(struct smbd_smb2_request *req,
+					       uint32_t data_length);
+size_t smbd_smb2_unread_bytes(struct smbd_smb2_request *req);
+void smbd_smb2_clear_unread_bytes(struct smbd_smb2_request *req);
+NTSTATUS smbd_smb2_request_drain_unread_bytes(struct smbd_smb2_request *req);
 NTSTATUS smbd_smb2_request_check_tcon(struct smbd_smb2_request *req);
 
 struct smb_request *smbd_smb2_fake_smb_request(struct smbd_smb2_request *req);
@@ -313,7 +318,8 @@ bool push_blocking_lock_request_smb2( struct byte_range_lock *br_lck,
 				uint64_t count,
 				uint64_t blocking_smblctx);
 void process_blocking_lock_queue_smb2(
-	struct smbd_server_connection *sconn, struct timeval tv_curr);
+	struct smbd_server_connection *sconn, struct timeval tv_curr,
+	const struct file_id *id);
 void cancel_pending_lock_requests_by_fid_smb2(files_struct *fsp,
 			struct byte_range_lock *br_lck,
 			enum file_close_type close_type);
@@ -354,6 +360,9 @@ struct smbd_smb2_request {
 	bool async;
 	bool cancelled;
 
+	/* when we received the request, for the credit scheduler */
+	struct timeval request_time;
+
 	/* fake smb1 request. */
 	struct smb_request *smb1req;
 	struct files_struct *compat_chain_fsp;
@@ -445,8 +454,28 @@ struct smbd_smb2_tcon {
 	connection_struct *compat_conn;
 };
 
+/*
+ * A SMB2.1 lease, shared by all opens of a file from this
+ * connection using the same lease key. The lease state is
+ * mirrored into the share mode entries of those opens.
+ */
+struct smbd_smb2_lease {
+	struct smbd_smb2_lease *prev, *next;
+	struct smbd_server_connection *sconn;
+	struct file_id id;
+	struct smb2_lease_key lease_key;
+	uint32_t lease_state;
+	/* a lease break was sent, waiting for the ack */
+	bool breaking;
+	uint32_t breaking_to;
+	uint32_t num_fsps;
+};
+
 struct pending_auth_data;
 
+/* number of request pools kept around per SMB2 connection */
+#define SMBD_SMB2_REQUEST_CACHE_SIZE 32
+
 struct smbd_server_connection {
 	int sock;
 	const struct tsocket_address *local_address;
@@ -469,7 +498,12 @@ struct smbd_server_connection {
 	struct bitmap *file_bmap;
 	int real_max_open_files;
 	int files_used;
-	struct fsp_singleton_cache fsp_fi_cache;
+	/* fnum -> fsp */
+	struct idr_context *file_idtree;
+	/* hashed by file_id and by fd, see files.c */
+	struct files_struct **file_id_hash;
+	struct files_struct **fd_hash;
+	unsigned int file_hash_size;
 	unsigned long file_gen_counter;
 	int first_file;
 
@@ -595,6 +629,73 @@ struct smbd_server_connection {
 		uint32_t credits_granted;
 		uint32_t max_credits;
 		struct bitmap *credits_bitmap;
+		/*
+		 * adaptive credit granting, see
+		 * smbd_smb2_credits_update().
+		 */
+		struct {
+			/* the current limit, <= max_credits */
+			uint32_t target;
+			/* fast and not under pressure, ramp up faster */
+			bool healthy;
+			uint32_t pressure_limit;
+			uint32_t latency_limit_usec;
+			uint32_t avg_latency_usec;
+			uint32_t throttled;
+			uint64_t num_requests;
+			uint64_t credits_total;
+			/*
+			 * what we last stored in smb2_credits.tdb,
+			 * only changes are written
+			 */
+			struct {
+				uint32_t target;
+				uint32_t granted;
+				uint32_t in_flight;
+				uint32_t async_pending;
+				uint32_t throttled;
+				uint64_t num_requests;
+				struct timeval time;
+				bool stored;
+			} published;
+		} credits;
+		/* the negotiated dialect and the limits we announced */
+		uint16_t dialect;
+		bool supports_multicredit;
+		bool supports_leasing;
+		struct GUID client_guid;
+		struct smbd_smb2_lease *leases;
+		uint32_t max_trans;
+		uint32_t max_read;
+		uint32_t max_write;
+		/*
+		 * talloc pools of finished requests, reused by
+		 * smbd_smb2_request_allocate() to avoid a malloc/free
+		 * of the request, its iovecs and headers per PDU.
+		 */
+		struct {
+			TALLOC_CTX *pools[SMBD_SMB2_REQUEST_CACHE_SIZE];
+			uint32_t num_pools;
+			uint64_t hits;
+			uint64_t misses;
+		} req_cache;
+		/*
+		 * finished replies waiting to be merged into a single
+		 * writev by smbd_smb2_send_pending().
+		 */
+		struct {
+			struct smbd_smb2_request *list;
+			struct tevent_immediate *im;
+			uint32_t num_iov;
+			size_t num_bytes;
+			uint32_t num_batches;
+			bool corked;
+			/*
+			 * bytes the PDU being read still needs from the
+			 * socket (an upper bound), 0 between PDUs
+			 */
+			size_t recv_missing;
+		} send_pending;
 	} smb2;
 };
 
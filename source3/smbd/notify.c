@@ -362,9 +362,16 @@ void notify_fname(connection_struct *conn, uint32 action, uint32 filter,
 		smb_fname_parent.base_name = parent;
 
 		if (SMB_VFS_STAT(conn, &smb_fname_parent) != -1) {
-			notify_onelevel(conn->notify_ctx, action, filter,
-			    SMB_VFS_FILE_ID_CREATE(conn, &smb_fname_parent.st),
-			    name);
+			struct file_id id = SMB_VFS_FILE_ID_CREATE(
+				conn, &smb_fname_parent.st);
+
+			if (filter & (FILE_NOTIFY_CHANGE_FILE_NAME|
+				      FILE_NOTIFY_CHANGE_DIR_NAME)) {
+				dirname_index_delete(conn, &id);
+			}
+			dircache_delete(conn, &id);
+			notify_onelevel(conn->notify_ctx, action, filter, id,
+					name);
 		}
 	}
 
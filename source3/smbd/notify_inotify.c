@@ -341,6 +341,20 @@ static uint32_t inotify_map(struct notify_entry *e)
 	return out;
 }
 
+/*
+  the part of a completion filter that inotify_watch() would take
+  over, used by smbds that leave the inotify watches to notifyd
+*/
+uint32_t inotify_filter_handled(uint32_t filter)
+{
+	struct notify_entry e;
+
+	ZERO_STRUCT(e);
+	e.filter = filter;
+	inotify_map(&e);
+	return filter & ~e.filter;
+}
+
 /*
   destroy a watch
 */
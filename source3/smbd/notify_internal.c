@@ -21,6 +21,15 @@
   this is the change notify database. It implements mechanisms for
   storing current change notify waiters in a tdb, and checking if a
   given event matches any of the stored notify waiiters.
+
+  notify.tdb has one record per watched directory, keyed by its path,
+  so adding or removing a watch only locks and rewrites the waiters of
+  that directory. notify_trigger() looks up the record of every parent
+  directory of the changed path.
+
+  With notifyd running, the part of a watch inotify can handle is
+  passed on to it, so all smbds share a single kernel watch per
+  directory.
 */
 
 #include "includes.h"
@@ -38,10 +47,9 @@ struct notify_context {
 	struct server_id server;
 	struct messaging_context *messaging_ctx;
 	struct notify_list *list;
-	struct notify_array *array;
-	int seqnum;
 	struct sys_notify_context *sys_notify_ctx;
-	TDB_DATA key;
+	bool use_notifyd;
+	struct server_id notifyd;
 };
 
 
@@ -50,18 +58,24 @@ struct notify_list {
 	void *private_data;
 	void (*callback)(void *, const struct notify_event *);
 	void *sys_notify_handle;
-	int depth;
+	char *path;
+	struct file_id dir_id;
+	uint32_t notifyd_filter; /* filter bits watched by notifyd */
+	bool in_db;
 };
 
-#define NOTIFY_KEY "notify array"
-
 #define NOTIFY_ENABLE		"notify:enable"
 #define NOTIFY_ENABLE_DEFAULT	True
 
-static NTSTATUS notify_remove_all(struct notify_context *notify,
-				  const struct server_id *server);
 static void notify_handler(struct messaging_context *msg_ctx, void *private_data, 
 			   uint32_t msg_type, struct server_id server_id, DATA_BLOB *data);
+static void notifyd_reject_handler(struct messaging_context *msg_ctx,
+				   void *private_data, uint32_t msg_type,
+				   struct server_id server_id, DATA_BLOB *data);
+static void notifyd_restarted_handler(struct messaging_context *msg_ctx,
+				      void *private_data, uint32_t msg_type,
+				      struct server_id server_id,
+				      DATA_BLOB *data);
 
 /*
   destroy the notify context
@@ -69,9 +83,13 @@ static void notify_handler(struct messaging_context *msg_ctx, void *private_data
 static int notify_destructor(struct notify_context *notify)
 {
 	messaging_deregister(notify->messaging_ctx, MSG_PVFS_NOTIFY, notify);
+	messaging_deregister(notify->messaging_ctx, MSG_SMB_NOTIFYD_REJECT,
+			     notify);
+	messaging_deregister(notify->messaging_ctx, MSG_SMB_NOTIFYD_RESTARTED,
+			     notify);
 
-	if (notify->list != NULL) {
-		notify_remove_all(notify, &notify->server);
+	while (notify->list != NULL) {
+		notify_remove(notify, notify->list->private_data);
 	}
 
 	return 0;
@@ -99,7 +117,7 @@ struct notify_context *notify_init(TALLOC_CTX *mem_ctx, struct server_id server,
 	}
 
 	notify->db_recursive = db_open(notify, lock_path("notify.tdb"),
-				       0, TDB_SEQNUM|TDB_CLEAR_IF_FIRST|TDB_INCOMPATIBLE_HASH,
+				       0, TDB_CLEAR_IF_FIRST|TDB_INCOMPATIBLE_HASH,
 				       O_RDWR|O_CREAT, 0644);
 	if (notify->db_recursive == NULL) {
 		talloc_free(notify);
@@ -117,10 +135,11 @@ struct notify_context *notify_init(TALLOC_CTX *mem_ctx, struct server_id server,
 	notify->server = server;
 	notify->messaging_ctx = messaging_ctx;
 	notify->list = NULL;
-	notify->array = NULL;
-	notify->seqnum = notify->db_recursive->get_seqnum(
-		notify->db_recursive);
-	notify->key = string_term_tdb_data(NOTIFY_KEY);
+
+	notify->use_notifyd =
+		lp_kernel_change_notify(conn->params) &&
+		lp_parm_bool(SNUM(conn), "notify", "daemon", false) &&
+		notifyd_server_id(&notify->notifyd);
 
 	talloc_set_destructor(notify, notify_destructor);
 
@@ -128,6 +147,14 @@ struct notify_context *notify_init(TALLOC_CTX *mem_ctx, struct server_id server,
 	   message type */
 	messaging_register(notify->messaging_ctx, notify, 
 			   MSG_PVFS_NOTIFY, notify_handler);
+	if (notify->use_notifyd) {
+		messaging_register(notify->messaging_ctx, notify,
+				   MSG_SMB_NOTIFYD_REJECT,
+				   notifyd_reject_handler);
+		messaging_register(notify->messaging_ctx, notify,
+				   MSG_SMB_NOTIFYD_RESTARTED,
+				   notifyd_restarted_handler);
+	}
 
 	notify->sys_notify_ctx = sys_notify_context_create(conn, notify, ev);
 
@@ -149,7 +176,7 @@ bool notify_internal_parent_init(TALLOC_CTX *mem_ctx)
 	 */
 
 	db1 = tdb_wrap_open(mem_ctx, lock_path("notify.tdb"),
-			    0, TDB_SEQNUM|TDB_CLEAR_IF_FIRST|TDB_INCOMPATIBLE_HASH,
+			    0, TDB_CLEAR_IF_FIRST|TDB_INCOMPATIBLE_HASH,
 			   O_RDWR|O_CREAT, 0644);
 	if (db1 == NULL) {
 		DEBUG(1, ("could not open notify.tdb: %s\n", strerror(errno)));
@@ -166,238 +193,207 @@ bool notify_internal_parent_init(TALLOC_CTX *mem_ctx)
 	return true;
 }
 
-/*
-  lock and fetch the record
-*/
-static NTSTATUS notify_fetch_locked(struct notify_context *notify, struct db_record **rec)
-{
-	*rec = notify->db_recursive->fetch_locked(notify->db_recursive,
-						  notify, notify->key);
-	if (*rec == NULL) {
-		return NT_STATUS_INTERNAL_DB_CORRUPTION;
-	}
-	return NT_STATUS_OK;
-}
 
 /*
-  load the notify array
+  handle incoming notify messages
 */
-static NTSTATUS notify_load(struct notify_context *notify, struct db_record *rec)
+static void notify_handler(struct messaging_context *msg_ctx, void *private_data, 
+			   uint32_t msg_type, struct server_id server_id, DATA_BLOB *data)
 {
-	TDB_DATA dbuf;
-	DATA_BLOB blob;
-	NTSTATUS status;
-	int seqnum;
-
-	seqnum = notify->db_recursive->get_seqnum(notify->db_recursive);
+	struct notify_context *notify = talloc_get_type(private_data, struct notify_context);
+	enum ndr_err_code ndr_err;
+	struct notify_event ev;
+	TALLOC_CTX *tmp_ctx = talloc_new(notify);
+	struct notify_list *listel;
 
-	if (seqnum == notify->seqnum && notify->array != NULL) {
-		return NT_STATUS_OK;
+	if (tmp_ctx == NULL) {
+		return;
 	}
 
-	notify->seqnum = seqnum;
-
-	talloc_free(notify->array);
-	notify->array = talloc_zero(notify, struct notify_array);
-	NT_STATUS_HAVE_NO_MEMORY(notify->array);
-
-	if (!rec) {
-		if (notify->db_recursive->fetch(notify->db_recursive, notify,
-						notify->key, &dbuf) != 0) {
-			return NT_STATUS_INTERNAL_DB_CORRUPTION;
-		}
-	} else {
-		dbuf = rec->value;
+	ndr_err = ndr_pull_struct_blob(data, tmp_ctx, &ev,
+				       (ndr_pull_flags_fn_t)ndr_pull_notify_event);
+	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
+		talloc_free(tmp_ctx);
+		return;
 	}
 
-	blob.data = (uint8 *)dbuf.dptr;
-	blob.length = dbuf.dsize;
-
-	status = NT_STATUS_OK;
-	if (blob.length > 0) {
-		enum ndr_err_code ndr_err;
-		ndr_err = ndr_pull_struct_blob(&blob, notify->array, notify->array,
-					       (ndr_pull_flags_fn_t)ndr_pull_notify_array);
-		if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-			/* 1. log that we got a corrupt notify_array
-			 * 2. clear the variable the garbage was stored into to not trip
-			 *  over it next time this method is entered with the same seqnum
-			 * 3. delete it from the database */
-			DEBUG(2, ("notify_array is corrupt, discarding it\n"));
-
-			ZERO_STRUCTP(notify->array);
-			if (rec != NULL) {
-				rec->delete_rec(rec);
-			}
-
-		} else {
-			if (DEBUGLEVEL >= 10) {
-				DEBUG(10, ("notify_load:\n"));
-				NDR_PRINT_DEBUG(notify_array, notify->array);
-			}
+	for (listel=notify->list;listel;listel=listel->next) {
+		if (listel->private_data == ev.private_data) {
+			listel->callback(listel->private_data, &ev);
+			break;
 		}
 	}
 
-
-	if (!rec) {
-		talloc_free(dbuf.dptr);
-	}
-
-	return status;
+	talloc_free(tmp_ctx);	
 }
 
 /*
-  compare notify entries for sorting
+  callback from sys_notify telling us about changes from the OS
 */
-static int notify_compare(const struct notify_entry *e1, const struct notify_entry *e2)
+static void sys_notify_callback(struct sys_notify_context *ctx, 
+				void *ptr, struct notify_event *ev)
 {
-	return strcmp(e1->path, e2->path);
+	struct notify_list *listel = talloc_get_type(ptr, struct notify_list);
+	ev->private_data = listel;
+	DEBUG(10, ("sys_notify_callback called with action=%d, for %s\n",
+		   ev->action, ev->path));
+	listel->callback(listel->private_data, ev);
 }
 
+
 /*
-  save the notify array
+  fetch the waiters stored under key, an empty array if there are none
 */
-static NTSTATUS notify_save(struct notify_context *notify, struct db_record *rec)
+static struct notify_entry_array *notify_array_parse(TALLOC_CTX *mem_ctx,
+						     TDB_DATA dbuf)
 {
-	TDB_DATA dbuf;
+	struct notify_entry_array *array;
 	DATA_BLOB blob;
-	NTSTATUS status;
 	enum ndr_err_code ndr_err;
-	TALLOC_CTX *tmp_ctx;
 
-	/* if possible, remove some depth arrays */
-	while (notify->array->num_depths > 0 &&
-	       notify->array->depth[notify->array->num_depths-1].num_entries == 0) {
-		notify->array->num_depths--;
+	array = talloc_zero(mem_ctx, struct notify_entry_array);
+	if (array == NULL) {
+		return NULL;
 	}
 
-	/* we might just be able to delete the record */
-	if (notify->array->num_depths == 0) {
-		return rec->delete_rec(rec);
-	}
+	blob.data = (uint8_t *)dbuf.dptr;
+	blob.length = dbuf.dsize;
 
-	tmp_ctx = talloc_new(notify);
-	NT_STATUS_HAVE_NO_MEMORY(tmp_ctx);
+	if (blob.length == 0) {
+		return array;
+	}
 
-	ndr_err = ndr_push_struct_blob(&blob, tmp_ctx, notify->array,
-				      (ndr_push_flags_fn_t)ndr_push_notify_array);
+	ndr_err = ndr_pull_struct_blob(&blob, array, array,
+		(ndr_pull_flags_fn_t)ndr_pull_notify_entry_array);
 	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-		talloc_free(tmp_ctx);
-		return ndr_map_error2ntstatus(ndr_err);
+		DEBUG(10, ("ndr_pull_notify_entry_array failed: %s\n",
+			   ndr_errstr(ndr_err)));
+		TALLOC_FREE(array);
+		return NULL;
 	}
-
 	if (DEBUGLEVEL >= 10) {
-		DEBUG(10, ("notify_save:\n"));
-		NDR_PRINT_DEBUG(notify_array, notify->array);
+		NDR_PRINT_DEBUG(notify_entry_array, array);
 	}
-
-	dbuf.dptr = blob.data;
-	dbuf.dsize = blob.length;
-
-	status = rec->store(rec, dbuf, TDB_REPLACE);
-	talloc_free(tmp_ctx);
-
-	return status;
+	return array;
 }
 
-
 /*
-  handle incoming notify messages
+  store the waiters under rec, deleting it if there are none left
 */
-static void notify_handler(struct messaging_context *msg_ctx, void *private_data, 
-			   uint32_t msg_type, struct server_id server_id, DATA_BLOB *data)
+static NTSTATUS notify_array_store(struct db_record *rec,
+				   struct notify_entry_array *array)
 {
-	struct notify_context *notify = talloc_get_type(private_data, struct notify_context);
+	DATA_BLOB blob;
+	TDB_DATA dbuf;
 	enum ndr_err_code ndr_err;
-	struct notify_event ev;
-	TALLOC_CTX *tmp_ctx = talloc_new(notify);
-	struct notify_list *listel;
 
-	if (tmp_ctx == NULL) {
-		return;
+	if (array->num_entries == 0) {
+		return rec->delete_rec(rec);
 	}
 
-	ndr_err = ndr_pull_struct_blob(data, tmp_ctx, &ev,
-				       (ndr_pull_flags_fn_t)ndr_pull_notify_event);
+	ndr_err = ndr_push_struct_blob(&blob, rec, array,
+		(ndr_push_flags_fn_t)ndr_push_notify_entry_array);
 	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-		talloc_free(tmp_ctx);
-		return;
+		DEBUG(10, ("ndr_push_notify_entry_array failed: %s\n",
+			   ndr_errstr(ndr_err)));
+		return ndr_map_error2ntstatus(ndr_err);
 	}
 
-	for (listel=notify->list;listel;listel=listel->next) {
-		if (listel->private_data == ev.private_data) {
-			listel->callback(listel->private_data, &ev);
-			break;
-		}
-	}
+	dbuf.dptr = blob.data;
+	dbuf.dsize = blob.length;
 
-	talloc_free(tmp_ctx);	
+	return rec->store(rec, dbuf, TDB_REPLACE);
 }
 
 /*
-  callback from sys_notify telling us about changes from the OS
+  add a waiter to the record under key
 */
-static void sys_notify_callback(struct sys_notify_context *ctx, 
-				void *ptr, struct notify_event *ev)
+static NTSTATUS notify_array_add(struct notify_context *notify,
+				 struct db_context *db, TDB_DATA key,
+				 const struct notify_entry *e,
+				 void *private_data)
 {
-	struct notify_list *listel = talloc_get_type(ptr, struct notify_list);
-	ev->private_data = listel;
-	DEBUG(10, ("sys_notify_callback called with action=%d, for %s\n",
-		   ev->action, ev->path));
-	listel->callback(listel->private_data, ev);
+	struct notify_entry_array *array;
+	struct notify_entry *entries;
+	struct db_record *rec;
+	NTSTATUS status;
+
+	rec = db->fetch_locked(db, talloc_tos(), key);
+	if (rec == NULL) {
+		return NT_STATUS_INTERNAL_DB_CORRUPTION;
+	}
+
+	array = notify_array_parse(rec, rec->value);
+	if (array == NULL) {
+		TALLOC_FREE(rec);
+		return NT_STATUS_INTERNAL_DB_CORRUPTION;
+	}
+
+	entries = talloc_realloc(array, array->entries, struct notify_entry,
+				 array->num_entries+1);
+	if (entries == NULL) {
+		TALLOC_FREE(rec);
+		return NT_STATUS_NO_MEMORY;
+	}
+	array->entries = entries;
+
+	entries[array->num_entries] = *e;
+	entries[array->num_entries].private_data = private_data;
+	entries[array->num_entries].server = notify->server;
+	entries[array->num_entries].path_len = strlen(e->path);
+	array->num_entries += 1;
+
+	status = notify_array_store(rec, array);
+	TALLOC_FREE(rec);
+	return status;
 }
 
 /*
-  add an entry to the notify array
+  remove the waiter of server with private_data from the record under key
 */
-static NTSTATUS notify_add_array(struct notify_context *notify, struct db_record *rec,
-				 struct notify_entry *e,
-				 void *private_data, int depth)
+static NTSTATUS notify_array_remove(struct db_context *db, TDB_DATA key,
+				    const struct server_id *server,
+				    void *private_data)
 {
+	struct notify_entry_array *array;
+	struct db_record *rec;
+	NTSTATUS status;
 	int i;
-	struct notify_depth *d;
-	struct notify_entry *ee;
-
-	/* possibly expand the depths array */
-	if (depth >= notify->array->num_depths) {
-		d = talloc_realloc(notify->array, notify->array->depth, 
-				   struct notify_depth, depth+1);
-		NT_STATUS_HAVE_NO_MEMORY(d);
-		for (i=notify->array->num_depths;i<=depth;i++) {
-			ZERO_STRUCT(d[i]);
-		}
-		notify->array->depth = d;
-		notify->array->num_depths = depth+1;
-	}
-	d = &notify->array->depth[depth];
 
-	/* expand the entries array */
-	ee = talloc_realloc(notify->array->depth, d->entries, struct notify_entry,
-			    d->num_entries+1);
-	NT_STATUS_HAVE_NO_MEMORY(ee);
-	d->entries = ee;
+	rec = db->fetch_locked(db, talloc_tos(), key);
+	if (rec == NULL) {
+		return NT_STATUS_INTERNAL_DB_CORRUPTION;
+	}
 
-	d->entries[d->num_entries] = *e;
-	d->entries[d->num_entries].private_data = private_data;
-	d->entries[d->num_entries].server = notify->server;
-	d->entries[d->num_entries].path_len = strlen(e->path);
-	d->num_entries++;
+	array = notify_array_parse(rec, rec->value);
+	if (array == NULL) {
+		TALLOC_FREE(rec);
+		return NT_STATUS_INTERNAL_DB_CORRUPTION;
+	}
 
-	d->max_mask |= e->filter;
-	d->max_mask_subdir |= e->subdir_filter;
+	for (i=0; i<array->num_entries; i++) {
+		if ((private_data == array->entries[i].private_data) &&
+		    cluster_id_equal(server, &array->entries[i].server)) {
+			break;
+		}
+	}
 
-	TYPESAFE_QSORT(d->entries, d->num_entries, notify_compare);
+	if (i == array->num_entries) {
+		TALLOC_FREE(rec);
+		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
+	}
 
-	/* recalculate the maximum masks */
-	d->max_mask = 0;
-	d->max_mask_subdir = 0;
+	array->entries[i] = array->entries[array->num_entries-1];
+	array->num_entries -= 1;
 
-	for (i=0;i<d->num_entries;i++) {
-		d->max_mask |= d->entries[i].filter;
-		d->max_mask_subdir |= d->entries[i].subdir_filter;
-	}
+	status = notify_array_store(rec, array);
+	TALLOC_FREE(rec);
+	return status;
+}
 
-	return notify_save(notify, rec);
+static TDB_DATA notify_path_key(const char *path, size_t len)
+{
+	return make_tdb_data((const uint8_t *)path, len);
 }
 
 /*
@@ -407,86 +403,182 @@ static NTSTATUS notify_add_array(struct notify_context *notify, struct db_record
 static void notify_add_onelevel(struct notify_context *notify,
 				struct notify_entry *e, void *private_data)
 {
-	struct notify_entry_array *array;
-	struct db_record *rec;
-	DATA_BLOB blob;
-	TDB_DATA dbuf;
-	enum ndr_err_code ndr_err;
 	NTSTATUS status;
 
-	array = talloc_zero(talloc_tos(), struct notify_entry_array);
-	if (array == NULL) {
+	status = notify_array_add(
+		notify, notify->db_onelevel,
+		make_tdb_data((uint8_t *)&e->dir_id, sizeof(e->dir_id)),
+		e, private_data);
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(10, ("notify_add_onelevel for %s failed: %s\n",
+			   file_id_string_tos(&e->dir_id), nt_errstr(status)));
 		return;
 	}
+	e->filter = 0;
+}
 
-	rec = notify->db_onelevel->fetch_locked(
-		notify->db_onelevel, talloc_tos(),
-		make_tdb_data((uint8_t *)&e->dir_id, sizeof(e->dir_id)));
-	if (rec == NULL) {
-		DEBUG(10, ("notify_add_onelevel: fetch_locked for %s failed"
-			   "\n", file_id_string_tos(&e->dir_id)));
-		TALLOC_FREE(array);
-		return;
-	}
+/*
+  watch the local part of e, either in the kernel or in the onelevel db
+*/
+static void notify_add_local(struct notify_context *notify,
+			     struct notify_entry *e,
+			     struct notify_list *listel)
+{
+	NTSTATUS status;
 
-	blob.data = (uint8_t *)rec->value.dptr;
-	blob.length = rec->value.dsize;
-
-	if (blob.length > 0) {
-		ndr_err = ndr_pull_struct_blob(&blob, array, array,
-			(ndr_pull_flags_fn_t)ndr_pull_notify_entry_array);
-		if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-			DEBUG(10, ("ndr_pull_notify_entry_array failed: %s\n",
-				   ndr_errstr(ndr_err)));
-			TALLOC_FREE(array);
-			return;
-		}
-		if (DEBUGLEVEL >= 10) {
-			DEBUG(10, ("notify_add_onelevel:\n"));
-			NDR_PRINT_DEBUG(notify_entry_array, array);
+	/* ignore failures from sys_notify */
+	if (notify->sys_notify_ctx != NULL) {
+		/*
+		  this call will modify e->filter and e->subdir_filter
+		  to remove bits handled by the backend
+		*/
+		status = sys_notify_watch(notify->sys_notify_ctx, e,
+					  sys_notify_callback, listel,
+					  &listel->sys_notify_handle);
+		if (NT_STATUS_IS_OK(status)) {
+			talloc_steal(listel, listel->sys_notify_handle);
 		}
 	}
 
-	array->entries = talloc_realloc(array, array->entries,
-					struct notify_entry,
-					array->num_entries+1);
-	if (array->entries == NULL) {
-		TALLOC_FREE(array);
-		return;
+	if (e->filter != 0) {
+		notify_add_onelevel(notify, e, listel->private_data);
 	}
-	array->entries[array->num_entries] = *e;
-	array->entries[array->num_entries].private_data = private_data;
-	array->entries[array->num_entries].server = notify->server;
-	array->num_entries += 1;
+}
 
-	ndr_err = ndr_push_struct_blob(&blob, rec, array,
-		(ndr_push_flags_fn_t)ndr_push_notify_entry_array);
+static uint32_t notifyd_filter_handled(uint32_t filter)
+{
+#ifdef HAVE_INOTIFY
+	return inotify_filter_handled(filter);
+#else
+	return 0;
+#endif
+}
+
+/*
+  send a watch request or its cancellation to notifyd
+*/
+static NTSTATUS notifyd_send(struct notify_context *notify,
+			     uint32_t msg_type, const char *path,
+			     struct file_id dir_id, uint32_t filter,
+			     void *private_data)
+{
+	struct notify_entry e;
+	DATA_BLOB blob;
+	enum ndr_err_code ndr_err;
+	NTSTATUS status;
+
+	ZERO_STRUCT(e);
+	e.server = notify->server;
+	e.filter = filter;
+	e.dir_id = dir_id;
+	e.path = path;
+	e.path_len = strlen(path);
+	e.private_data = private_data;
+
+	ndr_err = ndr_push_struct_blob(&blob, talloc_tos(), &e,
+		(ndr_push_flags_fn_t)ndr_push_notify_entry);
 	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-		DEBUG(10, ("ndr_push_notify_entry_array failed: %s\n",
-			   ndr_errstr(ndr_err)));
-		TALLOC_FREE(array);
-		return;
+		return ndr_map_error2ntstatus(ndr_err);
 	}
 
-	if (DEBUGLEVEL >= 10) {
-		DEBUG(10, ("notify_add_onelevel:\n"));
-		NDR_PRINT_DEBUG(notify_entry_array, array);
-	}
+	status = messaging_send(notify->messaging_ctx, notify->notifyd,
+				msg_type, &blob);
+	TALLOC_FREE(blob.data);
+	return status;
+}
 
-	dbuf.dptr = blob.data;
-	dbuf.dsize = blob.length;
+/*
+  notifyd could not watch something for us, do it ourselves
+*/
+static void notifyd_reject_handler(struct messaging_context *msg_ctx,
+				   void *private_data, uint32_t msg_type,
+				   struct server_id server_id, DATA_BLOB *data)
+{
+	struct notify_context *notify = talloc_get_type_abort(
+		private_data, struct notify_context);
+	struct notify_list *listel;
+	struct notify_entry e;
+	enum ndr_err_code ndr_err;
 
-	status = rec->store(rec, dbuf, TDB_REPLACE);
-	TALLOC_FREE(array);
-	if (!NT_STATUS_IS_OK(status)) {
-		DEBUG(10, ("notify_add_onelevel: store failed: %s\n",
-			   nt_errstr(status)));
+	ndr_err = ndr_pull_struct_blob_all(data, talloc_tos(), &e,
+		(ndr_pull_flags_fn_t)ndr_pull_notify_entry);
+	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
 		return;
 	}
-	e->filter = 0;
-	return;
+
+	for (listel=notify->list;listel;listel=listel->next) {
+		if (listel->private_data == e.private_data) {
+			break;
+		}
+	}
+	if ((listel == NULL) || (listel->notifyd_filter == 0)) {
+		/* Not ours or already gone */
+		return;
+	}
+
+	DEBUG(10, ("notifyd rejected watch for %s, watching locally\n",
+		   e.path));
+
+	listel->notifyd_filter = 0;
+	notify_add_local(notify, &e, listel);
 }
 
+/*
+  notifyd died and lost our watches. The parent smbd restarted it and
+  sends us the new server id, or an empty message if it gave up. Hand
+  the watches to the new notifyd or watch them ourselves.
+*/
+static void notifyd_restarted_handler(struct messaging_context *msg_ctx,
+				      void *private_data, uint32_t msg_type,
+				      struct server_id server_id,
+				      DATA_BLOB *data)
+{
+	struct notify_context *notify = talloc_get_type_abort(
+		private_data, struct notify_context);
+	struct notify_list *listel;
+	bool have_notifyd = false;
+
+	if (data->length == sizeof(notify->notifyd)) {
+		memcpy(&notify->notifyd, data->data, sizeof(notify->notifyd));
+		have_notifyd = true;
+	} else {
+		notify->use_notifyd = false;
+	}
+
+	for (listel=notify->list;listel;listel=listel->next) {
+		struct notify_entry e;
+
+		if (listel->notifyd_filter == 0) {
+			continue;
+		}
+
+		if (have_notifyd) {
+			NTSTATUS status;
+
+			status = notifyd_send(notify, MSG_SMB_NOTIFYD_WATCH,
+					      listel->path, listel->dir_id,
+					      listel->notifyd_filter,
+					      listel->private_data);
+			if (NT_STATUS_IS_OK(status)) {
+				continue;
+			}
+		}
+
+		DEBUG(10, ("notifyd is gone, watching %s locally\n",
+			   listel->path));
+
+		ZERO_STRUCT(e);
+		e.server = notify->server;
+		e.filter = listel->notifyd_filter;
+		e.dir_id = listel->dir_id;
+		e.path = listel->path;
+		e.path_len = strlen(listel->path);
+		e.private_data = listel->private_data;
+
+		listel->notifyd_filter = 0;
+		notify_add_local(notify, &e, listel);
+	}
+}
 
 /*
   add a notify watch. This is called when a notify is first setup on a open
@@ -497,82 +589,72 @@ NTSTATUS notify_add(struct notify_context *notify, struct notify_entry *e0,
 		    void *private_data)
 {
 	struct notify_entry e = *e0;
-	NTSTATUS status;
-	char *tmp_path = NULL;
+	NTSTATUS status = NT_STATUS_OK;
 	struct notify_list *listel;
 	size_t len;
-	int depth;
-	struct db_record *rec;
 
 	/* see if change notify is enabled at all */
 	if (notify == NULL) {
 		return NT_STATUS_NOT_IMPLEMENTED;
 	}
 
-	status = notify_fetch_locked(notify, &rec);
-	NT_STATUS_NOT_OK_RETURN(status);
-
-	status = notify_load(notify, rec);
-	if (!NT_STATUS_IS_OK(status)) {
-		talloc_free(rec);
-		return status;
+	listel = talloc_zero(notify, struct notify_list);
+	if (listel == NULL) {
+		return NT_STATUS_NO_MEMORY;
 	}
 
 	/* cope with /. on the end of the path */
 	len = strlen(e.path);
 	if (len > 1 && e.path[len-1] == '.' && e.path[len-2] == '/') {
-		tmp_path = talloc_strndup(notify, e.path, len-2);
-		if (tmp_path == NULL) {
-			status = NT_STATUS_NO_MEMORY;
-			goto done;
-		}
-		e.path = tmp_path;
+		len -= 2;
 	}
-
-	depth = count_chars(e.path, '/');
-
-	listel = talloc_zero(notify, struct notify_list);
-	if (listel == NULL) {
-		status = NT_STATUS_NO_MEMORY;
-		goto done;
+	listel->path = talloc_strndup(listel, e.path, len);
+	if (listel->path == NULL) {
+		TALLOC_FREE(listel);
+		return NT_STATUS_NO_MEMORY;
 	}
+	e.path = listel->path;
 
+	listel->dir_id = e.dir_id;
 	listel->private_data = private_data;
 	listel->callback = callback;
-	listel->depth = depth;
 	DLIST_ADD(notify->list, listel);
 
-	/* ignore failures from sys_notify */
-	if (notify->sys_notify_ctx != NULL) {
-		/*
-		  this call will modify e.filter and e.subdir_filter
-		  to remove bits handled by the backend
-		*/
-		status = sys_notify_watch(notify->sys_notify_ctx, &e,
-					  sys_notify_callback, listel, 
-					  &listel->sys_notify_handle);
-		if (NT_STATUS_IS_OK(status)) {
-			talloc_steal(listel, listel->sys_notify_handle);
+	if (notify->use_notifyd) {
+		uint32_t handled = notifyd_filter_handled(e.filter);
+
+		if (handled != 0) {
+			status = notifyd_send(notify, MSG_SMB_NOTIFYD_WATCH,
+					      e.path, e.dir_id, handled,
+					      private_data);
+			if (NT_STATUS_IS_OK(status)) {
+				listel->notifyd_filter = handled;
+				e.filter &= ~handled;
+			} else {
+				DEBUG(3, ("notify_add: sending to notifyd "
+					  "failed: %s\n", nt_errstr(status)));
+			}
 		}
 	}
 
-	if (e.filter != 0) {
+	if (listel->notifyd_filter == 0) {
+		notify_add_local(notify, &e, listel);
+	} else if (e.filter != 0) {
 		notify_add_onelevel(notify, &e, private_data);
-		status = NT_STATUS_OK;
 	}
+	status = NT_STATUS_OK;
 
 	/* if the system notify handler couldn't handle some of the
 	   filter bits, or couldn't handle a request for recursion
-	   then we need to install it in the array used for the
+	   then we need to install it in the database used for the
 	   intra-samba notify handling */
 	if (e.filter != 0 || e.subdir_filter != 0) {
-		status = notify_add_array(notify, rec, &e, private_data, depth);
+		status = notify_array_add(
+			notify, notify->db_recursive,
+			notify_path_key(listel->path, len), &e, private_data);
+		listel->in_db = NT_STATUS_IS_OK(status);
 	}
 
-done:
-	talloc_free(rec);
-	talloc_free(tmp_path);
-
 	return status;
 }
 
@@ -580,98 +662,14 @@ NTSTATUS notify_remove_onelevel(struct notify_context *notify,
 				const struct file_id *fid,
 				void *private_data)
 {
-	struct notify_entry_array *array;
-	struct db_record *rec;
-	DATA_BLOB blob;
-	TDB_DATA dbuf;
-	enum ndr_err_code ndr_err;
-	NTSTATUS status;
-	int i;
-
 	if (notify == NULL) {
 		return NT_STATUS_NOT_IMPLEMENTED;
 	}
 
-	array = talloc_zero(talloc_tos(), struct notify_entry_array);
-	if (array == NULL) {
-		return NT_STATUS_NO_MEMORY;
-	}
-
-	rec = notify->db_onelevel->fetch_locked(
-		notify->db_onelevel, array,
-		make_tdb_data((const uint8_t *)fid, sizeof(*fid)));
-	if (rec == NULL) {
-		DEBUG(10, ("notify_remove_onelevel: fetch_locked for %s failed"
-			   "\n", file_id_string_tos(fid)));
-		TALLOC_FREE(array);
-		return NT_STATUS_INTERNAL_DB_CORRUPTION;
-	}
-
-	blob.data = (uint8_t *)rec->value.dptr;
-	blob.length = rec->value.dsize;
-
-	if (blob.length > 0) {
-		ndr_err = ndr_pull_struct_blob(&blob, array, array,
-			(ndr_pull_flags_fn_t)ndr_pull_notify_entry_array);
-		if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-			DEBUG(10, ("ndr_pull_notify_entry_array failed: %s\n",
-				   ndr_errstr(ndr_err)));
-			TALLOC_FREE(array);
-			return ndr_map_error2ntstatus(ndr_err);
-		}
-		if (DEBUGLEVEL >= 10) {
-			DEBUG(10, ("notify_remove_onelevel:\n"));
-			NDR_PRINT_DEBUG(notify_entry_array, array);
-		}
-	}
-
-	for (i=0; i<array->num_entries; i++) {
-		if ((private_data == array->entries[i].private_data) &&
-		    cluster_id_equal(&notify->server,
-				     &array->entries[i].server)) {
-			break;
-		}
-	}
-
-	if (i == array->num_entries) {
-		TALLOC_FREE(array);
-		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
-	}
-
-	array->entries[i] = array->entries[array->num_entries-1];
-	array->num_entries -= 1;
-
-	if (array->num_entries == 0) {
-		rec->delete_rec(rec);
-		TALLOC_FREE(array);
-		return NT_STATUS_OK;
-	}
-
-	ndr_err = ndr_push_struct_blob(&blob, rec, array,
-		(ndr_push_flags_fn_t)ndr_push_notify_entry_array);
-	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-		DEBUG(10, ("ndr_push_notify_entry_array failed: %s\n",
-			   ndr_errstr(ndr_err)));
-		TALLOC_FREE(array);
-		return ndr_map_error2ntstatus(ndr_err);
-	}
-
-	if (DEBUGLEVEL >= 10) {
-		DEBUG(10, ("notify_add_onelevel:\n"));
-		NDR_PRINT_DEBUG(notify_entry_array, array);
-	}
-
-	dbuf.dptr = blob.data;
-	dbuf.dsize = blob.length;
-
-	status = rec->store(rec, dbuf, TDB_REPLACE);
-	TALLOC_FREE(array);
-	if (!NT_STATUS_IS_OK(status)) {
-		DEBUG(10, ("notify_add_onelevel: store failed: %s\n",
-			   nt_errstr(status)));
-		return status;
-	}
-	return NT_STATUS_OK;
+	return notify_array_remove(
+		notify->db_onelevel,
+		make_tdb_data((const uint8_t *)fid, sizeof(*fid)),
+		&notify->server, private_data);
 }
 
 /*
@@ -679,11 +677,8 @@ NTSTATUS notify_remove_onelevel(struct notify_context *notify,
 */
 NTSTATUS notify_remove(struct notify_context *notify, void *private_data)
 {
-	NTSTATUS status;
+	NTSTATUS status = NT_STATUS_OK;
 	struct notify_list *listel;
-	int i, depth;
-	struct notify_depth *d;
-	struct db_record *rec;
 
 	/* see if change notify is enabled at all */
 	if (notify == NULL) {
@@ -700,97 +695,26 @@ NTSTATUS notify_remove(struct notify_context *notify, void *private_data)
 		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
 	}
 
-	depth = listel->depth;
-
-	talloc_free(listel);
-
-	status = notify_fetch_locked(notify, &rec);
-	NT_STATUS_NOT_OK_RETURN(status);
-
-	status = notify_load(notify, rec);
-	if (!NT_STATUS_IS_OK(status)) {
-		talloc_free(rec);
-		return status;
-	}
-
-	if (depth >= notify->array->num_depths) {
-		talloc_free(rec);
-		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
-	}
-
-	/* we only have to search at the depth of this element */
-	d = &notify->array->depth[depth];
-
-	for (i=0;i<d->num_entries;i++) {
-		if (private_data == d->entries[i].private_data &&
-		    cluster_id_equal(&notify->server, &d->entries[i].server)) {
-			break;
-		}
-	}
-	if (i == d->num_entries) {
-		talloc_free(rec);
-		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
-	}
-
-	if (i < d->num_entries-1) {
-		memmove(&d->entries[i], &d->entries[i+1], 
-			sizeof(d->entries[i])*(d->num_entries-(i+1)));
-	}
-	d->num_entries--;
-
-	status = notify_save(notify, rec);
-
-	talloc_free(rec);
-
-	return status;
-}
-
-/*
-  remove all notify watches for a messaging server
-*/
-static NTSTATUS notify_remove_all(struct notify_context *notify,
-				  const struct server_id *server)
-{
-	NTSTATUS status;
-	int i, depth, del_count=0;
-	struct db_record *rec;
-
-	status = notify_fetch_locked(notify, &rec);
-	NT_STATUS_NOT_OK_RETURN(status);
+	if (listel->notifyd_filter != 0) {
+		struct file_id dir_id;
 
-	status = notify_load(notify, rec);
-	if (!NT_STATUS_IS_OK(status)) {
-		talloc_free(rec);
-		return status;
+		ZERO_STRUCT(dir_id);
+		notifyd_send(notify, MSG_SMB_NOTIFYD_UNWATCH, listel->path,
+			     dir_id, listel->notifyd_filter, private_data);
 	}
 
-	/* we have to search for all entries across all depths, looking for matches
-	   for the server id */
-	for (depth=0;depth<notify->array->num_depths;depth++) {
-		struct notify_depth *d = &notify->array->depth[depth];
-		for (i=0;i<d->num_entries;i++) {
-			if (cluster_id_equal(server, &d->entries[i].server)) {
-				if (i < d->num_entries-1) {
-					memmove(&d->entries[i], &d->entries[i+1], 
-						sizeof(d->entries[i])*(d->num_entries-(i+1)));
-				}
-				i--;
-				d->num_entries--;
-				del_count++;
-			}
-		}
+	if (listel->in_db) {
+		status = notify_array_remove(
+			notify->db_recursive,
+			notify_path_key(listel->path, strlen(listel->path)),
+			&notify->server, private_data);
 	}
 
-	if (del_count > 0) {
-		status = notify_save(notify, rec);
-	}
-
-	talloc_free(rec);
+	talloc_free(listel);
 
 	return status;
 }
 
-
 /*
   send a notify message to another messaging server
 */
@@ -822,12 +746,36 @@ static NTSTATUS notify_send(struct notify_context *notify, struct notify_entry *
 	return status;
 }
 
+/*
+  remove the waiters notify_send() found dead from the record under key
+*/
+static void notify_remove_dead(struct db_context *db, TDB_DATA key,
+			       struct notify_entry_array *array)
+{
+	int i;
+
+	for (i=0; i<array->num_entries; i++) {
+		struct notify_entry *e = &array->entries[i];
+		if (e->path != NULL) {
+			continue;
+		}
+		DEBUG(10, ("Deleting notify entries for process %s because "
+			   "it's gone\n", procid_str_static(&e->server)));
+		/*
+		 * Potential TODO: This might need optimizing,
+		 * notify_array_remove() does a fetch_locked() operation at
+		 * every call. But this would only matter if a process with
+		 * MANY notifies has died without shutting down properly.
+		 */
+		notify_array_remove(db, key, &e->server, e->private_data);
+	}
+}
+
 void notify_onelevel(struct notify_context *notify, uint32_t action,
 		     uint32_t filter, struct file_id fid, const char *name)
 {
 	struct notify_entry_array *array;
-	TDB_DATA dbuf;
-	DATA_BLOB blob;
+	TDB_DATA key, dbuf;
 	bool have_dead_entries = false;
 	int i;
 
@@ -835,36 +783,17 @@ void notify_onelevel(struct notify_context *notify, uint32_t action,
 		return;
 	}
 
-	array = talloc_zero(talloc_tos(), struct notify_entry_array);
-	if (array == NULL) {
-		return;
-	}
+	key = make_tdb_data((uint8_t *)&fid, sizeof(fid));
 
-	if (notify->db_onelevel->fetch(
-		    notify->db_onelevel, array,
-		    make_tdb_data((uint8_t *)&fid, sizeof(fid)),
-		    &dbuf) != 0) {
-		TALLOC_FREE(array);
+	if (notify->db_onelevel->fetch(notify->db_onelevel, talloc_tos(),
+				       key, &dbuf) != 0) {
 		return;
 	}
 
-	blob.data = (uint8 *)dbuf.dptr;
-	blob.length = dbuf.dsize;
-
-	if (blob.length > 0) {
-		enum ndr_err_code ndr_err;
-		ndr_err = ndr_pull_struct_blob(&blob, array, array,
-			(ndr_pull_flags_fn_t)ndr_pull_notify_entry_array);
-		if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-			DEBUG(10, ("ndr_pull_notify_entry_array failed: %s\n",
-				   ndr_errstr(ndr_err)));
-			TALLOC_FREE(array);
-			return;
-		}
-		if (DEBUGLEVEL >= 10) {
-			DEBUG(10, ("notify_onelevel:\n"));
-			NDR_PRINT_DEBUG(notify_entry_array, array);
-		}
+	array = notify_array_parse(talloc_tos(), dbuf);
+	TALLOC_FREE(dbuf.dptr);
+	if (array == NULL) {
+		return;
 	}
 
 	for (i=0; i<array->num_entries; i++) {
@@ -887,25 +816,8 @@ void notify_onelevel(struct notify_context *notify, uint32_t action,
 		}
 	}
 
-	if (!have_dead_entries) {
-		TALLOC_FREE(array);
-		return;
-	}
-
-	for (i=0; i<array->num_entries; i++) {
-		struct notify_entry *e = &array->entries[i];
-		if (e->path != NULL) {
-			continue;
-		}
-		DEBUG(10, ("Deleting notify entries for process %s because "
-			   "it's gone\n", procid_str_static(&e->server)));
-		/*
-		 * Potential TODO: This might need optimizing,
-		 * notify_remove_onelevel() does a fetch_locked() operation at
-		 * every call. But this would only matter if a process with
-		 * MANY notifies has died without shutting down properly.
-		 */
-		notify_remove_onelevel(notify, &e->dir_id, e->private_data);
+	if (have_dead_entries) {
+		notify_remove_dead(notify->db_onelevel, key, array);
 	}
 
 	TALLOC_FREE(array);
@@ -915,15 +827,13 @@ void notify_onelevel(struct notify_context *notify, uint32_t action,
 /*
   trigger a notify message for anyone waiting on a matching event
 
-  This function is called a lot, and needs to be very fast. The unusual data structure
-  and traversal is designed to be fast in the average case, even for large numbers of
-  notifies
+  This function is called a lot, and needs to be very fast. Waiters are
+  stored per directory, so we only look at the records of the
+  directories above path, one tdb lookup per path component.
 */
 void notify_trigger(struct notify_context *notify,
 		    uint32_t action, uint32_t filter, const char *path)
 {
-	NTSTATUS status;
-	int depth;
 	const char *p, *next_p;
 
 	DEBUG(10, ("notify_trigger called action=0x%x, filter=0x%x, "
@@ -934,72 +844,43 @@ void notify_trigger(struct notify_context *notify,
 		return;
 	}
 
- again:
-	status = notify_load(notify, NULL);
-	if (!NT_STATUS_IS_OK(status)) {
-		return;
-	}
+	/* loop along the given path, looking at each parent directory */
+	for (p = strchr(path, '/'); p != NULL; p = next_p) {
+		struct notify_entry_array *array;
+		TDB_DATA key, dbuf;
+		bool have_dead_entries = false;
+		int i;
 
-	/* loop along the given path, working with each directory depth separately */
-	for (depth=0,p=path;
-	     p && depth < notify->array->num_depths;
-	     p=next_p,depth++) {
-		int p_len = p - path;
-		int min_i, max_i, i;
-		struct notify_depth *d = &notify->array->depth[depth];
 		next_p = strchr(p+1, '/');
 
-		/* see if there are any entries at this depth */
-		if (d->num_entries == 0) continue;
-
-		/* try to skip based on the maximum mask. If next_p is
-		 NULL then we know it will be a 'this directory'
-		 match, otherwise it must be a subdir match */
-		if (next_p != NULL) {
-			if (0 == (filter & d->max_mask_subdir)) {
-				continue;
-			}
-		} else {
-			if (0 == (filter & d->max_mask)) {
-				continue;
-			}
+		if (p == path) {
+			continue;
 		}
 
-		/* we know there is an entry here worth looking
-		 for. Use a bisection search to find the first entry
-		 with a matching path */
-		min_i = 0;
-		max_i = d->num_entries-1;
-
-		while (min_i < max_i) {
-			struct notify_entry *e;
-			int cmp;
-			i = (min_i+max_i)/2;
-			e = &d->entries[i];
-			cmp = strncmp(path, e->path, p_len);
-			if (cmp == 0) {
-				if (p_len == e->path_len) {
-					max_i = i;
-				} else {
-					max_i = i-1;
-				}
-			} else if (cmp < 0) {
-				max_i = i-1;
-			} else {
-				min_i = i+1;
-			}
+		key = notify_path_key(path, p - path);
+
+		if (notify->db_recursive->fetch(notify->db_recursive,
+						talloc_tos(), key,
+						&dbuf) != 0) {
+			continue;
+		}
+		if (dbuf.dptr == NULL) {
+			continue;
 		}
 
-		if (min_i != max_i) {
-			/* none match */
+		array = notify_array_parse(talloc_tos(), dbuf);
+		TALLOC_FREE(dbuf.dptr);
+		if (array == NULL) {
 			continue;
 		}
 
-		/* we now know that the entries start at min_i */
-		for (i=min_i;i<d->num_entries;i++) {
-			struct notify_entry *e = &d->entries[i];
-			if (p_len != e->path_len ||
-			    strncmp(path, e->path, p_len) != 0) break;
+		for (i=0; i<array->num_entries; i++) {
+			struct notify_entry *e = &array->entries[i];
+			NTSTATUS status;
+
+			/* If next_p is NULL then this is a 'this
+			 directory' match, otherwise it must be a
+			 subdir match */
 			if (next_p != NULL) {
 				if (0 == (filter & e->subdir_filter)) {
 					continue;
@@ -1009,19 +890,20 @@ void notify_trigger(struct notify_context *notify,
 					continue;
 				}
 			}
-			status = notify_send(notify, e,	path + e->path_len + 1,
-					     action);
+
+			status = notify_send(notify, e, p + 1, action);
 
 			if (NT_STATUS_EQUAL(
 				    status, NT_STATUS_INVALID_HANDLE)) {
-				struct server_id server = e->server;
-
-				DEBUG(10, ("Deleting notify entries for "
-					   "process %s because it's gone\n",
-					   procid_str_static(&e->server)));
-				notify_remove_all(notify, &server);
-				goto again;
+				e->path = NULL;
+				have_dead_entries = true;
 			}
 		}
+
+		if (have_dead_entries) {
+			notify_remove_dead(notify->db_recursive, key, array);
+		}
+
+		TALLOC_FREE(array);
 	}
 }
@@ -0,0 +1,493 @@
+/*
+   Unix SMB/CIFS implementation.
+   Server-wide inotify watches for change notify
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Without this every smbd opens its own inotify instance and adds a
+ * watch per change notify request. With many clients keeping many
+ * Explorer windows open this runs into the per-user inotify instance
+ * and watch limits.
+ *
+ * With "notify:daemon = yes" the parent smbd forks this daemon. smbds
+ * hand the inotify part of their watches to it with
+ * MSG_SMB_NOTIFYD_WATCH and drop them with MSG_SMB_NOTIFYD_UNWATCH.
+ * All watches live on the daemon's single inotify instance, where the
+ * kernel keeps one watch descriptor per directory no matter how many
+ * smbds watch it. Events are fanned out to the subscribed smbds as
+ * MSG_PVFS_NOTIFY messages, the same message the notify database uses.
+ * A watch the daemon cannot set up is sent back with
+ * MSG_SMB_NOTIFYD_REJECT, so the smbd can fall back to its own
+ * mechanisms.
+ *
+ * If the daemon dies the parent smbd forks a new one and broadcasts
+ * its server id with MSG_SMB_NOTIFYD_RESTARTED, the smbds then send
+ * their watches again. If it dies again right away the parent gives up
+ * and broadcasts an empty MSG_SMB_NOTIFYD_RESTARTED, the smbds then
+ * watch locally.
+ */
+
+#include "includes.h"
+#include "smbd/smbd.h"
+#include "smbd/globals.h"
+#include "librpc/gen_ndr/ndr_notify.h"
+#include "dbwrap.h"
+#include "messages.h"
+#include "serverid.h"
+#include "util_tdb.h"
+
+static struct server_id notifyd_id;
+static bool notifyd_started;
+
+/****************************************************************************
+ The server id of the notify daemon, false if there is none. A dead
+ daemon does not count, the parent broadcasts the id of its successor.
+****************************************************************************/
+
+bool notifyd_server_id(struct server_id *id)
+{
+	if (!notifyd_started) {
+		return false;
+	}
+	if (!process_exists(notifyd_id)) {
+		return false;
+	}
+	*id = notifyd_id;
+	return true;
+}
+
+#ifdef HAVE_INOTIFY
+
+/* don't restart a notifyd that died sooner than this after its start */
+#define NOTIFYD_RESTART_INTERVAL 10
+
+/* how often notifyd looks for watches of smbds that died */
+#define NOTIFYD_SWEEP_INTERVAL 60
+
+static struct tevent_context *notifyd_ev_ctx;
+static struct messaging_context *notifyd_msg_ctx;
+static time_t notifyd_start_time;
+static int notifyd_pause_pipe = -1;
+
+struct notifyd_state {
+	struct messaging_context *msg_ctx;
+	struct sys_notify_context *sys_ctx;
+	/* (server, private_data) -> struct notifyd_watch */
+	struct db_context *watches;
+};
+
+struct notifyd_watch {
+	struct notifyd_state *state;
+	struct server_id server;
+	void *private_data;
+	void *sys_handle;
+};
+
+struct notifyd_key {
+	struct server_id server;
+	uint64_t private_data;
+};
+
+static TDB_DATA notifyd_key(struct notifyd_key *key,
+			    const struct server_id *server,
+			    void *private_data)
+{
+	ZERO_STRUCTP(key);
+	key->server = *server;
+	key->private_data = (uint64_t)(uintptr_t)private_data;
+	return make_tdb_data((uint8_t *)key, sizeof(*key));
+}
+
+static struct notifyd_watch *notifyd_find(struct notifyd_state *state,
+					  const struct server_id *server,
+					  void *private_data)
+{
+	struct notifyd_key key;
+	struct notifyd_watch *w = NULL;
+	TDB_DATA data;
+
+	data = dbwrap_fetch(state->watches, talloc_tos(),
+			    notifyd_key(&key, server, private_data));
+	if (data.dsize == sizeof(w)) {
+		memcpy(&w, data.dptr, sizeof(w));
+	}
+	TALLOC_FREE(data.dptr);
+	return w;
+}
+
+static int notifyd_watch_destructor(struct notifyd_watch *w)
+{
+	struct notifyd_key key;
+
+	dbwrap_delete(w->state->watches,
+		      notifyd_key(&key, &w->server, w->private_data));
+	return 0;
+}
+
+/****************************************************************************
+ An inotify event for one subscriber, pass it on.
+****************************************************************************/
+
+static void notifyd_event(struct sys_notify_context *ctx,
+			  void *private_data, struct notify_event *ev)
+{
+	struct notifyd_watch *w = talloc_get_type_abort(
+		private_data, struct notifyd_watch);
+	enum ndr_err_code ndr_err;
+	DATA_BLOB blob;
+	NTSTATUS status;
+
+	ev->private_data = w->private_data;
+
+	ndr_err = ndr_push_struct_blob(
+		&blob, talloc_tos(), ev,
+		(ndr_push_flags_fn_t)ndr_push_notify_event);
+	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
+		return;
+	}
+
+	status = messaging_send(w->state->msg_ctx, w->server,
+				MSG_PVFS_NOTIFY, &blob);
+	TALLOC_FREE(blob.data);
+
+	if (NT_STATUS_EQUAL(status, NT_STATUS_INVALID_HANDLE)) {
+		DEBUG(10, ("notifyd: dropping watch of %s, it's gone\n",
+			   procid_str_static(&w->server)));
+		TALLOC_FREE(w);
+	}
+}
+
+static void notifyd_watch_msg(struct messaging_context *msg_ctx,
+			      void *private_data,
+			      uint32_t msg_type,
+			      struct server_id src,
+			      DATA_BLOB *data)
+{
+	struct notifyd_state *state = talloc_get_type_abort(
+		private_data, struct notifyd_state);
+	struct notifyd_watch *w;
+	struct notify_entry e;
+	enum ndr_err_code ndr_err;
+	struct notifyd_key key;
+	NTSTATUS status;
+
+	ndr_err = ndr_pull_struct_blob_all(
+		data, talloc_tos(), &e,
+		(ndr_pull_flags_fn_t)ndr_pull_notify_entry);
+	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
+		DEBUG(1, ("notifyd: invalid watch request from %s\n",
+			  procid_str_static(&src)));
+		return;
+	}
+
+	w = notifyd_find(state, &e.server, e.private_data);
+	TALLOC_FREE(w);
+
+	w = talloc_zero(state, struct notifyd_watch);
+	if (w == NULL) {
+		goto reject;
+	}
+	w->state = state;
+	w->server = e.server;
+	w->private_data = e.private_data;
+
+	status = inotify_watch(state->sys_ctx, &e, notifyd_event, w,
+			       &w->sys_handle);
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(3, ("notifyd: could not watch %s for %s: %s\n",
+			  e.path, procid_str_static(&e.server),
+			  nt_errstr(status)));
+		TALLOC_FREE(w);
+		goto reject;
+	}
+	talloc_steal(w, w->sys_handle);
+
+	status = dbwrap_store(state->watches,
+			      notifyd_key(&key, &w->server, w->private_data),
+			      make_tdb_data((uint8_t *)&w, sizeof(w)), 0);
+	if (!NT_STATUS_IS_OK(status)) {
+		TALLOC_FREE(w);
+		goto reject;
+	}
+	talloc_set_destructor(w, notifyd_watch_destructor);
+
+	DEBUG(10, ("notifyd: %s watches %s\n",
+		   procid_str_static(&e.server), e.path));
+	return;
+
+reject:
+	messaging_send(msg_ctx, e.server, MSG_SMB_NOTIFYD_REJECT, data);
+}
+
+static void notifyd_unwatch_msg(struct messaging_context *msg_ctx,
+				void *private_data,
+				uint32_t msg_type,
+				struct server_id src,
+				DATA_BLOB *data)
+{
+	struct notifyd_state *state = talloc_get_type_abort(
+		private_data, struct notifyd_state);
+	struct notifyd_watch *w;
+	struct notify_entry e;
+	enum ndr_err_code ndr_err;
+
+	ndr_err = ndr_pull_struct_blob_all(
+		data, talloc_tos(), &e,
+		(ndr_pull_flags_fn_t)ndr_pull_notify_entry);
+	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
+		DEBUG(1, ("notifyd: invalid unwatch request from %s\n",
+			  procid_str_static(&src)));
+		return;
+	}
+
+	w = notifyd_find(state, &e.server, e.private_data);
+	TALLOC_FREE(w);
+}
+
+struct notifyd_sweep_state {
+	struct notifyd_watch **dead;
+	size_t num_dead;
+};
+
+static int notifyd_sweep_fn(struct db_record *rec, void *private_data)
+{
+	struct notifyd_sweep_state *sweep =
+		(struct notifyd_sweep_state *)private_data;
+	struct notifyd_watch *w;
+
+	if (rec->value.dsize != sizeof(w)) {
+		return 0;
+	}
+	memcpy(&w, rec->value.dptr, sizeof(w));
+
+	if (serverid_exists(&w->server)) {
+		return 0;
+	}
+
+	sweep->dead = talloc_realloc(talloc_tos(), sweep->dead,
+				     struct notifyd_watch *,
+				     sweep->num_dead + 1);
+	if (sweep->dead == NULL) {
+		sweep->num_dead = 0;
+		return -1;
+	}
+	sweep->dead[sweep->num_dead++] = w;
+	return 0;
+}
+
+/****************************************************************************
+ Drop the watches of smbds that died without removing them. Their
+ watches otherwise only go away with the next event in the directory.
+****************************************************************************/
+
+static void notifyd_sweep(struct tevent_context *ev,
+			  struct tevent_timer *te,
+			  struct timeval now,
+			  void *private_data)
+{
+	struct notifyd_state *state = talloc_get_type_abort(
+		private_data, struct notifyd_state);
+	struct notifyd_sweep_state sweep;
+	size_t i;
+
+	ZERO_STRUCT(sweep);
+
+	/* the watch destructor deletes from the db, don't do it here */
+	state->watches->traverse_read(state->watches, notifyd_sweep_fn,
+				      &sweep);
+
+	for (i=0; i<sweep.num_dead; i++) {
+		DEBUG(10, ("notifyd: dropping watch of %s, it's gone\n",
+			   procid_str_static(&sweep.dead[i]->server)));
+		TALLOC_FREE(sweep.dead[i]);
+	}
+	TALLOC_FREE(sweep.dead);
+
+	if (tevent_add_timer(ev, state,
+			     timeval_current_ofs(NOTIFYD_SWEEP_INTERVAL, 0),
+			     notifyd_sweep, state) == NULL) {
+		DEBUG(0, ("notifyd: could not schedule the next sweep\n"));
+	}
+}
+
+static void notifyd_pause_fd_handler(struct tevent_context *ev,
+				     struct tevent_fd *fde,
+				     uint16_t flags,
+				     void *private_data)
+{
+	/*
+	 * If the other end of the pipe is closed it means the parent
+	 * smbd and children exited or aborted.
+	 */
+	exit_server_cleanly(NULL);
+}
+
+/****************************************************************************
+ Fork the notify daemon. Called in the parent smbd before any client
+ connection is accepted, so all smbds know the daemon's server id, and
+ again when the daemon died. listeners holds the parent's listening
+ sockets, the child frees it so it does not accept connections.
+****************************************************************************/
+
+void start_notifyd(struct tevent_context *ev_ctx,
+		   struct messaging_context *msg_ctx,
+		   TALLOC_CTX *listeners)
+{
+	struct notifyd_state *state;
+	struct tevent_fd *fde;
+	NTSTATUS status;
+	pid_t pid;
+	int pause_pipe[2];
+	int rc;
+
+	DEBUG(1, ("Forking notify daemon\n"));
+
+	notifyd_started = false;
+	notifyd_ev_ctx = ev_ctx;
+	notifyd_msg_ctx = msg_ctx;
+
+	if (pipe(pause_pipe) == -1) {
+		DEBUG(0, ("Failed to create the notify daemon pipe: %s, "
+			  "using per process notify\n", strerror(errno)));
+		return;
+	}
+
+	pid = sys_fork();
+
+	if (pid == -1) {
+		DEBUG(0, ("Failed to fork notify daemon: %s, using per "
+			  "process notify\n", strerror(errno)));
+		close(pause_pipe[0]);
+		close(pause_pipe[1]);
+		return;
+	}
+
+	if (pid) {
+		/* parent */
+		close(pause_pipe[1]);
+		if (notifyd_pause_pipe != -1) {
+			close(notifyd_pause_pipe);
+		}
+		notifyd_pause_pipe = pause_pipe[0];
+		notifyd_id = pid_to_procid(pid);
+		notifyd_start_time = time_mono(NULL);
+		notifyd_started = true;
+		return;
+	}
+
+	/* child */
+	close(pause_pipe[0]);
+	pause_pipe[0] = -1;
+
+	TALLOC_FREE(listeners);
+
+	status = reinit_after_fork(msg_ctx, ev_ctx, procid_self(), true);
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(0,("reinit_after_fork() failed\n"));
+		smb_panic("reinit_after_fork() failed");
+	}
+
+	smbd_setup_sig_term_handler();
+	smbd_setup_sig_hup_handler(ev_ctx, msg_ctx);
+
+	if (!serverid_register(procid_self(), FLAG_MSG_GENERAL)) {
+		DEBUG(0, ("Failed to register serverid in notifyd!\n"));
+		exit(1);
+	}
+
+	state = talloc_zero(ev_ctx, struct notifyd_state);
+	if (state == NULL) {
+		exit(1);
+	}
+	state->msg_ctx = msg_ctx;
+	state->watches = db_open_rbt(state);
+	state->sys_ctx = sys_notify_context_create(NULL, state, ev_ctx);
+	if ((state->watches == NULL) || (state->sys_ctx == NULL)) {
+		exit(1);
+	}
+
+	messaging_register(msg_ctx, state, MSG_SMB_NOTIFYD_WATCH,
+			   notifyd_watch_msg);
+	messaging_register(msg_ctx, state, MSG_SMB_NOTIFYD_UNWATCH,
+			   notifyd_unwatch_msg);
+
+	if (tevent_add_timer(ev_ctx, state,
+			     timeval_current_ofs(NOTIFYD_SWEEP_INTERVAL, 0),
+			     notifyd_sweep, state) == NULL) {
+		exit(1);
+	}
+
+	fde = tevent_add_fd(ev_ctx, ev_ctx, pause_pipe[1], TEVENT_FD_READ,
+			    notifyd_pause_fd_handler, NULL);
+	if (fde == NULL) {
+		DEBUG(0,("tevent_add_fd() failed for pause_pipe\n"));
+		smb_panic("tevent_add_fd() failed for pause_pipe");
+	}
+
+	DEBUG(1, ("Notify Daemon Started (%d)\n", getpid()));
+
+	rc = tevent_loop_wait(ev_ctx);
+
+	/* should not be reached */
+	DEBUG(0,("notifyd: tevent_loop_wait() exited with %d - %s\n",
+		 rc, (rc == 0) ? "out of events" : strerror(errno)));
+	exit(1);
+}
+
+/****************************************************************************
+ Called in the parent smbd for every child it reaps. If it was notifyd
+ restart it, unless it died right after its start, and tell the smbds.
+****************************************************************************/
+
+void notifyd_child_exited(pid_t pid, TALLOC_CTX *listeners)
+{
+	if (!notifyd_started || (pid != procid_to_pid(&notifyd_id))) {
+		return;
+	}
+
+	if (time_mono(NULL) - notifyd_start_time < NOTIFYD_RESTART_INTERVAL) {
+		DEBUG(0, ("notifyd %d died right after its start, using per "
+			  "process notify\n", (int)pid));
+		notifyd_started = false;
+	} else {
+		DEBUG(1, ("notifyd %d died, restarting it\n", (int)pid));
+		start_notifyd(notifyd_ev_ctx, notifyd_msg_ctx, listeners);
+	}
+
+	if (notifyd_started) {
+		message_send_all(notifyd_msg_ctx, MSG_SMB_NOTIFYD_RESTARTED,
+				 &notifyd_id, sizeof(notifyd_id), NULL);
+	} else {
+		message_send_all(notifyd_msg_ctx, MSG_SMB_NOTIFYD_RESTARTED,
+				 NULL, 0, NULL);
+	}
+}
+
+#else /* HAVE_INOTIFY */
+
+void start_notifyd(struct tevent_context *ev_ctx,
+		   struct messaging_context *msg_ctx,
+		   TALLOC_CTX *listeners)
+{
+	DEBUG(1, ("notify:daemon needs inotify, using per process "
+		  "notify\n"));
+}
+
+void notifyd_child_exited(pid_t pid, TALLOC_CTX *listeners)
+{
+}
+
+#endif /* HAVE_INOTIFY */
@@ -29,12 +29,20 @@
 #include "../librpc/gen_ndr/ndr_security.h"
 #include "auth.h"
 #include "messages.h"
+#include "smbprofile.h"
 
 extern const struct generic_mapping file_generic_mapping;
 
 struct deferred_open_record {
         bool delayed_for_oplocks;
         struct file_id id;
+	/*
+	 * For a share mode conflict the open that waits, so the close
+	 * path can tell whether a retry would succeed. 0 otherwise.
+	 */
+	uint32_t name_hash;
+	uint32_t access_mask;
+	uint32_t share_access;
 };
 
 /****************************************************************************
@@ -158,6 +166,7 @@ static NTSTATUS fd_open(struct connection_struct *conn,
 #endif
 
 	fsp->fh->fd = SMB_VFS_OPEN(conn, smb_fname, fsp, flags, mode);
+	fsp_update_fd_hash(fsp);
 	if (fsp->fh->fd == -1) {
 		status = map_nt_error_from_unix(errno);
 		if (errno == EMFILE) {
@@ -201,6 +210,7 @@ NTSTATUS fd_close(files_struct *fsp)
 
 	ret = SMB_VFS_CLOSE(fsp);
 	fsp->fh->fd = -1;
+	fsp_update_fd_hash(fsp);
 	if (ret == -1) {
 		return map_nt_error_from_unix(errno);
 	}
@@ -665,7 +675,7 @@ static NTSTATUS open_file(files_struct *fsp,
 	}
 
 	fsp->mode = smb_fname->st.st_ex_mode;
-	fsp->file_id = vfs_file_id_from_sbuf(conn, &smb_fname->st);
+	fsp_set_file_id(fsp, vfs_file_id_from_sbuf(conn, &smb_fname->st));
 	fsp->vuid = req ? req->vuid : UID_FIELD_INVALID;
 	fsp->file_pid = req ? req->smbpid : 0;
 	fsp->can_lock = True;
@@ -993,16 +1003,20 @@ static NTSTATUS send_break_message(files_struct *fsp,
  * 2). Batch or exclusive oplock entry (may be identical to #1).
  * bool have_level2_oplock
  * bool have_no_oplock.
+ * bool have_handle_lease (only for opens without a lease).
  * Do internal consistency checks on the share mode for a file.
+ * Opens sharing the lease the caller asks for are ignored.
  */
 
 static void find_oplock_types(files_struct *fsp,
 				int oplock_request,
+				const struct smb2_lease *lease,
 				struct share_mode_lock *lck,
 				struct share_mode_entry **pp_batch,
 				struct share_mode_entry **pp_ex_or_batch,
 				bool *got_level2,
-				bool *got_no_oplock)
+				bool *got_no_oplock,
+				bool *got_handle_lease)
 {
 	int i;
 
@@ -1010,6 +1024,7 @@ static void find_oplock_types(files_struct *fsp,
 	*pp_ex_or_batch = NULL;
 	*got_level2 = false;
 	*got_no_oplock = false;
+	*got_handle_lease = false;
 
 	/* Ignore stat or internal opens, as is done in
 		delay_for_batch_oplocks() and
@@ -1032,6 +1047,31 @@ static void find_oplock_types(files_struct *fsp,
 			continue;
 		}
 
+		if ((lease != NULL) &&
+		    share_mode_entry_is_lease(&lck->share_modes[i],
+				&fsp->conn->sconn->smb2.client_guid,
+				&lease->lease_key)) {
+			/* Our own lease is never broken by this open. */
+			continue;
+		}
+
+		if (lck->share_modes[i].flags & SHARE_MODE_FLAG_LEASE) {
+			struct share_mode_entry *e = &lck->share_modes[i];
+
+			if ((lease == NULL) &&
+			    (e->lease_state & SMB2_LEASE_HANDLE)) {
+				*got_handle_lease = true;
+			}
+
+			/* All opens of a lease carry the same oplock. */
+			if ((*pp_ex_or_batch != NULL) &&
+			    share_mode_entry_is_lease(*pp_ex_or_batch,
+						      &e->client_guid,
+						      &e->lease_key)) {
+				continue;
+			}
+		}
+
 		if (BATCH_OPLOCK_TYPE(lck->share_modes[i].op_type)) {
 			/* batch - can only be one. */
 			if (*pp_ex_or_batch || *pp_batch || *got_level2 || *got_no_oplock) {
@@ -1106,7 +1146,8 @@ static void grant_fsp_oplock_type(files_struct *fsp,
 				const struct byte_range_lock *br_lck,
 				int oplock_request,
 				bool got_level2_oplock,
-				bool got_a_none_oplock)
+				bool got_a_none_oplock,
+				bool got_handle_lease)
 {
 	bool allow_level2 = (global_client_caps & CAP_LEVEL_II_OPLOCKS) &&
 		            lp_level2_oplocks(SNUM(fsp->conn));
@@ -1142,8 +1183,13 @@ static void grant_fsp_oplock_type(files_struct *fsp,
 	if (got_a_none_oplock) {
 		fsp->oplock_type = NO_OPLOCK;
 	} else if (got_level2_oplock) {
+		/*
+		 * A handle caching lease prevents other
+		 * clients from getting a level2 oplock.
+		 */
 		if (fsp->oplock_type == NO_OPLOCK ||
-				fsp->oplock_type == FAKE_LEVEL_II_OPLOCK) {
+				fsp->oplock_type == FAKE_LEVEL_II_OPLOCK ||
+				got_handle_lease) {
 			/* Store a level2 oplock, but don't tell the client */
 			fsp->oplock_type = FAKE_LEVEL_II_OPLOCK;
 		} else {
@@ -1171,6 +1217,105 @@ static void grant_fsp_oplock_type(files_struct *fsp,
 		  fsp->oplock_type, fsp_str_dbg(fsp)));
 }
 
+/*
+ * Work out the lease state for an open asking for a SMB2.1 lease.
+ * grant_fsp_oplock_type() has already granted fsp->oplock_type from
+ * the oplock matching the requested lease state.
+ */
+
+static void grant_fsp_lease(files_struct *fsp,
+			    struct share_mode_lock *lck,
+			    const struct smb2_lease *lease)
+{
+	struct smbd_server_connection *sconn = fsp->conn->sconn;
+	struct smbd_smb2_lease *cur;
+	uint32_t granted;
+	bool got_other_open = false;
+	bool got_oplock = false;
+	int i;
+
+	if (fsp->is_directory) {
+		return;
+	}
+
+	for (i=0; i<lck->num_share_modes; i++) {
+		struct share_mode_entry *e = &lck->share_modes[i];
+
+		if (!is_valid_share_mode_entry(e)) {
+			continue;
+		}
+		if (e->op_type == NO_OPLOCK && is_stat_open(e->access_mask)) {
+			continue;
+		}
+		if (share_mode_entry_is_lease(e, &sconn->smb2.client_guid,
+					      &lease->lease_key)) {
+			continue;
+		}
+		got_other_open = true;
+		if (e->flags & SHARE_MODE_FLAG_LEASE) {
+			continue;
+		}
+		if ((e->op_type == LEVEL_II_OPLOCK) ||
+		    EXCLUSIVE_OPLOCK_TYPE(e->op_type)) {
+			got_oplock = true;
+		}
+	}
+
+	switch (fsp->oplock_type) {
+	case BATCH_OPLOCK:
+		granted = SMB2_LEASE_READ|SMB2_LEASE_WRITE|SMB2_LEASE_HANDLE;
+		break;
+	case EXCLUSIVE_OPLOCK:
+		granted = SMB2_LEASE_READ|SMB2_LEASE_WRITE;
+		break;
+	case LEVEL_II_OPLOCK:
+		granted = SMB2_LEASE_READ|SMB2_LEASE_HANDLE;
+		break;
+	default:
+		granted = SMB2_LEASE_NONE;
+		break;
+	}
+	granted &= lease->lease_state;
+
+	/* Handle caching can't be combined with other clients' oplocks */
+	if (got_oplock) {
+		granted &= ~SMB2_LEASE_HANDLE;
+	}
+
+	cur = smbd_smb2_lease_find(sconn, &lease->lease_key);
+	if (cur != NULL) {
+		if (!file_id_equal(&cur->id, &fsp->file_id)) {
+			DEBUG(1, ("grant_fsp_lease: lease key already used "
+				  "for another file, not granting a lease "
+				  "on %s\n", fsp_str_dbg(fsp)));
+			fsp->oplock_type = NO_OPLOCK;
+			return;
+		}
+
+		/*
+		 * Another open of our lease: we can only upgrade
+		 * to a superset of the current state and only if
+		 * nobody else has the file open. The other opens
+		 * of the lease get upgraded along with us.
+		 */
+		if (!cur->breaking && !got_other_open &&
+		    (granted != cur->lease_state) &&
+		    ((granted & cur->lease_state) == cur->lease_state)) {
+			smbd_smb2_lease_set_state(cur, lck, granted);
+		}
+		granted = cur->lease_state;
+	}
+
+	if (!smbd_smb2_lease_attach(fsp, &lease->lease_key, granted)) {
+		fsp->oplock_type = NO_OPLOCK;
+		return;
+	}
+	fsp->oplock_type = map_lease_state_to_oplock_type(granted);
+
+	DEBUG(10,("grant_fsp_lease: lease state 0x%x on file %s\n",
+		  (unsigned int)granted, fsp_str_dbg(fsp)));
+}
+
 bool request_timed_out(struct timeval request_time,
 		       struct timeval timeout)
 {
@@ -1222,7 +1367,43 @@ static void defer_open(struct share_mode_lock *lck,
 		exit_server("push_deferred_open_message_smb failed");
 	}
 	add_deferred_open(lck, req->mid, request_time,
-			  sconn_server_id(req->sconn), state->id);
+			  sconn_server_id(req->sconn), state->id,
+			  state->name_hash, state->access_mask,
+			  state->share_access);
+}
+
+/****************************************************************************
+ Would the deferred open e get past the share mode check if it was retried
+ now ? Called with the share mode lock held after an open went away.
+ Deferred opens waiting for something else than a share mode conflict
+ (oplock breaks, immediate retries) are always woken.
+****************************************************************************/
+
+bool deferred_open_can_proceed(struct share_mode_lock *lck,
+			       const struct share_mode_entry *e)
+{
+	int i;
+
+	if (!(e->flags & SHARE_MODE_FLAG_SHARING_WAIT)) {
+		return true;
+	}
+
+	/* Let the retry fail with DELETE_PENDING right away. */
+	if (is_delete_on_close_set(lck, e->name_hash)) {
+		return true;
+	}
+
+	for (i=0; i<lck->num_share_modes; i++) {
+		struct share_mode_entry *cur = &lck->share_modes[i];
+
+		if (!is_valid_share_mode_entry(cur)) {
+			continue;
+		}
+		if (share_conflict(cur, e->access_mask, e->share_access)) {
+			return false;
+		}
+	}
+	return true;
 }
 
 
@@ -1513,6 +1694,9 @@ static void schedule_defer_open(struct share_mode_lock *lck,
 
 	state.delayed_for_oplocks = True;
 	state.id = lck->id;
+	state.name_hash = 0;
+	state.access_mask = 0;
+	state.share_access = 0;
 
 	if (!request_timed_out(request_time, timeout)) {
 		defer_open(lck, request_time, timeout, req, &state);
@@ -1582,6 +1766,75 @@ static NTSTATUS calculate_access_mask(connection_struct *conn,
 	return NT_STATUS_OK;
 }
 
+/****************************************************************************
+ Look at the share modes of an existing file without locking the record.
+ Returns true if nobody has the file open in a way that needs an oplock
+ or lease break or conflicts with this open. The caller may then open the
+ file first and do the real checks under the lock afterwards, like it
+ does for files it created.
+****************************************************************************/
+
+static bool open_mode_check_unlocked(connection_struct *conn,
+				     struct smb_request *req,
+				     files_struct *fsp,
+				     struct file_id id,
+				     uint32 access_mask,
+				     uint32 share_access,
+				     uint32 create_options,
+				     int oplock_request)
+{
+	struct share_mode_lock *lck;
+	bool file_existed = true;
+	NTSTATUS status;
+	int i;
+
+	/*
+	 * Without a request we can't retry, with kernel oplocks the open
+	 * itself could block on another smbd's oplock.
+	 */
+	if ((req == NULL) || (oplock_request & INTERNAL_OPEN_ONLY) ||
+	    lp_kernel_oplocks() ||
+	    !lp_parm_bool(SNUM(conn), "smbd", "share mode fast path", true)) {
+		return false;
+	}
+
+	DO_PROFILE_INC(share_mode_fast_lookups);
+
+	lck = fetch_share_mode_unlocked(talloc_tos(), id);
+	if (lck == NULL) {
+		/* Nobody has the file open. */
+		DO_PROFILE_INC(share_mode_fast_hits);
+		return true;
+	}
+
+	for (i = 0; i < lck->num_share_modes; i++) {
+		struct share_mode_entry *e = &lck->share_modes[i];
+
+		if (!is_valid_share_mode_entry(e)) {
+			continue;
+		}
+		if (EXCLUSIVE_OPLOCK_TYPE(e->op_type) ||
+		    (e->flags & SHARE_MODE_FLAG_LEASE)) {
+			DEBUG(10, ("open_mode_check_unlocked: %s has an "
+				   "oplock or lease\n", fsp_str_dbg(fsp)));
+			TALLOC_FREE(lck);
+			return false;
+		}
+	}
+
+	status = open_mode_check(conn, lck, fsp->name_hash, access_mask,
+				 share_access, create_options, &file_existed);
+	TALLOC_FREE(lck);
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(10, ("open_mode_check_unlocked: %s: %s\n",
+			   fsp_str_dbg(fsp), nt_errstr(status)));
+		return false;
+	}
+
+	DO_PROFILE_INC(share_mode_fast_hits);
+	return true;
+}
+
 /****************************************************************************
  Remove the deferred open entry under lock.
 ****************************************************************************/
@@ -1669,6 +1922,7 @@ static NTSTATUS open_file_ntcreate(connection_struct *conn,
 	int flags=0;
 	int flags2=0;
 	bool file_existed = VALID_STAT(smb_fname->st);
+	bool check_share_modes_after_open = false;
 	bool def_acl = False;
 	bool posix_open = False;
 	bool new_file_created = False;
@@ -1976,7 +2230,7 @@ static NTSTATUS open_file_ntcreate(connection_struct *conn,
 		return NT_STATUS_ACCESS_DENIED;
 	}
 
-	fsp->file_id = vfs_file_id_from_sbuf(conn, &smb_fname->st);
+	fsp_set_file_id(fsp, vfs_file_id_from_sbuf(conn, &smb_fname->st));
 	fsp->share_access = share_access;
 	fsp->fh->private_options = private_flags;
 	fsp->access_mask = open_access_mask; /* We change this to the
@@ -1992,11 +2246,25 @@ static NTSTATUS open_file_ntcreate(connection_struct *conn,
 	}
 
 	if (file_existed) {
+		/*
+		 * If nobody has the file open in a conflicting way we don't
+		 * hold the share mode lock over the open, but check again
+		 * afterwards as for a file we created.
+		 */
+		check_share_modes_after_open = open_mode_check_unlocked(
+			conn, req, fsp,
+			vfs_file_id_from_sbuf(conn, &smb_fname->st),
+			access_mask, share_access, create_options,
+			oplock_request);
+	}
+
+	if (file_existed && !check_share_modes_after_open) {
 		struct byte_range_lock *br_lck = NULL;
 		struct share_mode_entry *batch_entry = NULL;
 		struct share_mode_entry *exclusive_entry = NULL;
 		bool got_level2_oplock = false;
 		bool got_a_none_oplock = false;
+		bool got_handle_lease = false;
 
 		struct timespec old_write_time = smb_fname->st.st_ex_mtime;
 		id = vfs_file_id_from_sbuf(conn, &smb_fname->st);
@@ -2015,11 +2283,13 @@ static NTSTATUS open_file_ntcreate(connection_struct *conn,
 		/* Get the types we need to examine. */
 		find_oplock_types(fsp,
 				oplock_request,
+				req ? req->lease : NULL,
 				lck,
 				&batch_entry,
 				&exclusive_entry,
 				&got_level2_oplock,
-				&got_a_none_oplock);
+				&got_a_none_oplock,
+				&got_handle_lease);
 
 		/* First pass - send break only on batch oplocks. */
 		if ((req != NULL) &&
@@ -2065,7 +2335,8 @@ static NTSTATUS open_file_ntcreate(connection_struct *conn,
 				br_lck,
                                 oplock_request,
                                 got_level2_oplock,
-                                got_a_none_oplock);
+                                got_a_none_oplock,
+                                got_handle_lease);
 
 		if (!NT_STATUS_IS_OK(status)) {
 			uint32 can_access_mask;
@@ -2166,6 +2437,9 @@ static NTSTATUS open_file_ntcreate(connection_struct *conn,
 
 				state.delayed_for_oplocks = False;
 				state.id = id;
+				state.name_hash = fsp->name_hash;
+				state.access_mask = access_mask;
+				state.share_access = share_access;
 
 				if ((req != NULL)
 				    && !request_timed_out(request_time,
@@ -2193,7 +2467,8 @@ static NTSTATUS open_file_ntcreate(connection_struct *conn,
 		 */
 	}
 
-	SMB_ASSERT(!file_existed || (lck != NULL));
+	SMB_ASSERT(!file_existed || check_share_modes_after_open ||
+		   (lck != NULL));
 
 	/*
 	 * Ensure we pay attention to default ACLs on directories if required.
@@ -2223,19 +2498,22 @@ static NTSTATUS open_file_ntcreate(connection_struct *conn,
 		return fsp_open;
 	}
 
-	if (!file_existed) {
+	if (!file_existed || check_share_modes_after_open) {
 		struct byte_range_lock *br_lck = NULL;
 		struct share_mode_entry *batch_entry = NULL;
 		struct share_mode_entry *exclusive_entry = NULL;
 		bool got_level2_oplock = false;
 		bool got_a_none_oplock = false;
+		bool got_handle_lease = false;
 		struct timespec old_write_time = smb_fname->st.st_ex_mtime;
 		/*
 		 * Deal with the race condition where two smbd's detect the
 		 * file doesn't exist and do the create at the same time. One
 		 * of them will win and set a share mode, the other (ie. this
 		 * one) should check if the requested share mode for this
-		 * create is allowed.
+		 * create is allowed. The same applies to an existing file
+		 * that open_mode_check_unlocked() found without conflicting
+		 * opens.
 		 */
 
 		/*
@@ -2261,11 +2539,13 @@ static NTSTATUS open_file_ntcreate(connection_struct *conn,
 		/* Get the types we need to examine. */
 		find_oplock_types(fsp,
 				oplock_request,
+				req ? req->lease : NULL,
 				lck,
 				&batch_entry,
 				&exclusive_entry,
 				&got_level2_oplock,
-				&got_a_none_oplock);
+				&got_a_none_oplock,
+				&got_handle_lease);
 
 		/* First pass - send break only on batch oplocks. */
 		if ((req != NULL) &&
@@ -2306,6 +2586,13 @@ static NTSTATUS open_file_ntcreate(connection_struct *conn,
 
 			state.delayed_for_oplocks = False;
 			state.id = id;
+			state.name_hash = 0;
+			state.access_mask = 0;
+			state.share_access = 0;
+
+			if (check_share_modes_after_open) {
+				DO_PROFILE_INC(share_mode_fast_retries);
+			}
 
 			/* Do it all over again immediately. In the second
 			 * round we will find that the file existed and handle
@@ -2327,7 +2614,8 @@ static NTSTATUS open_file_ntcreate(connection_struct *conn,
 				br_lck,
                                 oplock_request,
                                 got_level2_oplock,
-                                got_a_none_oplock);
+                                got_a_none_oplock,
+                                got_handle_lease);
 
 		/*
 		 * We exit this block with the share entry *locked*.....
@@ -2428,6 +2716,10 @@ static NTSTATUS open_file_ntcreate(connection_struct *conn,
 		*pinfo = info;
 	}
 
+	if ((req != NULL) && (req->lease != NULL)) {
+		grant_fsp_lease(fsp, lck, req->lease);
+	}
+
 	/*
 	 * Setup the oplock info in both the shared memory and
 	 * file structs.
@@ -2870,7 +3162,7 @@ static NTSTATUS open_directory(connection_struct *conn,
 	 */
 
 	fsp->mode = smb_dname->st.st_ex_mode;
-	fsp->file_id = vfs_file_id_from_sbuf(conn, &smb_dname->st);
+	fsp_set_file_id(fsp, vfs_file_id_from_sbuf(conn, &smb_dname->st));
 	fsp->vuid = req ? req->vuid : UID_FIELD_INVALID;
 	fsp->file_pid = req ? req->smbpid : 0;
 	fsp->can_lock = False;
@@ -208,6 +208,241 @@ bool downgrade_oplock(files_struct *fsp)
 	return ret;
 }
 
+/****************************************************************************
+ SMB2.1 leases. All opens of a file from one client using the same lease key
+ share a struct smbd_smb2_lease. Each of them carries the oplock type that
+ matches the lease state, so the share mode code below treats a lease like
+ a set of identical oplocks which are broken with a single lease break.
+****************************************************************************/
+
+int map_lease_state_to_oplock_type(uint32_t lease_state)
+{
+	if (!(lease_state & SMB2_LEASE_READ)) {
+		return NO_OPLOCK;
+	}
+	if (lease_state & SMB2_LEASE_WRITE) {
+		if (lease_state & SMB2_LEASE_HANDLE) {
+			return BATCH_OPLOCK;
+		}
+		return EXCLUSIVE_OPLOCK;
+	}
+	return LEVEL_II_OPLOCK;
+}
+
+struct smbd_smb2_lease *smbd_smb2_lease_find(
+	struct smbd_server_connection *sconn,
+	const struct smb2_lease_key *lease_key)
+{
+	struct smbd_smb2_lease *lease;
+
+	for (lease = sconn->smb2.leases; lease; lease = lease->next) {
+		if ((lease->lease_key.data[0] == lease_key->data[0]) &&
+		    (lease->lease_key.data[1] == lease_key->data[1])) {
+			return lease;
+		}
+	}
+	return NULL;
+}
+
+/****************************************************************************
+ Make fsp an open of the given lease, creating the lease if necessary.
+****************************************************************************/
+
+bool smbd_smb2_lease_attach(files_struct *fsp,
+			    const struct smb2_lease_key *lease_key,
+			    uint32_t lease_state)
+{
+	struct smbd_server_connection *sconn = fsp->conn->sconn;
+	struct smbd_smb2_lease *lease;
+
+	lease = smbd_smb2_lease_find(sconn, lease_key);
+	if (lease == NULL) {
+		lease = talloc_zero(sconn, struct smbd_smb2_lease);
+		if (lease == NULL) {
+			return false;
+		}
+		lease->sconn = sconn;
+		lease->id = fsp->file_id;
+		lease->lease_key = *lease_key;
+		lease->lease_state = lease_state;
+		DLIST_ADD(sconn->smb2.leases, lease);
+	}
+
+	if (!file_id_equal(&lease->id, &fsp->file_id)) {
+		DEBUG(1, ("smbd_smb2_lease_attach: lease key already used "
+			  "for %s\n", file_id_string_tos(&lease->id)));
+		return false;
+	}
+
+	lease->num_fsps++;
+	fsp->lease = lease;
+	return true;
+}
+
+/****************************************************************************
+ Called from file_free(), the lease goes away with its last open.
+****************************************************************************/
+
+void smbd_smb2_lease_detach(files_struct *fsp)
+{
+	struct smbd_smb2_lease *lease = fsp->lease;
+
+	if (lease == NULL) {
+		return;
+	}
+	fsp->lease = NULL;
+
+	SMB_ASSERT(lease->num_fsps > 0);
+	lease->num_fsps--;
+	if (lease->num_fsps > 0) {
+		return;
+	}
+
+	DLIST_REMOVE(lease->sconn->smb2.leases, lease);
+	TALLOC_FREE(lease);
+}
+
+/*
+ * Change the oplock of a leased open without touching the share mode,
+ * the caller updates that via set_share_mode_lease().
+ */
+static void set_lease_file_oplock(files_struct *fsp, int oplock_type)
+{
+	if (EXCLUSIVE_OPLOCK_TYPE(fsp->oplock_type) &&
+	    !EXCLUSIVE_OPLOCK_TYPE(oplock_type)) {
+		/* We lose write caching. */
+		flush_write_cache(fsp, OPLOCK_RELEASE_FLUSH);
+		delete_write_cache(fsp);
+	}
+
+	if (fsp->oplock_type == LEVEL_II_OPLOCK) {
+		level_II_oplocks_open--;
+	} else if (EXCLUSIVE_OPLOCK_TYPE(fsp->oplock_type)) {
+		exclusive_oplocks_open--;
+	}
+
+	fsp->oplock_type = oplock_type;
+	fsp->sent_oplock_break = NO_BREAK_SENT;
+
+	if (fsp->oplock_type == LEVEL_II_OPLOCK) {
+		level_II_oplocks_open++;
+	} else if (EXCLUSIVE_OPLOCK_TYPE(fsp->oplock_type)) {
+		exclusive_oplocks_open++;
+	}
+
+	SMB_ASSERT(exclusive_oplocks_open>=0);
+	SMB_ASSERT(level_II_oplocks_open>=0);
+}
+
+/****************************************************************************
+ Set a new lease state on all opens of a lease. The share mode lock of the
+ file must be held by the caller.
+****************************************************************************/
+
+void smbd_smb2_lease_set_state(struct smbd_smb2_lease *lease,
+			       struct share_mode_lock *lck,
+			       uint32_t lease_state)
+{
+	int oplock_type = map_lease_state_to_oplock_type(lease_state);
+	files_struct *fsp;
+
+	DEBUG(10, ("smbd_smb2_lease_set_state: %s lease state 0x%x -> 0x%x\n",
+		   file_id_string_tos(&lease->id),
+		   (unsigned int)lease->lease_state,
+		   (unsigned int)lease_state));
+
+	lease->lease_state = lease_state;
+
+	for (fsp = file_find_di_first(lease->sconn, lease->id); fsp;
+	     fsp = file_find_di_next(fsp)) {
+		if (fsp->lease != lease) {
+			continue;
+		}
+		set_lease_file_oplock(fsp, oplock_type);
+		if (!set_share_mode_lease(lck, fsp)) {
+			DEBUG(0, ("smbd_smb2_lease_set_state: failed to set "
+				  "share mode lease for file %s fnum %d\n",
+				  fsp_str_dbg(fsp), fsp->fnum));
+		}
+	}
+}
+
+/****************************************************************************
+ Deal with the lease break ack (or its timeout): downgrade all opens of the
+ lease and release the opens waiting for the break.
+****************************************************************************/
+
+bool smbd_smb2_lease_downgrade(struct smbd_smb2_lease *lease,
+			       uint32_t lease_state)
+{
+	struct smbd_server_connection *sconn = lease->sconn;
+	struct file_id id = lease->id;
+	struct share_mode_lock *lck;
+	files_struct *fsp, *next;
+
+	lck = get_share_mode_lock(talloc_tos(), id, NULL, NULL, NULL);
+	if (lck == NULL) {
+		DEBUG(0,("smbd_smb2_lease_downgrade: failed to lock share "
+			 "entry for %s\n", file_id_string_tos(&id)));
+		return false;
+	}
+	lease->breaking = false;
+	smbd_smb2_lease_set_state(lease, lck, lease_state);
+	TALLOC_FREE(lck);
+
+	for (fsp = file_find_di_first(sconn, id); fsp; fsp = next) {
+		next = file_find_di_next(fsp);
+		if (fsp->lease != lease) {
+			continue;
+		}
+		reply_to_oplock_break_requests(fsp);
+	}
+	return true;
+}
+
+/****************************************************************************
+ Send one lease break for all opens of fsp's lease.
+****************************************************************************/
+
+static void send_lease_break(files_struct *fsp, uint32_t new_lease_state,
+			     int sent_oplock_break)
+{
+	struct smbd_smb2_lease *lease = fsp->lease;
+	files_struct *cur;
+	uint32_t flags = 0;
+	NTSTATUS status;
+
+	/* Losing write or handle caching needs an ack from the client. */
+	if (lease->lease_state & (SMB2_LEASE_WRITE|SMB2_LEASE_HANDLE)) {
+		flags |= SMB2_NOTIFY_BREAK_LEASE_FLAG_ACK_REQUIRED;
+	}
+
+	DEBUG(10, ("send_lease_break: breaking lease on file %s from 0x%x "
+		   "to 0x%x\n", fsp_str_dbg(fsp),
+		   (unsigned int)lease->lease_state,
+		   (unsigned int)new_lease_state));
+
+	status = smbd_smb2_send_lease_break(lease->sconn, flags,
+					    &lease->lease_key,
+					    lease->lease_state,
+					    new_lease_state);
+	if (!NT_STATUS_IS_OK(status)) {
+		smbd_server_connection_terminate(lease->sconn,
+						 nt_errstr(status));
+		return;
+	}
+
+	lease->breaking = (flags != 0);
+	lease->breaking_to = new_lease_state;
+
+	for (cur = file_find_di_first(lease->sconn, lease->id); cur;
+	     cur = file_find_di_next(cur)) {
+		if (cur->lease == lease) {
+			cur->sent_oplock_break = sent_oplock_break;
+		}
+	}
+}
+
 /*
  * Some kernel oplock implementations handle the notification themselves.
  */
@@ -328,6 +563,11 @@ static void oplock_timeout_handler(struct event_context *ctx,
 	TALLOC_FREE(fsp->oplock_timeout);
 	DEBUG(0, ("Oplock break failed for file %s -- replying anyway\n",
 		  fsp_str_dbg(fsp)));
+	if (fsp->lease != NULL) {
+		smbd_smb2_lease_downgrade(fsp->lease,
+					  fsp->lease->breaking_to);
+		return;
+	}
 	remove_oplock(fsp);
 	reply_to_oplock_break_requests(fsp);
 }
@@ -406,6 +646,29 @@ void break_level2_to_none_async(files_struct *fsp)
 	/* Ensure we're really at level2 state. */
 	SMB_ASSERT(fsp->oplock_type == LEVEL_II_OPLOCK);
 
+	if (fsp->lease != NULL) {
+		struct smbd_smb2_lease *lease = fsp->lease;
+		struct share_mode_lock *lck;
+
+		/*
+		 * Break the whole lease to none. As with level2
+		 * oplocks we don't wait for an ack.
+		 */
+		send_lease_break(fsp, SMB2_LEASE_NONE, BREAK_TO_NONE_SENT);
+
+		lck = get_share_mode_lock(talloc_tos(), lease->id, NULL,
+					  NULL, NULL);
+		if (lck == NULL) {
+			DEBUG(0, ("break_level2_to_none_async: failed to "
+				  "lock share entry for file %s\n",
+				  fsp_str_dbg(fsp)));
+			return;
+		}
+		smbd_smb2_lease_set_state(lease, lck, SMB2_LEASE_NONE);
+		TALLOC_FREE(lck);
+		return;
+	}
+
 	DEBUG(10,("process_oplock_async_level2_break_message: sending break "
 		  "to none message for fid %d, file %s\n", fsp->fnum,
 		  fsp_str_dbg(fsp)));
@@ -563,7 +826,19 @@ static void process_oplock_break_message(struct messaging_context *msg_ctx,
 		wait_before_sending_break();
 	}
 
-	if (sconn->using_smb2) {
+	if (fsp->lease != NULL) {
+		/*
+		 * Breaking to level2 keeps read and handle caching,
+		 * only write caching is lost.
+		 */
+		send_lease_break(fsp,
+			break_to_level2 ?
+			(fsp->lease->lease_state &
+			 (SMB2_LEASE_READ|SMB2_LEASE_HANDLE)) :
+			SMB2_LEASE_NONE,
+			break_to_level2 ?
+			LEVEL_II_BREAK_SENT : BREAK_TO_NONE_SENT);
+	} else if (sconn->using_smb2) {
 		send_break_message_smb2(fsp, break_to_level2 ?
 			OPLOCKLEVEL_II : OPLOCKLEVEL_NONE);
 	} else {
@@ -571,7 +846,10 @@ static void process_oplock_break_message(struct messaging_context *msg_ctx,
 			OPLOCKLEVEL_II : OPLOCKLEVEL_NONE);
 	}
 
-	fsp->sent_oplock_break = break_to_level2 ? LEVEL_II_BREAK_SENT:BREAK_TO_NONE_SENT;
+	if (fsp->lease == NULL) {
+		fsp->sent_oplock_break = break_to_level2 ?
+			LEVEL_II_BREAK_SENT : BREAK_TO_NONE_SENT;
+	}
 
 	msg.pid = src;
 	ADD_TO_ARRAY(NULL, struct share_mode_entry, msg,
@@ -799,6 +1077,14 @@ static void contend_level2_oplocks_begin_default(files_struct *fsp,
 			continue;
 		}
 
+		/* A write through a lease does not break the lease itself. */
+		if ((fsp->lease != NULL) &&
+		    share_mode_entry_is_lease(share_entry,
+					      &fsp->conn->sconn->smb2.client_guid,
+					      &fsp->lease->lease_key)) {
+			continue;
+		}
+
 		/* Paranoia .... */
 		if (EXCLUSIVE_OPLOCK_TYPE(share_entry->op_type)) {
 			DEBUG(0,("release_level_2_oplocks_on_change: PANIC. "
@@ -73,6 +73,9 @@ NTSTATUS schedule_aio_write_and_X(connection_struct *conn,
 			      files_struct *fsp, const char *data,
 			      SMB_OFF_T startpos,
 			      size_t numtowrite);
+NTSTATUS schedule_aio_flush(connection_struct *conn,
+			    struct smb_request *smbreq,
+			    files_struct *fsp);
 NTSTATUS schedule_smb2_aio_read(connection_struct *conn,
 				struct smb_request *smbreq,
 				files_struct *fsp,
@@ -86,6 +89,9 @@ NTSTATUS schedule_aio_smb2_write(connection_struct *conn,
 				uint64_t in_offset,
 				DATA_BLOB in_data,
 				bool write_through);
+NTSTATUS schedule_aio_smb2_flush(connection_struct *conn,
+				struct smb_request *smbreq,
+				files_struct *fsp);
 int wait_for_aio_completion(files_struct *fsp);
 void cancel_aio_by_fsp(files_struct *fsp);
 void smbd_aio_complete_aio_ex(struct aio_extra *aio_ex);
@@ -99,6 +105,8 @@ void brl_timeout_fn(struct event_context *event_ctx,
 struct timeval timeval_brl_min(const struct timeval *tv1,
 			const struct timeval *tv2);
 void process_blocking_lock_queue(struct smbd_server_connection *sconn);
+void process_blocking_lock_queue_file(struct smbd_server_connection *sconn,
+				      const struct file_id *id);
 bool push_blocking_lock_request( struct byte_range_lock *br_lck,
 		struct smb_request *req,
 		files_struct *fsp,
@@ -209,6 +217,10 @@ char *dptr_ReadDirName(TALLOC_CTX *ctx,
 			SMB_STRUCT_STAT *pst);
 bool dptr_SearchDir(struct dptr_struct *dptr, const char *name, long *poffset, SMB_STRUCT_STAT *pst);
 void dptr_DirCacheAdd(struct dptr_struct *dptr, const char *name, long offset);
+bool dptr_cached_dos_mode(struct dptr_struct *dptr, uint32_t *mode);
+char **dptr_peek_names(TALLOC_CTX *mem_ctx, struct dptr_struct *dptr,
+		       unsigned int skip, unsigned int max_names,
+		       unsigned int *num_names);
 void dptr_init_search_op(struct dptr_struct *dptr);
 bool dptr_fill(struct smbd_server_connection *sconn,
 	       char *buf1,unsigned int key);
@@ -256,6 +268,36 @@ bool smbd_setup_mdns_registration(struct tevent_context *ev,
 				  TALLOC_CTX *mem_ctx,
 				  uint16_t port);
 
+/* The following definitions come from smbd/dircache.c  */
+
+struct dircache_snapshot;
+
+bool dircache_enabled(connection_struct *conn);
+struct dircache_snapshot *dircache_fetch(TALLOC_CTX *mem_ctx,
+					 connection_struct *conn,
+					 const char *path);
+bool dircache_valid(connection_struct *conn, const char *path,
+		    struct dircache_snapshot *snap);
+struct dircache_snapshot *dircache_build(TALLOC_CTX *mem_ctx,
+					 connection_struct *conn,
+					 const char *path);
+bool dircache_snapshot_entry(const struct dircache_snapshot *snap,
+			     uint32_t idx, const char **name,
+			     SMB_STRUCT_STAT *st, uint32_t *mode);
+void dircache_delete(connection_struct *conn, const struct file_id *id);
+
+/* The following definitions come from smbd/dirprefetch.c  */
+
+unsigned int dir_prefetch_batch(connection_struct *conn);
+struct tevent_req *dir_prefetch_send(TALLOC_CTX *mem_ctx,
+				     struct tevent_context *ev,
+				     connection_struct *conn,
+				     struct dptr_struct *dptr,
+				     const char *dir_path,
+				     unsigned int skip,
+				     unsigned int num);
+int dir_prefetch_recv(struct tevent_req *req);
+
 /* The following definitions come from smbd/dosmode.c  */
 
 mode_t unix_mode(connection_struct *conn, int dosmode,
@@ -329,6 +371,11 @@ ssize_t write_file(struct smb_request *req,
 			const char *data,
 			SMB_OFF_T pos,
 			size_t n);
+ssize_t copy_file_chunk(files_struct *src_fsp,
+			SMB_OFF_T src_off,
+			files_struct *dest_fsp,
+			SMB_OFF_T dest_off,
+			size_t n);
 void delete_write_cache(files_struct *fsp);
 void set_filelen_write_cache(files_struct *fsp, SMB_OFF_T file_size);
 ssize_t flush_write_cache(files_struct *fsp, enum flush_reason_enum reason);
@@ -385,6 +432,8 @@ NTSTATUS file_name_hash(connection_struct *conn,
 			const char *name, uint32_t *p_name_hash);
 NTSTATUS fsp_set_smb_fname(struct files_struct *fsp,
 			   const struct smb_filename *smb_fname_in);
+void fsp_set_file_id(struct files_struct *fsp, struct file_id id);
+void fsp_update_fd_hash(struct files_struct *fsp);
 
 /* The following definitions come from smbd/ipc.c  */
 
@@ -529,6 +578,7 @@ NTSTATUS inotify_watch(struct sys_notify_context *ctx,
 					struct notify_event *ev),
 		       void *private_data,
 		       void *handle_p);
+uint32_t inotify_filter_handled(uint32_t filter);
 
 /* The following definitions come from smbd/notify_internal.c  */
 
@@ -549,6 +599,14 @@ void notify_onelevel(struct notify_context *notify, uint32_t action,
 void notify_trigger(struct notify_context *notify,
 		    uint32_t action, uint32_t filter, const char *path);
 
+/* The following definitions come from smbd/notifyd.c  */
+
+bool notifyd_server_id(struct server_id *id);
+void start_notifyd(struct tevent_context *ev_ctx,
+		   struct messaging_context *msg_ctx,
+		   TALLOC_CTX *listeners);
+void notifyd_child_exited(pid_t pid, TALLOC_CTX *listeners);
+
 /* The following definitions come from smbd/ntquotas.c  */
 
 int vfs_get_ntquota(files_struct *fsp, enum SMB_QUOTA_TYPE qtype, struct dom_sid *psid, SMB_NTQUOTA_STRUCT *qt);
@@ -593,6 +651,8 @@ bool is_executable(const char *fname);
 bool is_stat_open(uint32 access_mask);
 bool request_timed_out(struct timeval request_time,
 		       struct timeval timeout);
+bool deferred_open_can_proceed(struct share_mode_lock *lck,
+			       const struct share_mode_entry *e);
 bool open_match_attributes(connection_struct *conn,
 			   uint32 old_dos_attr,
 			   uint32 new_dos_attr,
@@ -663,6 +723,19 @@ bool set_file_oplock(files_struct *fsp, int oplock_type);
 void release_file_oplock(files_struct *fsp);
 bool remove_oplock(files_struct *fsp);
 bool downgrade_oplock(files_struct *fsp);
+int map_lease_state_to_oplock_type(uint32_t lease_state);
+struct smbd_smb2_lease *smbd_smb2_lease_find(
+	struct smbd_server_connection *sconn,
+	const struct smb2_lease_key *lease_key);
+bool smbd_smb2_lease_attach(files_struct *fsp,
+			    const struct smb2_lease_key *lease_key,
+			    uint32_t lease_state);
+void smbd_smb2_lease_detach(files_struct *fsp);
+void smbd_smb2_lease_set_state(struct smbd_smb2_lease *lease,
+			       struct share_mode_lock *lck,
+			       uint32_t lease_state);
+bool smbd_smb2_lease_downgrade(struct smbd_smb2_lease *lease,
+			       uint32_t lease_state);
 bool should_notify_deferred_opens(void);
 void break_level2_to_none_async(files_struct *fsp);
 void reply_to_oplock_break_requests(files_struct *fsp);
@@ -1061,6 +1134,11 @@ struct TDB_DATA;
 unsigned int fast_string_hash(struct TDB_DATA *key);
 #endif
 bool reset_stat_cache( void );
+bool dirname_index_lookup(connection_struct *conn, const char *path,
+			  const char *name, TALLOC_CTX *mem_ctx,
+			  char **found_name);
+void dirname_index_delete(connection_struct *conn, const struct file_id *id);
+void dirname_index_flush(void);
 
 /* The following definitions come from smbd/statvfs.c  */
 
@@ -4793,7 +4793,23 @@ void reply_flush(struct smb_request *req)
 	if (!fsp) {
 		file_sync_all(conn);
 	} else {
-		NTSTATUS status = sync_file(conn, fsp, True);
+		NTSTATUS status;
+
+		status = schedule_aio_flush(conn, req, fsp);
+		if (NT_STATUS_IS_OK(status)) {
+			/* flush scheduled - we're done. */
+			END_PROFILE(SMBflush);
+			return;
+		}
+		if (!NT_STATUS_EQUAL(status, NT_STATUS_RETRY)) {
+			/* Real error - report to client. */
+			reply_nterror(req, status);
+			END_PROFILE(SMBflush);
+			return;
+		}
+		/* NT_STATUS_RETRY - fall through to sync flush. */
+
+		status = sync_file(conn, fsp, True);
 		if (!NT_STATUS_IS_OK(status)) {
 			DEBUG(5,("reply_flush: sync_file for %s returned %s\n",
 				fsp_str_dbg(fsp), nt_errstr(status)));
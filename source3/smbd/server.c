@@ -40,6 +40,7 @@
 #include "auth.h"
 #include "messages.h"
 #include "smbprofile.h"
+#include "smb2_credits.h"
 
 extern void start_epmd(struct tevent_context *ev_ctx,
 		       struct messaging_context *msg_ctx);
@@ -269,6 +270,8 @@ static void remove_child_pid(pid_t pid, bool unclean_shutdown)
 			  (int)pid));
 	}
 
+	smb2_credits_delete(child_id);
+
 	for (child = children; child != NULL; child = child->next) {
 		if (child->pid == pid) {
 			struct child_pid *tmp = child;
@@ -324,10 +327,13 @@ static void smbd_sig_chld_handler(struct tevent_context *ev,
 			unclean_shutdown = True;
 		}
 		remove_child_pid(pid, unclean_shutdown);
+		notifyd_child_exited(pid, private_data);
 	}
 }
 
-static void smbd_setup_sig_chld_handler(void)
+struct smbd_parent_context;
+
+static void smbd_setup_sig_chld_handler(struct smbd_parent_context *parent)
 {
 	struct tevent_signal *se;
 
@@ -335,7 +341,7 @@ static void smbd_setup_sig_chld_handler(void)
 			       server_event_context(),
 			       SIGCHLD, 0,
 			       smbd_sig_chld_handler,
-			       NULL);
+			       parent);
 	if (!se) {
 		exit_server("failed to setup SIGCHLD handler");
 	}
@@ -595,6 +601,20 @@ static bool smbd_parent_housekeeping(const struct timeval *now, void *private_da
 	return true;
 }
 
+/*
+ * Sum up the SMB2 credit statistics of all children, they use the
+ * result to throttle their credit grants when the server is busy.
+ */
+static bool smbd_parent_smb2_credits(const struct timeval *now,
+				     void *private_data)
+{
+	if (num_children == 0) {
+		return true;
+	}
+	smb2_credits_update_global();
+	return true;
+}
+
 /****************************************************************************
  Open the socket communication.
 ****************************************************************************/
@@ -613,7 +633,7 @@ static bool open_sockets_smbd(struct smbd_parent_context *parent,
 #endif
 
 	/* Stop zombies */
-	smbd_setup_sig_chld_handler();
+	smbd_setup_sig_chld_handler(parent);
 
 	/* use a reasonable default set of ports - listing on 445 and 139 */
 	if (!smb_ports) {
@@ -744,6 +764,14 @@ static bool open_sockets_smbd(struct smbd_parent_context *parent,
 		return false;
 	}
 
+	if (!(event_add_idle(server_event_context(), NULL,
+			     timeval_set(SMB2_CREDITS_UPDATE_INTERVAL, 0),
+			     "parent_smb2_credits", smbd_parent_smb2_credits,
+			     NULL))) {
+		DEBUG(0, ("Could not add parent_smb2_credits event\n"));
+		return false;
+	}
+
         /* Listen to messages */
 
 	messaging_register(msg_ctx, NULL, MSG_SMB_SAM_SYNC, msg_sam_sync);
@@ -1145,6 +1173,10 @@ extern void build_options(bool screen);
 		exit(1);
 	}
 
+	if (!smb2_credits_init(true)) {
+		exit(1);
+	}
+
 	if (!connections_init(True))
 		exit(1);
 
@@ -1159,6 +1191,13 @@ extern void build_options(bool screen);
 		exit(1);
 	}
 
+	/* Fork notifyd before any smbd child, they need to know its id */
+	if (is_daemon && !interactive && !lp_clustering()
+	    && lp_parm_bool(-1, "notify", "daemon", false)) {
+		start_notifyd(server_event_context(),
+			      smbd_messaging_context(), NULL);
+	}
+
 	if (!serverid_parent_init(server_event_context())) {
 		exit(1);
 	}
@@ -1261,7 +1300,7 @@ extern void build_options(bool screen);
 #endif
 
 	        /* Stop zombies */
-		smbd_setup_sig_chld_handler();
+		smbd_setup_sig_chld_handler(NULL);
 
 		smbd_process(smbd_server_conn);
 
@@ -34,6 +34,9 @@ static NTSTATUS smbd_smb2_oplock_break_recv(struct tevent_req *req,
 					    uint8_t *out_oplock_level);
 
 static void smbd_smb2_request_oplock_break_done(struct tevent_req *subreq);
+static NTSTATUS smbd_smb2_request_process_lease_break(
+	struct smbd_smb2_request *req);
+
 NTSTATUS smbd_smb2_request_process_break(struct smbd_smb2_request *req)
 {
 	const uint8_t *inhdr;
@@ -47,6 +50,10 @@ NTSTATUS smbd_smb2_request_process_break(struct smbd_smb2_request *req)
 	struct tevent_req *subreq;
 
 	inhdr = (const uint8_t *)req->in.vector[i+0].iov_base;
+	if (req->in.vector[i+1].iov_len == 0x24) {
+		/* SMB2.1 lease break acknowledgment */
+		return smbd_smb2_request_process_lease_break(req);
+	}
 	if (req->in.vector[i+1].iov_len != (expected_body_size & 0xFFFFFFFE)) {
 		return smbd_smb2_request_error(req, NT_STATUS_INVALID_PARAMETER);
 	}
@@ -206,6 +213,12 @@ static struct tevent_req *smbd_smb2_oplock_break_send(TALLOC_CTX *mem_ctx,
 		fsp_str_dbg(fsp),
 		fsp->fnum ));
 
+	/* Leases are acknowledged with a lease break ack. */
+	if (fsp->lease != NULL) {
+		tevent_req_nterror(req, NT_STATUS_INVALID_OPLOCK_PROTOCOL);
+		return tevent_req_post(req, ev);
+	}
+
 	/* Are we awaiting a break message ? */
 	if (fsp->oplock_timeout == NULL) {
 		tevent_req_nterror(req, NT_STATUS_INVALID_OPLOCK_PROTOCOL);
@@ -253,6 +266,85 @@ static NTSTATUS smbd_smb2_oplock_break_recv(struct tevent_req *req,
 	return NT_STATUS_OK;
 }
 
+/*********************************************************
+ Deal with a SMB2 LEASE_BREAK_ACK. This downgrades
+ all opens of the lease at once.
+*********************************************************/
+
+static NTSTATUS smbd_smb2_request_process_lease_break(
+	struct smbd_smb2_request *req)
+{
+	const uint8_t *inbody;
+	int i = req->current_idx;
+	size_t expected_body_size = 0x24;
+	size_t body_size;
+	struct smb2_lease_key lease_key;
+	uint32_t in_lease_state;
+	struct smbd_smb2_lease *lease;
+	DATA_BLOB outbody;
+
+	inbody = (const uint8_t *)req->in.vector[i+1].iov_base;
+
+	body_size = SVAL(inbody, 0x00);
+	if (body_size != expected_body_size) {
+		return smbd_smb2_request_error(req, NT_STATUS_INVALID_PARAMETER);
+	}
+
+	/* 0x02 2 bytes reserved */
+	/* 0x04 4 bytes flags */
+	lease_key.data[0]	= BVAL(inbody, 0x08);
+	lease_key.data[1]	= BVAL(inbody, 0x10);
+	in_lease_state		= IVAL(inbody, 0x18);
+	/* 0x1C 8 bytes lease duration */
+
+	lease = smbd_smb2_lease_find(req->sconn, &lease_key);
+	if (lease == NULL) {
+		return smbd_smb2_request_error(req,
+				NT_STATUS_OBJECT_NAME_NOT_FOUND);
+	}
+
+	DEBUG(5,("smbd_smb2_request_process_lease_break: got lease break "
+		 "ack (0x%x) from client for %s\n",
+		 (unsigned int)in_lease_state,
+		 file_id_string_tos(&lease->id)));
+
+	/* Are we awaiting a break ack ? */
+	if (!lease->breaking) {
+		return smbd_smb2_request_error(req, NT_STATUS_UNSUCCESSFUL);
+	}
+
+	if ((in_lease_state & ~lease->breaking_to) != 0) {
+		return smbd_smb2_request_error(req,
+				NT_STATUS_REQUEST_NOT_ACCEPTED);
+	}
+
+	if (!smbd_smb2_lease_downgrade(lease, in_lease_state)) {
+		DEBUG(0, ("smbd_smb2_request_process_lease_break: error in "
+			  "downgrading lease on %s\n",
+			  file_id_string_tos(&lease->id)));
+		/* Hmmm. Is this panic justified? */
+		smb_panic("internal tdb error");
+	}
+
+	outbody = data_blob_talloc(req->out.vector, NULL, 0x24);
+	if (outbody.data == NULL) {
+		return smbd_smb2_request_error(req, NT_STATUS_NO_MEMORY);
+	}
+
+	SSVAL(outbody.data, 0x00, 0x24);	/* struct size */
+	SSVAL(outbody.data, 0x02, 0);		/* reserved */
+	SIVAL(outbody.data, 0x04, 0);		/* flags */
+	SBVAL(outbody.data, 0x08,
+	      lease_key.data[0]);		/* lease key */
+	SBVAL(outbody.data, 0x10,
+	      lease_key.data[1]);
+	SIVAL(outbody.data, 0x18,
+	      in_lease_state);			/* lease state */
+	SBVAL(outbody.data, 0x1C, 0);		/* lease duration */
+
+	return smbd_smb2_request_done(req, outbody, NULL);
+}
+
 /*********************************************************
  Create and send an asynchronous
  SMB2 OPLOCK_BREAK_NOTIFICATION.
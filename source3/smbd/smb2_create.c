@@ -402,6 +402,7 @@ struct smbd_smb2_create_state {
 	uint64_t out_file_id_persistent;
 	uint64_t out_file_id_volatile;
 	struct smb2_create_blobs out_context_blobs;
+	struct smb2_lease lease;
 };
 
 static struct tevent_req *smbd_smb2_create_send(TALLOC_CTX *mem_ctx,
@@ -512,6 +513,7 @@ static struct tevent_req *smbd_smb2_create_send(TALLOC_CTX *mem_ctx,
 		uint64_t allocation_size = 0;
 		struct smb2_create_blob *twrp = NULL;
 		struct smb2_create_blob *qfid = NULL;
+		struct smb2_create_blob *rqls = NULL;
 
 		exta = smb2_create_blob_find(&in_context_blobs,
 					     SMB2_CREATE_TAG_EXTA);
@@ -529,6 +531,8 @@ static struct tevent_req *smbd_smb2_create_send(TALLOC_CTX *mem_ctx,
 					     SMB2_CREATE_TAG_TWRP);
 		qfid = smb2_create_blob_find(&in_context_blobs,
 					     SMB2_CREATE_TAG_QFID);
+		rqls = smb2_create_blob_find(&in_context_blobs,
+					     SMB2_CREATE_TAG_RQLS);
 
 		fname = talloc_strdup(state, in_name);
 		if (tevent_req_nomem(fname, req)) {
@@ -670,6 +674,37 @@ static struct tevent_req *smbd_smb2_create_send(TALLOC_CTX *mem_ctx,
 			}
 		}
 
+		if (rqls) {
+			if (rqls->data.length != 32) {
+				tevent_req_nterror(req, NT_STATUS_INVALID_PARAMETER);
+				return tevent_req_post(req, ev);
+			}
+		}
+
+		/*
+		 * Leases are only used if the client negotiated them
+		 * and asked for one with the oplock level, otherwise
+		 * the lease context is ignored.
+		 */
+		smb1req->lease = NULL;
+		if (rqls &&
+		    (in_oplock_level == SMB2_OPLOCK_LEVEL_LEASE) &&
+		    smb2req->sconn->smb2.supports_leasing &&
+		    lp_oplocks(SNUM(smb1req->conn)) &&
+		    !lp_fake_oplocks(SNUM(smb1req->conn))) {
+			ZERO_STRUCT(state->lease);
+			state->lease.lease_key.data[0] =
+				BVAL(rqls->data.data, 0x00);
+			state->lease.lease_key.data[1] =
+				BVAL(rqls->data.data, 0x08);
+			state->lease.lease_state =
+				IVAL(rqls->data.data, 0x10) &
+				(SMB2_LEASE_READ|SMB2_LEASE_HANDLE|
+				 SMB2_LEASE_WRITE);
+			/* 0x14 lease flags and 0x18 lease duration are ignored */
+			smb1req->lease = &state->lease;
+		}
+
 		/* these are ignored for SMB2 */
 		in_create_options &= ~(0x10);/* NTCREATEX_OPTIONS_SYNC_ALERT */
 		in_create_options &= ~(0x20);/* NTCREATEX_OPTIONS_ASYNC_ALERT */
@@ -702,6 +737,30 @@ static struct tevent_req *smbd_smb2_create_send(TALLOC_CTX *mem_ctx,
 
 		in_file_attributes &= ~FILE_FLAG_POSIX_SEMANTICS;
 
+		if (smb1req->lease != NULL) {
+			struct smbd_smb2_lease *lease;
+
+			/* A lease key can only be used for a single file. */
+			lease = smbd_smb2_lease_find(smb2req->sconn,
+					&smb1req->lease->lease_key);
+			if (lease != NULL) {
+				struct file_id id;
+
+				if (!VALID_STAT(smb_fname->st)) {
+					tevent_req_nterror(req,
+						NT_STATUS_INVALID_PARAMETER);
+					return tevent_req_post(req, ev);
+				}
+				id = vfs_file_id_from_sbuf(smb1req->conn,
+							   &smb_fname->st);
+				if (!file_id_equal(&id, &lease->id)) {
+					tevent_req_nterror(req,
+						NT_STATUS_INVALID_PARAMETER);
+					return tevent_req_post(req, ev);
+				}
+			}
+		}
+
 		status = SMB_VFS_CREATE_FILE(smb1req->conn,
 					     smb1req,
 					     0, /* root_dir_fid */
@@ -711,6 +770,9 @@ static struct tevent_req *smbd_smb2_create_send(TALLOC_CTX *mem_ctx,
 					     in_create_disposition,
 					     in_create_options,
 					     in_file_attributes,
+					     smb1req->lease != NULL ?
+					     map_lease_state_to_oplock_type(
+						smb1req->lease->lease_state) :
 					     map_smb2_oplock_levels_to_samba(requested_oplock_level),
 					     allocation_size,
 					     0, /* private_flags */
@@ -778,12 +840,33 @@ static struct tevent_req *smbd_smb2_create_send(TALLOC_CTX *mem_ctx,
 				return tevent_req_post(req, ev);
 			}
 		}
+
+		if (result->lease != NULL) {
+			uint8_t p[32];
+			DATA_BLOB blob = data_blob_const(p, sizeof(p));
+
+			SBVAL(p, 0x00, result->lease->lease_key.data[0]);
+			SBVAL(p, 0x08, result->lease->lease_key.data[1]);
+			SIVAL(p, 0x10, result->lease->lease_state);
+			SIVAL(p, 0x14, 0);	/* lease flags */
+			SBVAL(p, 0x18, 0);	/* lease duration */
+
+			status = smb2_create_blob_add(state, &out_context_blobs,
+						      SMB2_CREATE_TAG_RQLS,
+						      blob);
+			if (!NT_STATUS_IS_OK(status)) {
+				tevent_req_nterror(req, status);
+				return tevent_req_post(req, ev);
+			}
+		}
 	}
 
 	smb2req->compat_chain_fsp = smb1req->chain_fsp;
 
 	if(lp_fake_oplocks(SNUM(smb2req->tcon->compat_conn))) {
 		state->out_oplock_level	= in_oplock_level;
+	} else if (result->lease != NULL) {
+		state->out_oplock_level	= SMB2_OPLOCK_LEVEL_LEASE;
 	} else {
 		state->out_oplock_level	= map_samba_oplock_levels_to_smb2(result->oplock_type);
 	}
@@ -59,6 +59,7 @@ NTSTATUS smbd_smb2_request_process_find(struct smbd_smb2_request *req)
 	uint32_t in_output_buffer_length;
 	struct tevent_req *subreq;
 	bool ok;
+	NTSTATUS status;
 
 	inhdr = (const uint8_t *)req->in.vector[i+0].iov_base;
 	if (req->in.vector[i+1].iov_len != (expected_body_size & 0xFFFFFFFE)) {
@@ -100,6 +101,12 @@ NTSTATUS smbd_smb2_request_process_find(struct smbd_smb2_request *req)
 	DEBUG(10,("smbd_smb2_request_find_done: in_output_buffer_length = %u\n",
 		(unsigned int)in_output_buffer_length ));
 
+	status = smbd_smb2_request_verify_creditcharge(req,
+						       in_output_buffer_length);
+	if (!NT_STATUS_IS_OK(status)) {
+		return smbd_smb2_request_error(req, status);
+	}
+
 	/* Take into account the output header. */
 	in_output_buffer_length -= 8;
 
@@ -200,10 +207,31 @@ static void smbd_smb2_request_find_done(struct tevent_req *subreq)
 }
 
 struct smbd_smb2_find_state {
+	struct tevent_context *ev;
 	struct smbd_smb2_request *smb2req;
+	struct smb_request *smbreq;
+	uint64_t in_file_id_volatile;
+	struct dptr_struct *dptr;
+	const char *in_file_name;
+	uint32_t in_output_buffer_length;
+	uint32_t info_level;
+	uint32_t dirtype;
+	uint32_t max_count;
+	bool dont_descend;
+	bool ask_sharemode;
+	NTSTATUS empty_status;
+	char *pdata;
+	char *base_data;
+	char *end_data;
+	int last_entry_off;
+	uint32_t num;
+	unsigned int prefetch_batch;
 	DATA_BLOB out_output_buffer;
 };
 
+static void smbd_smb2_find_fill(struct tevent_req *req, uint32_t limit);
+static void smbd_smb2_find_prefetched(struct tevent_req *subreq);
+
 static struct tevent_req *smbd_smb2_find_send(TALLOC_CTX *mem_ctx,
 					      struct tevent_context *ev,
 					      struct smbd_smb2_request *smb2req,
@@ -223,21 +251,15 @@ static struct tevent_req *smbd_smb2_find_send(TALLOC_CTX *mem_ctx,
 	NTSTATUS empty_status;
 	uint32_t info_level;
 	uint32_t max_count;
-	char *pdata;
-	char *base_data;
-	char *end_data;
-	int last_entry_off = 0;
-	int off = 0;
-	uint32_t num = 0;
 	uint32_t dirtype = FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_DIRECTORY;
 	bool dont_descend = false;
-	bool ask_sharemode = true;
 
 	req = tevent_req_create(mem_ctx, &state,
 				struct smbd_smb2_find_state);
 	if (req == NULL) {
 		return NULL;
 	}
+	state->ev = ev;
 	state->smb2req = smb2req;
 	state->out_output_buffer = data_blob_null;
 
@@ -281,7 +303,7 @@ static struct tevent_req *smbd_smb2_find_send(TALLOC_CTX *mem_ctx,
 		return tevent_req_post(req, ev);
 	}
 
-	if (in_output_buffer_length > 0x10000) {
+	if (in_output_buffer_length > smb2req->sconn->smb2.max_trans) {
 		tevent_req_nterror(req, NT_STATUS_INVALID_PARAMETER);
 		return tevent_req_post(req, ev);
 	}
@@ -369,16 +391,16 @@ static struct tevent_req *smbd_smb2_find_send(TALLOC_CTX *mem_ctx,
 	}
 
 	state->out_output_buffer.length = 0;
-	pdata = (char *)state->out_output_buffer.data;
-	base_data = pdata;
+	state->pdata = (char *)state->out_output_buffer.data;
+	state->base_data = state->pdata;
 	/*
 	 * end_data must include the safety margin as it's what is
 	 * used to determine if pushed strings have been truncated.
 	 */
-	end_data = pdata + in_output_buffer_length + DIR_ENTRY_SAFETY_MARGIN - 1;
-	last_entry_off = 0;
-	off = 0;
-	num = 0;
+	state->end_data = state->pdata + in_output_buffer_length +
+		DIR_ENTRY_SAFETY_MARGIN - 1;
+	state->last_entry_off = 0;
+	state->num = 0;
 
 	DEBUG(8,("smbd_smb2_find_send: dirpath=<%s> dontdescend=<%s>, "
 		"in_output_buffer_length = %u\n",
@@ -389,69 +411,152 @@ static struct tevent_req *smbd_smb2_find_send(TALLOC_CTX *mem_ctx,
 		dont_descend = true;
 	}
 
-	ask_sharemode = lp_parm_bool(SNUM(conn),
-				     "smbd", "search ask sharemode",
-				     true);
+	state->smbreq = smbreq;
+	state->in_file_id_volatile = in_file_id_volatile;
+	state->dptr = fsp->dptr;
+	state->in_file_name = in_file_name;
+	state->in_output_buffer_length = in_output_buffer_length;
+	state->info_level = info_level;
+	state->dirtype = dirtype;
+	state->max_count = max_count;
+	state->dont_descend = dont_descend;
+	state->empty_status = empty_status;
+	state->ask_sharemode = lp_parm_bool(SNUM(conn),
+					    "smbd", "search ask sharemode",
+					    true);
+
+	if ((max_count > 1) && dptr_has_wild(fsp->dptr)) {
+		state->prefetch_batch = dir_prefetch_batch(conn);
+	}
 
-	while (true) {
+	if (state->prefetch_batch != 0) {
+		struct tevent_req *subreq;
+
+		/*
+		 * Wait for the metadata of the first batch, the next
+		 * batches are prefetched while we marshall this one.
+		 */
+		subreq = dir_prefetch_send(state, ev, conn, fsp->dptr,
+					   fsp->fsp_name->base_name,
+					   0, state->prefetch_batch);
+		if (tevent_req_nomem(subreq, req)) {
+			return tevent_req_post(req, ev);
+		}
+		tevent_req_set_callback(subreq, smbd_smb2_find_prefetched,
+					req);
+		return req;
+	}
+
+	smbd_smb2_find_fill(req, UINT32_MAX);
+	return tevent_req_post(req, ev);
+}
+
+static void smbd_smb2_find_prefetched(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(
+		subreq, struct tevent_req);
+	struct smbd_smb2_find_state *state = tevent_req_data(
+		req, struct smbd_smb2_find_state);
+	files_struct *fsp;
+
+	/* A failed prefetch only means we have to wait for the disk. */
+	dir_prefetch_recv(subreq);
+	TALLOC_FREE(subreq);
+
+	/* The handle might have been closed in the meantime. */
+	fsp = file_fsp(state->smbreq, (uint16_t)state->in_file_id_volatile);
+	if ((fsp == NULL) || (fsp->dptr != state->dptr)) {
+		tevent_req_nterror(req, NT_STATUS_FILE_CLOSED);
+		return;
+	}
+
+	subreq = dir_prefetch_send(state, state->ev, fsp->conn, fsp->dptr,
+				   fsp->fsp_name->base_name,
+				   state->prefetch_batch,
+				   state->prefetch_batch);
+	if (tevent_req_nomem(subreq, req)) {
+		return;
+	}
+
+	smbd_smb2_find_fill(req, state->prefetch_batch);
+	if (!tevent_req_is_in_progress(req)) {
+		return;
+	}
+
+	tevent_req_set_callback(subreq, smbd_smb2_find_prefetched, req);
+}
+
+/*
+ * Marshall up to limit entries into the output buffer. Finishes req
+ * when the buffer is full or the directory is exhausted.
+ */
+
+static void smbd_smb2_find_fill(struct tevent_req *req, uint32_t limit)
+{
+	struct smbd_smb2_find_state *state = tevent_req_data(
+		req, struct smbd_smb2_find_state);
+	connection_struct *conn = state->smb2req->tcon->compat_conn;
+	int off = (int)PTR_DIFF(state->pdata, state->base_data);
+	uint32_t count = 0;
+
+	while (count < limit) {
 		bool ok;
 		bool got_exact_match = false;
 		bool out_of_space = false;
-		int space_remaining = in_output_buffer_length - off;
+		int space_remaining = state->in_output_buffer_length - off;
 
 		SMB_ASSERT(space_remaining >= 0);
 
 		ok = smbd_dirptr_lanman2_entry(state,
 					       conn,
-					       fsp->dptr,
-					       smbreq->flags2,
-					       in_file_name,
-					       dirtype,
-					       info_level,
+					       state->dptr,
+					       state->smbreq->flags2,
+					       state->in_file_name,
+					       state->dirtype,
+					       state->info_level,
 					       false, /* requires_resume_key */
-					       dont_descend,
-					       ask_sharemode,
+					       state->dont_descend,
+					       state->ask_sharemode,
 					       8, /* align to 8 bytes */
 					       false, /* no padding */
-					       &pdata,
-					       base_data,
-					       end_data,
+					       &state->pdata,
+					       state->base_data,
+					       state->end_data,
 					       space_remaining,
 					       &out_of_space,
 					       &got_exact_match,
-					       &last_entry_off,
+					       &state->last_entry_off,
 					       NULL);
 
-		off = (int)PTR_DIFF(pdata, base_data);
+		off = (int)PTR_DIFF(state->pdata, state->base_data);
 
 		if (!ok) {
-			if (num > 0) {
-				SIVAL(state->out_output_buffer.data, last_entry_off, 0);
+			if (state->num > 0) {
+				SIVAL(state->out_output_buffer.data,
+				      state->last_entry_off, 0);
 				tevent_req_done(req);
-				return tevent_req_post(req, ev);
 			} else if (out_of_space) {
-				tevent_req_nterror(req, NT_STATUS_INFO_LENGTH_MISMATCH);
-				return tevent_req_post(req, ev);
+				tevent_req_nterror(
+					req, NT_STATUS_INFO_LENGTH_MISMATCH);
 			} else {
-				tevent_req_nterror(req, empty_status);
-				return tevent_req_post(req, ev);
+				tevent_req_nterror(req, state->empty_status);
 			}
+			return;
 		}
 
-		num++;
+		state->num++;
+		count++;
 		state->out_output_buffer.length = off;
 
-		if (num < max_count) {
+		if (state->num < state->max_count) {
 			continue;
 		}
 
-		SIVAL(state->out_output_buffer.data, last_entry_off, 0);
+		SIVAL(state->out_output_buffer.data,
+		      state->last_entry_off, 0);
 		tevent_req_done(req);
-		return tevent_req_post(req, ev);
+		return;
 	}
-
-	tevent_req_nterror(req, NT_STATUS_INTERNAL_ERROR);
-	return tevent_req_post(req, ev);
 }
 
 static NTSTATUS smbd_smb2_find_recv(struct tevent_req *req,
@@ -171,6 +171,24 @@ static struct tevent_req *smbd_smb2_flush_send(TALLOC_CTX *mem_ctx,
 		return tevent_req_post(req, ev);
 	}
 
+	/* Try and do an asynchronous flush. */
+	status = schedule_aio_smb2_flush(smbreq->conn, smbreq, fsp);
+	if (NT_STATUS_IS_OK(status)) {
+		/*
+		 * Doing an async flush. The aio code
+		 * completes the request.
+		 */
+		smb2req->async = true;
+		return req;
+	}
+
+	if (!NT_STATUS_EQUAL(status, NT_STATUS_RETRY)) {
+		/* Real error in setting up aio. Fail. */
+		tevent_req_nterror(req, status);
+		return tevent_req_post(req, ev);
+	}
+
+	/* Fallback to synchronous. */
 	status = sync_file(smbreq->conn, fsp, true);
 	if (!NT_STATUS_IS_OK(status)) {
 		DEBUG(5,("smbd_smb2_flush: sync_file for %s returned %s\n",
@@ -25,6 +25,7 @@
 #include "../lib/util/tevent_ntstatus.h"
 #include "rpc_server/srv_pipe_hnd.h"
 #include "include/ntioctl.h"
+#include "libcli/security/security.h"
 
 static struct tevent_req *smbd_smb2_ioctl_send(TALLOC_CTX *mem_ctx,
 					       struct tevent_context *ev,
@@ -55,6 +56,7 @@ NTSTATUS smbd_smb2_request_process_ioctl(struct smbd_smb2_request *req)
 	uint32_t in_max_output_length;
 	uint32_t in_flags;
 	struct tevent_req *subreq;
+	NTSTATUS status;
 
 	inhdr = (const uint8_t *)req->in.vector[i+0].iov_base;
 	if (req->in.vector[i+1].iov_len != (expected_body_size & 0xFFFFFFFE)) {
@@ -84,6 +86,12 @@ NTSTATUS smbd_smb2_request_process_ioctl(struct smbd_smb2_request *req)
 		return smbd_smb2_request_error(req, NT_STATUS_INVALID_PARAMETER);
 	}
 
+	status = smbd_smb2_request_verify_creditcharge(req,
+			MAX(in_input_length, in_max_output_length));
+	if (!NT_STATUS_IS_OK(status)) {
+		return smbd_smb2_request_error(req, status);
+	}
+
 	in_input_buffer.data = (uint8_t *)req->in.vector[i+2].iov_base;
 	in_input_buffer.length = in_input_length;
 
@@ -137,9 +145,22 @@ static void smbd_smb2_request_ioctl_done(struct tevent_req *subreq)
 		(unsigned int)out_output_buffer.length,
 		nt_errstr(status) ));
 
+	inbody = (const uint8_t *)req->in.vector[i+1].iov_base;
+
+	in_ctl_code		= IVAL(inbody, 0x04);
+	in_file_id_persistent	= BVAL(inbody, 0x08);
+	in_file_id_volatile	= BVAL(inbody, 0x10);
+
 	TALLOC_FREE(subreq);
 	if (NT_STATUS_EQUAL(status, STATUS_BUFFER_OVERFLOW)) {
 		/* also ok */
+	} else if (((in_ctl_code == FSCTL_SRV_COPYCHUNK) ||
+		    (in_ctl_code == FSCTL_SRV_COPYCHUNK_WRITE)) &&
+		   (out_output_buffer.length != 0)) {
+		/*
+		 * the copychunk limits or how much was copied
+		 * go back with the error
+		 */
 	} else if (!NT_STATUS_IS_OK(status)) {
 		error = smbd_smb2_request_error(req, status);
 		if (!NT_STATUS_IS_OK(error)) {
@@ -153,12 +174,6 @@ static void smbd_smb2_request_ioctl_done(struct tevent_req *subreq)
 	out_input_offset = SMB2_HDR_BODY + 0x30;
 	out_output_offset = SMB2_HDR_BODY + 0x30;
 
-	inbody = (const uint8_t *)req->in.vector[i+1].iov_base;
-
-	in_ctl_code		= IVAL(inbody, 0x04);
-	in_file_id_persistent	= BVAL(inbody, 0x08);
-	in_file_id_volatile	= BVAL(inbody, 0x10);
-
 	outhdr = (uint8_t *)req->out.vector[i].iov_base;
 
 	outbody = data_blob_talloc(req->out.vector, NULL, 0x30);
@@ -218,6 +233,218 @@ struct smbd_smb2_ioctl_state {
 static void smbd_smb2_ioctl_pipe_write_done(struct tevent_req *subreq);
 static void smbd_smb2_ioctl_pipe_read_done(struct tevent_req *subreq);
 
+/*
+ * The limits Windows 2008 R2 announces for FSCTL_SRV_COPYCHUNK.
+ */
+#define COPYCHUNK_MAX_CHUNKS		256
+#define COPYCHUNK_MAX_CHUNK_LEN		1048576
+#define COPYCHUNK_MAX_TOTAL_LEN		16777216
+
+#define COPYCHUNK_RESUME_KEY_LEN	24
+#define COPYCHUNK_HDR_LEN		(COPYCHUNK_RESUME_KEY_LEN + 8)
+#define COPYCHUNK_CHUNK_LEN		24
+#define COPYCHUNK_RESPONSE_LEN		12
+
+/*
+ * The resume key handed out by FSCTL_SRV_REQUEST_RESUME_KEY is
+ * opaque to the client, we just encode the fnum and the generation
+ * of the handle.
+ */
+static void smbd_smb2_resume_key_push(files_struct *fsp, uint8_t *key)
+{
+	memset(key, 0, COPYCHUNK_RESUME_KEY_LEN);
+	SBVAL(key, 0, fsp->fnum);
+	SBVAL(key, 8, fsp->fh->gen_id);
+}
+
+struct smbd_smb2_resume_key_state {
+	uint64_t fnum;
+	uint64_t gen_id;
+};
+
+static struct files_struct *smbd_smb2_resume_key_fn(struct files_struct *fsp,
+						    void *private_data)
+{
+	struct smbd_smb2_resume_key_state *state =
+		(struct smbd_smb2_resume_key_state *)private_data;
+
+	if ((fsp->fnum == state->fnum) && (fsp->fh->gen_id == state->gen_id)) {
+		return fsp;
+	}
+	return NULL;
+}
+
+static files_struct *smbd_smb2_resume_key_fsp(struct smbd_server_connection *sconn,
+					      const uint8_t *key)
+{
+	struct smbd_smb2_resume_key_state state;
+
+	state.fnum = BVAL(key, 0);
+	state.gen_id = BVAL(key, 8);
+
+	return files_forall(sconn, smbd_smb2_resume_key_fn, &state);
+}
+
+static NTSTATUS smbd_smb2_ioctl_copychunk(struct smbd_smb2_ioctl_state *state,
+					  uint32_t in_ctl_code)
+{
+	struct smb_request *smbreq = state->smbreq;
+	files_struct *dst_fsp = state->fsp;
+	files_struct *src_fsp;
+	DATA_BLOB in = state->in_input;
+	uint32_t chunk_count;
+	uint32_t chunks_written = 0;
+	uint32_t chunk_written = 0;
+	uint32_t total_written = 0;
+	uint64_t total_len = 0;
+	NTSTATUS status = NT_STATUS_OK;
+	uint32_t i;
+	uint8_t *p;
+
+	if (dst_fsp == NULL) {
+		return NT_STATUS_FILE_CLOSED;
+	}
+	if (IS_IPC(smbreq->conn) || dst_fsp->is_directory) {
+		return NT_STATUS_INVALID_DEVICE_REQUEST;
+	}
+	if (in.length < COPYCHUNK_HDR_LEN ||
+	    state->in_max_output < COPYCHUNK_RESPONSE_LEN) {
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+
+	state->out_output = data_blob_talloc(state, NULL,
+					     COPYCHUNK_RESPONSE_LEN);
+	if (state->out_output.data == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	chunk_count = IVAL(in.data, COPYCHUNK_RESUME_KEY_LEN);
+
+	if (in.length < COPYCHUNK_HDR_LEN +
+			(uint64_t)chunk_count * COPYCHUNK_CHUNK_LEN) {
+		data_blob_free(&state->out_output);
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+
+	for (i = 0; i < chunk_count; i++) {
+		p = in.data + COPYCHUNK_HDR_LEN + i * COPYCHUNK_CHUNK_LEN;
+		if (IVAL(p, 16) == 0 ||
+		    IVAL(p, 16) > COPYCHUNK_MAX_CHUNK_LEN) {
+			break;
+		}
+		total_len += IVAL(p, 16);
+	}
+
+	if (chunk_count > COPYCHUNK_MAX_CHUNKS || i < chunk_count ||
+	    total_len > COPYCHUNK_MAX_TOTAL_LEN) {
+		/*
+		 * Tell the client what we are prepared to do, it is
+		 * expected to retry with smaller requests.
+		 */
+		p = state->out_output.data;
+		SIVAL(p, 0, COPYCHUNK_MAX_CHUNKS);
+		SIVAL(p, 4, COPYCHUNK_MAX_CHUNK_LEN);
+		SIVAL(p, 8, COPYCHUNK_MAX_TOTAL_LEN);
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+
+	src_fsp = smbd_smb2_resume_key_fsp(smbreq->sconn, in.data);
+	if (src_fsp == NULL || src_fsp->conn != dst_fsp->conn ||
+	    src_fsp->vuid != dst_fsp->vuid || src_fsp->is_directory) {
+		data_blob_free(&state->out_output);
+		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+
+	if (!CHECK_READ(src_fsp, smbreq) || !CHECK_WRITE(dst_fsp)) {
+		data_blob_free(&state->out_output);
+		return NT_STATUS_ACCESS_DENIED;
+	}
+	if (in_ctl_code == FSCTL_SRV_COPYCHUNK &&
+	    !CHECK_READ(dst_fsp, smbreq)) {
+		/* unlike _WRITE, the plain variant wants read access */
+		data_blob_free(&state->out_output);
+		return NT_STATUS_ACCESS_DENIED;
+	}
+
+	DEBUG(10, ("smbd_smb2_ioctl_copychunk: %u chunks, %llu bytes "
+		   "from %s to %s\n", (unsigned)chunk_count,
+		   (unsigned long long)total_len,
+		   fsp_str_dbg(src_fsp), fsp_str_dbg(dst_fsp)));
+
+	for (i = 0; i < chunk_count; i++) {
+		struct lock_struct src_lock;
+		struct lock_struct dst_lock;
+		uint64_t src_off, dst_off;
+		uint32_t length;
+
+		p = in.data + COPYCHUNK_HDR_LEN + i * COPYCHUNK_CHUNK_LEN;
+		src_off = BVAL(p, 0);
+		dst_off = BVAL(p, 8);
+		length = IVAL(p, 16);
+
+		init_strict_lock_struct(src_fsp, src_fsp->fnum, src_off,
+					length, READ_LOCK, &src_lock);
+		init_strict_lock_struct(dst_fsp, dst_fsp->fnum, dst_off,
+					length, WRITE_LOCK, &dst_lock);
+
+		if (!SMB_VFS_STRICT_LOCK(src_fsp->conn, src_fsp, &src_lock)) {
+			status = NT_STATUS_FILE_LOCK_CONFLICT;
+			break;
+		}
+		if (!SMB_VFS_STRICT_LOCK(dst_fsp->conn, dst_fsp, &dst_lock)) {
+			SMB_VFS_STRICT_UNLOCK(src_fsp->conn, src_fsp,
+					      &src_lock);
+			status = NT_STATUS_FILE_LOCK_CONFLICT;
+			break;
+		}
+
+		/*
+		 * A short copy is retried for the rest of the chunk, the
+		 * next call tells an error from the end of the source.
+		 */
+		chunk_written = 0;
+		while (chunk_written < length) {
+			ssize_t ret;
+
+			ret = copy_file_chunk(src_fsp, src_off + chunk_written,
+					      dst_fsp, dst_off + chunk_written,
+					      length - chunk_written);
+			if (ret == -1) {
+				status = map_nt_error_from_unix(errno);
+				break;
+			}
+			if (ret == 0) {
+				/* the source range reaches beyond the end of file */
+				status = NT_STATUS_INVALID_VIEW_SIZE;
+				break;
+			}
+			chunk_written += ret;
+		}
+
+		SMB_VFS_STRICT_UNLOCK(dst_fsp->conn, dst_fsp, &dst_lock);
+		SMB_VFS_STRICT_UNLOCK(src_fsp->conn, src_fsp, &src_lock);
+
+		total_written += chunk_written;
+		if (!NT_STATUS_IS_OK(status)) {
+			break;
+		}
+		chunks_written++;
+		chunk_written = 0;
+	}
+
+	/*
+	 * On failure the client still learns how much landed: the
+	 * complete chunks, the bytes of the chunk that failed and the
+	 * total.
+	 */
+	p = state->out_output.data;
+	SIVAL(p, 0, chunks_written);
+	SIVAL(p, 4, chunk_written);
+	SIVAL(p, 8, total_written);
+
+	return status;
+}
+
 static struct tevent_req *smbd_smb2_ioctl_send(TALLOC_CTX *mem_ctx,
 					       struct tevent_context *ev,
 					       struct smbd_smb2_request *smb2req,
@@ -504,6 +731,49 @@ static struct tevent_req *smbd_smb2_ioctl_send(TALLOC_CTX *mem_ctx,
 		return tevent_req_post(req, ev);
         }
 
+	case FSCTL_SRV_REQUEST_RESUME_KEY:
+	{
+		if (fsp == NULL) {
+			tevent_req_nterror(req, NT_STATUS_FILE_CLOSED);
+			return tevent_req_post(req, ev);
+		}
+		if (IS_IPC(smbreq->conn)) {
+			tevent_req_nterror(req, NT_STATUS_INVALID_DEVICE_REQUEST);
+			return tevent_req_post(req, ev);
+		}
+
+		/* resume key, context length and 4 bytes of context */
+		if (in_max_output < COPYCHUNK_RESUME_KEY_LEN + 8) {
+			tevent_req_nterror(req, NT_STATUS_INVALID_PARAMETER);
+			return tevent_req_post(req, ev);
+		}
+
+		state->out_output = data_blob_talloc_zero(state,
+					COPYCHUNK_RESUME_KEY_LEN + 8);
+		if (tevent_req_nomem(state->out_output.data, req)) {
+			return tevent_req_post(req, ev);
+		}
+		smbd_smb2_resume_key_push(fsp, state->out_output.data);
+
+		tevent_req_done(req);
+		return tevent_req_post(req, ev);
+	}
+
+	case FSCTL_SRV_COPYCHUNK:
+	case FSCTL_SRV_COPYCHUNK_WRITE:
+	{
+		NTSTATUS status;
+
+		status = smbd_smb2_ioctl_copychunk(state, in_ctl_code);
+		if (!NT_STATUS_IS_OK(status)) {
+			tevent_req_nterror(req, status);
+			return tevent_req_post(req, ev);
+		}
+
+		tevent_req_done(req);
+		return tevent_req_post(req, ev);
+	}
+
 	default:
 		if (IS_IPC(smbreq->conn)) {
 			tevent_req_nterror(req, NT_STATUS_FS_DRIVER_REQUIRED);
@@ -607,7 +877,8 @@ static NTSTATUS smbd_smb2_ioctl_recv(struct tevent_req *req,
 					      struct smbd_smb2_ioctl_state);
 
 	if (tevent_req_is_nterror(req, &status)) {
-		if (!NT_STATUS_EQUAL(status, STATUS_BUFFER_OVERFLOW)) {
+		if (!NT_STATUS_EQUAL(status, STATUS_BUFFER_OVERFLOW) &&
+		    (state->out_output.length == 0)) {
 			tevent_req_received(req);
 			return status;
 		}
@@ -446,8 +446,9 @@ static bool smbd_smb2_lock_cancel(struct tevent_req *req)
 }
 
 /****************************************************************
- Got a message saying someone unlocked a file. Re-schedule all
- blocking lock requests as we don't know if anything overlapped.
+ Got a message saying someone unlocked a file. Re-schedule the
+ blocking lock requests on that file, all of them if the sender
+ didn't say which file.
 *****************************************************************/
 
 static void received_unlock_msg(struct messaging_context *msg,
@@ -457,6 +458,7 @@ static void received_unlock_msg(struct messaging_context *msg,
 				DATA_BLOB *data)
 {
 	struct smbd_server_connection *sconn;
+	struct file_id id;
 
 	DEBUG(10,("received_unlock_msg (SMB2)\n"));
 
@@ -465,7 +467,14 @@ static void received_unlock_msg(struct messaging_context *msg,
 		DEBUG(1, ("could not find sconn\n"));
 		return;
 	}
-	process_blocking_lock_queue_smb2(sconn, timeval_current());
+
+	if (data->length != 24) {
+		process_blocking_lock_queue_smb2(sconn, timeval_current(),
+						 NULL);
+		return;
+	}
+	pull_file_id_24((char *)data->data, &id);
+	process_blocking_lock_queue_smb2(sconn, timeval_current(), &id);
 }
 
 /****************************************************************
@@ -824,11 +833,12 @@ static void reprocess_blocked_smb2_lock(struct smbd_smb2_request *smb2req,
 
 /****************************************************************
  Attempt to proccess all outstanding blocking locks pending on
- the request queue.
+ the request queue, only those on one file if id is given.
 *****************************************************************/
 
 void process_blocking_lock_queue_smb2(
-	struct smbd_server_connection *sconn, struct timeval tv_curr)
+	struct smbd_server_connection *sconn, struct timeval tv_curr,
+	const struct file_id *id)
 {
 	struct smbd_smb2_request *smb2req, *nextreq;
 
@@ -847,9 +857,19 @@ void process_blocking_lock_queue_smb2(
 		}
 
 		inhdr = (const uint8_t *)smb2req->in.vector[smb2req->current_idx].iov_base;
-		if (SVAL(inhdr, SMB2_HDR_OPCODE) == SMB2_OP_LOCK) {
-			reprocess_blocked_smb2_lock(smb2req, tv_curr);
+		if (SVAL(inhdr, SMB2_HDR_OPCODE) != SMB2_OP_LOCK) {
+			continue;
+		}
+		if (id != NULL) {
+			struct blocking_lock_record *blr =
+				get_pending_smb2req_blr(smb2req);
+
+			if ((blr == NULL) ||
+			    !file_id_equal(&blr->fsp->file_id, id)) {
+				continue;
+			}
 		}
+		reprocess_blocked_smb2_lock(smb2req, tv_curr);
 	}
 
 	recalc_smb2_brl_timeout(sconn);
@@ -22,12 +22,13 @@
 #include "smbd/smbd.h"
 #include "smbd/globals.h"
 #include "../libcli/smb/smb_common.h"
+#include "../librpc/ndr/libndr.h"
 
 /*
  * this is the entry point if SMB2 is selected via
- * the SMB negprot
+ * the SMB negprot and the given dialect.
  */
-void reply_smb2002(struct smb_request *req, uint16_t choice)
+static void reply_smb20xx(struct smb_request *req, uint16_t dialect)
 {
 	uint8_t *smb2_inbuf;
 	uint8_t *smb2_hdr;
@@ -51,7 +52,7 @@ void reply_smb2002(struct smb_request *req, uint16_t choice)
 	SSVAL(smb2_body, 0x00, 0x0024);	/* struct size */
 	SSVAL(smb2_body, 0x02, 0x0001);	/* dialect count */
 
-	SSVAL(smb2_dyn,  0x00, 0x0202);	/* dialect 2.002 */
+	SSVAL(smb2_dyn,  0x00, dialect);
 
 	req->outbuf = NULL;
 
@@ -59,6 +60,28 @@ void reply_smb2002(struct smb_request *req, uint16_t choice)
 	return;
 }
 
+/*
+ * this is the entry point if SMB2 is selected via
+ * the SMB negprot and the "SMB 2.002" dialect.
+ */
+void reply_smb2002(struct smb_request *req, uint16_t choice)
+{
+	reply_smb20xx(req, SMB2_DIALECT_REVISION_202);
+}
+
+/*
+ * this is the entry point if SMB2 is selected via
+ * the SMB negprot and the "SMB 2.???" dialect.
+ *
+ * We reply with the wildcard dialect 0x02FF,
+ * which tells the client to send a real SMB2 negprot
+ * where we can select SMB 2.1.
+ */
+void reply_smb20ff(struct smb_request *req, uint16_t choice)
+{
+	reply_smb20xx(req, SMB2_DIALECT_REVISION_2FF);
+}
+
 NTSTATUS smbd_smb2_request_process_negprot(struct smbd_smb2_request *req)
 {
 	const uint8_t *inbody;
@@ -77,6 +100,13 @@ NTSTATUS smbd_smb2_request_process_negprot(struct smbd_smb2_request *req)
 	uint16_t dialect_count;
 	uint16_t dialect = 0;
 	uint32_t capabilities;
+	uint32_t max_limit;
+	uint32_t max_trans;
+	uint32_t max_read;
+	uint32_t max_write;
+	DATA_BLOB client_guid_blob;
+	struct GUID client_guid;
+	NTSTATUS status;
 
 /* TODO: drop the connection with INVALID_PARAMETER */
 
@@ -102,17 +132,35 @@ NTSTATUS smbd_smb2_request_process_negprot(struct smbd_smb2_request *req)
 	}
 	indyn = (const uint8_t *)req->in.vector[i+2].iov_base;
 
+	/* select the highest dialect we support */
 	for (c=0; c < dialect_count; c++) {
-		dialect = SVAL(indyn, c*2);
-		if (dialect == SMB2_DIALECT_REVISION_202) {
+		uint16_t d = SVAL(indyn, c*2);
+
+		switch (d) {
+		case SMB2_DIALECT_REVISION_202:
+		case SMB2_DIALECT_REVISION_210:
+			dialect = MAX(dialect, d);
+			break;
+		default:
 			break;
 		}
 	}
 
-	if (dialect != SMB2_DIALECT_REVISION_202) {
+	/*
+	 * The wildcard 0x02FF is only valid in our reply to the SMB
+	 * negprot, it is never the negotiated dialect.
+	 */
+	if (dialect == 0) {
 		return smbd_smb2_request_error(req, NT_STATUS_INVALID_PARAMETER);
 	}
 
+	/* leases are keyed by the client guid and the lease key */
+	client_guid_blob = data_blob_const(inbody + 0x0C, 16);
+	status = GUID_from_ndr_blob(&client_guid_blob, &client_guid);
+	if (!NT_STATUS_IS_OK(status)) {
+		return smbd_smb2_request_error(req, status);
+	}
+
 	set_Protocol(PROTOCOL_SMB2);
 
 	if (get_remote_arch() != RA_SAMBA) {
@@ -139,6 +187,34 @@ NTSTATUS smbd_smb2_request_process_negprot(struct smbd_smb2_request *req)
 		capabilities |= SMB2_CAP_DFS;
 	}
 
+	/*
+	 * SMB 2.002 clients can only use a single credit
+	 * per request, which limits all I/O to 64k.
+	 * SMB 2.1 with large MTU support allows multi-credit
+	 * requests up to the configured limits.
+	 */
+	max_limit = 0x10000;
+	req->sconn->smb2.supports_multicredit = false;
+	if (dialect == SMB2_DIALECT_REVISION_210) {
+		capabilities |= SMB2_CAP_LARGE_MTU;
+		req->sconn->smb2.supports_multicredit = true;
+		max_limit = 0x7FFFFFFF;
+	}
+
+	/*
+	 * SMB 2.1 leases are implemented on top of our oplock
+	 * code, kernel oplocks can't represent them.
+	 */
+	req->sconn->smb2.supports_leasing = false;
+	if (dialect == SMB2_DIALECT_REVISION_210 && !lp_kernel_oplocks()) {
+		capabilities |= SMB2_CAP_LEASING;
+		req->sconn->smb2.supports_leasing = true;
+	}
+
+	max_trans = MIN(max_limit, lp_smb2_max_trans());
+	max_read = MIN(max_limit, lp_smb2_max_read());
+	max_write = MIN(max_limit, lp_smb2_max_write());
+
 	security_offset = SMB2_HDR_BODY + 0x40;
 
 #if 1
@@ -164,9 +240,9 @@ NTSTATUS smbd_smb2_request_process_negprot(struct smbd_smb2_request *req)
 	       negprot_spnego_blob.data, 16);	/* server guid */
 	SIVAL(outbody.data, 0x18,
 	      capabilities);			/* capabilities */
-	SIVAL(outbody.data, 0x1C, lp_smb2_max_trans());	/* max transact size */
-	SIVAL(outbody.data, 0x20, lp_smb2_max_read());	/* max read size */
-	SIVAL(outbody.data, 0x24, lp_smb2_max_write());	/* max write size */
+	SIVAL(outbody.data, 0x1C, max_trans);	/* max transact size */
+	SIVAL(outbody.data, 0x20, max_read);	/* max read size */
+	SIVAL(outbody.data, 0x24, max_write);	/* max write size */
 	SBVAL(outbody.data, 0x28, 0);		/* system time */
 	SBVAL(outbody.data, 0x30, 0);		/* server start time */
 	SSVAL(outbody.data, 0x38,
@@ -178,6 +254,11 @@ NTSTATUS smbd_smb2_request_process_negprot(struct smbd_smb2_request *req)
 	outdyn = security_buffer;
 
 	req->sconn->using_smb2 = true;
+	req->sconn->smb2.dialect = dialect;
+	req->sconn->smb2.client_guid = client_guid;
+	req->sconn->smb2.max_trans = max_trans;
+	req->sconn->smb2.max_read = max_read;
+	req->sconn->smb2.max_write = max_write;
 
 	return smbd_smb2_request_done(req, outbody, &outdyn);
 }
@@ -57,6 +57,7 @@ NTSTATUS smbd_smb2_request_process_read(struct smbd_smb2_request *req)
 	uint32_t in_minimum_count;
 	uint32_t in_remaining_bytes;
 	struct tevent_req *subreq;
+	NTSTATUS status;
 
 	inhdr = (const uint8_t *)req->in.vector[i+0].iov_base;
 	if (req->in.vector[i+1].iov_len != (expected_body_size & 0xFFFFFFFE)) {
@@ -80,12 +81,18 @@ NTSTATUS smbd_smb2_request_process_read(struct smbd_smb2_request *req)
 	in_remaining_bytes	= IVAL(inbody, 0x28);
 
 	/* check the max read size */
-	if (in_length > lp_smb2_max_read()) {
-		DEBUG(0,("here:%s: 0x%08X: 0x%08X\n",
-			__location__, in_length, lp_smb2_max_read()));
+	if (in_length > req->sconn->smb2.max_read) {
+		DEBUG(2,("smbd_smb2_request_process_read: "
+			"client ignored max read :%s: 0x%08X: 0x%08X\n",
+			__location__, in_length, req->sconn->smb2.max_read));
 		return smbd_smb2_request_error(req, NT_STATUS_INVALID_PARAMETER);
 	}
 
+	status = smbd_smb2_request_verify_creditcharge(req, in_length);
+	if (!NT_STATUS_IS_OK(status)) {
+		return smbd_smb2_request_error(req, status);
+	}
+
 	if (req->compat_chain_fsp) {
 		/* skip check */
 	} else if (in_file_id_persistent != in_file_id_volatile) {
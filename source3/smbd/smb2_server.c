@@ -20,12 +20,14 @@
 */
 
 #include "includes.h"
+#include "system/filesys.h"
 #include "smbd/smbd.h"
 #include "smbd/globals.h"
 #include "../libcli/smb/smb_common.h"
 #include "../lib/tsocket/tsocket.h"
 #include "../lib/util/tevent_ntstatus.h"
 #include "smbprofile.h"
+#include "smb2_credits.h"
 
 #define OUTVEC_ALLOC_SIZE (SMB2_HDR_BODY + 9)
 
@@ -88,6 +90,9 @@ bool smbd_is_smb2_header(const uint8_t *inbuf, size_t size)
 	return true;
 }
 
+static bool smbd_smb2_credits_update(const struct timeval *now,
+				     void *private_data);
+
 static NTSTATUS smbd_initialize_smb2(struct smbd_server_connection *sconn)
 {
 	NTSTATUS status;
@@ -107,6 +112,11 @@ static NTSTATUS smbd_initialize_smb2(struct smbd_server_connection *sconn)
 		return NT_STATUS_NO_MEMORY;
 	}
 
+	sconn->smb2.send_pending.im = tevent_create_immediate(sconn);
+	if (sconn->smb2.send_pending.im == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+
 	sconn->smb2.sessions.idtree = idr_init(sconn);
 	if (sconn->smb2.sessions.idtree == NULL) {
 		return NT_STATUS_NO_MEMORY;
@@ -122,6 +132,20 @@ static NTSTATUS smbd_initialize_smb2(struct smbd_server_connection *sconn)
 		return NT_STATUS_NO_MEMORY;
 	}
 
+	sconn->smb2.credits.target = sconn->smb2.max_credits;
+	sconn->smb2.credits.healthy = true;
+	sconn->smb2.credits.pressure_limit = lp_parm_int(-1, "smbd",
+		"smb2 credit pressure limit", 512);
+	sconn->smb2.credits.latency_limit_usec = 1000 * lp_parm_int(-1, "smbd",
+		"smb2 credit latency limit", 100);
+
+	if (!(event_add_idle(sconn->smb2.event_ctx, sconn,
+			     timeval_set(SMB2_CREDITS_UPDATE_INTERVAL, 0),
+			     "smb2_credits", smbd_smb2_credits_update,
+			     sconn))) {
+		return NT_STATUS_NO_MEMORY;
+	}
+
 	ret = tstream_bsd_existing_socket(sconn, sconn->sock,
 					  &sconn->smb2.stream);
 	if (ret == -1) {
@@ -165,28 +189,82 @@ static int smbd_smb2_request_parent_destructor(struct smbd_smb2_request **req)
 	return 0;
 }
 
+/*
+ * Keep the talloc pool of a request that goes away for the next one.
+ * The remaining objects in the pool are freed when it's reused, as
+ * we're called from within the destructor of one of them.
+ */
+static bool smbd_smb2_request_cache_pool(struct smbd_server_connection *sconn,
+					 TALLOC_CTX *mem_pool)
+{
+	if (sconn->smb2.req_cache.num_pools >= SMBD_SMB2_REQUEST_CACHE_SIZE) {
+		return false;
+	}
+
+	talloc_steal(sconn, mem_pool);
+	sconn->smb2.req_cache.pools[sconn->smb2.req_cache.num_pools++] =
+		mem_pool;
+
+	return true;
+}
+
+static TALLOC_CTX *smbd_smb2_request_get_pool(
+	struct smbd_server_connection *sconn,
+	TALLOC_CTX *mem_ctx)
+{
+	TALLOC_CTX *mem_pool;
+
+	DO_PROFILE_INC(smb2_req_cache_lookups);
+
+	if (sconn->smb2.req_cache.num_pools == 0) {
+		DO_PROFILE_INC(smb2_req_cache_misses);
+		sconn->smb2.req_cache.misses += 1;
+#if 0
+		/* Enable this to find subtle valgrind errors. */
+		return talloc_init("smbd_smb2_request_allocate");
+#else
+		return talloc_pool(mem_ctx, 8192);
+#endif
+	}
+
+	DO_PROFILE_INC(smb2_req_cache_hits);
+	sconn->smb2.req_cache.hits += 1;
+
+	mem_pool = sconn->smb2.req_cache.pools[
+		--sconn->smb2.req_cache.num_pools];
+	sconn->smb2.req_cache.pools[sconn->smb2.req_cache.num_pools] = NULL;
+
+	/*
+	 * Once the pool is the only object left,
+	 * talloc hands out its memory from the start again.
+	 */
+	talloc_free_children(mem_pool);
+	talloc_steal(mem_ctx, mem_pool);
+
+	return mem_pool;
+}
+
 static int smbd_smb2_request_destructor(struct smbd_smb2_request *req)
 {
 	if (req->parent) {
 		*req->parent = NULL;
-		talloc_free(req->mem_pool);
+		if (!smbd_smb2_request_cache_pool(req->sconn, req->mem_pool)) {
+			talloc_free(req->mem_pool);
+		}
 	}
 
 	return 0;
 }
 
-static struct smbd_smb2_request *smbd_smb2_request_allocate(TALLOC_CTX *mem_ctx)
+static struct smbd_smb2_request *smbd_smb2_request_allocate(
+	TALLOC_CTX *mem_ctx,
+	struct smbd_server_connection *sconn)
 {
 	TALLOC_CTX *mem_pool;
 	struct smbd_smb2_request **parent;
 	struct smbd_smb2_request *req;
 
-#if 0
-	/* Enable this to find subtle valgrind errors. */
-	mem_pool = talloc_init("smbd_smb2_request_allocate");
-#else
-	mem_pool = talloc_pool(mem_ctx, 8192);
-#endif
+	mem_pool = smbd_smb2_request_get_pool(sconn, mem_ctx);
 	if (mem_pool == NULL) {
 		return NULL;
 	}
@@ -205,6 +283,7 @@ static struct smbd_smb2_request *smbd_smb2_request_allocate(TALLOC_CTX *mem_ctx)
 	*parent		= req;
 	req->mem_pool	= mem_pool;
 	req->parent	= parent;
+	req->sconn	= sconn;
 
 	talloc_set_destructor(parent, smbd_smb2_request_parent_destructor);
 	talloc_set_destructor(req, smbd_smb2_request_destructor);
@@ -251,11 +330,11 @@ static NTSTATUS smbd_smb2_request_create(struct smbd_server_connection *sconn,
 		return NT_STATUS_INVALID_PARAMETER;
 	}
 
-	req = smbd_smb2_request_allocate(sconn);
+	req = smbd_smb2_request_allocate(sconn, sconn);
 	if (req == NULL) {
 		return NT_STATUS_NO_MEMORY;
 	}
-	req->sconn = sconn;
+	GetTimeOfDay(&req->request_time);
 
 	talloc_steal(req, inbuf);
 
@@ -295,51 +374,42 @@ static NTSTATUS smbd_smb2_request_create(struct smbd_server_connection *sconn,
 	return NT_STATUS_OK;
 }
 
-static bool smb2_validate_message_id(struct smbd_server_connection *sconn,
-				const uint8_t *inhdr)
+static bool smb2_validate_sequence_number(struct smbd_server_connection *sconn,
+					  uint64_t message_id, uint64_t seq_id)
 {
-	uint64_t message_id = BVAL(inhdr, SMB2_HDR_MESSAGE_ID);
 	struct bitmap *credits_bm = sconn->smb2.credits_bitmap;
-	uint16_t opcode = IVAL(inhdr, SMB2_HDR_OPCODE);
 	unsigned int bitmap_offset;
 
-	if (opcode == SMB2_OP_CANCEL) {
-		/* SMB2_CANCEL requests by definition resend messageids. */
-		return true;
-	}
-
-	if (message_id < sconn->smb2.seqnum_low ||
-			message_id > (sconn->smb2.seqnum_low +
+	if (seq_id < sconn->smb2.seqnum_low ||
+			seq_id > (sconn->smb2.seqnum_low +
 			(sconn->smb2.max_credits * DEFAULT_SMB2_MAX_CREDIT_BITMAP_FACTOR))) {
-		DEBUG(0,("smb2_validate_message_id: bad message_id "
-			"%llu (low = %llu, max = %lu)\n",
+		DEBUG(0,("smb2_validate_sequence_number: bad message_id "
+			"%llu (sequence id %llu) (low = %llu, max = %lu)\n",
 			(unsigned long long)message_id,
+			(unsigned long long)seq_id,
 			(unsigned long long)sconn->smb2.seqnum_low,
 			(unsigned long)sconn->smb2.max_credits ));
 		return false;
 	}
 
-	/* client just used a credit. */
-	SMB_ASSERT(sconn->smb2.credits_granted > 0);
-	sconn->smb2.credits_granted -= 1;
-
 	/* Mark the message_id as seen in the bitmap. */
-	bitmap_offset = (unsigned int)(message_id %
+	bitmap_offset = (unsigned int)(seq_id %
 			(uint64_t)(sconn->smb2.max_credits * DEFAULT_SMB2_MAX_CREDIT_BITMAP_FACTOR));
 	if (bitmap_query(credits_bm, bitmap_offset)) {
-		DEBUG(0,("smb2_validate_message_id: duplicate message_id "
-			"%llu (bm offset %u)\n",
+		DEBUG(0,("smb2_validate_sequence_number: duplicate message_id "
+			"%llu (sequence id %llu) (bm offset %u)\n",
 			(unsigned long long)message_id,
+			(unsigned long long)seq_id,
 			bitmap_offset));
 		return false;
 	}
 	bitmap_set(credits_bm, bitmap_offset);
 
-	if (message_id == sconn->smb2.seqnum_low + 1) {
+	if (seq_id == sconn->smb2.seqnum_low + 1) {
 		/* Move the window forward by all the message_id's
 		   already seen. */
 		while (bitmap_query(credits_bm, bitmap_offset)) {
-			DEBUG(10,("smb2_validate_message_id: clearing "
+			DEBUG(10,("smb2_validate_sequence_number: clearing "
 				"id %llu (position %u) from bitmap\n",
 				(unsigned long long)(sconn->smb2.seqnum_low + 1),
 				bitmap_offset ));
@@ -353,6 +423,59 @@ static bool smb2_validate_message_id(struct smbd_server_connection *sconn,
 	return true;
 }
 
+static bool smb2_validate_message_id(struct smbd_server_connection *sconn,
+				const uint8_t *inhdr)
+{
+	uint64_t message_id = BVAL(inhdr, SMB2_HDR_MESSAGE_ID);
+	uint16_t opcode = IVAL(inhdr, SMB2_HDR_OPCODE);
+	uint16_t credit_charge = 1;
+	uint64_t i;
+
+	if (opcode == SMB2_OP_CANCEL) {
+		/* SMB2_CANCEL requests by definition resend messageids. */
+		return true;
+	}
+
+	if (sconn->smb2.supports_multicredit) {
+		/*
+		 * A multi-credit request consumes one message_id
+		 * per credit. A charge of 0 is treated as 1.
+		 */
+		credit_charge = SVAL(inhdr, SMB2_HDR_CREDIT_CHARGE);
+		credit_charge = MAX(credit_charge, 1);
+	}
+
+	DEBUG(11, ("smb2_validate_message_id: mid %llu, credits_granted %u, "
+		   "charge %u, max_credits %u, seqnum_low: %llu\n",
+		   (unsigned long long) message_id,
+		   (unsigned int)sconn->smb2.credits_granted,
+		   (unsigned int)credit_charge,
+		   (unsigned int)sconn->smb2.max_credits,
+		   (unsigned long long)sconn->smb2.seqnum_low));
+
+	if (sconn->smb2.credits_granted < credit_charge) {
+		DEBUG(0, ("smb2_validate_message_id: client used more "
+			  "credits than granted, mid %llu, charge %u, "
+			  "credits_granted %u\n",
+			  (unsigned long long)message_id,
+			  (unsigned int)credit_charge,
+			  (unsigned int)sconn->smb2.credits_granted));
+		return false;
+	}
+
+	for (i = 0; i < credit_charge; i++) {
+		if (!smb2_validate_sequence_number(sconn, message_id,
+						   message_id + i)) {
+			return false;
+		}
+	}
+
+	/* client just used credit_charge credits. */
+	sconn->smb2.credits_granted -= credit_charge;
+
+	return true;
+}
+
 static NTSTATUS smbd_smb2_request_validate(struct smbd_smb2_request *req)
 {
 	int count;
@@ -437,12 +560,185 @@ static NTSTATUS smbd_smb2_request_validate(struct smbd_smb2_request *req)
 	return NT_STATUS_OK;
 }
 
+/*
+ * Adaptive credit granting: every SMB2_CREDITS_UPDATE_INTERVAL
+ * seconds the credit target of a connection is adjusted between
+ * SMBD_SMB2_CREDITS_MIN and "smb2 max credits". Under server wide
+ * pressure (too many requests outstanding over all connections) the
+ * target is halved towards a fair share of "smbd:smb2 credit pressure
+ * limit", if our own requests take longer than "smbd:smb2 credit
+ * latency limit" it shrinks by a quarter, otherwise it grows again.
+ */
+#define SMBD_SMB2_CREDITS_MIN 16
+
+static bool smbd_smb2_credits_ignore(const struct smbd_smb2_request *req)
+{
+	const uint8_t *inhdr;
+	uint16_t opcode;
+
+	if (req->current_idx >= req->in.vector_count) {
+		return true;
+	}
+
+	inhdr = (const uint8_t *)req->in.vector[req->current_idx].iov_base;
+	opcode = SVAL(inhdr, SMB2_HDR_OPCODE);
+
+	/*
+	 * Notify and blocking lock requests wait on the client's
+	 * behalf, they don't say anything about how loaded we are.
+	 */
+	switch (opcode) {
+	case SMB2_OP_NOTIFY:
+	case SMB2_OP_LOCK:
+		return true;
+	default:
+		break;
+	}
+	return false;
+}
+
+static void smbd_smb2_credits_account(struct smbd_smb2_request *req)
+{
+	struct smbd_server_connection *sconn = req->sconn;
+	struct timeval now;
+	uint64_t usec;
+	uint32_t avg = sconn->smb2.credits.avg_latency_usec;
+
+	sconn->smb2.credits.num_requests += 1;
+
+	if (smbd_smb2_credits_ignore(req)) {
+		return;
+	}
+
+	GetTimeOfDay(&now);
+	usec = usec_time_diff(&now, &req->request_time);
+
+	/* one very slow request must not dominate the average */
+	usec = MIN(usec, 10 * (uint64_t)sconn->smb2.credits.latency_limit_usec);
+
+	/* exponentially weighted moving average, weight 1/8 */
+	sconn->smb2.credits.avg_latency_usec = avg - avg / 8 + usec / 8;
+}
+
+static bool smbd_smb2_credits_update(const struct timeval *now,
+				     void *private_data)
+{
+	struct smbd_server_connection *sconn = talloc_get_type_abort(
+		private_data, struct smbd_server_connection);
+	struct smb2_credits_global global;
+	struct smb2_credit_stats stats;
+	struct smbd_smb2_request *req;
+	uint32_t in_flight = 0;
+	uint32_t async_pending = 0;
+	uint32_t max = sconn->smb2.max_credits;
+	uint32_t min = MIN(SMBD_SMB2_CREDITS_MIN, max);
+	uint32_t target = sconn->smb2.credits.target;
+	uint32_t pressure_limit = sconn->smb2.credits.pressure_limit;
+	bool healthy = false;
+	char *addr;
+
+	for (req = sconn->smb2.requests; req != NULL; req = req->next) {
+		if (smbd_smb2_credits_ignore(req)) {
+			continue;
+		}
+		in_flight += 1;
+		if (req->async) {
+			async_pending += 1;
+		}
+	}
+
+	if ((pressure_limit != 0)
+	    && smb2_credits_fetch_global(&global)
+	    && (global.in_flight > pressure_limit)) {
+		uint32_t share = pressure_limit /
+			MAX(global.num_connections, 1);
+
+		target = MAX(target / 2, share);
+		sconn->smb2.credits.throttled += 1;
+	} else if ((sconn->smb2.credits.avg_latency_usec >
+		    sconn->smb2.credits.latency_limit_usec)
+		   && (async_pending > 0)) {
+		target -= target / 4;
+	} else {
+		target += MAX(max / 16, 1);
+		healthy = true;
+	}
+
+	target = MAX(target, min);
+	target = MIN(target, max);
+
+	if (target != sconn->smb2.credits.target) {
+		DEBUG(10, ("smbd_smb2_credits_update: target %u -> %u, "
+			   "in_flight %u, async %u, avg latency %u usec\n",
+			   (unsigned int)sconn->smb2.credits.target,
+			   (unsigned int)target,
+			   (unsigned int)in_flight,
+			   (unsigned int)async_pending,
+			   (unsigned int)sconn->smb2.credits.avg_latency_usec));
+	}
+
+	sconn->smb2.credits.target = target;
+	sconn->smb2.credits.healthy = healthy;
+
+	if (sconn->smb2.credits.published.stored
+	    && (sconn->smb2.credits.published.target == target)
+	    && (sconn->smb2.credits.published.granted ==
+		sconn->smb2.credits_granted)
+	    && (sconn->smb2.credits.published.in_flight == in_flight)
+	    && (sconn->smb2.credits.published.async_pending ==
+		async_pending)
+	    && (sconn->smb2.credits.published.throttled ==
+		sconn->smb2.credits.throttled)
+	    && ((sconn->smb2.credits.published.num_requests ==
+		 sconn->smb2.credits.num_requests)
+		|| (timeval_elapsed2(&sconn->smb2.credits.published.time,
+				     now) < SMB2_CREDITS_PUBLISH_INTERVAL))) {
+		/*
+		 * The credit numbers did not change, the request count
+		 * and latency are republished on a coarser interval.
+		 */
+		return true;
+	}
+
+	ZERO_STRUCT(stats);
+	stats.pid = procid_self();
+	addr = tsocket_address_inet_addr_string(sconn->remote_address,
+						talloc_tos());
+	if (addr != NULL) {
+		fstrcpy(stats.addr, addr);
+		TALLOC_FREE(addr);
+	}
+	stats.dialect = sconn->smb2.dialect;
+	stats.max_credits = max;
+	stats.target = target;
+	stats.granted = sconn->smb2.credits_granted;
+	stats.in_flight = in_flight;
+	stats.async_pending = async_pending;
+	stats.avg_latency_usec = sconn->smb2.credits.avg_latency_usec;
+	stats.throttled = sconn->smb2.credits.throttled;
+	stats.num_requests = sconn->smb2.credits.num_requests;
+	stats.credits_total = sconn->smb2.credits.credits_total;
+
+	sconn->smb2.credits.published.stored = smb2_credits_store(&stats);
+	sconn->smb2.credits.published.target = stats.target;
+	sconn->smb2.credits.published.granted = stats.granted;
+	sconn->smb2.credits.published.in_flight = stats.in_flight;
+	sconn->smb2.credits.published.async_pending = stats.async_pending;
+	sconn->smb2.credits.published.throttled = stats.throttled;
+	sconn->smb2.credits.published.num_requests = stats.num_requests;
+	sconn->smb2.credits.published.time = *now;
+
+	return true;
+}
+
 static void smb2_set_operation_credit(struct smbd_server_connection *sconn,
 			const struct iovec *in_vector,
 			struct iovec *out_vector)
 {
 	uint8_t *outhdr = (uint8_t *)out_vector->iov_base;
 	uint16_t credits_requested = 0;
+	uint32_t credits_wanted;
+	uint32_t credits_available = 0;
 	uint16_t credits_granted = 0;
 
 	if (in_vector != NULL) {
@@ -451,10 +747,29 @@ static void smb2_set_operation_credit(struct smbd_server_connection *sconn,
 	}
 
 	SMB_ASSERT(sconn->smb2.max_credits >= sconn->smb2.credits_granted);
+	SMB_ASSERT(sconn->smb2.max_credits >= sconn->smb2.credits.target);
+
+	/*
+	 * The adaptive target may have dropped below what the client
+	 * already holds, then it only gets credits back as it uses
+	 * them up.
+	 */
+	if (sconn->smb2.credits.target > sconn->smb2.credits_granted) {
+		credits_available = sconn->smb2.credits.target -
+			sconn->smb2.credits_granted;
+	}
+
+	credits_wanted = credits_requested;
+	if (sconn->smb2.credits.healthy) {
+		/*
+		 * Nothing limits us right now, let the client
+		 * ramp up quicker than it asks for.
+		 */
+		credits_wanted *= 2;
+	}
 
 	/* Remember what we gave out. */
-	credits_granted = MIN(credits_requested, (sconn->smb2.max_credits -
-		sconn->smb2.credits_granted));
+	credits_granted = MIN(credits_wanted, credits_available);
 
 	if (credits_granted == 0 && sconn->smb2.credits_granted == 0) {
 		/* First negprot packet, or ensure the client credits can
@@ -464,12 +779,14 @@ static void smb2_set_operation_credit(struct smbd_server_connection *sconn,
 
 	SSVAL(outhdr, SMB2_HDR_CREDIT, credits_granted);
 	sconn->smb2.credits_granted += credits_granted;
+	sconn->smb2.credits.credits_total += credits_granted;
 
 	DEBUG(10,("smb2_set_operation_credit: requested %u, "
-		"granted %u, total granted %u\n",
+		"granted %u, total granted %u, target %u\n",
 		(unsigned int)credits_requested,
 		(unsigned int)credits_granted,
-		(unsigned int)sconn->smb2.credits_granted ));
+		(unsigned int)sconn->smb2.credits_granted,
+		(unsigned int)sconn->smb2.credits.target ));
 }
 
 static void smb2_calculate_credits(const struct smbd_smb2_request *inreq,
@@ -580,6 +897,10 @@ void smbd_server_connection_terminate_ex(struct smbd_server_connection *sconn,
 {
 	DEBUG(10,("smbd_server_connection_terminate_ex: reason[%s] at %s\n",
 		  reason, location));
+	DEBUG(10,("smbd_server_connection_terminate_ex: request cache "
+		  "hits[%llu] misses[%llu]\n",
+		  (unsigned long long)sconn->smb2.req_cache.hits,
+		  (unsigned long long)sconn->smb2.req_cache.misses));
 	exit_server_cleanly(reason);
 }
 
@@ -659,12 +980,11 @@ static struct smbd_smb2_request *dup_smb2_req(const struct smbd_smb2_request *re
 	int count = req->out.vector_count;
 	int i;
 
-	newreq = smbd_smb2_request_allocate(req->sconn);
+	newreq = smbd_smb2_request_allocate(req->sconn, req->sconn);
 	if (!newreq) {
 		return NULL;
 	}
 
-	newreq->sconn = req->sconn;
 	newreq->session = req->session;
 	newreq->do_signing = req->do_signing;
 	newreq->current_idx = req->current_idx;
@@ -710,7 +1030,8 @@ static struct smbd_smb2_request *dup_smb2_req(const struct smbd_smb2_request *re
 	return newreq;
 }
 
-static void smbd_smb2_request_writev_done(struct tevent_req *subreq);
+static void smbd_smb2_send_queue_reply(struct smbd_smb2_request *req);
+static NTSTATUS smbd_smb2_send_pending(struct smbd_server_connection *sconn);
 
 static NTSTATUS smb2_send_async_interim_response(const struct smbd_smb2_request *req)
 {
@@ -757,20 +1078,9 @@ static NTSTATUS smb2_send_async_interim_response(const struct smbd_smb2_request
 			(unsigned int)nreq->out.vector_count );
 		print_req_vectors(nreq);
 	}
-	nreq->subreq = tstream_writev_queue_send(nreq,
-					nreq->sconn->smb2.event_ctx,
-					nreq->sconn->smb2.stream,
-					nreq->sconn->smb2.send_queue,
-					nreq->out.vector,
-					nreq->out.vector_count);
 
-	if (nreq->subreq == NULL) {
-		return NT_STATUS_NO_MEMORY;
-	}
-
-	tevent_req_set_callback(nreq->subreq,
-			smbd_smb2_request_writev_done,
-			nreq);
+	/* nreq is freed once the batch it goes out in is written. */
+	smbd_smb2_send_queue_reply(nreq);
 
 	return NT_STATUS_OK;
 }
@@ -929,6 +1239,15 @@ NTSTATUS smbd_smb2_request_pending_queue(struct smbd_smb2_request *req,
 		}
 	}
 
+	/*
+	 * The interim response and any other queued replies
+	 * have to go out before the STATUS_PENDING packet.
+	 */
+	status = smbd_smb2_send_pending(req->sconn);
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
+	}
+
 	subreq = tstream_writev_queue_send(state,
 					req->sconn->smb2.event_ctx,
 					req->sconn->smb2.stream,
@@ -1071,6 +1390,121 @@ static NTSTATUS smbd_smb2_request_process_cancel(struct smbd_smb2_request *req)
 	return NT_STATUS_OK;
 }
 
+/*
+ * Return the number of payload bytes of a recvfile WRITE
+ * that are still waiting in the socket.
+ */
+size_t smbd_smb2_unread_bytes(struct smbd_smb2_request *req)
+{
+	int i = req->current_idx;
+
+	if (req->in.vector_count <= i + 2) {
+		return 0;
+	}
+
+	if (req->in.vector[i+2].iov_base != NULL) {
+		return 0;
+	}
+
+	return req->in.vector[i+2].iov_len;
+}
+
+/*
+ * Mark the recvfile payload as consumed.
+ */
+void smbd_smb2_clear_unread_bytes(struct smbd_smb2_request *req)
+{
+	int i = req->current_idx;
+
+	if (smbd_smb2_unread_bytes(req) == 0) {
+		return;
+	}
+
+	req->in.vector[i+2].iov_len = 0;
+}
+
+/*
+ * Throw away the payload of a recvfile WRITE we didn't
+ * process, so the socket is positioned at the next request.
+ */
+NTSTATUS smbd_smb2_request_drain_unread_bytes(struct smbd_smb2_request *req)
+{
+	size_t unread_bytes = smbd_smb2_unread_bytes(req);
+	int sock = req->sconn->sock;
+	int old_flags;
+	ssize_t ret;
+
+	if (unread_bytes == 0) {
+		return NT_STATUS_OK;
+	}
+
+	DEBUG(10,("smbd_smb2_request_drain_unread_bytes: draining %u bytes\n",
+		  (unsigned int)unread_bytes));
+
+	smbd_smb2_clear_unread_bytes(req);
+
+	/* drain_socket() needs a blocking socket. */
+	old_flags = fcntl(sock, F_GETFL, 0);
+	if (old_flags == -1 || set_blocking(sock, true) == -1) {
+		return map_nt_error_from_unix(errno);
+	}
+
+	ret = drain_socket(sock, unread_bytes);
+
+	if (fcntl(sock, F_SETFL, old_flags) == -1) {
+		return map_nt_error_from_unix(errno);
+	}
+
+	if (ret != unread_bytes) {
+		return NT_STATUS_IO_DEVICE_ERROR;
+	}
+
+	return NT_STATUS_OK;
+}
+
+/*
+ * Check that the CreditCharge of a READ, WRITE, IOCTL or
+ * QUERY_DIRECTORY request covers the payload size,
+ * one credit for each started 64k.
+ */
+NTSTATUS smbd_smb2_request_verify_creditcharge(struct smbd_smb2_request *req,
+					       uint32_t data_length)
+{
+	const uint8_t *inhdr;
+	int i = req->current_idx;
+	uint16_t credit_charge = 1;
+	uint32_t needed_charge;
+
+	inhdr = (const uint8_t *)req->in.vector[i].iov_base;
+
+	if (req->sconn->smb2.supports_multicredit) {
+		credit_charge = SVAL(inhdr, SMB2_HDR_CREDIT_CHARGE);
+		credit_charge = MAX(credit_charge, 1);
+	}
+
+	needed_charge = 1;
+	if (data_length > 0) {
+		needed_charge = ((data_length - 1) / 65536) + 1;
+	}
+
+	DEBUG(10, ("smbd_smb2_request_verify_creditcharge: mid %llu, "
+		   "CreditCharge %u, needed %u, length %u\n",
+		   (unsigned long long)BVAL(inhdr, SMB2_HDR_MESSAGE_ID),
+		   (unsigned int)credit_charge,
+		   (unsigned int)needed_charge,
+		   (unsigned int)data_length));
+
+	if (needed_charge > credit_charge) {
+		DEBUG(2, ("smbd_smb2_request_verify_creditcharge: "
+			  "CreditCharge too low, given %u, needed %u\n",
+			  (unsigned int)credit_charge,
+			  (unsigned int)needed_charge));
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+
+	return NT_STATUS_OK;
+}
+
 NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 {
 	const uint8_t *inhdr;
@@ -1140,17 +1574,15 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 	switch (opcode) {
 	case SMB2_OP_NEGPROT:
 		{
-			START_PROFILE(smb2_negprot);
+			DO_PROFILE_INC(smb2_negprot_count);
 			return_value = smbd_smb2_request_process_negprot(req);
-			END_PROFILE(smb2_negprot);
 		}
 		break;
 
 	case SMB2_OP_SESSSETUP:
 		{
-			START_PROFILE(smb2_sesssetup);
+			DO_PROFILE_INC(smb2_sesssetup_count);
 			return_value = smbd_smb2_request_process_sesssetup(req);
-			END_PROFILE(smb2_sesssetup);
 		}
 		break;
 
@@ -1161,9 +1593,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_logoff);
+			DO_PROFILE_INC(smb2_logoff_count);
 			return_value = smbd_smb2_request_process_logoff(req);
-			END_PROFILE(smb2_logoff);
 		}
 		break;
 
@@ -1174,9 +1605,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_tcon);
+			DO_PROFILE_INC(smb2_tcon_count);
 			return_value = smbd_smb2_request_process_tcon(req);
-			END_PROFILE(smb2_tcon);
 		}
 		break;
 
@@ -1192,9 +1622,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_tdis);
+			DO_PROFILE_INC(smb2_tdis_count);
 			return_value = smbd_smb2_request_process_tdis(req);
-			END_PROFILE(smb2_tdis);
 		}
 		break;
 
@@ -1210,9 +1639,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_create);
+			DO_PROFILE_INC(smb2_create_count);
 			return_value = smbd_smb2_request_process_create(req);
-			END_PROFILE(smb2_create);
 		}
 		break;
 
@@ -1228,9 +1656,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_close);
+			DO_PROFILE_INC(smb2_close_count);
 			return_value = smbd_smb2_request_process_close(req);
-			END_PROFILE(smb2_close);
 		}
 		break;
 
@@ -1246,9 +1673,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_flush);
+			DO_PROFILE_INC(smb2_flush_count);
 			return_value = smbd_smb2_request_process_flush(req);
-			END_PROFILE(smb2_flush);
 		}
 		break;
 
@@ -1264,9 +1690,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_read);
+			DO_PROFILE_INC(smb2_read_count);
 			return_value = smbd_smb2_request_process_read(req);
-			END_PROFILE(smb2_read);
 		}
 		break;
 
@@ -1282,9 +1707,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_write);
+			DO_PROFILE_INC(smb2_write_count);
 			return_value = smbd_smb2_request_process_write(req);
-			END_PROFILE(smb2_write);
 		}
 		break;
 
@@ -1308,9 +1732,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_lock);
+			DO_PROFILE_INC(smb2_lock_count);
 			return_value = smbd_smb2_request_process_lock(req);
-			END_PROFILE(smb2_lock);
 		}
 		break;
 
@@ -1326,24 +1749,21 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_ioctl);
+			DO_PROFILE_INC(smb2_ioctl_count);
 			return_value = smbd_smb2_request_process_ioctl(req);
-			END_PROFILE(smb2_ioctl);
 		}
 		break;
 
 	case SMB2_OP_CANCEL:
 		{
-			START_PROFILE(smb2_cancel);
+			DO_PROFILE_INC(smb2_cancel_count);
 			return_value = smbd_smb2_request_process_cancel(req);
-			END_PROFILE(smb2_cancel);
 		}
 		break;
 
 	case SMB2_OP_KEEPALIVE:
-		{START_PROFILE(smb2_keepalive);
-		return_value = smbd_smb2_request_process_keepalive(req);
-		END_PROFILE(smb2_keepalive);}
+		{DO_PROFILE_INC(smb2_keepalive_count);
+		return_value = smbd_smb2_request_process_keepalive(req);}
 		break;
 
 	case SMB2_OP_FIND:
@@ -1358,9 +1778,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_find);
+			DO_PROFILE_INC(smb2_find_count);
 			return_value = smbd_smb2_request_process_find(req);
-			END_PROFILE(smb2_find);
 		}
 		break;
 
@@ -1376,9 +1795,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_notify);
+			DO_PROFILE_INC(smb2_notify_count);
 			return_value = smbd_smb2_request_process_notify(req);
-			END_PROFILE(smb2_notify);
 		}
 		break;
 
@@ -1394,9 +1812,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_getinfo);
+			DO_PROFILE_INC(smb2_getinfo_count);
 			return_value = smbd_smb2_request_process_getinfo(req);
-			END_PROFILE(smb2_getinfo);
 		}
 		break;
 
@@ -1412,9 +1829,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_setinfo);
+			DO_PROFILE_INC(smb2_setinfo_count);
 			return_value = smbd_smb2_request_process_setinfo(req);
-			END_PROFILE(smb2_setinfo);
 		}
 		break;
 
@@ -1430,9 +1846,8 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 		}
 
 		{
-			START_PROFILE(smb2_break);
+			DO_PROFILE_INC(smb2_break_count);
 			return_value = smbd_smb2_request_process_break(req);
-			END_PROFILE(smb2_break);
 		}
 		break;
 
@@ -1443,13 +1858,340 @@ NTSTATUS smbd_smb2_request_dispatch(struct smbd_smb2_request *req)
 	return return_value;
 }
 
+/*
+ * Replies are not written one at a time: smbd_smb2_request_reply()
+ * puts them on sconn->smb2.send_pending and smbd_smb2_send_pending()
+ * merges everything that is ready into a single writev, within these
+ * limits. While complete requests are already waiting in the socket we
+ * don't flush at all: smbd_smb2_request_incoming() calls
+ * smbd_smb2_send_schedule() again after each request it has read, so
+ * the flush happens once the socket is drained and a pipelining
+ * client gets its replies in as few syscalls and packets as possible.
+ * A partial request doesn't hold back the replies, the rest of it may
+ * take a while to arrive.
+ */
+#define SMBD_SMB2_SEND_MAX_IOV 64
+#define SMBD_SMB2_SEND_MAX_BYTES (256*1024)
+
+struct smbd_smb2_send_batch_state {
+	struct smbd_server_connection *sconn;
+	struct smbd_smb2_request *reqs;
+	uint32_t num_reqs;
+};
+
+static void smbd_smb2_send_batch_done(struct tevent_req *subreq);
+
+static size_t smbd_smb2_iov_len(const struct iovec *vector, int count)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		len += vector[i].iov_len;
+	}
+	return len;
+}
+
+static bool smbd_smb2_is_sendfile_reply(struct smbd_smb2_request *req)
+{
+	/* I am a sick, sick man... :-). Sendfile hack ... JRA. */
+	if (req->out.vector_count == 4 &&
+			req->out.vector[3].iov_base == NULL &&
+			req->out.vector[3].iov_len != 0) {
+		/* Dynamic part is NULL. It's going to be sent
+		   via sendfile by the destructor of the request. */
+		return true;
+	}
+	return false;
+}
+
+static void smbd_smb2_send_cork(struct smbd_server_connection *sconn,
+				bool cork)
+{
+#ifdef TCP_CORK
+	int val = cork ? 1 : 0;
+	int ret;
+
+	if (sconn->smb2.send_pending.corked == cork) {
+		return;
+	}
+
+	ret = setsockopt(sconn->sock, IPPROTO_TCP, TCP_CORK,
+			 &val, sizeof(val));
+	if (ret == -1) {
+		DEBUG(10, ("smbd_smb2_send_cork: setsockopt(TCP_CORK, %d) "
+			   "failed: %s\n", val, strerror(errno)));
+		return;
+	}
+	sconn->smb2.send_pending.corked = cork;
+#endif
+}
+
+static bool smbd_smb2_send_should_defer(struct smbd_server_connection *sconn)
+{
+	size_t missing = sconn->smb2.send_pending.recv_missing;
+	uint8_t nbt_hdr[4];
+	int available = 0;
+	ssize_t nread;
+	int ret;
+
+	if (sconn->smb2.send_pending.num_iov >= SMBD_SMB2_SEND_MAX_IOV) {
+		return false;
+	}
+	if (sconn->smb2.send_pending.num_bytes >= SMBD_SMB2_SEND_MAX_BYTES) {
+		return false;
+	}
+
+	/*
+	 * Only wait if the client has already sent a complete request,
+	 * otherwise we'd just add latency. The read handler picks it
+	 * up, the socket is readable.
+	 */
+	ret = ioctl(sconn->sock, FIONREAD, &available);
+	if (ret == -1 || available <= 0) {
+		return false;
+	}
+
+	if (missing != 0) {
+		/* in the middle of a PDU, can we read all of it? */
+		return ((size_t)available >= missing);
+	}
+
+	nread = recv(sconn->sock, nbt_hdr, sizeof(nbt_hdr),
+		     MSG_PEEK|MSG_DONTWAIT);
+	if (nread != sizeof(nbt_hdr)) {
+		return false;
+	}
+	return ((size_t)available >= sizeof(nbt_hdr) + smb2_len(nbt_hdr));
+}
+
+static NTSTATUS smbd_smb2_send_pending(struct smbd_server_connection *sconn)
+{
+	struct smbd_smb2_request *req;
+
+	while (sconn->smb2.send_pending.list != NULL) {
+		struct smbd_smb2_send_batch_state *state;
+		struct tevent_req *subreq;
+		struct iovec *vector;
+		uint32_t count = 0;
+		size_t bytes = 0;
+		int i;
+
+		state = talloc_zero(sconn, struct smbd_smb2_send_batch_state);
+		if (state == NULL) {
+			return NT_STATUS_NO_MEMORY;
+		}
+		state->sconn = sconn;
+
+		vector = talloc_array(state, struct iovec,
+				      SMBD_SMB2_SEND_MAX_IOV);
+		if (vector == NULL) {
+			TALLOC_FREE(state);
+			return NT_STATUS_NO_MEMORY;
+		}
+
+		while ((req = sconn->smb2.send_pending.list) != NULL) {
+			int num_iov = req->out.vector_count;
+			size_t len = smbd_smb2_iov_len(req->out.vector, num_iov);
+			bool sendfile = smbd_smb2_is_sendfile_reply(req);
+
+			if (sendfile) {
+				/* Chop off the NULL dynamic part. */
+				num_iov -= 1;
+				len -= req->out.vector[3].iov_len;
+			}
+
+			if (state->num_reqs > 0 &&
+			    (count + num_iov > SMBD_SMB2_SEND_MAX_IOV ||
+			     bytes + len > SMBD_SMB2_SEND_MAX_BYTES)) {
+				break;
+			}
+
+			if (count + num_iov > SMBD_SMB2_SEND_MAX_IOV) {
+				/* a large compound reply on its own */
+				vector = talloc_realloc(state, vector,
+							struct iovec,
+							count + num_iov);
+				if (vector == NULL) {
+					TALLOC_FREE(state);
+					return NT_STATUS_NO_MEMORY;
+				}
+			}
+
+			for (i = 0; i < num_iov; i++) {
+				vector[count++] = req->out.vector[i];
+			}
+			bytes += len;
+
+			sconn->smb2.send_pending.num_iov -=
+				req->out.vector_count;
+			sconn->smb2.send_pending.num_bytes -=
+				smbd_smb2_iov_len(req->out.vector,
+						  req->out.vector_count);
+
+			DLIST_REMOVE(sconn->smb2.send_pending.list, req);
+			DLIST_ADD_END(state->reqs, req,
+				      struct smbd_smb2_request *);
+			state->num_reqs += 1;
+
+			if (sendfile) {
+				/*
+				 * The file data has to follow this
+				 * reply directly, end the batch here.
+				 */
+				break;
+			}
+		}
+
+		if (sconn->smb2.send_pending.list != NULL) {
+			/*
+			 * More than one writev in this round, don't
+			 * let the kernel push out partial segments
+			 * between them.
+			 */
+			smbd_smb2_send_cork(sconn, true);
+		}
+
+		DEBUG(10, ("smbd_smb2_send_pending: %u replies, "
+			   "%u vectors, %u bytes\n",
+			   (unsigned int)state->num_reqs,
+			   (unsigned int)count, (unsigned int)bytes));
+
+		subreq = tstream_writev_queue_send(state,
+						   sconn->smb2.event_ctx,
+						   sconn->smb2.stream,
+						   sconn->smb2.send_queue,
+						   vector,
+						   count);
+		if (subreq == NULL) {
+			TALLOC_FREE(state);
+			return NT_STATUS_NO_MEMORY;
+		}
+		tevent_req_set_callback(subreq, smbd_smb2_send_batch_done,
+					state);
+
+		sconn->smb2.send_pending.num_batches += 1;
+
+		DO_PROFILE_INC(smb2_send_batches);
+		DO_PROFILE_ADD(smb2_send_replies, state->num_reqs);
+	}
+
+	return NT_STATUS_OK;
+}
+
+static void smbd_smb2_send_pending_handler(struct tevent_context *ctx,
+					   struct tevent_immediate *im,
+					   void *private_data)
+{
+	struct smbd_server_connection *sconn = talloc_get_type_abort(
+		private_data, struct smbd_server_connection);
+	NTSTATUS status;
+
+	status = smbd_smb2_send_pending(sconn);
+	if (!NT_STATUS_IS_OK(status)) {
+		smbd_server_connection_terminate(sconn, nt_errstr(status));
+		return;
+	}
+}
+
+static void smbd_smb2_send_schedule(struct smbd_server_connection *sconn)
+{
+	if (sconn->smb2.send_pending.list == NULL) {
+		return;
+	}
+	if (smbd_smb2_send_should_defer(sconn)) {
+		return;
+	}
+	tevent_schedule_immediate(sconn->smb2.send_pending.im,
+				  sconn->smb2.event_ctx,
+				  smbd_smb2_send_pending_handler,
+				  sconn);
+}
+
+static void smbd_smb2_send_queue_reply(struct smbd_smb2_request *req)
+{
+	struct smbd_server_connection *sconn = req->sconn;
+
+	DLIST_ADD_END(sconn->smb2.send_pending.list, req,
+		      struct smbd_smb2_request *);
+	sconn->smb2.send_pending.num_iov += req->out.vector_count;
+	sconn->smb2.send_pending.num_bytes +=
+		smbd_smb2_iov_len(req->out.vector, req->out.vector_count);
+
+	smbd_smb2_send_schedule(sconn);
+}
+
+static void smbd_smb2_send_batch_done(struct tevent_req *subreq)
+{
+	struct smbd_smb2_send_batch_state *state = tevent_req_callback_data(
+		subreq, struct smbd_smb2_send_batch_state);
+	struct smbd_server_connection *sconn = state->sconn;
+	struct smbd_smb2_request *req;
+	int ret;
+	int sys_errno;
+
+	ret = tstream_writev_queue_recv(subreq, &sys_errno);
+	TALLOC_FREE(subreq);
+
+	/*
+	 * Free the requests in order, a sendfile reply
+	 * sends its data from the destructor.
+	 */
+	while ((req = state->reqs) != NULL) {
+		DLIST_REMOVE(state->reqs, req);
+		TALLOC_FREE(req);
+	}
+	TALLOC_FREE(state);
+
+	sconn->smb2.send_pending.num_batches -= 1;
+
+	if (ret == -1) {
+		NTSTATUS status = map_nt_error_from_unix(sys_errno);
+		DEBUG(2,("smbd_smb2_send_batch_done: client write error %s\n",
+			nt_errstr(status)));
+		smbd_server_connection_terminate(sconn, nt_errstr(status));
+		return;
+	}
+
+	if (sconn->smb2.send_pending.num_batches == 0 &&
+	    sconn->smb2.send_pending.list == NULL) {
+		smbd_smb2_send_cork(sconn, false);
+	}
+}
+
+/*
+ * The smb2_* profile values are counted when the request is
+ * dispatched, the time is taken when the reply goes out. That way
+ * the latency histograms also cover the async requests.
+ */
+static void smbd_smb2_request_profile(struct smbd_smb2_request *req, int i)
+{
+#ifdef WITH_PROFILE
+	const uint8_t *inhdr = (const uint8_t *)req->in.vector[i].iov_base;
+	uint16_t opcode = SVAL(inhdr, SMB2_HDR_OPCODE);
+	struct timeval now;
+	uint64_t usec;
+
+	if (!do_profile_times || opcode > SMB2_OP_BREAK) {
+		return;
+	}
+
+	GetTimeOfDay(&now);
+	usec = usec_time_diff(&now, &req->request_time);
+
+	/* the PR_VALUE_SMB2_* values are in opcode order */
+	DO_PROFILE_TIME(PR_VALUE_SMB2_NEGPROT + opcode, usec);
+#endif
+}
+
 static NTSTATUS smbd_smb2_request_reply(struct smbd_smb2_request *req)
 {
-	struct tevent_req *subreq;
 	int i = req->current_idx;
 
 	req->subreq = NULL;
 
+	smbd_smb2_request_profile(req, i);
+
 	req->current_idx += 3;
 
 	if (req->current_idx < req->out.vector_count) {
@@ -1494,31 +2236,16 @@ static NTSTATUS smbd_smb2_request_reply(struct smbd_smb2_request *req)
 		print_req_vectors(req);
 	}
 
-	/* I am a sick, sick man... :-). Sendfile hack ... JRA. */
-	if (req->out.vector_count == 4 &&
-			req->out.vector[3].iov_base == NULL &&
-			req->out.vector[3].iov_len != 0) {
-		/* Dynamic part is NULL. Chop it off,
-		   We're going to send it via sendfile. */
-		req->out.vector_count -= 1;
-	}
+	smbd_smb2_credits_account(req);
 
-	subreq = tstream_writev_queue_send(req,
-					   req->sconn->smb2.event_ctx,
-					   req->sconn->smb2.stream,
-					   req->sconn->smb2.send_queue,
-					   req->out.vector,
-					   req->out.vector_count);
-	if (subreq == NULL) {
-		return NT_STATUS_NO_MEMORY;
-	}
-	tevent_req_set_callback(subreq, smbd_smb2_request_writev_done, req);
 	/*
 	 * We're done with this request -
 	 * move it off the "being processed" queue.
 	 */
 	DLIST_REMOVE(req->sconn->smb2.requests, req);
 
+	smbd_smb2_send_queue_reply(req);
+
 	return NT_STATUS_OK;
 }
 
@@ -1546,26 +2273,6 @@ void smbd_smb2_request_dispatch_immediate(struct tevent_context *ctx,
 	}
 }
 
-static void smbd_smb2_request_writev_done(struct tevent_req *subreq)
-{
-	struct smbd_smb2_request *req = tevent_req_callback_data(subreq,
-					struct smbd_smb2_request);
-	struct smbd_server_connection *sconn = req->sconn;
-	int ret;
-	int sys_errno;
-
-	ret = tstream_writev_queue_recv(subreq, &sys_errno);
-	TALLOC_FREE(subreq);
-	TALLOC_FREE(req);
-	if (ret == -1) {
-		NTSTATUS status = map_nt_error_from_unix(sys_errno);
-		DEBUG(2,("smbd_smb2_request_writev_done: client write error %s\n",
-			nt_errstr(status)));
-		smbd_server_connection_terminate(sconn, nt_errstr(status));
-		return;
-	}
-}
-
 NTSTATUS smbd_smb2_request_done_ex(struct smbd_smb2_request *req,
 				   NTSTATUS status,
 				   DATA_BLOB body, DATA_BLOB *dyn,
@@ -1679,6 +2386,16 @@ NTSTATUS smbd_smb2_request_error_ex(struct smbd_smb2_request *req,
 		  i, nt_errstr(status), info ? " +info" : "",
 		  location));
 
+	if (smbd_smb2_unread_bytes(req) > 0) {
+		/* Recvfile error. Drain incoming socket. */
+		NTSTATUS drain_status;
+
+		drain_status = smbd_smb2_request_drain_unread_bytes(req);
+		if (!NT_STATUS_IS_OK(drain_status)) {
+			return drain_status;
+		}
+	}
+
 	body.data = outhdr + SMB2_HDR_BODY;
 	body.length = 8;
 	SSVAL(body.data, 0, 9);
@@ -1714,21 +2431,20 @@ NTSTATUS smbd_smb2_request_error_ex(struct smbd_smb2_request *req,
 
 struct smbd_smb2_send_oplock_break_state {
 	struct smbd_server_connection *sconn;
-	uint8_t buf[4 + SMB2_HDR_BODY + 0x18];
+	uint8_t buf[4 + SMB2_HDR_BODY + 0x2C];
 	struct iovec vector;
 };
 
 static void smbd_smb2_oplock_break_writev_done(struct tevent_req *subreq);
 
-NTSTATUS smbd_smb2_send_oplock_break(struct smbd_server_connection *sconn,
-				     uint64_t file_id_persistent,
-				     uint64_t file_id_volatile,
-				     uint8_t oplock_level)
+static NTSTATUS smbd_smb2_send_break(struct smbd_server_connection *sconn,
+				     const uint8_t *body,
+				     size_t body_len)
 {
 	struct smbd_smb2_send_oplock_break_state *state;
 	struct tevent_req *subreq;
 	uint8_t *hdr;
-	uint8_t *body;
+	NTSTATUS status;
 
 	state = talloc(sconn, struct smbd_smb2_send_oplock_break_state);
 	if (state == NULL) {
@@ -1736,12 +2452,13 @@ NTSTATUS smbd_smb2_send_oplock_break(struct smbd_server_connection *sconn,
 	}
 	state->sconn = sconn;
 
+	SMB_ASSERT(body_len <= sizeof(state->buf) - 4 - SMB2_HDR_BODY);
+
 	state->vector.iov_base = (void *)state->buf;
-	state->vector.iov_len = sizeof(state->buf);
+	state->vector.iov_len = 4 + SMB2_HDR_BODY + body_len;
 
-	_smb2_setlen(state->buf, sizeof(state->buf) - 4);
+	_smb2_setlen(state->buf, state->vector.iov_len - 4);
 	hdr = state->buf + 4;
-	body = hdr + SMB2_HDR_BODY;
 
 	SIVAL(hdr, 0,				SMB2_MAGIC);
 	SSVAL(hdr, SMB2_HDR_LENGTH,		SMB2_HDR_BODY);
@@ -1757,13 +2474,14 @@ NTSTATUS smbd_smb2_send_oplock_break(struct smbd_server_connection *sconn,
 	SBVAL(hdr, SMB2_HDR_SESSION_ID,		0);
 	memset(hdr+SMB2_HDR_SIGNATURE, 0, 16);
 
-	SSVAL(body, 0x00, 0x18);
+	memcpy(hdr + SMB2_HDR_BODY, body, body_len);
 
-	SCVAL(body, 0x02, oplock_level);
-	SCVAL(body, 0x03, 0);		/* reserved */
-	SIVAL(body, 0x04, 0);		/* reserved */
-	SBVAL(body, 0x08, file_id_persistent);
-	SBVAL(body, 0x10, file_id_volatile);
+	/* Don't let the break overtake replies still queued. */
+	status = smbd_smb2_send_pending(sconn);
+	if (!NT_STATUS_IS_OK(status)) {
+		TALLOC_FREE(state);
+		return status;
+	}
 
 	subreq = tstream_writev_queue_send(state,
 					   sconn->smb2.event_ctx,
@@ -1780,6 +2498,47 @@ NTSTATUS smbd_smb2_send_oplock_break(struct smbd_server_connection *sconn,
 	return NT_STATUS_OK;
 }
 
+NTSTATUS smbd_smb2_send_oplock_break(struct smbd_server_connection *sconn,
+				     uint64_t file_id_persistent,
+				     uint64_t file_id_volatile,
+				     uint8_t oplock_level)
+{
+	uint8_t body[0x18];
+
+	SSVAL(body, 0x00, sizeof(body));
+
+	SCVAL(body, 0x02, oplock_level);
+	SCVAL(body, 0x03, 0);		/* reserved */
+	SIVAL(body, 0x04, 0);		/* reserved */
+	SBVAL(body, 0x08, file_id_persistent);
+	SBVAL(body, 0x10, file_id_volatile);
+
+	return smbd_smb2_send_break(sconn, body, sizeof(body));
+}
+
+NTSTATUS smbd_smb2_send_lease_break(struct smbd_server_connection *sconn,
+				    uint32_t flags,
+				    const struct smb2_lease_key *lease_key,
+				    uint32_t current_lease_state,
+				    uint32_t new_lease_state)
+{
+	uint8_t body[0x2C];
+
+	SSVAL(body, 0x00, sizeof(body));
+
+	SSVAL(body, 0x02, 0);		/* new epoch */
+	SIVAL(body, 0x04, flags);
+	SBVAL(body, 0x08, lease_key->data[0]);
+	SBVAL(body, 0x10, lease_key->data[1]);
+	SIVAL(body, 0x18, current_lease_state);
+	SIVAL(body, 0x1C, new_lease_state);
+	SIVAL(body, 0x20, 0);		/* break reason */
+	SIVAL(body, 0x24, 0);		/* access mask hint */
+	SIVAL(body, 0x28, 0);		/* share mask hint */
+
+	return smbd_smb2_send_break(sconn, body, sizeof(body));
+}
+
 static void smbd_smb2_oplock_break_writev_done(struct tevent_req *subreq)
 {
 	struct smbd_smb2_send_oplock_break_state *state =
@@ -1806,6 +2565,84 @@ struct smbd_smb2_request_read_state {
 	struct smbd_smb2_request *smb2_req;
 };
 
+/*
+ * Check if the SMB2 header we just got belongs to a
+ * WRITE request whose payload can be left in the socket
+ * and later be transferred directly into the file via
+ * SMB_VFS_RECVFILE(). This is only possible for a single,
+ * unsigned, non-compounded WRITE on a disk share.
+ */
+static bool is_smb2_recvfile_write(struct smbd_server_connection *sconn,
+				   const uint8_t *hdr,
+				   size_t dyn_size)
+{
+	size_t min_recv_size = lp_min_receive_file_size();
+	uint32_t flags;
+	uint64_t vuid;
+	uint32_t tid;
+	void *p;
+	struct smbd_smb2_session *session;
+	struct smbd_smb2_tcon *tcon;
+	connection_struct *conn;
+
+	if (min_recv_size == 0) {
+		/* recvfile is disabled */
+		return false;
+	}
+
+	if (dyn_size < min_recv_size) {
+		return false;
+	}
+
+	if (SVAL(hdr, SMB2_HDR_OPCODE) != SMB2_OP_WRITE) {
+		return false;
+	}
+
+	flags = IVAL(hdr, SMB2_HDR_FLAGS);
+	if (flags & (SMB2_HDR_FLAG_ASYNC |
+		     SMB2_HDR_FLAG_CHAINED |
+		     SMB2_HDR_FLAG_SIGNED)) {
+		/* we need the whole payload to check the signature */
+		return false;
+	}
+
+	if (IVAL(hdr, SMB2_HDR_NEXT_COMMAND) != 0) {
+		return false;
+	}
+
+	vuid = BVAL(hdr, SMB2_HDR_SESSION_ID);
+	if (vuid > sconn->smb2.sessions.limit) {
+		return false;
+	}
+	p = idr_find(sconn->smb2.sessions.idtree, vuid);
+	if (p == NULL) {
+		return false;
+	}
+	session = talloc_get_type_abort(p, struct smbd_smb2_session);
+	if (!NT_STATUS_IS_OK(session->status) || session->do_signing) {
+		return false;
+	}
+
+	tid = IVAL(hdr, SMB2_HDR_TID);
+	if (tid > session->tcons.limit) {
+		return false;
+	}
+	p = idr_find(session->tcons.idtree, tid);
+	if (p == NULL) {
+		return false;
+	}
+	tcon = talloc_get_type_abort(p, struct smbd_smb2_tcon);
+	conn = tcon->compat_conn;
+	if (conn == NULL || IS_IPC(conn) || IS_PRINT(conn)) {
+		return false;
+	}
+
+	DEBUG(10,("is_smb2_recvfile_write: true, dyn_size = %u\n",
+		  (unsigned int)dyn_size));
+
+	return true;
+}
+
 static int smbd_smb2_request_next_vector(struct tstream_context *stream,
 					 void *private_data,
 					 TALLOC_CTX *mem_ctx,
@@ -1829,11 +2666,10 @@ static struct tevent_req *smbd_smb2_request_read_send(TALLOC_CTX *mem_ctx,
 	state->missing = 0;
 	state->asked_for_header = false;
 
-	state->smb2_req = smbd_smb2_request_allocate(state);
+	state->smb2_req = smbd_smb2_request_allocate(state, sconn);
 	if (tevent_req_nomem(state->smb2_req, req)) {
 		return tevent_req_post(req, ev);
 	}
-	state->smb2_req->sconn = sconn;
 
 	subreq = tstream_readv_pdu_queue_send(state, ev, sconn->smb2.stream,
 					      sconn->smb2.recv_queue,
@@ -1866,6 +2702,8 @@ static int smbd_smb2_request_next_vector(struct tstream_context *stream,
 		/*
 		 * first we need to get the NBT header
 		 */
+		req->sconn->smb2.send_pending.recv_missing = 0;
+
 		req->in.vector = talloc_array(req, struct iovec,
 					      req->in.vector_count + 1);
 		if (req->in.vector == NULL) {
@@ -1893,6 +2731,7 @@ static int smbd_smb2_request_next_vector(struct tstream_context *stream,
 		 * Now we analyze the NBT header
 		 */
 		state->missing = smb2_len(req->in.vector[0].iov_base);
+		req->sconn->smb2.send_pending.recv_missing = state->missing;
 
 		if (state->missing == 0) {
 			/* if there're no remaining bytes, we're done */
@@ -1956,6 +2795,7 @@ static int smbd_smb2_request_next_vector(struct tstream_context *stream,
 
 	if (state->missing == 0) {
 		/* if there're no remaining bytes, we're done */
+		req->sconn->smb2.send_pending.recv_missing = 0;
 		*_vector = NULL;
 		*_count = 0;
 		return 0;
@@ -2045,6 +2885,39 @@ static int smbd_smb2_request_next_vector(struct tstream_context *stream,
 
 		state->missing -= (body_size - 2) + dyn_size;
 
+		if (!invalid && idx == 2 && state->missing == 0 &&
+		    is_smb2_recvfile_write(req->sconn, hdr, dyn_size)) {
+			/*
+			 * Only read the fixed body and leave the
+			 * payload in the socket. The NULL iov_base
+			 * of the dynamic part marks the unread bytes,
+			 * they're consumed by the WRITE or drained
+			 * on error before we read the next request.
+			 */
+			body = talloc_array(req->in.vector, uint8_t, body_size);
+			if (body == NULL) {
+				return -1;
+			}
+
+			req->in.vector[idx].iov_base	= (void *)body;
+			req->in.vector[idx].iov_len	= body_size;
+			req->in.vector[idx+1].iov_base	= NULL;
+			req->in.vector[idx+1].iov_len	= dyn_size;
+
+			vector = talloc_array(mem_ctx, struct iovec, 1);
+			if (vector == NULL) {
+				return -1;
+			}
+
+			memcpy(body, hdr + SMB2_HDR_BODY, 2);
+			vector[0].iov_base = body + 2;
+			vector[0].iov_len = body_size - 2;
+
+			*_vector = vector;
+			*_count = 1;
+			return 0;
+		}
+
 		body = talloc_array(req->in.vector, uint8_t, body_size);
 		if (body == NULL) {
 			return -1;
@@ -2237,6 +3110,7 @@ static void smbd_smb2_request_incoming(struct tevent_req *subreq)
 	}
 
 	req->current_idx = 1;
+	GetTimeOfDay(&req->request_time);
 
 	DEBUG(10,("smbd_smb2_request_incoming: idx[%d] of %d vectors\n",
 		 req->current_idx, req->in.vector_count));
@@ -2260,6 +3134,9 @@ static void smbd_smb2_request_incoming(struct tevent_req *subreq)
 	}
 
 next:
+	/* flush the replies if there's nothing more to read right now */
+	smbd_smb2_send_schedule(sconn);
+
 	/* ask for the next request (this constructs the main loop) */
 	subreq = smbd_smb2_request_read_send(sconn, sconn->smb2.event_ctx, sconn);
 	if (subreq == NULL) {
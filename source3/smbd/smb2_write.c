@@ -53,6 +53,7 @@ NTSTATUS smbd_smb2_request_process_write(struct smbd_smb2_request *req)
 	uint64_t in_file_id_volatile;
 	uint32_t in_flags;
 	struct tevent_req *subreq;
+	NTSTATUS status;
 
 	inhdr = (const uint8_t *)req->in.vector[i+0].iov_base;
 	if (req->in.vector[i+1].iov_len != (expected_body_size & 0xFFFFFFFE)) {
@@ -83,17 +84,29 @@ NTSTATUS smbd_smb2_request_process_write(struct smbd_smb2_request *req)
 		return smbd_smb2_request_error(req, NT_STATUS_INVALID_PARAMETER);
 	}
 
+	if (smbd_smb2_unread_bytes(req) > 0 &&
+	    in_data_length != smbd_smb2_unread_bytes(req)) {
+		/* recvfile needs to consume the whole payload */
+		return smbd_smb2_request_error(req, NT_STATUS_INVALID_PARAMETER);
+	}
+
 	/* check the max write size */
-	if (in_data_length > lp_smb2_max_write()) {
+	if (in_data_length > req->sconn->smb2.max_write) {
 		/* This is a warning. */
 		DEBUG(2,("smbd_smb2_request_process_write : "
 			"client ignored max write :%s: 0x%08X: 0x%08X\n",
-			__location__, in_data_length, lp_smb2_max_write()));
+			__location__, in_data_length,
+			req->sconn->smb2.max_write));
 #if 0
 		return smbd_smb2_request_error(req, NT_STATUS_INVALID_PARAMETER);
 #endif
 	}
 
+	status = smbd_smb2_request_verify_creditcharge(req, in_data_length);
+	if (!NT_STATUS_IS_OK(status)) {
+		return smbd_smb2_request_error(req, status);
+	}
+
 	in_data_buffer.data = (uint8_t *)req->in.vector[i+2].iov_base;
 	in_data_buffer.length = in_data_length;
 
@@ -111,6 +124,17 @@ NTSTATUS smbd_smb2_request_process_write(struct smbd_smb2_request *req)
 				      in_data_buffer,
 				      in_offset,
 				      in_flags);
+
+	/*
+	 * The payload of a recvfile write must be gone from the
+	 * socket before we return and read the next request.
+	 */
+	status = smbd_smb2_request_drain_unread_bytes(req);
+	if (!NT_STATUS_IS_OK(status)) {
+		TALLOC_FREE(subreq);
+		return status;
+	}
+
 	if (subreq == NULL) {
 		return smbd_smb2_request_error(req, NT_STATUS_NO_MEMORY);
 	}
@@ -278,6 +302,12 @@ static struct tevent_req *smbd_smb2_write_send(TALLOC_CTX *mem_ctx,
 	if (IS_IPC(smbreq->conn)) {
 		struct tevent_req *subreq = NULL;
 
+		if (in_data.data == NULL) {
+			/* no recvfile on IPC$ */
+			tevent_req_nterror(req, NT_STATUS_INTERNAL_ERROR);
+			return tevent_req_post(req, ev);
+		}
+
 		if (!fsp_is_np(fsp)) {
 			tevent_req_nterror(req, NT_STATUS_FILE_CLOSED);
 			return tevent_req_post(req, ev);
@@ -301,13 +331,22 @@ static struct tevent_req *smbd_smb2_write_send(TALLOC_CTX *mem_ctx,
 		return tevent_req_post(req, ev);
 	}
 
-	/* Try and do an asynchronous write. */
-	status = schedule_aio_smb2_write(conn,
-					smbreq,
-					fsp,
-					in_offset,
-					in_data,
-					state->write_through);
+	if (in_data.data == NULL) {
+		/*
+		 * The data is still in the socket, let write_file()
+		 * pass it to SMB_VFS_RECVFILE().
+		 */
+		smbreq->unread_bytes = in_data.length;
+		status = NT_STATUS_RETRY;
+	} else {
+		/* Try and do an asynchronous write. */
+		status = schedule_aio_smb2_write(conn,
+						smbreq,
+						fsp,
+						in_offset,
+						in_data,
+						state->write_through);
+	}
 
 	if (NT_STATUS_IS_OK(status)) {
 		/*
@@ -346,6 +385,12 @@ static struct tevent_req *smbd_smb2_write_send(TALLOC_CTX *mem_ctx,
 			      in_offset,
 			      in_data.length);
 
+	if (smbreq->unread_bytes == 0) {
+		/* SMB_VFS_RECVFILE() consumed the payload */
+		smbd_smb2_clear_unread_bytes(smb2req);
+	}
+	smbreq->unread_bytes = 0;
+
 	status = smb2_write_complete(req, nwritten, errno);
 
 	SMB_VFS_STRICT_UNLOCK(conn, fsp, &lock);
@@ -21,11 +21,13 @@
 */
 
 #include "includes.h"
+#include "system/filesys.h"
 #include "memcache.h"
 #include "smbd/smbd.h"
 #include "messages.h"
 #include "smbprofile.h"
 #include "tdb_compat.h"
+#include "util_tdb.h"
 
 /****************************************************************************
  Stat cache code used in unix_convert.
@@ -397,6 +399,366 @@ bool reset_stat_cache( void )
 		return True;
 
 	memcache_flush(smbd_memcache(), STAT_CACHE);
+	dirname_index_flush();
 
 	return True;
 }
+
+/****************************************************************************
+ Case insensitive directory name index used by get_real_filename().
+
+ When a case insensitive lookup misses, we would have to read the whole
+ directory and compare every entry. For large directories we instead
+ keep a hash table of the upper cased names, keyed by the file_id of the
+ directory and the share. An index is only valid as long as the mtime of
+ the directory is unchanged, changes made by this smbd also remove it via
+ notify_fname().
+
+ The index is stored as one flat blob in its own memcache, so that its
+ size is accounted for and the least recently used directories are
+ dropped once "smbd:dirname index cache size" (in KB) is exceeded.
+*****************************************************************************/
+
+#define DIRNAME_INDEX_KEY_SIZE	28
+
+#define DIRNAME_INDEX_HDR_MTIME_SEC	0
+#define DIRNAME_INDEX_HDR_MTIME_NSEC	8
+#define DIRNAME_INDEX_HDR_NUM_ENTRIES	12
+#define DIRNAME_INDEX_HDR_NUM_BUCKETS	16
+#define DIRNAME_INDEX_HDR_SIZE		20
+
+/* hash, next entry + 1, offset of the upper cased name */
+#define DIRNAME_INDEX_ENTRY_SIZE	12
+
+static struct memcache *dirname_index_cache;
+
+static struct memcache *dirname_index_memcache(void)
+{
+	int size;
+
+	if (dirname_index_cache != NULL) {
+		return dirname_index_cache;
+	}
+	if (!lp_stat_cache()) {
+		return NULL;
+	}
+	size = lp_parm_int(-1, "smbd", "dirname index cache size", 16384);
+	if (size <= 0) {
+		return NULL;
+	}
+	dirname_index_cache = memcache_init(NULL, (size_t)size * 1024);
+	return dirname_index_cache;
+}
+
+static void dirname_index_key(connection_struct *conn,
+			      const struct file_id *id,
+			      uint8_t key[DIRNAME_INDEX_KEY_SIZE])
+{
+	SBVAL(key, 0, id->devid);
+	SBVAL(key, 8, id->inode);
+	SBVAL(key, 16, id->extid);
+	SIVAL(key, 24, SNUM(conn));
+}
+
+static uint32_t dirname_index_hash(const char *folded)
+{
+	TDB_DATA key = string_tdb_data(folded);
+	return fast_string_hash(&key);
+}
+
+/*
+ * Search a valid index blob for the upper cased name. Returns the
+ * real name as stored in the directory or NULL.
+ */
+
+static const char *dirname_index_search(DATA_BLOB blob, const char *folded)
+{
+	uint32_t num_entries = IVAL(blob.data, DIRNAME_INDEX_HDR_NUM_ENTRIES);
+	uint32_t num_buckets = IVAL(blob.data, DIRNAME_INDEX_HDR_NUM_BUCKETS);
+	const uint8_t *buckets = blob.data + DIRNAME_INDEX_HDR_SIZE;
+	const uint8_t *entries = buckets + num_buckets * 4;
+	const char *strings = (const char *)(entries +
+				num_entries * DIRNAME_INDEX_ENTRY_SIZE);
+	uint32_t hash = dirname_index_hash(folded);
+	uint32_t idx;
+
+	idx = IVAL(buckets, (hash & (num_buckets - 1)) * 4);
+
+	while (idx != 0) {
+		const uint8_t *e = entries + (idx-1) * DIRNAME_INDEX_ENTRY_SIZE;
+		const char *efolded = strings + IVAL(e, 8);
+
+		if ((IVAL(e, 0) == hash) && (strcmp(efolded, folded) == 0)) {
+			/* the real name follows the upper cased one */
+			return efolded + strlen(efolded) + 1;
+		}
+		idx = IVAL(e, 4);
+	}
+	return NULL;
+}
+
+struct dirname_index_name {
+	const char *name;
+	const char *folded;
+	uint32_t hash;
+};
+
+static void dirname_index_store(const uint8_t key[DIRNAME_INDEX_KEY_SIZE],
+				const struct timespec *mtime,
+				const struct dirname_index_name *names,
+				uint32_t num_names)
+{
+	struct memcache *cache = dirname_index_memcache();
+	uint32_t num_buckets = 16;
+	size_t strings_size = 0;
+	size_t size, ofs;
+	uint8_t *buf, *buckets, *entries;
+	char *strings;
+	uint32_t i;
+
+	while (num_buckets < num_names) {
+		num_buckets <<= 1;
+	}
+
+	for (i=0; i<num_names; i++) {
+		strings_size += strlen(names[i].folded) + 1;
+		strings_size += strlen(names[i].name) + 1;
+	}
+
+	size = DIRNAME_INDEX_HDR_SIZE + num_buckets * 4 +
+		num_names * DIRNAME_INDEX_ENTRY_SIZE + strings_size;
+
+	if (size > (size_t)lp_parm_int(-1, "smbd", "dirname index cache size",
+				       16384) * 1024 / 2) {
+		DEBUG(5, ("dirname_index_store: index of %u names too large\n",
+			  (unsigned)num_names));
+		return;
+	}
+
+	buf = talloc_zero_array(talloc_tos(), uint8_t, size);
+	if (buf == NULL) {
+		return;
+	}
+
+	SBVAL(buf, DIRNAME_INDEX_HDR_MTIME_SEC, mtime->tv_sec);
+	SIVAL(buf, DIRNAME_INDEX_HDR_MTIME_NSEC, mtime->tv_nsec);
+	SIVAL(buf, DIRNAME_INDEX_HDR_NUM_ENTRIES, num_names);
+	SIVAL(buf, DIRNAME_INDEX_HDR_NUM_BUCKETS, num_buckets);
+
+	buckets = buf + DIRNAME_INDEX_HDR_SIZE;
+	entries = buckets + num_buckets * 4;
+	strings = (char *)(entries + num_names * DIRNAME_INDEX_ENTRY_SIZE);
+
+	ofs = 0;
+	for (i=0; i<num_names; i++) {
+		uint8_t *e = entries + i * DIRNAME_INDEX_ENTRY_SIZE;
+		uint32_t b = names[i].hash & (num_buckets - 1);
+		size_t len;
+
+		SIVAL(e, 0, names[i].hash);
+		SIVAL(e, 4, IVAL(buckets, b * 4));
+		SIVAL(e, 8, ofs);
+		SIVAL(buckets, b * 4, i + 1);
+
+		len = strlen(names[i].folded) + 1;
+		memcpy(strings + ofs, names[i].folded, len);
+		ofs += len;
+		len = strlen(names[i].name) + 1;
+		memcpy(strings + ofs, names[i].name, len);
+		ofs += len;
+	}
+
+	memcache_add(cache, DIRNAME_INDEX_CACHE,
+		     data_blob_const(key, DIRNAME_INDEX_KEY_SIZE),
+		     data_blob_const(buf, size));
+	TALLOC_FREE(buf);
+}
+
+/*
+ * Read the whole directory, looking for "folded" and collecting the
+ * names for a new index on the way.
+ */
+
+static bool dirname_index_build(connection_struct *conn, const char *path,
+				const uint8_t key[DIRNAME_INDEX_KEY_SIZE],
+				const struct timespec *mtime,
+				const char *folded, TALLOC_CTX *mem_ctx,
+				char **found_name)
+{
+	TALLOC_CTX *frame = talloc_stackframe();
+	struct dirname_index_name *names = NULL;
+	uint32_t num_names = 0;
+	struct smb_Dir *cur_dir;
+	const char *dname;
+	char *talloced = NULL;
+	struct timespec now;
+	long curpos = 0;
+	int min_entries;
+
+	cur_dir = OpenDir(frame, conn, path, NULL, 0);
+	if (cur_dir == NULL) {
+		DEBUG(3, ("dirname_index_build: can't open dir [%s]\n", path));
+		TALLOC_FREE(frame);
+		return false;
+	}
+
+	*found_name = NULL;
+
+	while ((dname = ReadDirName(cur_dir, &curpos, NULL, &talloced))) {
+		struct dirname_index_name *tmp;
+		char *name, *fname;
+
+		if (ISDOT(dname) || ISDOTDOT(dname)) {
+			TALLOC_FREE(talloced);
+			continue;
+		}
+
+		name = talloc_strdup(frame, dname);
+		fname = talloc_strdup_upper(frame, dname);
+		TALLOC_FREE(talloced);
+		if ((name == NULL) || (fname == NULL)) {
+			goto nomem;
+		}
+
+		if ((*found_name == NULL) && (strcmp(fname, folded) == 0)) {
+			*found_name = talloc_strdup(mem_ctx, name);
+			if (*found_name == NULL) {
+				goto nomem;
+			}
+		}
+
+		if ((num_names % 1024) == 0) {
+			tmp = talloc_realloc(frame, names,
+					     struct dirname_index_name,
+					     num_names + 1024);
+			if (tmp == NULL) {
+				goto nomem;
+			}
+			names = tmp;
+		}
+		names[num_names].name = name;
+		names[num_names].folded = fname;
+		names[num_names].hash = dirname_index_hash(fname);
+		num_names += 1;
+	}
+
+	min_entries = lp_parm_int(-1, "smbd", "dirname index min entries",
+				  256);
+
+	/*
+	 * A directory modified within the granularity of its mtime
+	 * could change again without the mtime changing, so don't
+	 * trust an index for it yet.
+	 */
+	now = timespec_current();
+
+	if ((num_names >= min_entries) && (mtime->tv_sec + 2 < now.tv_sec)) {
+		dirname_index_store(key, mtime, names, num_names);
+	}
+
+	TALLOC_FREE(frame);
+	return true;
+
+nomem:
+	TALLOC_FREE(*found_name);
+	TALLOC_FREE(frame);
+	return false;
+}
+
+/**
+ * Find a name in a directory without regard to case.
+ *
+ * @param path		The directory, relative to the share
+ * @param name		The (non-mangled) name to look for
+ * @param found_name	The real name if found, NULL otherwise
+ *
+ * @return false if the index can't be used, the caller has to scan
+ *	   the directory itself then.
+ */
+
+bool dirname_index_lookup(connection_struct *conn, const char *path,
+			  const char *name, TALLOC_CTX *mem_ctx,
+			  char **found_name)
+{
+	struct memcache *cache = dirname_index_memcache();
+	struct smb_filename smb_dname;
+	uint8_t key[DIRNAME_INDEX_KEY_SIZE];
+	struct file_id id;
+	DATA_BLOB blob;
+	char *folded;
+	bool ret;
+
+	if (cache == NULL) {
+		return false;
+	}
+
+	ZERO_STRUCT(smb_dname);
+	smb_dname.base_name = discard_const_p(char, path);
+
+	if (SMB_VFS_STAT(conn, &smb_dname) != 0) {
+		return false;
+	}
+	if (!S_ISDIR(smb_dname.st.st_ex_mode)) {
+		return false;
+	}
+
+	folded = talloc_strdup_upper(talloc_tos(), name);
+	if (folded == NULL) {
+		return false;
+	}
+
+	id = SMB_VFS_FILE_ID_CREATE(conn, &smb_dname.st);
+	dirname_index_key(conn, &id, key);
+
+	if (memcache_lookup(cache, DIRNAME_INDEX_CACHE,
+			    data_blob_const(key, sizeof(key)), &blob)) {
+		if ((BVAL(blob.data, DIRNAME_INDEX_HDR_MTIME_SEC) ==
+		     smb_dname.st.st_ex_mtime.tv_sec) &&
+		    (IVAL(blob.data, DIRNAME_INDEX_HDR_MTIME_NSEC) ==
+		     smb_dname.st.st_ex_mtime.tv_nsec)) {
+			const char *real = dirname_index_search(blob, folded);
+
+			DEBUG(10, ("dirname_index_lookup: %s in [%s]: %s\n",
+				   name, path, real ? real : "not found"));
+
+			TALLOC_FREE(folded);
+			*found_name = NULL;
+			if (real == NULL) {
+				return true;
+			}
+			*found_name = talloc_strdup(mem_ctx, real);
+			return (*found_name != NULL);
+		}
+		memcache_delete(cache, DIRNAME_INDEX_CACHE,
+				data_blob_const(key, sizeof(key)));
+	}
+
+	ret = dirname_index_build(conn, path, key, &smb_dname.st.st_ex_mtime,
+				  folded, mem_ctx, found_name);
+	TALLOC_FREE(folded);
+	return ret;
+}
+
+/***************************************************************************
+ Forget the index of a directory we changed ourselves.
+**************************************************************************/
+
+void dirname_index_delete(connection_struct *conn, const struct file_id *id)
+{
+	uint8_t key[DIRNAME_INDEX_KEY_SIZE];
+
+	if (dirname_index_cache == NULL) {
+		return;
+	}
+	dirname_index_key(conn, id, key);
+	memcache_delete(dirname_index_cache, DIRNAME_INDEX_CACHE,
+			data_blob_const(key, sizeof(key)));
+}
+
+void dirname_index_flush(void)
+{
+	if (dirname_index_cache == NULL) {
+		return;
+	}
+	memcache_flush(dirname_index_cache, DIRNAME_INDEX_CACHE);
+}
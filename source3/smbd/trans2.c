@@ -1362,6 +1362,7 @@ static bool check_msdfs_link(connection_struct *conn,
 
 struct smbd_dirptr_lanman2_state {
 	connection_struct *conn;
+	struct dptr_struct *dirptr;
 	uint32_t info_level;
 	bool check_mangled_names;
 	bool has_wild;
@@ -1449,6 +1450,13 @@ static bool smbd_dirptr_lanman2_mode_fn(TALLOC_CTX *ctx,
 	bool ms_dfs_link = false;
 	uint32_t mode = 0;
 
+	if (!INFO_LEVEL_IS_UNIX(state->info_level) &&
+	    VALID_STAT(smb_fname->st) &&
+	    dptr_cached_dos_mode(state->dirptr, _mode)) {
+		/* stat and DOS attributes from a dircache snapshot */
+		return true;
+	}
+
 	if (INFO_LEVEL_IS_UNIX(state->info_level)) {
 		if (SMB_VFS_LSTAT(state->conn, smb_fname) != 0) {
 			DEBUG(5,("smbd_dirptr_lanman2_mode_fn: "
@@ -2118,6 +2126,7 @@ bool smbd_dirptr_lanman2_entry(TALLOC_CTX *ctx,
 
 	ZERO_STRUCT(state);
 	state.conn = conn;
+	state.dirptr = dirptr;
 	state.info_level = info_level;
 	state.check_mangled_names = lp_manglednames(conn->params);
 	state.has_wild = dptr_has_wild(dirptr);
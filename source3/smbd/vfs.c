@@ -381,6 +381,42 @@ ssize_t vfs_pread_data(files_struct *fsp, char *buf,
 	return (ssize_t)total;
 }
 
+/****************************************************************************
+ Receive N bytes of file data directly from the client socket. The SMB2
+ server runs its socket non-blocking, recvfile needs it to block until
+ all data has arrived.
+****************************************************************************/
+
+static ssize_t vfs_recvfile_data(struct smb_request *req,
+				 files_struct *fsp,
+				 SMB_OFF_T offset,
+				 size_t N)
+{
+	int sockfd = req->sconn->sock;
+	int old_flags;
+	ssize_t ret;
+	int saved_errno;
+
+	old_flags = fcntl(sockfd, F_GETFL, 0);
+	if (old_flags == -1) {
+		return -1;
+	}
+
+	if (set_blocking(sockfd, true) == -1) {
+		return -1;
+	}
+
+	ret = SMB_VFS_RECVFILE(sockfd, fsp, offset, N);
+	saved_errno = errno;
+
+	if (fcntl(sockfd, F_SETFL, old_flags) == -1) {
+		return -1;
+	}
+
+	errno = saved_errno;
+	return ret;
+}
+
 /****************************************************************************
  Write data to a fd on the vfs.
 ****************************************************************************/
@@ -398,10 +434,7 @@ ssize_t vfs_write_data(struct smb_request *req,
 		/* VFS_RECVFILE must drain the socket
 		 * before returning. */
 		req->unread_bytes = 0;
-		return SMB_VFS_RECVFILE(req->sconn->sock,
-					fsp,
-					(SMB_OFF_T)-1,
-					N);
+		return vfs_recvfile_data(req, fsp, (SMB_OFF_T)-1, N);
 	}
 
 	while (total < N) {
@@ -431,10 +464,7 @@ ssize_t vfs_pwrite_data(struct smb_request *req,
 		/* VFS_RECVFILE must drain the socket
 		 * before returning. */
 		req->unread_bytes = 0;
-		return SMB_VFS_RECVFILE(req->sconn->sock,
-					fsp,
-					offset,
-					N);
+		return vfs_recvfile_data(req, fsp, offset, N);
 	}
 
 	while (total < N) {
@@ -1585,6 +1615,18 @@ int smb_vfs_call_fallocate(struct vfs_handle_struct *handle,
 	return handle->fns->fallocate(handle, fsp, mode, offset, len);
 }
 
+ssize_t smb_vfs_call_copy_chunk(struct vfs_handle_struct *handle,
+				struct files_struct *src_fsp,
+				SMB_OFF_T src_off,
+				struct files_struct *dest_fsp,
+				SMB_OFF_T dest_off,
+				size_t num)
+{
+	VFS_FIND(copy_chunk);
+	return handle->fns->copy_chunk(handle, src_fsp, src_off,
+				       dest_fsp, dest_off, num);
+}
+
 int smb_vfs_call_kernel_flock(struct vfs_handle_struct *handle,
 			      struct files_struct *fsp, uint32 share_mode,
 			      uint32_t access_mask)
@@ -477,7 +477,7 @@ static bool do_profile(struct messaging_context *msg_ctx,
 
 	if (argc != 2) {
 		fprintf(stderr, "Usage: smbcontrol <dest> profile "
-			"<off|count|on|flush>\n");
+			"<off|count|on|flush|latency-flush>\n");
 		return False;
 	}
 
@@ -489,6 +489,8 @@ static bool do_profile(struct messaging_context *msg_ctx,
 		v = 2;
 	} else if (strcmp(argv[1], "flush") == 0) {
 		v = 3;
+	} else if (strcmp(argv[1], "latency-flush") == 0) {
+		v = 4;
 	} else {
 		fprintf(stderr, "Unknown profile command '%s'\n", argv[1]);
 		return False;
@@ -582,6 +584,37 @@ static bool do_profilelevel(struct messaging_context *msg_ctx,
 	return num_replies;
 }
 
+/* Display the latency percentiles */
+
+static bool do_profile_latency(struct messaging_context *msg_ctx,
+			       const struct server_id pid,
+			       const int argc, const char **argv)
+{
+	if (argc != 1) {
+		fprintf(stderr, "Usage: smbcontrol <dest> profile-latency\n");
+		return False;
+	}
+
+	messaging_register(msg_ctx, NULL, MSG_PROFILE_LATENCY,
+			   print_string_cb);
+
+	/* Send a message and register our interest in a reply */
+
+	if (!send_message(msg_ctx, pid, MSG_REQ_PROFILE_LATENCY, NULL, 0))
+		return False;
+
+	wait_replies(msg_ctx, procid_to_pid(&pid) == 0);
+
+	/* No replies were received within the timeout period */
+
+	if (num_replies == 0)
+		printf("No replies received\n");
+
+	messaging_deregister(msg_ctx, MSG_PROFILE_LATENCY, NULL);
+
+	return num_replies;
+}
+
 /* Display debug level settings */
 
 static bool do_debuglevel(struct messaging_context *msg_ctx,
@@ -1262,6 +1295,8 @@ static const struct {
 	{ "stacktrace", do_daemon_stack_trace,
 	    "Display a stack trace of a daemon" },
 	{ "profilelevel", do_profilelevel, "" },
+	{ "profile-latency", do_profile_latency,
+	  "Display the latency percentiles" },
 	{ "debuglevel", do_debuglevel, "Display current debuglevels" },
 	{ "printnotify", do_printnotify, "Send a print notify message" },
 	{ "close-share", do_closeshare, "Forcibly disconnect a share" },
@@ -38,6 +38,7 @@
 #include "session.h"
 #include "locking/proto.h"
 #include "messages.h"
+#include "smb2_credits.h"
 
 #define SMB_MAXPIDS		2048
 static uid_t 		Ucrit_uid = 0;               /* added by OH */
@@ -51,6 +52,7 @@ static bool locks_only;            /* Added by RJS */
 static bool processes_only;
 static bool show_brl;
 static bool numeric_only;
+static bool credits_only;
 
 const char *username = NULL;
 
@@ -258,6 +260,29 @@ static int traverse_fn1(const struct connections_key *key,
 	return 0;
 }
 
+static int traverse_smb2_credits(const struct smb2_credit_stats *stats,
+				 void *private_data)
+{
+	if (!process_exists(stats->pid)) {
+		return 0;
+	}
+
+	d_printf("%-7s %-20s %04x %7u %6u %7u %8u %5u %10u %9u %12llu\n",
+		 procid_str_static(&stats->pid),
+		 stats->addr,
+		 (unsigned int)stats->dialect,
+		 (unsigned int)stats->granted,
+		 (unsigned int)stats->target,
+		 (unsigned int)stats->max_credits,
+		 (unsigned int)stats->in_flight,
+		 (unsigned int)stats->async_pending,
+		 (unsigned int)stats->avg_latency_usec,
+		 (unsigned int)stats->throttled,
+		 (unsigned long long)stats->num_requests);
+
+	return 0;
+}
+
 static int traverse_sessionid(const char *key, struct sessionid *session,
 			      void *private_data)
 {
@@ -303,6 +328,7 @@ static int traverse_sessionid(const char *key, struct sessionid *session,
 		{"profile-rates", 'R', POPT_ARG_NONE, NULL, 'R', "Show call rates" },
 		{"byterange",	'B', POPT_ARG_NONE,	NULL, 'B', "Include byte range locks"},
 		{"numeric",	'n', POPT_ARG_NONE,	NULL, 'n', "Numeric uid/gid"},
+		{"credits",	'C', POPT_ARG_NONE,	NULL, 'C', "Show SMB2 credit statistics only"},
 		POPT_COMMON_SAMBA
 		POPT_TABLEEND
 	};
@@ -354,6 +380,9 @@ static int traverse_sessionid(const char *key, struct sessionid *session,
 		case 'n':
 			numeric_only = true;
 			break;
+		case 'C':
+			credits_only = true;
+			break;
 		}
 	}
 
@@ -411,6 +440,35 @@ static int traverse_sessionid(const char *key, struct sessionid *session,
 			break;
 	}
 
+	if (credits_only) {
+		struct smb2_credits_global global;
+
+		if (!smb2_credits_init(false)) {
+			d_printf("%s not initialised\n",
+				 lock_path("smb2_credits.tdb"));
+			ret = 1;
+			goto done;
+		}
+
+		d_printf("\nPID     Machine              Dial Granted Target "
+			 "Max     InFlight Async Latency-us Throttled "
+			 "Requests\n");
+		d_printf("--------------------------------------------------"
+			 "------------------------------------------------"
+			 "--------\n");
+
+		smb2_credits_traverse_read(traverse_smb2_credits, NULL);
+
+		if (smb2_credits_fetch_global(&global)) {
+			d_printf("\nServer: %u connections, %u requests in "
+				 "flight, %u async\n",
+				 (unsigned int)global.num_connections,
+				 (unsigned int)global.in_flight,
+				 (unsigned int)global.async_pending);
+		}
+		goto done;
+	}
+
 	if ( show_processes ) {
 		d_printf("\nSamba version %s\n",samba_version_string());
 		d_printf("PID     Username      Group         Machine                        \n");
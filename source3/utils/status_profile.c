@@ -39,6 +39,20 @@ static void profile_separator(const char * title)
     line[sizeof(line) - 1] = '\0';
     d_printf("%s\n", line);
 }
+
+static void profile_latency_dump(void)
+{
+	char *s;
+
+	profile_separator("Latency Percentiles (usec, upper bounds)");
+
+	s = profile_latency_string(talloc_tos());
+	if (s == NULL) {
+		return;
+	}
+	d_printf("%s", s);
+	TALLOC_FREE(s);
+}
 #endif
 
 /*******************************************************************
@@ -129,6 +143,28 @@ bool status_profile_dump(bool verbose)
 	d_printf("misses:                         %u\n", profile_p->statcache_misses);
 	d_printf("hits:                           %u\n", profile_p->statcache_hits);
 
+	profile_separator("SMB2 Request Cache");
+	d_printf("lookups:                        %u\n", profile_p->smb2_req_cache_lookups);
+	d_printf("misses:                         %u\n", profile_p->smb2_req_cache_misses);
+	d_printf("hits:                           %u\n", profile_p->smb2_req_cache_hits);
+
+	profile_separator("Unlocked Share Mode Checks");
+	d_printf("lookups:                        %u\n", profile_p->share_mode_fast_lookups);
+	d_printf("hits:                           %u\n", profile_p->share_mode_fast_hits);
+	d_printf("retries:                        %u\n", profile_p->share_mode_fast_retries);
+	d_printf("hit_rate:                       %.2f%%\n",
+		 profile_p->share_mode_fast_lookups == 0 ? 0.0 :
+		 100.0 * (double)profile_p->share_mode_fast_hits /
+		 (double)profile_p->share_mode_fast_lookups);
+
+	profile_separator("SMB2 Reply Batching");
+	d_printf("batches:                        %u\n", profile_p->smb2_send_batches);
+	d_printf("replies:                        %u\n", profile_p->smb2_send_replies);
+	d_printf("replies_per_writev:             %.2f\n",
+		 profile_p->smb2_send_batches == 0 ? 0.0 :
+		 (double)profile_p->smb2_send_replies /
+		 (double)profile_p->smb2_send_batches);
+
 	profile_separator("Write Cache");
 	d_printf("read_hits:                      %u\n", profile_p->writecache_read_hits);
 	d_printf("abutted_writes:                 %u\n", profile_p->writecache_abutted_writes);
@@ -441,6 +477,8 @@ bool status_profile_dump(bool verbose)
 	d_printf("smb2_break_count:               %u\n", profile_p->smb2_break_count);
 	d_printf("smb2_break_time:                %u\n", profile_p->smb2_break_time);
 
+	profile_latency_dump();
+
 #else /* WITH_PROFILE */
 
 	fprintf(stderr, "Profile data unavailable\n");
@@ -0,0 +1,1049 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   SMB2 benchmarks
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "libcli/smb2/smb2.h"
+#include "libcli/smb2/smb2_calls.h"
+#include "system/time.h"
+#include "lib/events/events.h"
+#include "torture/torture.h"
+#include "torture/smb2/proto.h"
+
+#define BASEDIR "bench_smb2"
+
+/*
+  latency histogram: bucket 0 counts operations faster than 1
+  microsecond, bucket n counts operations taking [2^(n-1), 2^n)
+  microseconds
+*/
+#define BENCH_HIST_BUCKETS 32
+
+enum bench_op {
+	BENCH_READ,
+	BENCH_WRITE,
+	BENCH_CREATE,
+	BENCH_FIND,
+	BENCH_LOCK,
+	BENCH_COMPOUND
+};
+
+struct bench_state;
+struct bench_conn;
+
+/*
+  one outstanding operation. Each connection has "credits" of these,
+  they are reused for the whole run.
+*/
+struct bench_slot {
+	struct bench_conn *conn;
+	int num;
+	bool busy;
+	struct timeval start;
+	TALLOC_CTX *mem_ctx;
+	struct smb2_handle handle;
+
+	/* replies we still wait for before the operation is done */
+	int pending;
+	bool second_stage;
+
+	struct smb2_read rd;
+	struct smb2_write wr;
+	struct smb2_create cr;
+	struct smb2_close cl;
+	struct smb2_find f;
+	struct smb2_lock lck;
+	struct smb2_lock_element el;
+};
+
+struct bench_conn {
+	struct bench_state *state;
+	struct smb2_tree *tree;
+	int num;
+	char *fname;
+	struct smb2_handle handle;
+	uint64_t offset;
+
+	/* credits granted by the server that we have not used yet */
+	int credits;
+	int outstanding;
+
+	uint64_t count;
+	uint64_t lastcount;
+	uint64_t hist[BENCH_HIST_BUCKETS];
+
+	struct bench_slot *slots;
+};
+
+struct bench_state {
+	struct torture_context *tctx;
+	enum bench_op op;
+	const char *opname;
+	int nprocs;
+	int depth;
+	uint32_t iosize;
+	uint64_t filesize;
+	bool random;
+	bool stopping;
+	bool failed;
+	DATA_BLOB data;
+	struct bench_conn *conns;
+};
+
+static void bench_fill(struct bench_conn *conn);
+
+static int bench_hist_bucket(uint64_t usec)
+{
+	int b = 0;
+
+	while (usec != 0 && b < BENCH_HIST_BUCKETS - 1) {
+		usec >>= 1;
+		b++;
+	}
+	return b;
+}
+
+/*
+  return the upper bound in microseconds of the bucket holding the
+  given percentile (in tenths of a percent)
+*/
+static uint64_t bench_percentile(const uint64_t *hist, uint64_t total,
+				 unsigned permille)
+{
+	uint64_t threshold = (total * permille + 999) / 1000;
+	uint64_t sum = 0;
+	int b;
+
+	for (b=0; b<BENCH_HIST_BUCKETS; b++) {
+		sum += hist[b];
+		if (sum >= threshold) {
+			return (uint64_t)1 << b;
+		}
+	}
+	return (uint64_t)1 << (BENCH_HIST_BUCKETS - 1);
+}
+
+/*
+  how many credits to ask for, so that the server keeps enough of
+  them granted for "depth" operations in flight
+*/
+static uint16_t bench_credits_wanted(struct bench_conn *conn)
+{
+	struct bench_state *state = conn->state;
+	int want = state->depth;
+
+	if (state->op == BENCH_COMPOUND) {
+		want *= 3;
+	}
+	want -= conn->credits + conn->outstanding;
+	return MAX(want, 1);
+}
+
+static void bench_failed(struct bench_slot *slot, const char *op,
+			 NTSTATUS status)
+{
+	struct bench_state *state = slot->conn->state;
+
+	torture_comment(state->tctx, "[%d] %s failed - %s\n",
+			slot->conn->num, op, nt_errstr(status));
+	state->failed = true;
+}
+
+/*
+  account for a reply: give back the credits the server granted
+*/
+static void bench_reply(struct bench_conn *conn, struct smb2_request *req)
+{
+	if (req->in.hdr != NULL) {
+		conn->credits += SVAL(req->in.hdr, SMB2_HDR_CREDIT);
+	}
+	conn->outstanding--;
+}
+
+static void bench_done(struct bench_slot *slot)
+{
+	struct bench_conn *conn = slot->conn;
+	struct timeval now = timeval_current();
+	uint64_t usec = usec_time_diff(&now, &slot->start);
+
+	conn->hist[bench_hist_bucket(usec)]++;
+	conn->count++;
+	slot->busy = false;
+	TALLOC_FREE(slot->mem_ctx);
+
+	bench_fill(conn);
+}
+
+static void bench_send(struct bench_slot *slot, struct smb2_request *req,
+		       void (*fn)(struct smb2_request *))
+{
+	struct bench_conn *conn = slot->conn;
+
+	if (req == NULL) {
+		bench_failed(slot, "send", NT_STATUS_NO_MEMORY);
+		return;
+	}
+	conn->credits--;
+	conn->outstanding++;
+	slot->pending++;
+	req->async.fn = fn;
+	req->async.private_data = slot;
+}
+
+static uint64_t bench_next_offset(struct bench_conn *conn)
+{
+	struct bench_state *state = conn->state;
+	uint64_t blocks = state->filesize / state->iosize;
+	uint64_t ofs;
+
+	if (state->random) {
+		return (random() % blocks) * state->iosize;
+	}
+	ofs = conn->offset;
+	conn->offset += state->iosize;
+	if (conn->offset + state->iosize > state->filesize) {
+		conn->offset = 0;
+	}
+	return ofs;
+}
+
+static void bench_read_done(struct smb2_request *req)
+{
+	struct bench_slot *slot =
+		(struct bench_slot *)req->async.private_data;
+	NTSTATUS status;
+
+	bench_reply(slot->conn, req);
+	status = smb2_read_recv(req, slot->mem_ctx, &slot->rd);
+	if (!NT_STATUS_IS_OK(status)) {
+		bench_failed(slot, "read", status);
+		return;
+	}
+	bench_done(slot);
+}
+
+static void bench_write_done(struct smb2_request *req)
+{
+	struct bench_slot *slot =
+		(struct bench_slot *)req->async.private_data;
+	NTSTATUS status;
+
+	bench_reply(slot->conn, req);
+	status = smb2_write_recv(req, &slot->wr);
+	if (!NT_STATUS_IS_OK(status)) {
+		bench_failed(slot, "write", status);
+		return;
+	}
+	bench_done(slot);
+}
+
+static void bench_create_done(struct smb2_request *req)
+{
+	struct bench_slot *slot =
+		(struct bench_slot *)req->async.private_data;
+	struct bench_conn *conn = slot->conn;
+	NTSTATUS status;
+
+	bench_reply(slot->conn, req);
+	slot->pending--;
+
+	if (!slot->second_stage) {
+		status = smb2_create_recv(req, slot->mem_ctx, &slot->cr);
+		if (!NT_STATUS_IS_OK(status)) {
+			bench_failed(slot, "create", status);
+			return;
+		}
+		/*
+		  the close goes out right away, the server always
+		  leaves us at least one credit after a reply
+		*/
+		slot->second_stage = true;
+		ZERO_STRUCT(slot->cl);
+		slot->cl.in.file.handle = slot->cr.out.file.handle;
+		smb2_transport_credits_ask_num(conn->tree->session->transport,
+					       bench_credits_wanted(conn));
+		bench_send(slot, smb2_close_send(conn->tree, &slot->cl),
+			   bench_create_done);
+		return;
+	}
+
+	status = smb2_close_recv(req, &slot->cl);
+	if (!NT_STATUS_IS_OK(status)) {
+		bench_failed(slot, "close", status);
+		return;
+	}
+	bench_done(slot);
+}
+
+static void bench_find_done(struct smb2_request *req)
+{
+	struct bench_slot *slot =
+		(struct bench_slot *)req->async.private_data;
+	NTSTATUS status;
+
+	bench_reply(slot->conn, req);
+	status = smb2_find_recv(req, slot->mem_ctx, &slot->f);
+	if (!NT_STATUS_IS_OK(status)) {
+		bench_failed(slot, "find", status);
+		return;
+	}
+	bench_done(slot);
+}
+
+static void bench_lock_done(struct smb2_request *req)
+{
+	struct bench_slot *slot =
+		(struct bench_slot *)req->async.private_data;
+	struct bench_conn *conn = slot->conn;
+	NTSTATUS status;
+
+	bench_reply(slot->conn, req);
+	slot->pending--;
+
+	status = smb2_lock_recv(req, &slot->lck);
+	if (!NT_STATUS_IS_OK(status)) {
+		bench_failed(slot, slot->second_stage ? "unlock" : "lock",
+			     status);
+		return;
+	}
+
+	if (!slot->second_stage) {
+		slot->second_stage = true;
+		slot->el.flags = SMB2_LOCK_FLAG_UNLOCK;
+		smb2_transport_credits_ask_num(conn->tree->session->transport,
+					       bench_credits_wanted(conn));
+		bench_send(slot, smb2_lock_send(conn->tree, &slot->lck),
+			   bench_lock_done);
+		return;
+	}
+	bench_done(slot);
+}
+
+static void bench_compound_done(struct smb2_request *req)
+{
+	struct bench_slot *slot =
+		(struct bench_slot *)req->async.private_data;
+	uint16_t opcode = SVAL(req->out.hdr, SMB2_HDR_OPCODE);
+	NTSTATUS status;
+	const char *op;
+
+	bench_reply(slot->conn, req);
+	slot->pending--;
+
+	switch (opcode) {
+	case SMB2_OP_CREATE:
+		op = "create";
+		status = smb2_create_recv(req, slot->mem_ctx, &slot->cr);
+		break;
+	case SMB2_OP_READ:
+		op = "read";
+		status = smb2_read_recv(req, slot->mem_ctx, &slot->rd);
+		break;
+	default:
+		op = "close";
+		status = smb2_close_recv(req, &slot->cl);
+		break;
+	}
+	if (!NT_STATUS_IS_OK(status)) {
+		bench_failed(slot, op, status);
+		return;
+	}
+	if (slot->pending == 0) {
+		bench_done(slot);
+	}
+}
+
+static void bench_setup_create(struct bench_conn *conn, struct smb2_create *cr,
+			       uint32_t disposition)
+{
+	ZERO_STRUCTP(cr);
+	cr->in.desired_access = SEC_RIGHTS_FILE_ALL;
+	cr->in.file_attributes = FILE_ATTRIBUTE_NORMAL;
+	cr->in.share_access = NTCREATEX_SHARE_ACCESS_READ |
+		NTCREATEX_SHARE_ACCESS_WRITE |
+		NTCREATEX_SHARE_ACCESS_DELETE;
+	cr->in.create_disposition = disposition;
+	cr->in.impersonation_level = SMB2_IMPERSONATION_ANONYMOUS;
+	cr->in.fname = conn->fname;
+}
+
+/*
+  send create, read and close as one related compound chain
+*/
+static void bench_send_compound(struct bench_slot *slot)
+{
+	struct bench_conn *conn = slot->conn;
+	struct smb2_tree *tree = conn->tree;
+	struct smb2_transport *transport = tree->session->transport;
+	uint32_t saved_tid = tree->tid;
+	uint64_t saved_uid = tree->session->uid;
+	struct smb2_handle related;
+
+	related.data[0] = UINT64_MAX;
+	related.data[1] = UINT64_MAX;
+
+	bench_setup_create(conn, &slot->cr, NTCREATEX_DISP_OPEN);
+
+	ZERO_STRUCT(slot->rd);
+	slot->rd.in.file.handle = related;
+	slot->rd.in.length = conn->state->iosize;
+	slot->rd.in.offset = 0;
+
+	ZERO_STRUCT(slot->cl);
+	slot->cl.in.file.handle = related;
+
+	smb2_transport_compound_start(transport, 3);
+
+	bench_send(slot, smb2_create_send(tree, &slot->cr),
+		   bench_compound_done);
+
+	smb2_transport_compound_set_related(transport, true);
+	tree->tid = 0xFFFFFFFF;
+	tree->session->uid = UINT64_MAX;
+
+	bench_send(slot, smb2_read_send(tree, &slot->rd),
+		   bench_compound_done);
+	bench_send(slot, smb2_close_send(tree, &slot->cl),
+		   bench_compound_done);
+
+	tree->tid = saved_tid;
+	tree->session->uid = saved_uid;
+}
+
+static void bench_start(struct bench_slot *slot)
+{
+	struct bench_conn *conn = slot->conn;
+	struct bench_state *state = conn->state;
+	struct smb2_tree *tree = conn->tree;
+
+	slot->busy = true;
+	slot->pending = 0;
+	slot->second_stage = false;
+	slot->mem_ctx = talloc_new(conn->slots);
+	slot->start = timeval_current();
+
+	smb2_transport_credits_ask_num(tree->session->transport,
+				       bench_credits_wanted(conn));
+
+	switch (state->op) {
+	case BENCH_READ:
+		ZERO_STRUCT(slot->rd);
+		slot->rd.in.file.handle = slot->handle;
+		slot->rd.in.length = state->iosize;
+		slot->rd.in.offset = bench_next_offset(conn);
+		bench_send(slot, smb2_read_send(tree, &slot->rd),
+			   bench_read_done);
+		break;
+	case BENCH_WRITE:
+		ZERO_STRUCT(slot->wr);
+		slot->wr.in.file.handle = slot->handle;
+		slot->wr.in.offset = bench_next_offset(conn);
+		slot->wr.in.data = state->data;
+		bench_send(slot, smb2_write_send(tree, &slot->wr),
+			   bench_write_done);
+		break;
+	case BENCH_CREATE:
+		bench_setup_create(conn, &slot->cr, NTCREATEX_DISP_OPEN_IF);
+		bench_send(slot, smb2_create_send(tree, &slot->cr),
+			   bench_create_done);
+		break;
+	case BENCH_FIND:
+		ZERO_STRUCT(slot->f);
+		slot->f.in.file.handle = slot->handle;
+		slot->f.in.pattern = "*";
+		slot->f.in.continue_flags = SMB2_CONTINUE_FLAG_RESTART;
+		slot->f.in.max_response_size = 0x10000;
+		slot->f.in.level = SMB2_FIND_BOTH_DIRECTORY_INFO;
+		bench_send(slot, smb2_find_send(tree, &slot->f),
+			   bench_find_done);
+		break;
+	case BENCH_LOCK:
+		/* every slot of every connection has its own byte */
+		ZERO_STRUCT(slot->lck);
+		ZERO_STRUCT(slot->el);
+		slot->el.offset = conn->num * state->depth + slot->num;
+		slot->el.length = 1;
+		slot->el.flags = SMB2_LOCK_FLAG_EXCLUSIVE |
+			SMB2_LOCK_FLAG_FAIL_IMMEDIATELY;
+		slot->lck.in.file.handle = slot->handle;
+		slot->lck.in.lock_count = 1;
+		slot->lck.in.locks = &slot->el;
+		bench_send(slot, smb2_lock_send(tree, &slot->lck),
+			   bench_lock_done);
+		break;
+	case BENCH_COMPOUND:
+		bench_send_compound(slot);
+		break;
+	}
+}
+
+/*
+  keep as many operations in flight as we have slots and credits for
+*/
+static void bench_keepalive_done(struct smb2_request *req)
+{
+	struct bench_conn *conn = (struct bench_conn *)req->async.private_data;
+	NTSTATUS status;
+
+	bench_reply(conn, req);
+	status = smb2_keepalive_recv(req);
+	if (!NT_STATUS_IS_OK(status)) {
+		torture_comment(conn->state->tctx, "[%d] keepalive failed - %s\n",
+				conn->num, nt_errstr(status));
+		conn->state->failed = true;
+		return;
+	}
+	bench_fill(conn);
+}
+
+/*
+  we have too few credits for a compound chain and nothing in flight
+  that could grant us more: ask for them with a keepalive
+*/
+static void bench_ask_credits(struct bench_conn *conn)
+{
+	struct smb2_transport *transport = conn->tree->session->transport;
+	struct smb2_request *req;
+
+	smb2_transport_credits_ask_num(transport, bench_credits_wanted(conn));
+	req = smb2_keepalive_send(transport);
+	if (req == NULL) {
+		conn->state->failed = true;
+		return;
+	}
+	conn->credits--;
+	conn->outstanding++;
+	req->async.fn = bench_keepalive_done;
+	req->async.private_data = conn;
+}
+
+static void bench_fill(struct bench_conn *conn)
+{
+	struct bench_state *state = conn->state;
+	int needed = (state->op == BENCH_COMPOUND) ? 3 : 1;
+	int i;
+
+	for (i=0; i<state->depth; i++) {
+		struct bench_slot *slot = &conn->slots[i];
+
+		if (state->stopping || state->failed) {
+			return;
+		}
+		if (slot->busy) {
+			continue;
+		}
+		if (conn->credits < needed) {
+			if (conn->outstanding == 0) {
+				bench_ask_credits(conn);
+			}
+			return;
+		}
+		bench_start(slot);
+	}
+}
+
+static void bench_report_rate(struct tevent_context *ev,
+			      struct tevent_timer *te,
+			      struct timeval t, void *private_data)
+{
+	struct bench_state *state = talloc_get_type_abort(
+		private_data, struct bench_state);
+	int i;
+
+	for (i=0; i<state->nprocs; i++) {
+		struct bench_conn *conn = &state->conns[i];
+
+		torture_comment(state->tctx, "%5u ",
+				(unsigned)(conn->count - conn->lastcount));
+		conn->lastcount = conn->count;
+	}
+	torture_comment(state->tctx, "\r");
+
+	event_add_timed(ev, state, timeval_current_ofs(1, 0),
+			bench_report_rate, state);
+}
+
+/*
+  open the per connection handles the operation works on
+*/
+static bool bench_setup_conn(struct bench_state *state,
+			     struct bench_conn *conn)
+{
+	struct torture_context *tctx = state->tctx;
+	NTSTATUS status;
+	uint8_t c = 0;
+	int i;
+
+	switch (state->op) {
+	case BENCH_LOCK:
+		conn->fname = talloc_strdup(conn->slots, BASEDIR "\\lock.dat");
+		break;
+	case BENCH_FIND:
+		conn->fname = talloc_strdup(conn->slots, BASEDIR "\\find");
+		break;
+	default:
+		conn->fname = talloc_asprintf(conn->slots, BASEDIR "\\bench%d.dat",
+					      conn->num);
+		break;
+	}
+
+	if (state->op == BENCH_CREATE) {
+		return true;
+	}
+
+	if (state->op == BENCH_FIND) {
+		for (i=0; i<state->depth; i++) {
+			status = torture_smb2_testdir(conn->tree, conn->fname,
+						      &conn->slots[i].handle);
+			torture_assert_ntstatus_ok(tctx, status,
+						   "opening directory");
+		}
+		return true;
+	}
+
+	status = torture_smb2_testfile(conn->tree, conn->fname,
+				       &conn->handle);
+	torture_assert_ntstatus_ok(tctx, status, "opening file");
+
+	switch (state->op) {
+	case BENCH_READ:
+		/* a sparse file is good enough to read from */
+		status = smb2_util_write(conn->tree, conn->handle, &c,
+					 state->filesize - 1, 1);
+		torture_assert_ntstatus_ok(tctx, status, "extending file");
+		break;
+	case BENCH_COMPOUND:
+		status = smb2_util_write(conn->tree, conn->handle,
+					 state->data.data, 0,
+					 state->data.length);
+		torture_assert_ntstatus_ok(tctx, status, "writing file");
+		status = smb2_util_close(conn->tree, conn->handle);
+		torture_assert_ntstatus_ok(tctx, status, "closing file");
+		ZERO_STRUCT(conn->handle);
+		break;
+	default:
+		break;
+	}
+
+	for (i=0; i<state->depth; i++) {
+		conn->slots[i].handle = conn->handle;
+	}
+	return true;
+}
+
+static bool bench_setup_dir(struct bench_state *state, struct smb2_tree *tree)
+{
+	struct torture_context *tctx = state->tctx;
+	int numfiles = torture_setting_int(tctx, "numfiles", 100);
+	struct smb2_handle h;
+	NTSTATUS status;
+	int i;
+
+	smb2_deltree(tree, BASEDIR);
+
+	status = torture_smb2_testdir(tree, BASEDIR, &h);
+	torture_assert_ntstatus_ok(tctx, status, "creating base directory");
+	smb2_util_close(tree, h);
+
+	if (state->op != BENCH_FIND) {
+		return true;
+	}
+
+	status = torture_smb2_testdir(tree, BASEDIR "\\find", &h);
+	torture_assert_ntstatus_ok(tctx, status, "creating find directory");
+	smb2_util_close(tree, h);
+
+	for (i=0; i<numfiles; i++) {
+		char *fname = talloc_asprintf(tctx, BASEDIR "\\find\\file%d.dat",
+					      i);
+		status = torture_smb2_testfile(tree, fname, &h);
+		torture_assert_ntstatus_ok(tctx, status, "creating file");
+		smb2_util_close(tree, h);
+		talloc_free(fname);
+	}
+	torture_comment(tctx, "Created %d files\n", numfiles);
+	return true;
+}
+
+/*
+  run one benchmark over "nprocs" connections with "credits"
+  operations in flight on each of them, and report the operation
+  rate and latency percentiles
+*/
+static bool bench_run(struct torture_context *tctx, struct smb2_tree *tree,
+		      enum bench_op op, const char *opname, bool random_io)
+{
+	TALLOC_CTX *mem_ctx = talloc_new(tctx);
+	int timelimit = torture_setting_int(tctx, "timelimit", 10);
+	bool progress = torture_setting_bool(tctx, "progress", true);
+	struct bench_state *state;
+	struct tevent_timer *report_te = NULL;
+	uint64_t hist[BENCH_HIST_BUCKETS];
+	uint64_t total = 0, minops;
+	struct timeval tv;
+	double elapsed;
+	bool ret = true;
+	int i, b;
+
+	state = talloc_zero(mem_ctx, struct bench_state);
+	state->tctx = tctx;
+	state->op = op;
+	state->opname = opname;
+	state->random = random_io;
+	state->nprocs = torture_setting_int(tctx, "nprocs", 4);
+	state->depth = torture_setting_int(tctx, "credits", 8);
+	state->iosize = torture_setting_int(tctx, "iosize", 65536);
+	state->filesize = torture_setting_int(tctx, "filesize",
+					      16*1024*1024);
+
+	torture_assert(tctx, state->nprocs > 0, "nprocs must be positive");
+	torture_assert(tctx, state->depth > 0, "credits must be positive");
+	torture_assert(tctx, state->iosize > 0, "iosize must be positive");
+	if (state->filesize < state->iosize) {
+		state->filesize = state->iosize;
+	}
+
+	state->data = data_blob_talloc(state, NULL, state->iosize);
+	memset(state->data.data, 'x', state->data.length);
+
+	if (!bench_setup_dir(state, tree)) {
+		talloc_free(mem_ctx);
+		return false;
+	}
+
+	state->conns = talloc_zero_array(state, struct bench_conn,
+					 state->nprocs);
+
+	torture_comment(tctx, "Opening %d connections\n", state->nprocs);
+	for (i=0; i<state->nprocs; i++) {
+		struct bench_conn *conn = &state->conns[i];
+		int s;
+
+		conn->state = state;
+		conn->num = i;
+		conn->credits = 1;
+		if (!torture_smb2_connection(tctx, &conn->tree)) {
+			talloc_free(mem_ctx);
+			return false;
+		}
+		talloc_steal(state, conn->tree);
+
+		conn->slots = talloc_zero_array(conn->tree, struct bench_slot,
+						state->depth);
+		for (s=0; s<state->depth; s++) {
+			conn->slots[s].conn = conn;
+			conn->slots[s].num = s;
+		}
+
+		if (!bench_setup_conn(state, conn)) {
+			ret = false;
+			goto done;
+		}
+	}
+
+	torture_comment(tctx, "%s: %d connections, %d credits, "
+			"%u byte I/O%s\n", opname, state->nprocs,
+			state->depth, (unsigned)state->iosize,
+			state->random ? ", random offsets" : "");
+
+	tv = timeval_current();
+
+	for (i=0; i<state->nprocs; i++) {
+		bench_fill(&state->conns[i]);
+	}
+
+	if (progress) {
+		report_te = event_add_timed(tctx->ev, state,
+					    timeval_current_ofs(1, 0),
+					    bench_report_rate, state);
+	}
+
+	torture_comment(tctx, "Running for %d seconds\n", timelimit);
+	while (timeval_elapsed(&tv) < timelimit && !state->failed) {
+		event_loop_once(tctx->ev);
+	}
+	elapsed = timeval_elapsed(&tv);
+
+	talloc_free(report_te);
+	if (progress) {
+		torture_comment(tctx, "\n");
+	}
+
+	/* drain the operations still in flight */
+	state->stopping = true;
+	while (!state->failed) {
+		int outstanding = 0;
+		for (i=0; i<state->nprocs; i++) {
+			outstanding += state->conns[i].outstanding;
+		}
+		if (outstanding == 0) {
+			break;
+		}
+		event_loop_once(tctx->ev);
+	}
+
+	torture_assert_goto(tctx, !state->failed, ret, done,
+			    "benchmark operation failed");
+
+	ZERO_STRUCT(hist);
+	minops = state->conns[0].count;
+	for (i=0; i<state->nprocs; i++) {
+		struct bench_conn *conn = &state->conns[i];
+
+		torture_comment(tctx, "[%d] %llu ops\n", i,
+				(unsigned long long)conn->count);
+		total += conn->count;
+		minops = MIN(minops, conn->count);
+		for (b=0; b<BENCH_HIST_BUCKETS; b++) {
+			hist[b] += conn->hist[b];
+		}
+	}
+
+	torture_assert_goto(tctx, total > 0, ret, done,
+			    "no operations completed");
+
+	torture_comment(tctx, "%.2f ops/second", total/elapsed);
+	if (op == BENCH_READ || op == BENCH_WRITE ||
+	    op == BENCH_COMPOUND) {
+		torture_comment(tctx, " (%.2f MB/second)",
+				total * state->iosize / elapsed / 1e6);
+	}
+	torture_comment(tctx, "\n");
+	torture_comment(tctx, "latency p50 < %lluus p99 < %lluus "
+			"p999 < %lluus\n",
+			(unsigned long long)bench_percentile(hist, total, 500),
+			(unsigned long long)bench_percentile(hist, total, 990),
+			(unsigned long long)bench_percentile(hist, total, 999));
+
+	if (minops < 0.5*total/state->nprocs) {
+		torture_comment(tctx, "Warning: unbalanced %s rate\n",
+				opname);
+	}
+
+done:
+	for (i=0; i<state->nprocs; i++) {
+		struct bench_conn *conn = &state->conns[i];
+		int s;
+
+		if (conn->tree == NULL) {
+			continue;
+		}
+		for (s=0; s<state->depth && op == BENCH_FIND; s++) {
+			smb2_util_close(conn->tree, conn->slots[s].handle);
+		}
+		if (op != BENCH_FIND && op != BENCH_CREATE &&
+		    op != BENCH_COMPOUND) {
+			smb2_util_close(conn->tree, conn->handle);
+		}
+	}
+	smb2_deltree(tree, BASEDIR);
+	talloc_free(mem_ctx);
+	return ret;
+}
+
+static bool test_bench_read(struct torture_context *tctx,
+			    struct smb2_tree *tree)
+{
+	return bench_run(tctx, tree, BENCH_READ, "read", false);
+}
+
+static bool test_bench_randread(struct torture_context *tctx,
+				struct smb2_tree *tree)
+{
+	return bench_run(tctx, tree, BENCH_READ, "randread", true);
+}
+
+static bool test_bench_write(struct torture_context *tctx,
+			     struct smb2_tree *tree)
+{
+	return bench_run(tctx, tree, BENCH_WRITE, "write", false);
+}
+
+static bool test_bench_randwrite(struct torture_context *tctx,
+				 struct smb2_tree *tree)
+{
+	return bench_run(tctx, tree, BENCH_WRITE, "randwrite", true);
+}
+
+static bool test_bench_create(struct torture_context *tctx,
+			      struct smb2_tree *tree)
+{
+	return bench_run(tctx, tree, BENCH_CREATE, "create", false);
+}
+
+static bool test_bench_find(struct torture_context *tctx,
+			    struct smb2_tree *tree)
+{
+	return bench_run(tctx, tree, BENCH_FIND, "find", false);
+}
+
+static bool test_bench_lock(struct torture_context *tctx,
+			    struct smb2_tree *tree)
+{
+	return bench_run(tctx, tree, BENCH_LOCK, "lock", false);
+}
+
+static bool test_bench_compound(struct torture_context *tctx,
+				struct smb2_tree *tree)
+{
+	return bench_run(tctx, tree, BENCH_COMPOUND, "compound", false);
+}
+
+/*
+  time "numlookups" getinfo calls on the oldest of "num" open handles
+*/
+static double bench_handle_lookup(struct torture_context *tctx,
+				  struct smb2_tree *tree,
+				  struct smb2_handle h, int numlookups)
+{
+	union smb_fileinfo q;
+	struct timeval tv;
+	NTSTATUS status;
+	int i;
+
+	ZERO_STRUCT(q);
+	q.position_information.level = RAW_FILEINFO_POSITION_INFORMATION;
+	q.position_information.in.file.handle = h;
+
+	tv = timeval_current();
+	for (i=0; i<numlookups; i++) {
+		status = smb2_getinfo_file(tree, tctx, &q);
+		if (!NT_STATUS_IS_OK(status)) {
+			torture_comment(tctx, "getinfo failed: %s\n",
+					nt_errstr(status));
+			return -1;
+		}
+	}
+	return timeval_elapsed(&tv) * 1e6 / numlookups;
+}
+
+/*
+  open up to "numhandles" handles on distinct files and measure how the
+  latency of a request on the oldest one develops while more handles
+  get opened. The server looks handles up by id, so the latency should
+  not grow with the number of open handles. The default tries to open
+  64k handles, the run stops at the server's limit of open files.
+*/
+static bool test_bench_handles(struct torture_context *tctx,
+			       struct smb2_tree *tree)
+{
+	TALLOC_CTX *mem_ctx = talloc_new(tctx);
+	int numhandles = torture_setting_int(tctx, "numhandles", 65536);
+	int numlookups = torture_setting_int(tctx, "numlookups", 1000);
+	struct smb2_handle *handles;
+	struct smb2_create cr;
+	struct smb2_handle h;
+	double first = -1, usec = 0;
+	int checkpoint = 1;
+	int i, num = 0;
+	NTSTATUS status;
+	bool ret = true;
+
+	smb2_deltree(tree, BASEDIR);
+	status = torture_smb2_testdir(tree, BASEDIR, &h);
+	torture_assert_ntstatus_ok(tctx, status, "creating base directory");
+	smb2_util_close(tree, h);
+
+	handles = talloc_array(mem_ctx, struct smb2_handle, numhandles);
+	torture_assert(tctx, handles != NULL, "out of memory");
+
+	ZERO_STRUCT(cr);
+	/* Stat opens, so the server does not need an fd per handle. */
+	cr.in.desired_access = SEC_FILE_READ_ATTRIBUTE;
+	cr.in.file_attributes = FILE_ATTRIBUTE_NORMAL;
+	cr.in.share_access = NTCREATEX_SHARE_ACCESS_READ |
+		NTCREATEX_SHARE_ACCESS_WRITE |
+		NTCREATEX_SHARE_ACCESS_DELETE;
+	cr.in.create_disposition = NTCREATEX_DISP_OPEN_IF;
+	cr.in.impersonation_level = NTCREATEX_IMPERSONATION_ANONYMOUS;
+
+	for (i=0; i<numhandles; i++) {
+		cr.in.fname = talloc_asprintf(mem_ctx, BASEDIR "\\h%d.dat",
+					      i);
+		status = smb2_create(tree, mem_ctx, &cr);
+		if (!NT_STATUS_IS_OK(status)) {
+			torture_comment(tctx, "open %d failed: %s, stopping\n",
+					i, nt_errstr(status));
+			break;
+		}
+		handles[num++] = cr.out.file.handle;
+		talloc_free(discard_const(cr.in.fname));
+
+		if ((num != checkpoint) && (num != numhandles)) {
+			continue;
+		}
+		usec = bench_handle_lookup(tctx, tree, handles[0],
+					   numlookups);
+		if (usec < 0) {
+			ret = false;
+			goto done;
+		}
+		if (first < 0) {
+			first = usec;
+		}
+		torture_comment(tctx, "%6d handles open: %.1f usec/lookup\n",
+				num, usec);
+		checkpoint *= 4;
+	}
+
+	torture_assert_goto(tctx, num > 0, ret, done, "no handle opened");
+
+	if (num != checkpoint / 4 && num != numhandles) {
+		usec = bench_handle_lookup(tctx, tree, handles[0],
+					   numlookups);
+		torture_assert_goto(tctx, usec >= 0, ret, done,
+				    "lookup failed");
+		torture_comment(tctx, "%6d handles open: %.1f usec/lookup\n",
+				num, usec);
+	}
+	torture_comment(tctx, "lookup latency at %d handles is %.2f times "
+			"the latency at 1 handle\n", num, usec / first);
+
+done:
+	for (i=0; i<num; i++) {
+		smb2_util_close(tree, handles[i]);
+	}
+	smb2_deltree(tree, BASEDIR);
+	talloc_free(mem_ctx);
+	return ret;
+}
+
+/*
+   SMB2 benchmarks. The throughput ones take the torture:nprocs,
+   torture:timelimit, torture:credits, torture:iosize and
+   torture:filesize options, "handles" takes torture:numhandles and
+   torture:numlookups.
+*/
+struct torture_suite *torture_smb2_bench_init(void)
+{
+	struct torture_suite *suite = torture_suite_create(talloc_autofree_context(), "bench");
+
+	torture_suite_add_1smb2_test(suite, "read", test_bench_read);
+	torture_suite_add_1smb2_test(suite, "randread", test_bench_randread);
+	torture_suite_add_1smb2_test(suite, "write", test_bench_write);
+	torture_suite_add_1smb2_test(suite, "randwrite", test_bench_randwrite);
+	torture_suite_add_1smb2_test(suite, "create", test_bench_create);
+	torture_suite_add_1smb2_test(suite, "find", test_bench_find);
+	torture_suite_add_1smb2_test(suite, "lock", test_bench_lock);
+	torture_suite_add_1smb2_test(suite, "compound", test_bench_compound);
+	torture_suite_add_1smb2_test(suite, "handles", test_bench_handles);
+
+	suite->description = talloc_strdup(suite, "SMB2-BENCH tests");
+
+	return suite;
+}
@@ -982,6 +982,80 @@ done:
 	return ret;
 }
 
+/*
+  open the same file several times and close the handles in a
+  different order than they were opened, so the server has to find
+  each open by its file id on every open and close.
+*/
+
+static bool test_smb2_open_close_order(struct torture_context *tctx,
+				       struct smb2_tree *tree)
+{
+	const char *fname = "test_close_order.dat";
+	static const int close_order[] = { 3, 0, 6, 1, 7, 4, 2, 5 };
+	const int num_handles = ARRAY_SIZE(close_order);
+	struct smb2_handle h[ARRAY_SIZE(close_order)];
+	union smb_open io;
+	union smb_setfileinfo sfinfo;
+	NTSTATUS status;
+	int i;
+
+	smb2_util_unlink(tree, fname);
+
+	ZERO_STRUCT(io.smb2);
+	io.generic.level = RAW_OPEN_SMB2;
+	io.smb2.in.desired_access = SEC_RIGHTS_FILE_ALL;
+	io.smb2.in.file_attributes = FILE_ATTRIBUTE_NORMAL;
+	io.smb2.in.share_access = NTCREATEX_SHARE_ACCESS_READ|
+		NTCREATEX_SHARE_ACCESS_WRITE|
+		NTCREATEX_SHARE_ACCESS_DELETE;
+	io.smb2.in.create_disposition = NTCREATEX_DISP_OPEN_IF;
+	io.smb2.in.impersonation_level = SMB2_IMPERSONATION_ANONYMOUS;
+	io.smb2.in.fname = fname;
+
+	torture_comment(tctx, "Opening %s %d times\n", fname, num_handles);
+	for (i = 0; i < num_handles; i++) {
+		status = smb2_create(tree, tctx, &io.smb2);
+		CHECK_STATUS(status, NT_STATUS_OK);
+		h[i] = io.smb2.out.file.handle;
+	}
+
+	torture_comment(tctx, "Closing half of them out of order and "
+			"reopening\n");
+	for (i = 0; i < num_handles / 2; i++) {
+		status = smb2_util_close(tree, h[close_order[i]]);
+		CHECK_STATUS(status, NT_STATUS_OK);
+	}
+	for (i = 0; i < num_handles / 2; i++) {
+		status = smb2_create(tree, tctx, &io.smb2);
+		CHECK_STATUS(status, NT_STATUS_OK);
+		h[close_order[i]] = io.smb2.out.file.handle;
+	}
+
+	torture_comment(tctx, "Setting delete on close on a middle handle\n");
+	ZERO_STRUCT(sfinfo);
+	sfinfo.generic.level = RAW_SFILEINFO_DISPOSITION_INFORMATION;
+	sfinfo.generic.in.file.handle = h[num_handles / 2];
+	sfinfo.disposition_info.in.delete_on_close = 1;
+	status = smb2_setinfo_file(tree, &sfinfo);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	status = smb2_create(tree, tctx, &io.smb2);
+	CHECK_STATUS(status, NT_STATUS_DELETE_PENDING);
+
+	torture_comment(tctx, "Closing all handles in a different order\n");
+	for (i = num_handles - 1; i >= 0; i--) {
+		status = smb2_util_close(tree, h[close_order[i]]);
+		CHECK_STATUS(status, NT_STATUS_OK);
+	}
+
+	io.smb2.in.create_disposition = NTCREATEX_DISP_OPEN;
+	status = smb2_create(tree, tctx, &io.smb2);
+	CHECK_STATUS(status, NT_STATUS_OBJECT_NAME_NOT_FOUND);
+
+	return true;
+}
+
 /*
   test opening for delete on a read-only attribute file.
 */
@@ -1391,6 +1465,7 @@ struct torture_suite *torture_smb2_create_init(void)
 	torture_suite_add_1smb2_test(suite, "open", test_smb2_open);
 	torture_suite_add_1smb2_test(suite, "brlocked", test_smb2_open_brlocked);
 	torture_suite_add_1smb2_test(suite, "multi", test_smb2_open_multi);
+	torture_suite_add_1smb2_test(suite, "close-order", test_smb2_open_close_order);
 	torture_suite_add_1smb2_test(suite, "delete", test_smb2_open_for_delete);
 	torture_suite_add_1smb2_test(suite, "leading-slash", test_smb2_leading_slash);
 	torture_suite_add_1smb2_test(suite, "aclfile", test_create_acl_file);
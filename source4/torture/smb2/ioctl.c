@@ -0,0 +1,330 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   SMB2 ioctl test suite
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "libcli/smb2/smb2.h"
+#include "libcli/smb2/smb2_calls.h"
+#include "libcli/raw/ioctl.h"
+
+#include "torture/torture.h"
+#include "torture/smb2/proto.h"
+
+#define CHECK_STATUS(status, correct) do { \
+	if (!NT_STATUS_EQUAL(status, correct)) { \
+		printf("(%s) Incorrect status %s - should be %s\n", \
+		       __location__, nt_errstr(status), nt_errstr(correct)); \
+		ret = false; \
+		goto done; \
+	}} while (0)
+
+#define CHECK_VALUE(v, correct) do { \
+	if ((v) != (correct)) { \
+		printf("(%s) Incorrect value %s=%u - should be %u\n", \
+		       __location__, #v, (unsigned)v, (unsigned)correct); \
+		ret = false; \
+		goto done; \
+	}} while (0)
+
+#define FNAME_SRC "smb2_ioctl_src.dat"
+#define FNAME_DST "smb2_ioctl_dst.dat"
+
+#define TEST_LEN 8192
+
+struct copychunk_chunk {
+	uint64_t src_off;
+	uint64_t dst_off;
+	uint32_t length;
+};
+
+/*
+  create the source file filled with a pattern, an empty destination
+  and fetch the resume key of the source
+*/
+static bool setup_copy_chunk(struct torture_context *torture,
+			     struct smb2_tree *tree, TALLOC_CTX *mem_ctx,
+			     struct smb2_handle *src_h,
+			     struct smb2_handle *dst_h,
+			     DATA_BLOB *resume_key)
+{
+	uint8_t buf[TEST_LEN];
+	struct smb2_ioctl ioctl;
+	NTSTATUS status;
+	int i;
+
+	smb2_util_unlink(tree, FNAME_SRC);
+	smb2_util_unlink(tree, FNAME_DST);
+
+	for (i = 0; i < TEST_LEN; i++) {
+		buf[i] = i % 251;
+	}
+
+	status = torture_smb2_testfile(tree, FNAME_SRC, src_h);
+	torture_assert_ntstatus_ok(torture, status, "create source");
+
+	status = smb2_util_write(tree, *src_h, buf, 0, sizeof(buf));
+	torture_assert_ntstatus_ok(torture, status, "write source");
+
+	status = torture_smb2_testfile(tree, FNAME_DST, dst_h);
+	torture_assert_ntstatus_ok(torture, status, "create destination");
+
+	ZERO_STRUCT(ioctl);
+	ioctl.in.file.handle = *src_h;
+	ioctl.in.function = FSCTL_SRV_REQUEST_RESUME_KEY;
+	ioctl.in.max_response_size = 32;
+	ioctl.in.flags = 1; /* SMB2_0_IOCTL_IS_FSCTL */
+
+	status = smb2_ioctl(tree, mem_ctx, &ioctl);
+	torture_assert_ntstatus_ok(torture, status, "FSCTL_SRV_REQUEST_RESUME_KEY");
+	torture_assert_int_equal(torture, ioctl.out.out.length, 32,
+				 "resume key response length");
+
+	*resume_key = data_blob_talloc(mem_ctx, ioctl.out.out.data, 24);
+	return true;
+}
+
+static NTSTATUS copy_chunk(struct smb2_tree *tree, TALLOC_CTX *mem_ctx,
+			   struct smb2_handle dst_h, DATA_BLOB resume_key,
+			   const struct copychunk_chunk *chunks,
+			   uint32_t num_chunks, uint32_t *chunks_written,
+			   uint32_t *total_written)
+{
+	struct smb2_ioctl ioctl;
+	NTSTATUS status;
+	uint32_t i;
+
+	ZERO_STRUCT(ioctl);
+	ioctl.in.file.handle = dst_h;
+	ioctl.in.function = FSCTL_SRV_COPYCHUNK_WRITE;
+	ioctl.in.max_response_size = 12;
+	ioctl.in.flags = 1; /* SMB2_0_IOCTL_IS_FSCTL */
+
+	ioctl.in.out = data_blob_talloc_zero(mem_ctx, 32 + num_chunks * 24);
+	NT_STATUS_HAVE_NO_MEMORY(ioctl.in.out.data);
+
+	memcpy(ioctl.in.out.data, resume_key.data, 24);
+	SIVAL(ioctl.in.out.data, 24, num_chunks);
+	for (i = 0; i < num_chunks; i++) {
+		uint8_t *p = ioctl.in.out.data + 32 + i * 24;
+		SBVAL(p, 0, chunks[i].src_off);
+		SBVAL(p, 8, chunks[i].dst_off);
+		SIVAL(p, 16, chunks[i].length);
+	}
+
+	status = smb2_ioctl(tree, mem_ctx, &ioctl);
+	NT_STATUS_NOT_OK_RETURN(status);
+
+	if (ioctl.out.out.length != 12) {
+		return NT_STATUS_INVALID_NETWORK_RESPONSE;
+	}
+	*chunks_written = IVAL(ioctl.out.out.data, 0);
+	*total_written = IVAL(ioctl.out.out.data, 8);
+	return NT_STATUS_OK;
+}
+
+static bool check_pattern(struct torture_context *torture,
+			  struct smb2_tree *tree, TALLOC_CTX *mem_ctx,
+			  struct smb2_handle h, uint64_t off, uint32_t len,
+			  uint64_t src_off)
+{
+	struct smb2_read rd;
+	NTSTATUS status;
+	uint32_t i;
+
+	ZERO_STRUCT(rd);
+	rd.in.file.handle = h;
+	rd.in.length = len;
+	rd.in.offset = off;
+
+	status = smb2_read(tree, mem_ctx, &rd);
+	torture_assert_ntstatus_ok(torture, status, "read destination");
+	torture_assert_int_equal(torture, rd.out.data.length, len,
+				 "read length");
+
+	for (i = 0; i < len; i++) {
+		if (rd.out.data.data[i] != (src_off + i) % 251) {
+			torture_result(torture, TORTURE_FAIL,
+				       "data mismatch at offset %llu\n",
+				       (unsigned long long)(off + i));
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool test_ioctl_copy_chunk_simple(struct torture_context *torture,
+					 struct smb2_tree *tree)
+{
+	bool ret = true;
+	NTSTATUS status;
+	struct smb2_handle src_h, dst_h;
+	DATA_BLOB key;
+	struct copychunk_chunk chunk;
+	uint32_t chunks_written, total_written;
+	TALLOC_CTX *tmp_ctx = talloc_new(tree);
+
+	ZERO_STRUCT(src_h);
+	ZERO_STRUCT(dst_h);
+
+	ret = setup_copy_chunk(torture, tree, tmp_ctx, &src_h, &dst_h, &key);
+	if (!ret) {
+		goto done;
+	}
+
+	chunk.src_off = 0;
+	chunk.dst_off = 0;
+	chunk.length = TEST_LEN;
+
+	status = copy_chunk(tree, tmp_ctx, dst_h, key, &chunk, 1,
+			    &chunks_written, &total_written);
+	CHECK_STATUS(status, NT_STATUS_OK);
+	CHECK_VALUE(chunks_written, 1);
+	CHECK_VALUE(total_written, TEST_LEN);
+
+	ret = check_pattern(torture, tree, tmp_ctx, dst_h, 0, TEST_LEN, 0);
+
+done:
+	smb2_util_close(tree, src_h);
+	smb2_util_close(tree, dst_h);
+	smb2_util_unlink(tree, FNAME_SRC);
+	smb2_util_unlink(tree, FNAME_DST);
+	talloc_free(tmp_ctx);
+	return ret;
+}
+
+static bool test_ioctl_copy_chunk_multi(struct torture_context *torture,
+					struct smb2_tree *tree)
+{
+	bool ret = true;
+	NTSTATUS status;
+	struct smb2_handle src_h, dst_h;
+	DATA_BLOB key;
+	struct copychunk_chunk chunks[2];
+	uint32_t chunks_written, total_written;
+	TALLOC_CTX *tmp_ctx = talloc_new(tree);
+
+	ZERO_STRUCT(src_h);
+	ZERO_STRUCT(dst_h);
+
+	ret = setup_copy_chunk(torture, tree, tmp_ctx, &src_h, &dst_h, &key);
+	if (!ret) {
+		goto done;
+	}
+
+	/* swap the two halves of the source */
+	chunks[0].src_off = 0;
+	chunks[0].dst_off = TEST_LEN / 2;
+	chunks[0].length = TEST_LEN / 2;
+	chunks[1].src_off = TEST_LEN / 2;
+	chunks[1].dst_off = 0;
+	chunks[1].length = TEST_LEN / 2;
+
+	status = copy_chunk(tree, tmp_ctx, dst_h, key, chunks, 2,
+			    &chunks_written, &total_written);
+	CHECK_STATUS(status, NT_STATUS_OK);
+	CHECK_VALUE(chunks_written, 2);
+	CHECK_VALUE(total_written, TEST_LEN);
+
+	ret = check_pattern(torture, tree, tmp_ctx, dst_h,
+			    0, TEST_LEN / 2, TEST_LEN / 2);
+	if (!ret) {
+		goto done;
+	}
+	ret = check_pattern(torture, tree, tmp_ctx, dst_h,
+			    TEST_LEN / 2, TEST_LEN / 2, 0);
+
+done:
+	smb2_util_close(tree, src_h);
+	smb2_util_close(tree, dst_h);
+	smb2_util_unlink(tree, FNAME_SRC);
+	smb2_util_unlink(tree, FNAME_DST);
+	talloc_free(tmp_ctx);
+	return ret;
+}
+
+static bool test_ioctl_copy_chunk_bad(struct torture_context *torture,
+				      struct smb2_tree *tree)
+{
+	bool ret = true;
+	NTSTATUS status;
+	struct smb2_handle src_h, dst_h;
+	DATA_BLOB key;
+	struct copychunk_chunk chunk;
+	uint32_t chunks_written, total_written;
+	TALLOC_CTX *tmp_ctx = talloc_new(tree);
+
+	ZERO_STRUCT(src_h);
+	ZERO_STRUCT(dst_h);
+
+	ret = setup_copy_chunk(torture, tree, tmp_ctx, &src_h, &dst_h, &key);
+	if (!ret) {
+		goto done;
+	}
+
+	/* chunk too large */
+	chunk.src_off = 0;
+	chunk.dst_off = 0;
+	chunk.length = 2 * 1024 * 1024;
+	status = copy_chunk(tree, tmp_ctx, dst_h, key, &chunk, 1,
+			    &chunks_written, &total_written);
+	CHECK_STATUS(status, NT_STATUS_INVALID_PARAMETER);
+
+	/* source range beyond the end of file */
+	chunk.src_off = TEST_LEN / 2;
+	chunk.dst_off = 0;
+	chunk.length = TEST_LEN;
+	status = copy_chunk(tree, tmp_ctx, dst_h, key, &chunk, 1,
+			    &chunks_written, &total_written);
+	CHECK_STATUS(status, NT_STATUS_INVALID_VIEW_SIZE);
+
+	/* unknown resume key */
+	memset(key.data, 0xff, key.length);
+	chunk.src_off = 0;
+	chunk.dst_off = 0;
+	chunk.length = TEST_LEN;
+	status = copy_chunk(tree, tmp_ctx, dst_h, key, &chunk, 1,
+			    &chunks_written, &total_written);
+	CHECK_STATUS(status, NT_STATUS_OBJECT_NAME_NOT_FOUND);
+
+done:
+	smb2_util_close(tree, src_h);
+	smb2_util_close(tree, dst_h);
+	smb2_util_unlink(tree, FNAME_SRC);
+	smb2_util_unlink(tree, FNAME_DST);
+	talloc_free(tmp_ctx);
+	return ret;
+}
+
+/*
+   basic testing of SMB2 ioctls
+*/
+struct torture_suite *torture_smb2_ioctl_init(void)
+{
+	struct torture_suite *suite = torture_suite_create(talloc_autofree_context(), "ioctl");
+
+	torture_suite_add_1smb2_test(suite, "copy_chunk_simple",
+				     test_ioctl_copy_chunk_simple);
+	torture_suite_add_1smb2_test(suite, "copy_chunk_multi",
+				     test_ioctl_copy_chunk_multi);
+	torture_suite_add_1smb2_test(suite, "copy_chunk_bad",
+				     test_ioctl_copy_chunk_bad);
+
+	suite->description = talloc_strdup(suite, "SMB2-IOCTL tests");
+
+	return suite;
+}
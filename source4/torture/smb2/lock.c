@@ -2848,6 +2848,228 @@ done:
 	return ret;
 }
 
+/**
+ * Test lock and unlock latency with many locks on one file, as database
+ * applications do. The time per operation should stay flat as the
+ * number of locks grows.
+ */
+static bool test_scale(struct torture_context *torture,
+		       struct smb2_tree *tree)
+{
+	NTSTATUS status;
+	bool ret = true;
+	struct smb2_handle h, h2;
+	uint8_t buf[200];
+	int numlocks = torture_setting_int(torture, "numlocks", 10000);
+	int batch = MAX(numlocks / 10, 1);
+	double max_ratio = torture_setting_double(torture, "lockscale_maxratio",
+						  0);
+	double first_batch = 0, last_batch = 0, ratio;
+	struct timeval tv;
+	int i;
+
+	const char *fname = BASEDIR "\\scale.txt";
+
+	status = torture_smb2_testdir(tree, BASEDIR, &h);
+	CHECK_STATUS(status, NT_STATUS_OK);
+	smb2_util_close(tree, h);
+
+	status = torture_smb2_testfile(tree, fname, &h);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	ZERO_STRUCT(buf);
+	status = smb2_util_write(tree, h, buf, 0, ARRAY_SIZE(buf));
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	status = torture_smb2_testfile(tree, fname, &h2);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	torture_comment(torture, "Testing %d locks on one file\n", numlocks);
+
+	/* Lock every other byte, so the gaps stay lockable. */
+	tv = timeval_current();
+	for (i = 0; i < numlocks; i++) {
+		status = test_smb2_lock(tree, h, 2 * (uint64_t)i, 1, true);
+		CHECK_STATUS(status, NT_STATUS_OK);
+
+		if ((i + 1) % batch == 0) {
+			double usec = timeval_elapsed(&tv) * 1e6 / batch;
+
+			if (first_batch == 0) {
+				first_batch = usec;
+			}
+			last_batch = usec;
+			torture_comment(torture, "  locks %6d-%6d: %8.1f "
+					"usec/lock\n", i + 1 - batch, i,
+					usec);
+			tv = timeval_current();
+		}
+	}
+
+	ratio = first_batch > 0 ? last_batch / first_batch : 0;
+	torture_comment(torture, "  last/first batch: %.2f\n", ratio);
+
+	/* Wall clock time depends on the load, only check it on request. */
+	if (max_ratio > 0) {
+		torture_assert_goto(torture, ratio <= max_ratio, ret, done,
+				    talloc_asprintf(torture, "lock time grew "
+						    "%.2f times from the first "
+						    "to the last batch, "
+						    "allowed %.2f\n",
+						    ratio, max_ratio));
+	}
+
+	/* Check conflicts at the start, the middle and the end. */
+	for (i = 0; i < numlocks; i += MAX(numlocks / 4 - 1, 1)) {
+		status = test_smb2_lock(tree, h2, 2 * (uint64_t)i, 1, false);
+		CHECK_STATUS(status, NT_STATUS_LOCK_NOT_GRANTED);
+
+		status = test_smb2_lock(tree, h2, 2 * (uint64_t)i + 1, 1,
+					true);
+		CHECK_STATUS(status, NT_STATUS_OK);
+		status = test_smb2_unlock(tree, h2, 2 * (uint64_t)i + 1, 1);
+		CHECK_STATUS(status, NT_STATUS_OK);
+	}
+
+	status = test_smb2_lock(tree, h2, 2 * (uint64_t)numlocks - 2, 4,
+				false);
+	CHECK_STATUS(status, NT_STATUS_LOCK_NOT_GRANTED);
+	status = test_smb2_lock(tree, h2, 2 * (uint64_t)numlocks, 4, true);
+	CHECK_STATUS(status, NT_STATUS_OK);
+	status = test_smb2_unlock(tree, h2, 2 * (uint64_t)numlocks, 4);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	/* Unlock from the middle outwards to remove from all pages. */
+	tv = timeval_current();
+	for (i = 0; i < numlocks; i++) {
+		int idx = (i % 2) ? numlocks / 2 + i / 2 :
+			numlocks / 2 - 1 - i / 2;
+
+		status = test_smb2_unlock(tree, h, 2 * (uint64_t)idx, 1);
+		CHECK_STATUS(status, NT_STATUS_OK);
+	}
+	torture_comment(torture, "  unlock: %8.1f usec/unlock\n",
+			timeval_elapsed(&tv) * 1e6 / numlocks);
+
+	status = test_smb2_lock(tree, h2, 0, 2 * (uint64_t)numlocks, true);
+	CHECK_STATUS(status, NT_STATUS_OK);
+	status = test_smb2_unlock(tree, h2, 0, 2 * (uint64_t)numlocks);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+done:
+	smb2_util_close(tree, h2);
+	smb2_util_close(tree, h);
+	smb2_deltree(tree, BASEDIR);
+	return ret;
+}
+
+/**
+ * Measure how long it takes until a blocked lock is granted after
+ * another client released the conflicting lock. The two clients hand
+ * the lock back and forth.
+ */
+static bool test_handoff(struct torture_context *torture,
+			 struct smb2_tree *tree,
+			 struct smb2_tree *tree2)
+{
+	NTSTATUS status;
+	bool ret = true;
+	struct smb2_handle h, h2;
+	struct smb2_tree *trees[2];
+	struct smb2_handle handles[2];
+	uint8_t buf[200];
+	struct smb2_lock lck;
+	struct smb2_lock_element el[1];
+	struct smb2_request *req = NULL;
+	int numhandoffs = torture_setting_int(torture, "numhandoffs", 100);
+	double total = 0, max = 0;
+	struct timeval tv;
+	int i;
+
+	const char *fname = BASEDIR "\\handoff.txt";
+
+	ZERO_STRUCT(h2);
+
+	status = torture_smb2_testdir(tree, BASEDIR, &h);
+	CHECK_STATUS(status, NT_STATUS_OK);
+	smb2_util_close(tree, h);
+
+	status = torture_smb2_testfile(tree, fname, &h);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	ZERO_STRUCT(buf);
+	status = smb2_util_write(tree, h, buf, 0, ARRAY_SIZE(buf));
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	status = torture_smb2_testfile(tree2, fname, &h2);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	trees[0] = tree;
+	handles[0] = h;
+	trees[1] = tree2;
+	handles[1] = h2;
+
+	ZERO_STRUCT(lck);
+	lck.in.locks		= el;
+	lck.in.lock_count	= 0x0001;
+	el[0].offset		= 100;
+	el[0].length		= 50;
+	el[0].reserved		= 0x00000000;
+
+	lck.in.file.handle	= handles[0];
+	el[0].flags		= SMB2_LOCK_FLAG_EXCLUSIVE;
+	status = smb2_lock(trees[0], &lck);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	torture_comment(torture, "Handing a lock over %d times\n",
+			numhandoffs);
+
+	for (i = 0; i < numhandoffs; i++) {
+		int holder = i % 2;
+		int waiter = 1 - holder;
+		double usec;
+
+		lck.in.file.handle	= handles[waiter];
+		el[0].flags		= SMB2_LOCK_FLAG_EXCLUSIVE;
+		req = smb2_lock_send(trees[waiter], &lck);
+		torture_assert(torture, req != NULL, "smb2_lock_send failed");
+		WAIT_FOR_ASYNC_RESPONSE(req);
+
+		tv = timeval_current();
+
+		lck.in.file.handle	= handles[holder];
+		el[0].flags		= SMB2_LOCK_FLAG_UNLOCK;
+		status = smb2_lock(trees[holder], &lck);
+		CHECK_STATUS(status, NT_STATUS_OK);
+
+		status = smb2_lock_recv(req, &lck);
+		CHECK_STATUS(status, NT_STATUS_OK);
+		req = NULL;
+
+		usec = timeval_elapsed(&tv) * 1e6;
+		total += usec;
+		max = MAX(max, usec);
+	}
+
+	torture_comment(torture, "  handoff: %8.1f usec average, %8.1f usec "
+			"max\n", total / MAX(numhandoffs, 1), max);
+
+	/* A handoff must never wait for the brl:recalctime timer. */
+	torture_assert_goto(torture, max < 1e6, ret, done,
+			    "a lock handoff took longer than a second");
+
+	lck.in.file.handle	= handles[numhandoffs % 2];
+	el[0].flags		= SMB2_LOCK_FLAG_UNLOCK;
+	status = smb2_lock(trees[numhandoffs % 2], &lck);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+done:
+	smb2_util_close(tree2, h2);
+	smb2_util_close(tree, h);
+	smb2_deltree(tree, BASEDIR);
+	return ret;
+}
+
 /* basic testing of SMB2 locking
 */
 struct torture_suite *torture_smb2_lock_init(void)
@@ -2883,6 +3105,8 @@ struct torture_suite *torture_smb2_lock_init(void)
 	torture_suite_add_1smb2_test(suite, "range", test_range);
 	torture_suite_add_2smb2_test(suite, "overlap", test_overlap);
 	torture_suite_add_1smb2_test(suite, "truncate", test_truncate);
+	torture_suite_add_1smb2_test(suite, "scale", test_scale);
+	torture_suite_add_2smb2_test(suite, "handoff", test_handoff);
 
 	suite->description = talloc_strdup(suite, "SMB2-LOCK tests");
 
@@ -28,6 +28,25 @@
 
 #define FNAME "testmaxwrite.dat"
 
+#define CHECK_STATUS(status, correct) do { \
+	if (!NT_STATUS_EQUAL(status, correct)) { \
+		printf("(%s) Incorrect status %s - should be %s\n", \
+		       __location__, nt_errstr(status), nt_errstr(correct)); \
+		ret = false; \
+		goto done; \
+	}} while (0)
+
+#define CHECK_VALUE(v, correct) do { \
+	if ((v) != (correct)) { \
+		printf("(%s) Incorrect value %s=%u - should be %u\n", \
+		       __location__, #v, (unsigned)v, (unsigned)correct); \
+		ret = false; \
+		goto done; \
+	}} while (0)
+
+/* the largest multi-credit I/O size we test, the Windows 7 default */
+#define MULTICREDIT_MAX_IO (1024*1024)
+
 /*
   test writing
 */
@@ -68,13 +87,12 @@ static NTSTATUS torture_smb2_write(struct torture_context *tctx,
 			if (!NT_STATUS_IS_OK(status)) {
 				/* vista bug */
 				printf("coping with server disconnect\n");
-				talloc_free(tree);
-				if (!torture_smb2_connection(torture, &tree)) {
+				if (!torture_smb2_connection(tctx, &tree)) {
 					printf("failed to reconnect\n");
 					return NT_STATUS_NET_WRITE_FAULT;
 				}
 			}
-			handle = torture_smb2_create(tree, FNAME);
+			torture_smb2_testfile(tree, FNAME, &handle);
 			continue;
 		} else {
 			min = len;
@@ -108,20 +126,21 @@ static NTSTATUS torture_smb2_write(struct torture_context *tctx,
 
 
 
-/* 
-   basic testing of SMB2 connection calls
+/*
+  find the largest write the server accepts
 */
-bool torture_smb2_maxwrite(struct torture_context *torture)
+static bool test_maxwrite_converge(struct torture_context *torture,
+				   struct smb2_tree *tree)
 {
-	struct smb2_tree *tree;
 	struct smb2_handle h1;
 	NTSTATUS status;
 
-	if (!torture_smb2_connection(torture, &tree)) {
+	status = torture_smb2_testfile(tree, FNAME, &h1);
+	if (!NT_STATUS_IS_OK(status)) {
+		printf("Failed to create %s - %s\n", FNAME, nt_errstr(status));
 		return false;
 	}
 
-	h1 = torture_smb2_create(tree, FNAME);
 	status = torture_smb2_write(torture, tree, h1);
 	if (!NT_STATUS_IS_OK(status)) {
 		printf("Write failed - %s\n", nt_errstr(status));
@@ -130,3 +149,121 @@ bool torture_smb2_maxwrite(struct torture_context *torture)
 
 	return true;
 }
+
+/*
+  return the CreditCharge needed for a given payload size
+*/
+static uint16_t credit_charge(uint32_t len)
+{
+	if (len == 0) {
+		return 1;
+	}
+	return ((len - 1) / 65536) + 1;
+}
+
+/*
+  test SMB 2.1 multi-credit reads and writes up to 1MB
+*/
+static bool test_maxwrite_multicredit(struct torture_context *torture,
+				      struct smb2_tree *tree)
+{
+	struct smb2_transport *transport = tree->session->transport;
+	TALLOC_CTX *tmp_ctx = talloc_new(tree);
+	struct smb2_handle h;
+	struct smb2_write w;
+	struct smb2_read r;
+	NTSTATUS status;
+	bool ret = true;
+	uint32_t len;
+	uint32_t i;
+
+	ZERO_STRUCT(h);
+
+	if (transport->negotiate.dialect_revision < SMB2_DIALECT_REVISION_210) {
+		talloc_free(tmp_ctx);
+		torture_skip(torture, "server does not support SMB 2.1\n");
+	}
+
+	smb2_util_unlink(tree, FNAME);
+
+	status = torture_smb2_testfile(tree, FNAME, &h);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	/*
+	 * Ask for enough credits to cover the largest
+	 * request, the keepalive lets the server grant them.
+	 */
+	smb2_transport_credits_ask_num(transport,
+				       2 * credit_charge(MULTICREDIT_MAX_IO));
+	status = smb2_keepalive(transport);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	for (len = 0x10000; len <= MULTICREDIT_MAX_IO; len *= 2) {
+		torture_comment(torture, "multi-credit I/O of %u bytes "
+				"(CreditCharge %u)\n",
+				(unsigned)len, (unsigned)credit_charge(len));
+
+		ZERO_STRUCT(w);
+		w.in.file.handle = h;
+		w.in.offset      = 0;
+		w.in.data        = data_blob_talloc(tmp_ctx, NULL, len);
+		for (i=0;i<len;i++) {
+			w.in.data.data[i] = (i + len) % 256;
+		}
+
+		smb2_transport_credits_set_charge(transport,
+						  credit_charge(len));
+		status = smb2_write(tree, &w);
+		CHECK_STATUS(status, NT_STATUS_OK);
+		CHECK_VALUE(w.out.nwritten, len);
+
+		ZERO_STRUCT(r);
+		r.in.file.handle = h;
+		r.in.length      = len;
+		r.in.offset      = 0;
+		status = smb2_read(tree, tmp_ctx, &r);
+		CHECK_STATUS(status, NT_STATUS_OK);
+		CHECK_VALUE(r.out.data.length, len);
+		if (memcmp(w.in.data.data, r.out.data.data, len) != 0) {
+			printf("(%s) read data mismatch for %u bytes\n",
+			       __location__, (unsigned)len);
+			ret = false;
+			goto done;
+		}
+		data_blob_free(&w.in.data);
+		data_blob_free(&r.out.data);
+	}
+
+	/*
+	 * A request larger than 64k must be rejected
+	 * if the CreditCharge doesn't cover it.
+	 */
+	torture_comment(torture, "multi-credit read with too low CreditCharge\n");
+	smb2_transport_credits_set_charge(transport, 1);
+	ZERO_STRUCT(r);
+	r.in.file.handle = h;
+	r.in.length      = 0x10001;
+	r.in.offset      = 0;
+	status = smb2_read(tree, tmp_ctx, &r);
+	CHECK_STATUS(status, NT_STATUS_INVALID_PARAMETER);
+
+done:
+	smb2_transport_credits_set_charge(transport, 0);
+	smb2_transport_credits_ask_num(transport, 1);
+	smb2_util_close(tree, h);
+	smb2_util_unlink(tree, FNAME);
+	talloc_free(tmp_ctx);
+	return ret;
+}
+
+struct torture_suite *torture_smb2_maxwrite_init(void)
+{
+	struct torture_suite *suite = torture_suite_create(talloc_autofree_context(), "maxwrite");
+
+	torture_suite_add_1smb2_test(suite, "converge", test_maxwrite_converge);
+	torture_suite_add_1smb2_test(suite, "multicredit", test_maxwrite_multicredit);
+
+	suite->description = talloc_strdup(suite, "SMB2-MAXWRITE tests");
+
+	return suite;
+}